@@ -99,7 +99,12 @@ struct smp_boot_param {
 
 	unsigned long msg_buffer; /* Physical address */
 	unsigned long msg_buffer_size;
+	/* IHK_KMSG_VERSION Linux set msg_buffer up with, see ihk_debug.h */
+	unsigned long msg_buffer_version;
 	unsigned long mikc_queue_recv, mikc_queue_send;
+	/* struct ihk_ikc_master_queue[], see ikc/master.h */
+	unsigned long mikc_queues;
+	unsigned long nr_mikc_queues;
 
 	unsigned long monitor;
 	unsigned long monitor_size;
@@ -107,12 +112,21 @@ struct smp_boot_param {
 	unsigned long rusage;
 	unsigned long rusage_size;
 
+	/* struct ihk_os_rusage_snapshot, see ihk_rusage.h */
+	unsigned long rusage_snapshot;
+	unsigned long rusage_snapshot_size;
+
+	/* struct ihk_perf_rings, see ihk_perf.h */
+	unsigned long perf_ring;
+	unsigned long perf_ring_size;
+
 	unsigned long nmi_mode_addr;
 	unsigned long multi_intr_mode_addr;
 	unsigned long mckernel_do_futex;
 	unsigned long linux_kernel_pgt_phys;
 
 	unsigned long dma_address;
+	unsigned long dma_nr_channels;
 	unsigned long ident_table;
 	unsigned long ns_per_tsc;
 	unsigned long boot_tsc;
@@ -3,9 +3,15 @@
 #define __HEADER_BUILTIN_DMA_H
 
 #include <ihk/lock.h>
+#include <ihk/dma.h>
 
 #define BUILTIN_DMA_DESC_PARAM1_INTR  0x10000000
 
+#define BUILTIN_DMA_DESC_TYPE_COPY    1
+#define BUILTIN_DMA_DESC_TYPE_NOTIFY  2
+/* param2: physical address of a builtin_dma_segment array, param4: count */
+#define BUILTIN_DMA_DESC_TYPE_SG      4
+
 struct builtin_dma_desc { 
 	int type;
 	int param1;
@@ -14,7 +20,18 @@ struct builtin_dma_desc {
 	unsigned long param4;
 };
 
-#define BUILTIN_DMA_CHANNELS  2
+/* The array must stay valid until the request completes */
+struct builtin_dma_segment {
+	unsigned long src_phys;
+	unsigned long dest_phys;
+	unsigned long size;
+};
+
+/* The number of channels in use is passed in the boot parameter */
+#define BUILTIN_DMA_MAX_CHANNELS  64
+
+/* Pick a channel of the NUMA node of the calling CPU */
+#define BUILTIN_DMA_CHANNEL_LOCAL (-1)
 
 struct builtin_dma_channel {
 	unsigned long desc_ptr;
@@ -27,10 +44,15 @@ struct builtin_dma_channel {
 };
 
 struct builtin_dma_config_struct {
-	struct builtin_dma_channel channels[BUILTIN_DMA_CHANNELS];
+	struct builtin_dma_channel channels[BUILTIN_DMA_MAX_CHANNELS];
 
 	unsigned long doorbell; /* doorbell */
 	unsigned long status; /* core status */
 };
 
+int ihk_mc_dma_request_batch(int channel, struct ihk_dma_request *reqs,
+                             int nr_reqs);
+int ihk_mc_dma_request_sg(int channel, struct builtin_dma_segment *segs,
+                          int nr_segs, struct ihk_dma_request *req);
+
 #endif
@@ -11,6 +11,7 @@
 #include <irq.h>
 #include "bootparam.h"
 #include <kmsg.h>
+#include <ihk/ihk_debug.h>
 #include <llist.h>
 #include <kmalloc.h>
 #include <arch-perfctr.h>
@@ -27,6 +28,12 @@ extern void main(void);
 extern void setup_arm64(void);
 extern struct ihk_kmsg_buf *kmsg_buf;
 
+/* Used when Linux set msg_buffer up with another layout, the messages
+ * are then kept in the LWK memory only */
+#define KMSG_FALLBACK_NR_RECORDS 16
+static char kmsg_fallback[IHK_KMSG_BUF_SIZE(KMSG_FALLBACK_NR_RECORDS)]
+	__attribute__((aligned(4096)));
+
 unsigned long ap_trampoline = 0;
 unsigned long arm64_kernel_phys_base = 0;
 unsigned long arm64_st_phys_base = 0;
@@ -239,6 +246,12 @@ void arch_init(void)
 	ihk_get_kmsg_buf(&msg_buffer, &msg_buffer_size);
 	kmsg_buf = (struct ihk_kmsg_buf *)
 		map_fixed_area(msg_buffer, msg_buffer_size, 0);
+	if (boot_param->msg_buffer_version != IHK_KMSG_VERSION ||
+	    !ihk_kmsg_compatible(kmsg_buf)) {
+		/* Don't scribble on a ring Linux reads differently */
+		kmsg_buf = (struct ihk_kmsg_buf *)kmsg_fallback;
+		ihk_kmsg_init_buf(kmsg_buf, KMSG_FALLBACK_NR_RECORDS);
+	}
 	kmsg_init();
 	kprintf("boot_param_size: %lu\n", boot_param_size);
 
@@ -406,6 +419,30 @@ int ihk_set_rusage(unsigned long addr, unsigned long size)
 	return 0;
 }
 
+int ihk_set_rusage_snapshot(unsigned long addr, unsigned long size)
+{
+	boot_param->rusage_snapshot = addr;
+	boot_param->rusage_snapshot_size = size;
+
+	return 0;
+}
+
+int ihk_set_perf_ring(unsigned long addr, unsigned long size)
+{
+	boot_param->perf_ring = addr;
+	boot_param->perf_ring_size = size;
+
+	return 0;
+}
+
+int ihk_set_mikc_queues(unsigned long addr, int nr)
+{
+	boot_param->mikc_queues = addr;
+	boot_param->nr_mikc_queues = nr;
+
+	return 0;
+}
+
 int ihk_set_multi_intr_mode_addr(unsigned long addr)
 {
 	boot_param->multi_intr_mode_addr = addr;
@@ -553,6 +590,23 @@ int ihk_mc_get_ikc_cpu(int id)
 	return ihk_cpu_info->ikc_cpus[id];
 }
 
+/* Switch the Linux CPU taking the IKC interrupts of id, see
+ * IHK_IKC_MASTER_MSG_REMAP_CPU */
+int ihk_mc_set_ikc_cpu(int id, int linux_cpu)
+{
+	if (id < 0 || id >= boot_param->nr_cpus || ihk_cpu_info == NULL)
+		return -EINVAL;
+	if (linux_cpu < 0 || linux_cpu >= boot_param->nr_linux_cpus)
+		return -EINVAL;
+#ifndef IHK_IKC_USE_LINUX_WORK_IRQ
+	/* Only the Linux CPUs with an SPI at boot can be interrupted */
+	if (spi_table[linux_cpu] == -1)
+		return -ENOENT;
+#endif
+	ihk_cpu_info->ikc_cpus[id] = linux_cpu;
+	return 0;
+}
+
 int ihk_mc_get_apicid(int linux_core_id) {
 	return boot_param->ihk_ikc_cpu_hwids[linux_core_id];
 }
@@ -582,11 +636,12 @@ void arm64_set_warm_reset(unsigned long ip, char *first_page_va)
 	*(unsigned short *)(first_page_va + 0x467) = ip & 0xf;
 }
 
-void builtin_mc_dma_init(unsigned long cfg_addr);
+void builtin_mc_dma_init(unsigned long cfg_addr, int nr_channels);
 
 void ihk_mc_dma_init(void)
 {
-	builtin_mc_dma_init(boot_param->dma_address);
+	builtin_mc_dma_init(boot_param->dma_address,
+	                    boot_param->dma_nr_channels);
 }
 
 void ihk_mc_set_dump_level(unsigned int level)
@@ -1,5 +1,6 @@
 #include <ihk/mm.h>
 #include <ihk/lock.h>
+#include <ihk/cpu.h>
 #include <ihk/dma.h>
 #include <errno.h>
 #include "builtin_dma.h"
@@ -29,18 +30,28 @@ static char __builtin_desc_check_room(struct builtin_dma_channel *c, int ndesc)
 	return 0; /* NG */
 }
 
-static struct builtin_dma_desc *desc_ptrs[BUILTIN_DMA_CHANNELS];
+static struct builtin_dma_desc *desc_ptrs[BUILTIN_DMA_MAX_CHANNELS];
+static int builtin_mc_dma_nr_channels;
 
-void builtin_mc_dma_init(unsigned long cfg_addr)
+void builtin_mc_dma_init(unsigned long cfg_addr, int nr_channels)
 {
 	int i;
 
+	/* Linux without multi-channel support */
+	if (nr_channels <= 0) {
+		nr_channels = 2;
+	}
+	if (nr_channels > BUILTIN_DMA_MAX_CHANNELS) {
+		nr_channels = BUILTIN_DMA_MAX_CHANNELS;
+	}
+	builtin_mc_dma_nr_channels = nr_channels;
+
 	builtin_mc_dma_config = 
 		map_fixed_area(cfg_addr, sizeof(struct builtin_dma_config_struct),
 		               0);
 
 	kprintf("DMA Config: %lx", cfg_addr);
-	for (i = 0; i < BUILTIN_DMA_CHANNELS; i++) {
+	for (i = 0; i < nr_channels; i++) {
 		desc_ptrs[i] =
 			map_fixed_area(builtin_mc_dma_config->channels[i].desc_ptr,
 			               PAGE_SIZE, 0);
@@ -49,18 +60,90 @@ void builtin_mc_dma_init(unsigned long cfg_addr)
 	kprintf("\n");
 }
 
-int ihk_mc_dma_request(int channel, struct ihk_dma_request *req)
+/*
+ * Channel i is served by Linux on the NUMA node i % nr_numa_nodes.
+ * With more channels than NUMA nodes, the CPUs of a node are spread
+ * over its channels.
+ */
+static int __builtin_dma_channel(int channel)
+{
+	int nr_channels = builtin_mc_dma_nr_channels;
+	int nr_numa_nodes, numa_id, nr_node_channels;
+
+	if (channel >= 0) {
+		return channel % nr_channels;
+	}
+
+	nr_numa_nodes = ihk_mc_get_nr_numa_nodes();
+	numa_id = ihk_mc_get_numa_id();
+	if (nr_numa_nodes <= 0 || numa_id >= nr_channels) {
+		return (numa_id < 0 ? 0 : numa_id) % nr_channels;
+	}
+
+	nr_node_channels = (nr_channels - numa_id + nr_numa_nodes - 1) /
+		nr_numa_nodes;
+	return numa_id + nr_numa_nodes *
+		(ihk_mc_get_processor_id() % nr_node_channels);
+}
+
+/*
+ * Number of descriptors signaling the completion of a request. Linux
+ * can only raise the IKC vector of the submitter, nothing on this side
+ * would find and run a callback, so those requests are refused.
+ */
+static inline int __builtin_nr_completion_desc(struct ihk_dma_request *req)
+{
+	return req->notify ? 1 : 0;
+}
+
+static unsigned long __builtin_put_completion(struct builtin_dma_channel *c,
+                                              struct builtin_dma_desc *desc_head,
+                                              unsigned long h,
+                                              struct ihk_dma_request *req)
+{
+	struct builtin_dma_desc *desc = desc_head + h;
+
+	if (!__builtin_nr_completion_desc(req)) {
+		return h;
+	}
+
+	desc->type = BUILTIN_DMA_DESC_TYPE_NOTIFY;
+	desc->param1 = 0;
+	desc->param2 = (void *)req->notify;
+	desc->param4 = (unsigned long)req->priv;
+
+	return __next(c, h);
+}
+
+/*
+ * Submit the requests under one lock acquisition and one doorbell,
+ * or none of them if the ring is full (-EBUSY), too small to ever
+ * hold them or one of them asks for a callback (-EINVAL). channel can
+ * be BUILTIN_DMA_CHANNEL_LOCAL.
+ */
+int ihk_mc_dma_request_batch(int channel, struct ihk_dma_request *reqs,
+                             int nr_reqs)
 {
 	unsigned long flags;
-	int ndesc = 1;
+	int ndesc = 0;
 	struct builtin_dma_desc *desc, *desc_head;
 	unsigned long h;
 	struct builtin_dma_channel *c;
+	int i;
 
-	c = &builtin_mc_dma_config->channels[1];
+	channel = __builtin_dma_channel(channel);
+	c = &builtin_mc_dma_config->channels[channel];
 
-	if (req->callback || req->notify) {
-		ndesc++;
+	for (i = 0; i < nr_reqs; i++) {
+		if (reqs[i].callback) {
+			return -EINVAL;
+		}
+		ndesc += 1 + __builtin_nr_completion_desc(&reqs[i]);
+	}
+
+	/* Would never fit, even in an empty ring */
+	if (ndesc >= c->len) {
+		return -EINVAL;
 	}
 
 	flags = ihk_mc_spinlock_lock(&c->lock);
@@ -72,32 +155,23 @@ int ihk_mc_dma_request(int channel, struct ihk_dma_request *req)
 
 	h = c->head;
 
-	desc_head = desc_ptrs[1];
-
-	desc = desc_head + h;
-	desc->type = 1;
-	desc->param1 = 0;
-	desc->param2 = (void *)req->src_phys;
-	desc->param3 = (void *)req->dest_phys;
-	desc->param4 = req->size;
-
-	h = __next(c, h);
+	desc_head = desc_ptrs[channel];
 
-	if (ndesc > 1) {
+	for (i = 0; i < nr_reqs; i++) {
 		desc = desc_head + h;
-		desc->type = 2;
+		desc->type = BUILTIN_DMA_DESC_TYPE_COPY;
 		desc->param1 = 0;
+		desc->param2 = (void *)reqs[i].src_phys;
+		desc->param3 = (void *)reqs[i].dest_phys;
+		desc->param4 = reqs[i].size;
 
-		if (req->callback) {
-			desc->param1 = ihk_mc_get_hardware_processor_id() |
-				BUILTIN_DMA_DESC_PARAM1_INTR;
-		} else if(req->notify) {
-			desc->param2 = (void *)req->notify;
-			desc->param4 = (unsigned long)req->priv;
-		}
 		h = __next(c, h);
+
+		h = __builtin_put_completion(c, desc_head, h, &reqs[i]);
 	}
 
+	/* Linux must not see the new head before the descriptors */
+	ihk_mc_mb();
 	c->head = h;
 	ihk_mc_spinlock_unlock(&c->lock, flags);
 
@@ -107,4 +181,55 @@ int ihk_mc_dma_request(int channel, struct ihk_dma_request *req)
 	return 0;
 }
 
+int ihk_mc_dma_request(int channel, struct ihk_dma_request *req)
+{
+	return ihk_mc_dma_request_batch(channel, req, 1);
+}
+
+/* Only the completion members of req are used */
+int ihk_mc_dma_request_sg(int channel, struct builtin_dma_segment *segs,
+                          int nr_segs, struct ihk_dma_request *req)
+{
+	unsigned long flags;
+	struct builtin_dma_desc *desc, *desc_head;
+	unsigned long h;
+	struct builtin_dma_channel *c;
+
+	if (nr_segs <= 0 || req->callback) {
+		return -EINVAL;
+	}
+
+	channel = __builtin_dma_channel(channel);
+	c = &builtin_mc_dma_config->channels[channel];
+
+	flags = ihk_mc_spinlock_lock(&c->lock);
+
+	if (!__builtin_desc_check_room(c,
+	                               1 + __builtin_nr_completion_desc(req))) {
+		ihk_mc_spinlock_unlock(&c->lock, flags);
+		return -EBUSY;
+	}
+
+	h = c->head;
+
+	desc_head = desc_ptrs[channel];
+
+	desc = desc_head + h;
+	desc->type = BUILTIN_DMA_DESC_TYPE_SG;
+	desc->param1 = 0;
+	desc->param2 = (void *)virt_to_phys(segs);
+	desc->param4 = nr_segs;
+
+	h = __next(c, h);
 
+	h = __builtin_put_completion(c, desc_head, h, req);
+
+	/* Linux must not see the new head before the descriptors */
+	ihk_mc_mb();
+	c->head = h;
+	ihk_mc_spinlock_unlock(&c->lock, flags);
+
+	builtin_mc_dma_config->doorbell = 1;
+
+	return 0;
+}
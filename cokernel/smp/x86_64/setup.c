@@ -9,6 +9,7 @@
 #include "bootparam.h"
 #include <config.h>
 #include <kmsg.h>
+#include <ihk/ihk_debug.h>
 
 /* BUILTIN Setup.c */
 static unsigned char stack[8192] __attribute__((aligned(4096)));
@@ -24,6 +25,12 @@ extern void setup_x86_phase1(void);
 extern void setup_x86_phase2(void);
 extern void init_boot_processor_local(void);
 extern struct ihk_kmsg_buf *kmsg_buf;
+
+/* Used when Linux set msg_buffer up with another layout, the messages
+ * are then kept in the LWK memory only */
+#define KMSG_FALLBACK_NR_RECORDS 16
+static char kmsg_fallback[IHK_KMSG_BUF_SIZE(KMSG_FALLBACK_NR_RECORDS)]
+	__attribute__((aligned(4096)));
 extern int no_turbo;
 
 unsigned long linux_page_offset_base;
@@ -145,6 +152,12 @@ void arch_init(void)
 	/* Map kmsg_buf, which is out of kernel image, with the non-bootstrap map. */
 	ihk_get_kmsg_buf(&msg_buffer, &msg_buffer_size);
 	kmsg_buf = (struct ihk_kmsg_buf *)map_fixed_area(msg_buffer, msg_buffer_size, 0);
+	if (boot_param->msg_buffer_version != IHK_KMSG_VERSION ||
+	    !ihk_kmsg_compatible(kmsg_buf)) {
+		/* Don't scribble on a ring Linux reads differently */
+		kmsg_buf = (struct ihk_kmsg_buf *)kmsg_fallback;
+		ihk_kmsg_init_buf(kmsg_buf, KMSG_FALLBACK_NR_RECORDS);
+	}
 	kmsg_init();
 	kputs("IHK/McKernel started.\n");
 
@@ -287,6 +300,30 @@ int ihk_set_rusage(unsigned long addr, unsigned long size)
 	return 0;
 }
 
+int ihk_set_rusage_snapshot(unsigned long addr, unsigned long size)
+{
+	boot_param->rusage_snapshot = addr;
+	boot_param->rusage_snapshot_size = size;
+
+	return 0;
+}
+
+int ihk_set_perf_ring(unsigned long addr, unsigned long size)
+{
+	boot_param->perf_ring = addr;
+	boot_param->perf_ring_size = size;
+
+	return 0;
+}
+
+int ihk_set_mikc_queues(unsigned long addr, int nr)
+{
+	boot_param->mikc_queues = addr;
+	boot_param->nr_mikc_queues = nr;
+
+	return 0;
+}
+
 int ihk_set_multi_intr_mode_addr(unsigned long addr)
 {
 	boot_param->multi_intr_mode_addr = addr;
@@ -434,6 +471,18 @@ int ihk_mc_get_ikc_cpu(int id)
 	return ihk_cpu_info->ikc_cpus[id];
 }
 
+/* Switch the Linux CPU taking the IKC interrupts of id, see
+ * IHK_IKC_MASTER_MSG_REMAP_CPU */
+int ihk_mc_set_ikc_cpu(int id, int linux_cpu)
+{
+	if (id < 0 || id >= boot_param->nr_cpus || ihk_cpu_info == NULL)
+		return -EINVAL;
+	if (linux_cpu < 0 || linux_cpu >= boot_param->nr_linux_cpus)
+		return -EINVAL;
+	ihk_cpu_info->ikc_cpus[id] = linux_cpu;
+	return 0;
+}
+
 int ihk_mc_get_apicid(int linux_core_id) {
 	return boot_param->ihk_ikc_irq_apicids[linux_core_id];
 }
@@ -469,11 +518,12 @@ void x86_set_warm_reset(unsigned long ip, char *first_page_va)
 	memcpy(first_page_va + 0x467, &vect, sizeof(vect));
 }
 
-void builtin_mc_dma_init(unsigned long cfg_addr);
+void builtin_mc_dma_init(unsigned long cfg_addr, int nr_channels);
 
 void ihk_mc_dma_init(void)
 {
-	builtin_mc_dma_init(boot_param->dma_address);
+	builtin_mc_dma_init(boot_param->dma_address,
+	                    boot_param->dma_nr_channels);
 }
 
 static unsigned int perf_map_nehalem[] = 
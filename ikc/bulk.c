@@ -0,0 +1,352 @@
+/**
+ * \file ikc/bulk.c
+ * \brief IHK-IKC: Bulk transfers through a buffer pool shared by the
+ *        two ends of a channel
+ *
+ * Each end owns the pool it sends from. It sets the bits of the slots
+ * it allocates, the receiving end clears them on completion, both with
+ * cmpxchg as the pool is shared with the other kernel.
+ */
+#include <ikc/ihk.h>
+#include <ikc/queue.h>
+#include <ikc/bulk.h>
+
+//#define DEBUG_PRINT_IKC
+
+#ifdef DEBUG_PRINT_IKC
+#ifndef dkprintf
+#define dkprintf kprintf
+#else
+#undef DDEBUG_DEFAULT
+#define DDEBUG_DEFAULT DDEBUG_PRINT
+#endif
+#else
+#ifndef dkprintf
+#define dkprintf(...)
+#endif
+#endif
+
+int __ihk_ikc_send_bulk_pool(struct ihk_ikc_channel_desc *c,
+                             unsigned long phys, unsigned long size);
+
+static int ihk_ikc_bulk_test(uint64_t *bitmap, int slot)
+{
+	return (bitmap[slot / 64] >> (slot % 64)) & 1;
+}
+
+static void ihk_ikc_bulk_update(uint64_t *bitmap, int first, int n, int set)
+{
+	uint64_t old, mask;
+	int slot, bits;
+
+	for (slot = first; slot < first + n; slot += bits) {
+		bits = 64 - slot % 64;
+		if (bits > first + n - slot) {
+			bits = first + n - slot;
+		}
+		mask = (bits == 64 ? ~0UL : ((1UL << bits) - 1)) << (slot % 64);
+
+		do {
+			old = bitmap[slot / 64];
+		} while (cmpxchg(&bitmap[slot / 64], old,
+		                 set ? old | mask : old & ~mask) != old);
+	}
+}
+
+/* First slot of a free run of n slots, the pool lock held */
+static int ihk_ikc_bulk_find(struct ihk_ikc_bulk_pool *pool, int n)
+{
+	struct ihk_ikc_bulk_pool_head *head = pool->head;
+	int i, slot, run = 0;
+
+	for (i = 0; i < (int)head->nr_slots + n; i++) {
+		slot = (pool->next + i) % head->nr_slots;
+		if (slot == 0) {
+			run = 0;
+		}
+		if (ihk_ikc_bulk_test(head->bitmap, slot)) {
+			run = 0;
+			continue;
+		}
+		if (++run == n) {
+			return slot - n + 1;
+		}
+	}
+
+	return -1;
+}
+
+/* Slots of a descriptor, -1 if it does not fit in the pool */
+static int ihk_ikc_bulk_slots(struct ihk_ikc_bulk_pool *pool,
+                              const struct ihk_ikc_bulk_desc *d, int *n)
+{
+	struct ihk_ikc_bulk_pool_head *head = pool->head;
+
+	if (d->offset < head->slots || d->length > head->size ||
+	    d->offset > head->size - d->length ||
+	    (d->offset - head->slots) % head->slot_size) {
+		return -1;
+	}
+
+	*n = (d->length + head->slot_size - 1) / head->slot_size;
+	if (*n == 0) {
+		*n = 1;
+	}
+
+	return (d->offset - head->slots) / head->slot_size;
+}
+
+/* sync version. may sleep */
+int ihk_ikc_bulk_init(struct ihk_ikc_channel_desc *c,
+                      int nr_slots, int slot_size)
+{
+	struct ihk_ikc_bulk_pool *pool;
+	struct ihk_ikc_bulk_pool_head *head;
+	unsigned long slots, size;
+	int npages, r;
+
+	if (!c || nr_slots <= 0 || slot_size <= 0 ||
+	    slot_size % sizeof(unsigned long)) {
+		return -EINVAL;
+	}
+	if (c->bulk_send) {
+		return -EBUSY;
+	}
+
+	slots = (sizeof(*head) + (nr_slots + 63) / 64 * sizeof(uint64_t) + 63)
+		& ~63UL;
+	size = slots + (unsigned long)nr_slots * slot_size;
+
+	/* Allocated by order */
+	for (npages = 1; npages < (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	     npages <<= 1);
+
+	pool = ihk_ikc_malloc(sizeof(*pool));
+	if (!pool) {
+		return -ENOMEM;
+	}
+	memset(pool, 0, sizeof(*pool));
+
+	head = ihk_ikc_alloc_pages(c->remote_os, npages, -1);
+	if (!head) {
+		ihk_ikc_free(pool);
+		return -ENOMEM;
+	}
+	memset(head, 0, slots);
+
+	head->slot_size = slot_size;
+	head->nr_slots = nr_slots;
+	head->size = size;
+	head->slots = slots;
+
+	pool->head = head;
+	pool->qphys = virt_to_phys(head);
+	pool->npages = npages;
+	ihk_ikc_spinlock_init(&pool->lock);
+
+	c->bulk_send = pool;
+
+	r = __ihk_ikc_send_bulk_pool(c, pool->qphys, size);
+	if (r) {
+		c->bulk_send = NULL;
+		ihk_ikc_free_pages(head, npages);
+		ihk_ikc_free(pool);
+		return r;
+	}
+
+	dkprintf("%s: channel %d, %d slots of %d bytes\n",
+	         __FUNCTION__, c->channel_id, nr_slots, slot_size);
+
+	return 0;
+}
+
+void *ihk_ikc_bulk_alloc(struct ihk_ikc_channel_desc *c,
+                         unsigned long length, struct ihk_ikc_bulk_desc *d)
+{
+	struct ihk_ikc_bulk_pool *pool = c->bulk_send;
+	struct ihk_ikc_bulk_pool_head *head;
+	unsigned long flags;
+	int slot, n;
+
+	if (!pool || !d) {
+		return NULL;
+	}
+	head = pool->head;
+
+	n = (length + head->slot_size - 1) / head->slot_size;
+	if (n == 0) {
+		n = 1;
+	}
+	if (n > (int)head->nr_slots) {
+		return NULL;
+	}
+
+	flags = ihk_ikc_spinlock_lock(&pool->lock);
+	slot = ihk_ikc_bulk_find(pool, n);
+	if (slot >= 0) {
+		ihk_ikc_bulk_update(head->bitmap, slot, n, 1);
+		pool->next = (slot + n) % head->nr_slots;
+	}
+	ihk_ikc_spinlock_unlock(&pool->lock, flags);
+
+	if (slot < 0) {
+		return NULL;
+	}
+
+	d->offset = head->slots + (uint64_t)slot * head->slot_size;
+	d->length = length;
+
+	return (char *)head + d->offset;
+}
+
+void ihk_ikc_bulk_free(struct ihk_ikc_channel_desc *c,
+                       struct ihk_ikc_bulk_desc *d)
+{
+	struct ihk_ikc_bulk_pool *pool = c->bulk_send;
+	int slot, n;
+
+	if (!pool || !d) {
+		return;
+	}
+
+	slot = ihk_ikc_bulk_slots(pool, d, &n);
+	if (slot >= 0) {
+		ihk_ikc_bulk_update(pool->head->bitmap, slot, n, 0);
+	}
+}
+
+int ihk_ikc_bulk_send(struct ihk_ikc_channel_desc *c, void *packet,
+                      struct ihk_ikc_bulk_desc *d, const void *data,
+                      unsigned long length, uint64_t cookie, int opt)
+{
+	void *buf;
+	int r;
+
+	if (!c || !packet || !d || (!data && length)) {
+		return -EINVAL;
+	}
+
+	/* Buffers come back as the receiver completes them */
+	buf = ihk_ikc_bulk_alloc(c, length, d);
+	if (!buf) {
+		return c->bulk_send ? -EAGAIN : -EINVAL;
+	}
+
+	memcpy(buf, data, length);
+	d->cookie = cookie;
+	ihk_ikc_mb();
+
+	r = ihk_ikc_send(c, packet, opt);
+	if (r) {
+		ihk_ikc_bulk_free(c, d);
+	}
+
+	return r;
+}
+
+int ihk_ikc_bulk_attach(struct ihk_ikc_channel_desc *c,
+                        unsigned long rphys, unsigned long size)
+{
+	struct ihk_ikc_bulk_pool *pool;
+	ihk_os_t os = c->remote_os;
+	int npages;
+
+	if (c->bulk_recv) {
+		return -EBUSY;
+	}
+	if (!rphys || size < sizeof(struct ihk_ikc_bulk_pool_head)) {
+		return -EINVAL;
+	}
+
+	npages = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+
+	pool = ihk_ikc_malloc(sizeof(*pool));
+	if (!pool) {
+		return -ENOMEM;
+	}
+	memset(pool, 0, sizeof(*pool));
+
+	pool->qrphys = rphys;
+	pool->qphys = ihk_ikc_map_memory(os, rphys, npages * PAGE_SIZE);
+	pool->head = ihk_ikc_map_virtual(ihk_os_to_dev(os), pool->qphys,
+	                                 npages, IHK_IKC_QUEUE_PT_ATTR);
+	pool->npages = npages;
+	ihk_ikc_spinlock_init(&pool->lock);
+
+	if (!pool->head || pool->head->size > size ||
+	    pool->head->slot_size == 0 || pool->head->slots >= size) {
+		if (pool->head) {
+			ihk_ikc_unmap_virtual(ihk_os_to_dev(os), pool->head,
+			                      npages);
+		}
+		ihk_ikc_unmap_memory(os, pool->qphys, npages);
+		ihk_ikc_free(pool);
+		return -EINVAL;
+	}
+
+	c->bulk_recv = pool;
+
+	return 0;
+}
+
+void *ihk_ikc_bulk_data(struct ihk_ikc_channel_desc *c,
+                        const struct ihk_ikc_bulk_desc *d)
+{
+	struct ihk_ikc_bulk_pool *pool = c->bulk_recv;
+	int n;
+
+	if (!pool || !d || ihk_ikc_bulk_slots(pool, d, &n) < 0) {
+		return NULL;
+	}
+
+	return (char *)pool->head + d->offset;
+}
+
+void ihk_ikc_bulk_complete(struct ihk_ikc_channel_desc *c,
+                           const struct ihk_ikc_bulk_desc *d)
+{
+	struct ihk_ikc_bulk_pool *pool = c->bulk_recv;
+	int slot, n;
+
+	if (!pool || !d) {
+		return;
+	}
+
+	slot = ihk_ikc_bulk_slots(pool, d, &n);
+	if (slot < 0 || slot + n > (int)pool->head->nr_slots) {
+		kprintf("%s: invalid descriptor offset: %llu, length: %llu\n",
+		        __FUNCTION__, d->offset, d->length);
+		return;
+	}
+
+	/* The payload is read before the sender may reuse it */
+	ihk_ikc_mb();
+	ihk_ikc_bulk_update(pool->head->bitmap, slot, n, 0);
+}
+
+void ihk_ikc_bulk_fini(struct ihk_ikc_channel_desc *c)
+{
+	ihk_os_t os = c->remote_os;
+
+	if (c->bulk_send) {
+		ihk_ikc_free_pages(c->bulk_send->head, c->bulk_send->npages);
+		ihk_ikc_free(c->bulk_send);
+		c->bulk_send = NULL;
+	}
+
+	if (c->bulk_recv) {
+		ihk_ikc_unmap_virtual(ihk_os_to_dev(os), c->bulk_recv->head,
+		                      c->bulk_recv->npages);
+		ihk_ikc_unmap_memory(os, c->bulk_recv->qphys,
+		                     c->bulk_recv->npages);
+		ihk_ikc_free(c->bulk_recv);
+		c->bulk_recv = NULL;
+	}
+}
+
+IHK_EXPORT_SYMBOL(ihk_ikc_bulk_init);
+IHK_EXPORT_SYMBOL(ihk_ikc_bulk_alloc);
+IHK_EXPORT_SYMBOL(ihk_ikc_bulk_free);
+IHK_EXPORT_SYMBOL(ihk_ikc_bulk_send);
+IHK_EXPORT_SYMBOL(ihk_ikc_bulk_data);
+IHK_EXPORT_SYMBOL(ihk_ikc_bulk_complete);
@@ -0,0 +1,67 @@
+/**
+ * \file ikc/include/ikc/bulk.h
+ * \brief IHK-IKC: Bulk transfers through a buffer pool shared by the
+ *        two ends of a channel
+ *
+ * The sender copies a payload into a buffer of its pool and sends only
+ * a descriptor of it in a packet of the channel. The receiver reads the
+ * payload in place and returns the buffer with ihk_ikc_bulk_complete().
+ */
+#ifndef HEADER_IHK_IKC_BULK_H
+#define HEADER_IHK_IKC_BULK_H
+
+#include <ikc/queue.h>
+
+/* In front of the pool, in memory seen by both kernels */
+struct ihk_ikc_bulk_pool_head {
+/* 0 */
+	uint32_t        slot_size;
+	uint32_t        nr_slots;
+	uint64_t        size;      /* Whole pool in bytes */
+/* 16 */
+	uint64_t        slots;     /* Offset of the first slot */
+	uint64_t        reserve[5];
+/* 64 */
+	uint64_t        bitmap[];  /* Set for the slots in use */
+};
+
+/* Carried in a packet in place of the payload */
+struct ihk_ikc_bulk_desc {
+	uint64_t        offset;    /* From the start of the pool */
+	uint64_t        length;
+	uint64_t        cookie;    /* Left to the caller */
+};
+
+struct ihk_ikc_bulk_pool {
+	struct ihk_ikc_bulk_pool_head *head; /* Virtual address */
+	unsigned long              qrphys;   /* Remote physical memory */
+	unsigned long              qphys;    /* Local physical memory */
+	int                        npages;
+	unsigned int               next;     /* Slot to look from */
+	ihk_spinlock_t             lock;
+};
+
+/* Sender side. sync version. may sleep */
+int ihk_ikc_bulk_init(struct ihk_ikc_channel_desc *c,
+                      int nr_slots, int slot_size);
+void *ihk_ikc_bulk_alloc(struct ihk_ikc_channel_desc *c,
+                         unsigned long length, struct ihk_ikc_bulk_desc *d);
+void ihk_ikc_bulk_free(struct ihk_ikc_channel_desc *c,
+                       struct ihk_ikc_bulk_desc *d);
+/* d points in packet, it is filled before packet is sent */
+int ihk_ikc_bulk_send(struct ihk_ikc_channel_desc *c, void *packet,
+                      struct ihk_ikc_bulk_desc *d, const void *data,
+                      unsigned long length, uint64_t cookie, int opt);
+
+/* Receiver side */
+int ihk_ikc_bulk_attach(struct ihk_ikc_channel_desc *c,
+                        unsigned long rphys, unsigned long size);
+void *ihk_ikc_bulk_data(struct ihk_ikc_channel_desc *c,
+                        const struct ihk_ikc_bulk_desc *d);
+void ihk_ikc_bulk_complete(struct ihk_ikc_channel_desc *c,
+                           const struct ihk_ikc_bulk_desc *d);
+
+/* Called when the channel is freed */
+void ihk_ikc_bulk_fini(struct ihk_ikc_channel_desc *c);
+
+#endif
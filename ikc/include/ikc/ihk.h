@@ -43,6 +43,11 @@ typedef void * ihk_wait_t;
 
 #define IHK_EXPORT_SYMBOL(x)
 
+/* Buckets of the channel table of each CPU, which only adds and looks
+ * up its own channels
+ */
+#define IHK_IKC_CHANNEL_TABLE_SIZE 64
+
 #else /* !IHK_OS_MANYCORE */
 
 #include <linux/kernel.h>
@@ -71,6 +76,7 @@ typedef void * ihk_wait_t;
 
 #define ihk_atomic_t             atomic_t
 #define ihk_atomic_inc_return    atomic_inc_return
+#define ihk_atomic_read          atomic_read
 
 #define ihk_ikc_map_memory       ihk_os_map_memory
 #define ihk_ikc_unmap_memory     ihk_os_unmap_memory
@@ -85,6 +91,9 @@ typedef void * ihk_wait_t;
 #endif /* __x86_64 */
 #define ihk_ikc_mb                mb
 
+/* Buckets of the channel table of an OS instance */
+#define IHK_IKC_CHANNEL_TABLE_SIZE 1024
+
 #define kprintf                  printk
 
 typedef wait_queue_head_t        ihk_wait_t;
@@ -94,6 +103,7 @@ ihk_device_t ihk_os_to_dev(ihk_os_t);
 #define ihk_ikc_get_unique_channel_id ihk_os_get_unique_channel_id
 #define ihk_ikc_get_channel_list_lock ihk_os_get_ikc_channel_lock
 #define ihk_ikc_get_channel_list      ihk_os_get_ikc_channel_list
+#define ihk_ikc_get_channel_table     ihk_os_get_ikc_channel_table
 
 #define ihk_ikc_get_regular_channel   ihk_os_get_regular_channel
 #define ihk_ikc_set_regular_channel   ihk_os_set_regular_channel
@@ -107,10 +117,19 @@ struct ihk_ikc_master_wait_struct;
 
 int ihk_ikc_send_interrupt(struct ihk_ikc_channel_desc *c);
 
-struct ihk_ikc_queue_head *ihk_ikc_alloc_queue(int qpages);
+/* cpu is the CPU reading the queue or using the channel descriptor,
+ * -1 for the current one
+ */
+struct ihk_ikc_queue_head *ihk_ikc_alloc_queue(ihk_os_t os, int qpages,
+                                               int cpu);
 void ihk_ikc_free_queue(struct ihk_ikc_queue_head *q);
+/* npages is a power of two */
+void *ihk_ikc_alloc_pages(ihk_os_t os, int npages, int cpu);
+void ihk_ikc_free_pages(void *p, int npages);
 
 void *ihk_ikc_malloc(int size);
+void *ihk_ikc_alloc_desc(ihk_os_t os, int size, int cpu);
+void ihk_ikc_free_desc(struct ihk_ikc_channel_desc *desc);
 void ihk_ikc_free(void *);
 
 int call_arch_master_packet_handler(void *os, struct ihk_ikc_channel_desc *c,
@@ -121,7 +140,25 @@ int ihk_ikc_wait_master(struct ihk_ikc_master_wait_struct *wq);
 void ihk_ikc_wake_master(struct ihk_ikc_master_wait_struct *wq);
 
 struct ihk_ikc_channel_desc *ihk_ikc_get_master_channel(ihk_os_t os);
+/* Additional master channel drained on cpu, NULL if none */
+struct ihk_ikc_channel_desc *ihk_ikc_get_cpu_master_channel(ihk_os_t os,
+                                                            int cpu);
+/* Master channel to start a connection from the current CPU on */
+struct ihk_ikc_channel_desc *ihk_ikc_pick_master_channel(ihk_os_t os);
+#ifdef IHK_OS_MANYCORE
+int ihk_ikc_add_master_channel(ihk_os_t os, struct ihk_ikc_channel_desc *c,
+                               int cpu);
+#else
+/* Read what is pending for cpu on cpu. may sleep */
+void ihk_ikc_drain_cpu(ihk_os_t os, int cpu);
+/* ihk_ikc_wait_master() giving up with -ETIMEDOUT after msecs */
+int ihk_ikc_wait_master_timeout(struct ihk_ikc_master_wait_struct *wq,
+                                unsigned int msecs);
+#endif
+/* Make linux_cpu take the IKC interrupts of the LWK CPU cpu */
+int ihk_ikc_set_ikc_cpu(ihk_os_t os, int cpu, int linux_cpu);
 struct list_head *ihk_ikc_get_channel_list(ihk_os_t os);
+struct ihk_ikc_channel_desc **ihk_ikc_get_channel_table(ihk_os_t os);
 ihk_spinlock_t *ihk_ikc_get_channel_list_lock(ihk_os_t ihk_os);
 
 struct ihk_ikc_channel_desc *ihk_ikc_get_regular_channel(ihk_os_t os, int cpu);
@@ -11,9 +11,20 @@
 #include <ikc/msg.h>
 
 #define IHK_IKC_MAX_PORT   512
+/* Master channels in addition to the primary one */
+#define IHK_IKC_MAX_MASTER_CHANNELS 64
 
 struct ihk_ikc_channel_info;
 
+/* A pair of additional master queues published by the LWK with
+ * ihk_set_mikc_queues(). recv and send are named from the host side,
+ * the host reads recv on a CPU of its choice.
+ */
+struct ihk_ikc_master_queue {
+	unsigned long recv, send;
+	unsigned long size;
+};
+
 enum ihk_ikc_direction {
 	IHK_IKC_DIRECTION_SEND,
 	IHK_IKC_DIRECTION_RECV,
@@ -60,5 +71,9 @@ int ihk_ikc_listen_port(ihk_os_t os, struct ihk_ikc_listen_param *param);
 int ihk_ikc_connect(ihk_os_t os, struct ihk_ikc_connect_param *p);
 int ihk_ikc_disconnect(struct ihk_ikc_channel_desc *c);
 void ihk_ikc_destroy_channel(struct ihk_ikc_channel_desc *c);
+#ifndef IHK_OS_MANYCORE
+/* sync version. may sleep */
+int ihk_ikc_remap_cpu(ihk_os_t os, int cpu, int old_cpu, int linux_cpu);
+#endif
 
 #endif
@@ -14,6 +14,12 @@
 #define IHK_IKC_MASTER_MSG_CONNECT_REPLY 0x20000002
 #define IHK_IKC_MASTER_MSG_DISCONNECT    0x20000008
 #define IHK_IKC_MASTER_MSG_PACKET_ON_CHANNEL 0x20000010
+#define IHK_IKC_MASTER_MSG_BULK_POOL     0x20000020
+#define IHK_IKC_MASTER_MSG_BULK_POOL_REPLY 0x20000021
+#define IHK_IKC_MASTER_MSG_PRIO_LANE     0x20000030
+#define IHK_IKC_MASTER_MSG_PRIO_LANE_REPLY 0x20000031
+#define IHK_IKC_MASTER_MSG_REMAP_CPU     0x20000040
+#define IHK_IKC_MASTER_MSG_REMAP_CPU_REPLY 0x20000041
 
 struct ihk_ikc_master_packet {
 	struct ihk_ikc_packet_header header;
@@ -13,6 +13,7 @@
 
 struct ihk_ikc_channel_desc;
 struct ihk_ikc_queue_desc;
+struct ihk_ikc_bulk_pool;
 
 typedef int (*ihk_ikc_ph_t)(struct ihk_ikc_channel_desc *,
                             void *, void *);
@@ -38,6 +39,12 @@ struct ihk_ikc_queue_head {
 /* 64 */
 };
 
+/* Set in ihk_ikc_queue_head.flag by a writer waiting for room in the
+ * queue, cleared by the reader when it drains the queue below the low
+ * watermark, which then interrupts the writer side.
+ */
+#define IHK_IKC_QUEUE_FLAG_WANT_SPACE  0x1
+
 struct ihk_ikc_queue_desc {
 	struct ihk_ikc_queue_head *queue;  /* Virtual address */
 	struct ihk_ikc_queue_head  cache;  /* Cache for local reference */
@@ -45,6 +52,23 @@ struct ihk_ikc_queue_desc {
 	unsigned long              qphys;  /* Local physical memory */
 	ihk_spinlock_t             lock;
 	uint32_t                   intr_cpu;
+	ihk_atomic_t               nr_full;  /* Sends finding it full */
+};
+
+/* Lanes of a channel. The bulk lane is recv/send, the priority lane
+ * prio_recv/prio_send is added by ihk_ikc_add_prio_lane() and drained
+ * first.
+ */
+enum ihk_ikc_lane {
+	IHK_IKC_LANE_BULK = 0,
+	IHK_IKC_LANE_PRIO = 1,
+};
+
+struct ihk_ikc_lane_stats {
+	unsigned long sent;
+	unsigned long received;
+	unsigned long queued;      /* Received but not read yet */
+	unsigned long full;        /* Sends finding the lane full */
 };
 
 enum ihk_ikc_channel_flag {
@@ -66,6 +90,16 @@ struct ihk_ikc_free_packet {
 
 struct ihk_ikc_channel_desc {
 	struct list_head           list_all;
+	/* Lock of the list_all and of the table the channel is on. They
+	 * are per-CPU on the LWK, where the channel may be freed on a CPU
+	 * other than the one which created it.
+	 */
+	ihk_spinlock_t             *list_lock;
+	struct ihk_ikc_channel_desc **table;
+	/* Next in the bucket of the channel table */
+	struct ihk_ikc_channel_desc *table_next;
+	/* Creator's and ihk_ikc_find_channel()'s, protected by list_lock */
+	int                        refcount;
 	ihk_os_t                   remote_os;
 	int                        remote_channel_id;
 	uint64_t                   remote_channel_va;
@@ -73,11 +107,14 @@ struct ihk_ikc_channel_desc {
 	int                        port;
 	int                        channel_id;
 	struct ihk_ikc_queue_desc  recv, send;
+	struct ihk_ikc_queue_desc  prio_recv, prio_send;
 	ihk_spinlock_t             lock;
 	enum ihk_ikc_channel_flag  flag;
 	ihk_ikc_ph_t               handler;
 	struct list_head           packet_pool;
 	ihk_spinlock_t             packet_pool_lock;
+	/* Buffer pools for bulk transfers, see ikc/bulk.h */
+	struct ihk_ikc_bulk_pool   *bulk_send, *bulk_recv;
 };
 
 struct ihk_ikc_free_packet *ihk_ikc_alloc_packet(struct ihk_ikc_channel_desc *c);
@@ -89,6 +126,7 @@ int ihk_ikc_queue_is_empty(struct ihk_ikc_queue_head *q);
 int ihk_ikc_queue_is_full(struct ihk_ikc_queue_head *q);
 int ihk_ikc_read_queue(struct ihk_ikc_queue_head *q, void *packet, int flag);
 int ihk_ikc_write_queue(struct ihk_ikc_queue_head *q, void *packet, int flag);
+void ihk_ikc_queue_want_space(struct ihk_ikc_queue_head *q);
 
 struct ihk_ikc_channel_desc *ihk_ikc_create_channel(ihk_os_t os,
                                                     int port,
@@ -96,7 +134,8 @@ struct ihk_ikc_channel_desc *ihk_ikc_create_channel(ihk_os_t os,
                                                     unsigned long qsize,
                                                     unsigned long *rq,
                                                     unsigned long *sq,
-                                                    enum ihk_ikc_channel_flag);
+                                                    enum ihk_ikc_channel_flag,
+                                                    int cpu);
 void ihk_ikc_free_channel(struct ihk_ikc_channel_desc *desc);
 
 void ihk_ikc_enable_channel(struct ihk_ikc_channel_desc *channel);
@@ -105,13 +144,30 @@ void ihk_ikc_disable_channel(struct ihk_ikc_channel_desc *channel);
 void ihk_ikc_channel_set_cpu(struct ihk_ikc_channel_desc *c, int cpu);
 
 #define IKC_NO_NOTIFY    0x100
-
+/* Return -EAGAIN at once when the send queue is full */
+#define IKC_NONBLOCK     0x200
+/* Wait for room in the send queue as long as the channel is enabled */
+#define IKC_BLOCK        0x400
+/* Send on the priority lane if any, the peer is always notified */
+#define IKC_PRIO         0x800
+
+/* Waits up to the platform default for room in a full send queue */
 int ihk_ikc_send(struct ihk_ikc_channel_desc *channel, void *p, int opt);
+/* timeout_us 0 fails at once and a negative one waits forever */
+int ihk_ikc_send_timeout(struct ihk_ikc_channel_desc *channel, void *p,
+                         int opt, long timeout_us);
 int ihk_ikc_recv(struct ihk_ikc_channel_desc *channel, void *p, int opt);
 int ihk_ikc_recv_handler(struct ihk_ikc_channel_desc *channel, 
                          ihk_ikc_ph_t h, void *harg, int opt);
 int ihk_ikc_set_remote_queue(struct ihk_ikc_queue_desc *q, ihk_os_t os,
                              unsigned long rphys, unsigned long qsize);
+int ihk_ikc_set_local_queue(struct ihk_ikc_queue_desc *q, ihk_os_t os,
+                            int port, int packet_size, unsigned long qsize,
+                            int cpu);
+/* sync version. may sleep */
+int ihk_ikc_add_prio_lane(struct ihk_ikc_channel_desc *c, unsigned long qsize);
+int ihk_ikc_get_lane_stats(struct ihk_ikc_channel_desc *c, int lane,
+                           struct ihk_ikc_lane_stats *st);
 void ihk_ikc_system_init(ihk_os_t);
 void ihk_ikc_system_exit(ihk_os_t);
 
@@ -122,10 +178,25 @@ void ihk_ikc_init_desc(struct ihk_ikc_channel_desc *c,
                        ihk_ikc_ph_t packet_handler,
                        struct ihk_ikc_channel_desc *master);
 struct ihk_ikc_channel_desc *ihk_ikc_find_channel(ihk_os_t os, int id);
+void ihk_ikc_channel_put(struct ihk_ikc_channel_desc *c);
 
 static inline int ihk_ikc_channel_enabled(struct ihk_ikc_channel_desc *c)
 {
 	return (c->flag & IKC_FLAG_STATUS_MASK) == IKC_FLAG_ENABLED;
 }
 
+static inline int ihk_ikc_channel_is_empty(struct ihk_ikc_channel_desc *c)
+{
+	return ihk_ikc_queue_is_empty(c->recv.queue) &&
+		(!c->prio_recv.queue ||
+		 ihk_ikc_queue_is_empty(c->prio_recv.queue));
+}
+
+static inline struct ihk_ikc_queue_desc *
+ihk_ikc_send_lane(struct ihk_ikc_channel_desc *c, int opt)
+{
+	return (opt & IKC_PRIO) && c->prio_send.queue ?
+		&c->prio_send : &c->send;
+}
+
 #endif
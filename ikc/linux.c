@@ -11,8 +11,22 @@
 #include <asm/bitops.h>
 #include <asm/smp.h>
 #include <linux/interrupt.h>
+#include <linux/moduleparam.h>
+#include <linux/topology.h>
+#include <linux/ktime.h>
 
+/* Bound on the wait for room in a full send queue in ihk_ikc_send() */
+#define IHK_IKC_SEND_TIMEOUT_US	(1000 * 1000)
+/* Attempts at a full send queue in atomic context, which can't wait */
 #define IHK_IKC_SEND_RETRY	1000
+
+/* Senders waiting for room, woken by the IKC interrupt */
+static DECLARE_WAIT_QUEUE_HEAD(ihk_ikc_space_wait);
+static atomic_t ihk_ikc_nr_space_waiters = ATOMIC_INIT(0);
+
+static bool ihk_ikc_numa_strict;
+module_param(ihk_ikc_numa_strict, bool, 0644);
+MODULE_PARM_DESC(ihk_ikc_numa_strict, "Fail IKC channel creation instead of falling back to another NUMA node when the node of the CPU reading the channel is out of memory");
 #ifdef POSTK_DEBUG_TEMP_FIX_49 /* IHK_IKC_RECV_HANDLER_IN_WORKQ enabled */
 #define IHK_IKC_RECV_HANDLER_IN_WORKQ
 #else /* POSTK_DEBUG_TEMP_FIX_49 */
@@ -25,18 +39,27 @@ int ihk_ikc_call_master_packet_handler(ihk_os_t ihk_os,
                                        struct ihk_ikc_channel_desc *c,
                                        void *packet);
 struct ihk_ikc_channel_desc *ihk_os_get_master_channel(ihk_os_t __os);
+struct ihk_ikc_channel_desc *ihk_os_get_cpu_master_channel(ihk_os_t __os,
+                                                           int cpu);
+struct ihk_ikc_channel_desc *ihk_os_pick_master_channel(ihk_os_t __os);
 
 void ihk_ikc_linux_init_work_data(ihk_os_t ihk_os,
                                   void (*f)(struct work_struct *));
 void ihk_ikc_linux_schedule_work(ihk_os_t ihk_os);
 ihk_os_t ihk_ikc_linux_get_os_from_work(struct work_struct *work);
+void ihk_os_count_ikc_alloc(ihk_os_t ihk_os, int queue, int local);
+void ihk_os_count_ikc_time(ihk_os_t ihk_os, int cpu, u64 ns);
 
-static void __ihk_ikc_reception_handler(ihk_os_t os)
+static void ___ihk_ikc_reception_handler(ihk_os_t os)
 {
 	struct ihk_ikc_channel_desc *m_channel;
 	struct ihk_ikc_channel_desc *r_channel;
 	int found = 0;
 	//printk("%s: id=%d\n", __FUNCTION__, smp_processor_id());
+	if (atomic_read(&ihk_ikc_nr_space_waiters)) {
+		wake_up_all(&ihk_ikc_space_wait);
+	}
+
 	if (smp_processor_id() == 0) {
 		m_channel = ihk_ikc_get_master_channel(os);
 		if (m_channel) {
@@ -47,6 +70,15 @@ static void __ihk_ikc_reception_handler(ihk_os_t os)
 		}
 	}
 
+	/* Connection requests spread over the additional master channels */
+	m_channel = ihk_ikc_get_cpu_master_channel(os, smp_processor_id());
+	if (m_channel) {
+		while (ihk_ikc_channel_enabled(m_channel) &&
+		       !ihk_ikc_queue_is_empty(m_channel->recv.queue)) {
+			ihk_ikc_recv_handler(m_channel, m_channel->handler, os, 0);
+		}
+	}
+
 	r_channel = ihk_ikc_get_regular_channel(os, smp_processor_id());
 	if (!r_channel) {
 		/* It is fine not to have this channel for CPU 0 as we may be
@@ -59,7 +91,7 @@ static void __ihk_ikc_reception_handler(ihk_os_t os)
 		return;
 	}
 	while (ihk_ikc_channel_enabled(r_channel) &&
-	       !ihk_ikc_queue_is_empty(r_channel->recv.queue)) {
+	       !ihk_ikc_channel_is_empty(r_channel)) {
 		found = 1;
 		ihk_ikc_recv_handler(r_channel, r_channel->handler, os, 0);
 	}
@@ -68,6 +100,44 @@ static void __ihk_ikc_reception_handler(ihk_os_t os)
 	}
 }
 
+static void __ihk_ikc_reception_handler(ihk_os_t os)
+{
+	u64 start = ktime_get_ns();
+
+	___ihk_ikc_reception_handler(os);
+	ihk_os_count_ikc_time(os, smp_processor_id(),
+	                      ktime_get_ns() - start);
+}
+
+static long ihk_ikc_drain_func(void *os)
+{
+#ifdef IHK_IKC_RECV_HANDLER_IN_WORKQ
+	__ihk_ikc_reception_handler(os);
+#else
+	unsigned long flags;
+
+	/* As from the interrupt handler */
+	local_irq_save(flags);
+	__ihk_ikc_reception_handler(os);
+	local_irq_restore(flags);
+#endif
+	return 0;
+}
+
+/** \brief Read on cpu what is pending for it, may sleep */
+void ihk_ikc_drain_cpu(ihk_os_t os, int cpu)
+{
+	if (cpu_online(cpu)) {
+		work_on_cpu(cpu, ihk_ikc_drain_func, os);
+	}
+}
+
+/** \brief Linux does not take IKC interrupts for the LWK */
+int ihk_ikc_set_ikc_cpu(ihk_os_t os, int cpu, int linux_cpu)
+{
+	return -EINVAL;
+}
+
 /** \brief Worker thread for IKC interrupts */
 static void ikc_work_func(struct work_struct *work)
 {
@@ -98,6 +168,19 @@ struct ihk_ikc_channel_desc *ihk_ikc_get_master_channel(ihk_os_t os)
 	return ihk_os_get_master_channel(os);
 }
 
+/** \brief Get the additional master channel read on a CPU */
+struct ihk_ikc_channel_desc *ihk_ikc_get_cpu_master_channel(ihk_os_t os,
+                                                            int cpu)
+{
+	return ihk_os_get_cpu_master_channel(os, cpu);
+}
+
+/** \brief Get the master channel to connect from the current CPU on */
+struct ihk_ikc_channel_desc *ihk_ikc_pick_master_channel(ihk_os_t os)
+{
+	return ihk_os_pick_master_channel(os);
+}
+
 /** \brief Initialize the IKC stuffs of an OS */
 void ihk_ikc_system_init(ihk_os_t os)
 {
@@ -122,11 +205,45 @@ void ihk_ikc_system_exit(ihk_os_t os)
 	ihk_os_unregister_interrupt_handler(os, 0, h);
 }
 
-struct ihk_ikc_queue_head *ihk_ikc_alloc_queue(int qpages)
+static int ihk_ikc_cpu_to_node(int cpu)
+{
+	if (cpu < 0 || cpu >= nr_cpu_ids || !cpu_possible(cpu)) {
+		return numa_node_id();
+	}
+	return cpu_to_node(cpu);
+}
+
+/** \brief Allocate pages shared with the LWK on the node of cpu, falling
+ *         back to the other nodes unless ihk_ikc_numa_strict is set */
+void *ihk_ikc_alloc_pages(ihk_os_t os, int qpages, int cpu)
 {
 	int order = fls(qpages) - 1;
+	int node = ihk_ikc_cpu_to_node(cpu);
+	struct page *page;
+
+	page = alloc_pages_node(node, GFP_ATOMIC | __GFP_THISNODE |
+	                        __GFP_NOWARN, order);
+	if (!page && !ihk_ikc_numa_strict) {
+		page = alloc_pages_node(node, GFP_ATOMIC, order);
+	}
+	if (!page) {
+		return NULL;
+	}
+
+	ihk_os_count_ikc_alloc(os, 1, page_to_nid(page) == node);
+	return page_address(page);
+}
 
-	return (void *)__get_free_pages(GFP_ATOMIC, order);
+void ihk_ikc_free_pages(void *p, int npages)
+{
+	free_pages((unsigned long)p, fls(npages) - 1);
+}
+
+/** \brief Allocate the queue on the node of its reader */
+struct ihk_ikc_queue_head *ihk_ikc_alloc_queue(ihk_os_t os, int qpages,
+                                               int cpu)
+{
+	return ihk_ikc_alloc_pages(os, qpages, cpu);
 }
 
 void ihk_ikc_free_queue(struct ihk_ikc_queue_head *q)
@@ -141,11 +258,34 @@ void *ihk_ikc_malloc(int size)
 {
 	return kmalloc(size, GFP_ATOMIC);
 }
+
+void *ihk_ikc_alloc_desc(ihk_os_t os, int size, int cpu)
+{
+	int node = ihk_ikc_cpu_to_node(cpu);
+	void *p;
+
+	p = kmalloc_node(size, GFP_ATOMIC | __GFP_THISNODE | __GFP_NOWARN,
+	                 node);
+	if (!p && !ihk_ikc_numa_strict) {
+		p = kmalloc_node(size, GFP_ATOMIC, node);
+	}
+	if (!p) {
+		return NULL;
+	}
+
+	ihk_os_count_ikc_alloc(os, 0, page_to_nid(virt_to_page(p)) == node);
+	return p;
+}
 void ihk_ikc_free(void *p)
 {
 	kfree(p);
 }
 
+void ihk_ikc_free_desc(struct ihk_ikc_channel_desc *desc)
+{
+	kfree(desc);
+}
+
 int call_arch_master_packet_handler(void *os, struct ihk_ikc_channel_desc *c,
                                     void *__packet)
 {
@@ -162,48 +302,124 @@ int ihk_ikc_wait_master(struct ihk_ikc_master_wait_struct *ws)
 	return wait_event_interruptible(ws->wait, ws->status);
 }
 
+int ihk_ikc_wait_master_timeout(struct ihk_ikc_master_wait_struct *ws,
+                                unsigned int msecs)
+{
+	long ret;
+
+	ret = wait_event_interruptible_timeout(ws->wait, ws->status,
+	                                       msecs_to_jiffies(msecs));
+	if (ret < 0) {
+		return ret;
+	}
+	if (ret == 0) {
+		return -ETIMEDOUT;
+	}
+	return 0;
+}
+
 void ihk_ikc_wake_master(struct ihk_ikc_master_wait_struct *ws)
 {
 	wake_up_interruptible(&ws->wait);
 }
 
-int ihk_ikc_send(struct ihk_ikc_channel_desc *channel, void *p, int opt)
+/*
+ * Wait for the reader to drain a full send queue. Sleeps, i.e. only
+ * called in sleepable context.
+ */
+static void ihk_ikc_wait_space(struct ihk_ikc_channel_desc *channel,
+                               struct ihk_ikc_queue_head *q, u64 deadline)
 {
-	int r;
+	unsigned long timeout = msecs_to_jiffies(10);
+	u64 now;
+
+	ihk_ikc_queue_want_space(q);
+
+	/* Wake up now and then to see the channel being disabled */
+	if (deadline) {
+		now = ktime_get_ns();
+		if (now >= deadline) {
+			return;
+		}
+		timeout = min(timeout, nsecs_to_jiffies(deadline - now) + 1);
+	}
+
+	atomic_inc(&ihk_ikc_nr_space_waiters);
+	wait_event_timeout(ihk_ikc_space_wait,
+	                   !ihk_ikc_channel_enabled(channel) ||
+	                   !ihk_ikc_queue_is_full(q), timeout);
+	atomic_dec(&ihk_ikc_nr_space_waiters);
+}
+
+int ihk_ikc_send_timeout(struct ihk_ikc_channel_desc *channel, void *p,
+                         int opt, long timeout_us)
+{
+	struct ihk_ikc_queue_desc *lane;
+	int r, full = 0;
 	unsigned long flags;
-	int attempts = 0;
+	u64 deadline = 0;
+	bool atomic = in_interrupt() || irqs_disabled();
 
 	if (!channel || !p) {
 		return -EINVAL;
 	}
+	lane = ihk_ikc_send_lane(channel, opt);
 
-	local_irq_save(flags);
-retry:
-	/* Add main packet to target channel */
-	if (ihk_ikc_channel_enabled(channel)) {
-		r = ihk_ikc_write_queue(channel->send.queue, p, opt);
-
-		if (r != 0) {
-			if (++attempts > IHK_IKC_SEND_RETRY) {
-				kprintf("%s: couldn't append packet\n", __FUNCTION__);
-				r = -EBUSY;
-				goto out;
+	if (timeout_us > 0 && !(opt & IKC_BLOCK)) {
+		deadline = ktime_get_ns() + (u64)timeout_us * NSEC_PER_USEC;
+	}
+
+	for (;;) {
+		local_irq_save(flags);
+		/* Add main packet to target channel */
+		if (ihk_ikc_channel_enabled(channel)) {
+			r = ihk_ikc_write_queue(lane->queue, p, opt);
+			if (r == 0 && (!(opt & IKC_NO_NOTIFY) ||
+			               lane == &channel->prio_send)) {
+				ihk_ikc_notify_remote_write(channel);
 			}
+		} else {
+			r = -EINVAL;
+		}
+		local_irq_restore(flags);
+
+		if (r != -EBUSY) {
+			return r;
+		}
 
-			kprintf("%s: couldn't append packet -> retrying\n", __FUNCTION__);
-			goto retry;
+		if (!full++) {
+			ihk_atomic_inc_return(&lane->nr_full);
 		}
 
-		if (!(opt & IKC_NO_NOTIFY)) {
-			ihk_ikc_notify_remote_write(channel);
+		if ((opt & IKC_NONBLOCK) || timeout_us == 0) {
+			return -EAGAIN;
 		}
-	} else {
-		r = -EINVAL;
+
+		/* Don't hold up an interrupt or an IRQs-off section for long */
+		if (atomic) {
+			if (full > IHK_IKC_SEND_RETRY) {
+				kprintf("%s: couldn't append packet\n",
+				        __FUNCTION__);
+				return -EBUSY;
+			}
+			cpu_relax();
+			continue;
+		}
+
+		if (deadline && ktime_get_ns() >= deadline) {
+			kprintf("%s: couldn't append packet\n", __FUNCTION__);
+			return -EBUSY;
+		}
+
+		ihk_ikc_wait_space(channel, lane->queue, deadline);
 	}
+}
 
-out:
-	local_irq_restore(flags);
-	return r;
+IHK_EXPORT_SYMBOL(ihk_ikc_send_timeout);
+
+int ihk_ikc_send(struct ihk_ikc_channel_desc *channel, void *p, int opt)
+{
+	return ihk_ikc_send_timeout(channel, p, opt, IHK_IKC_SEND_TIMEOUT_US);
 }
 
 IHK_EXPORT_SYMBOL(ihk_ikc_send);
@@ -9,14 +9,23 @@
 #include <ikc/master.h>
 
 extern int num_processors;
+void arch_delay(int us);
+int ihk_mc_set_ikc_cpu(int id, int linux_cpu);
 
 struct ihk_ikc_channel_desc *ihk_mc_get_master_channel(void);
 
 static ihk_spinlock_t *ihk_ikc_channels_lock;
 static struct list_head *ihk_ikc_channels;
+static struct ihk_ikc_channel_desc **ihk_ikc_channel_tables;
 
 static struct ihk_ikc_channel_desc **regular_channels;
 
+/* Additional master channels, by the CPU draining them and in the order
+ * they were added */
+static struct ihk_ikc_channel_desc **cpu_master_channels;
+static struct ihk_ikc_channel_desc *master_channels[IHK_IKC_MAX_MASTER_CHANNELS];
+static int nr_master_channels;
+
 struct list_head *ihk_ikc_get_channel_list(ihk_os_t os)
 {
 	return &ihk_ikc_channels[ihk_mc_get_processor_id()];
@@ -25,6 +34,11 @@ ihk_spinlock_t *ihk_ikc_get_channel_list_lock(ihk_os_t os)
 {
 	return &ihk_ikc_channels_lock[ihk_mc_get_processor_id()];
 }
+struct ihk_ikc_channel_desc **ihk_ikc_get_channel_table(ihk_os_t os)
+{
+	return &ihk_ikc_channel_tables[ihk_mc_get_processor_id() *
+	                               IHK_IKC_CHANNEL_TABLE_SIZE];
+}
 
 struct ihk_ikc_channel_desc *ihk_ikc_get_regular_channel(ihk_os_t os, int cpu)
 {
@@ -42,6 +56,48 @@ void ihk_ikc_set_regular_channel(ihk_os_t os, struct ihk_ikc_channel_desc *c, in
 	}
 }
 
+struct ihk_ikc_channel_desc *ihk_ikc_get_cpu_master_channel(ihk_os_t os,
+                                                            int cpu)
+{
+	if (cpu < 0 || cpu >= num_processors) {
+		return NULL;
+	}
+
+	return cpu_master_channels[cpu];
+}
+
+/*
+ * Register the LWK end of a pair of queues published with
+ * ihk_set_mikc_queues(). c is initialized with the master packet handler
+ * and its receive queue is read on cpu. Called before the host sends
+ * IHK_IKC_MASTER_MSG_INIT_ACK.
+ */
+int ihk_ikc_add_master_channel(ihk_os_t os, struct ihk_ikc_channel_desc *c,
+                               int cpu)
+{
+	if (cpu < 0 || cpu >= num_processors || cpu_master_channels[cpu] ||
+	    nr_master_channels >= IHK_IKC_MAX_MASTER_CHANNELS) {
+		return -EINVAL;
+	}
+
+	ihk_ikc_channel_set_cpu(c, cpu);
+	cpu_master_channels[cpu] = c;
+	master_channels[nr_master_channels++] = c;
+
+	return 0;
+}
+
+struct ihk_ikc_channel_desc *ihk_ikc_pick_master_channel(ihk_os_t os)
+{
+	int i = ihk_mc_get_processor_id() % (nr_master_channels + 1);
+
+	if (i == 0 || !ihk_ikc_channel_enabled(master_channels[i - 1])) {
+		return ihk_mc_get_master_channel();
+	}
+
+	return master_channels[i - 1];
+}
+
 static void ihk_ikc_interrupt_handler(void *priv)
 {
 	/* This should be done in the software irq... */
@@ -61,47 +117,107 @@ static void ihk_ikc_interrupt_handler(void *priv)
 	}
 no_m_channel:
 
+	m_channel = ihk_ikc_get_cpu_master_channel(NULL, ihk_mc_get_processor_id());
+	if (m_channel) {
+		while (ihk_ikc_channel_enabled(m_channel) &&
+		       !ihk_ikc_queue_is_empty(m_channel->recv.queue) &&
+		       m_channel->recv.queue->read_cpu == ihk_mc_get_processor_id()) {
+			ihk_ikc_recv_handler(m_channel, m_channel->handler, NULL, 0);
+		}
+	}
+
 	r_channel = ihk_ikc_get_regular_channel(NULL, ihk_mc_get_processor_id());
 	if (!r_channel)
 		return;
 
 	while (ihk_ikc_channel_enabled(r_channel) &&
-	       !ihk_ikc_queue_is_empty(r_channel->recv.queue) &&
+	       !ihk_ikc_channel_is_empty(r_channel) &&
 	       r_channel->recv.queue->read_cpu == ihk_mc_get_processor_id()) {
 		ihk_ikc_recv_handler(r_channel, r_channel->handler, NULL, 0);
 	}
 }
 
-int ihk_ikc_send(struct ihk_ikc_channel_desc *channel, void *p, int opt)
+/*
+ * Wait for the reader to drain a full send queue with interrupts as the
+ * caller had them instead of spinning on the queue with them disabled.
+ * Returns the time waited in us.
+ */
+static long ihk_ikc_wait_space(struct ihk_ikc_channel_desc *channel,
+                               struct ihk_ikc_queue_head *q, long timeout_us)
 {
-	int r;
+	long waited = 0;
+
+	ihk_ikc_queue_want_space(q);
+
+	while ((q->flag & IHK_IKC_QUEUE_FLAG_WANT_SPACE) &&
+	       ihk_ikc_queue_is_full(q) &&
+	       ihk_ikc_channel_enabled(channel) &&
+	       (timeout_us < 0 || waited < timeout_us)) {
+		arch_delay(1);
+		waited++;
+	}
+
+	return waited;
+}
+
+int ihk_ikc_send_timeout(struct ihk_ikc_channel_desc *channel, void *p,
+                         int opt, long timeout_us)
+{
+	struct ihk_ikc_queue_desc *lane;
+	int r, full = 0;
 	unsigned long flags;
+	long waited = 0;
 
 	if(!channel || !p)
 		return -EINVAL;
 
-	flags = cpu_disable_interrupt_save();
+	lane = ihk_ikc_send_lane(channel, opt);
 
-retry:
-	/* Add main packet to target channel */
-	if (ihk_ikc_channel_enabled(channel)) {
-		r = ihk_ikc_write_queue(channel->send.queue, p, opt);
+	if (opt & IKC_BLOCK) {
+		timeout_us = -1;
+	}
 
-		if (r != 0) {
-			kprintf("%s: couldn't append packet -> retrying\n", __FUNCTION__);
-			goto retry;
+	for (;;) {
+		flags = cpu_disable_interrupt_save();
+		/* Add main packet to target channel */
+		if (ihk_ikc_channel_enabled(channel)) {
+			r = ihk_ikc_write_queue(lane->queue, p, opt);
+			if (r == 0 && (!(opt & IKC_NO_NOTIFY) ||
+			               lane == &channel->prio_send)) {
+				ihk_ikc_notify_remote_write(channel);
+			}
+		} else {
+			r = -EINVAL;
 		}
+		cpu_restore_interrupt(flags);
 
-		if (!(opt & IKC_NO_NOTIFY)) {
-			ihk_ikc_notify_remote_write(channel);
+		if (r != -EBUSY) {
+			return r;
 		}
-	} else {
-		r = -EINVAL;
-	}
 
-	cpu_restore_interrupt(flags);
+		if (!full++) {
+			ihk_atomic_inc_return(&lane->nr_full);
+		}
 
-	return r;
+		if ((opt & IKC_NONBLOCK) || timeout_us == 0) {
+			return -EAGAIN;
+		}
+
+		if (timeout_us > 0 && waited >= timeout_us) {
+			kprintf("%s: couldn't append packet\n", __FUNCTION__);
+			return -EBUSY;
+		}
+
+		waited += ihk_ikc_wait_space(channel, lane->queue,
+		                             timeout_us < 0 ?
+		                             -1 : timeout_us - waited);
+	}
+}
+
+/* Senders on the LWK wait as long as it takes, as they always did */
+int ihk_ikc_send(struct ihk_ikc_channel_desc *channel, void *p, int opt)
+{
+	return ihk_ikc_send_timeout(channel, p, opt, -1);
 }
 
 struct ihk_ikc_channel_desc *ihk_ikc_get_master_channel(ihk_os_t os)
@@ -123,15 +239,26 @@ void ihk_ikc_system_init(ihk_os_t os)
 
 	ihk_ikc_channels = ihk_ikc_malloc(sizeof(*ihk_ikc_channels) * num_processors);
 	ihk_ikc_channels_lock = ihk_ikc_malloc(sizeof(*ihk_ikc_channels_lock) * num_processors);
+	ihk_ikc_channel_tables = ihk_ikc_malloc(sizeof(*ihk_ikc_channel_tables) *
+	                                        IHK_IKC_CHANNEL_TABLE_SIZE *
+	                                        num_processors);
 
 	regular_channels = ihk_ikc_malloc(sizeof(*regular_channels) * num_processors);
+	cpu_master_channels = ihk_ikc_malloc(sizeof(*cpu_master_channels) *
+	                                     num_processors);
 
-	if (!ihk_ikc_channels || !ihk_ikc_channels_lock || !regular_channels) {
+	if (!ihk_ikc_channels || !ihk_ikc_channels_lock ||
+	    !ihk_ikc_channel_tables || !regular_channels ||
+	    !cpu_master_channels) {
 		kprintf("%s: error allocating channels list\n", __FUNCTION__);
 		panic("");
 	}
 
 	memset(regular_channels, 0, sizeof(*regular_channels) * num_processors);
+	memset(cpu_master_channels, 0,
+	       sizeof(*cpu_master_channels) * num_processors);
+	memset(ihk_ikc_channel_tables, 0, sizeof(*ihk_ikc_channel_tables) *
+	       IHK_IKC_CHANNEL_TABLE_SIZE * num_processors);
 
 	for (i = 0; i < num_processors; ++i) {
 		INIT_LIST_HEAD(&ihk_ikc_channels[i]);
@@ -145,9 +272,21 @@ void ihk_ikc_system_exit(ihk_os_t os)
 	                                    &ihk_ikc_handler);
 }
 
-struct ihk_ikc_queue_head *ihk_ikc_alloc_queue(int qpages)
+/* The placement of the LWK memory follows its own allocator */
+void *ihk_ikc_alloc_pages(ihk_os_t os, int npages, int cpu)
 {
-	return ihk_mc_alloc_pages(qpages, 0);
+	return ihk_mc_alloc_pages(npages, 0);
+}
+
+void ihk_ikc_free_pages(void *p, int npages)
+{
+	ihk_mc_free_pages(p, npages);
+}
+
+struct ihk_ikc_queue_head *ihk_ikc_alloc_queue(ihk_os_t os, int qpages,
+                                               int cpu)
+{
+	return ihk_ikc_alloc_pages(os, qpages, cpu);
 }
 
 void ihk_ikc_free_queue(struct ihk_ikc_queue_head *q)
@@ -160,11 +299,21 @@ void *ihk_ikc_malloc(int size)
 {
 	return ihk_mc_allocate(size, 0);
 }
+
+void *ihk_ikc_alloc_desc(ihk_os_t os, int size, int cpu)
+{
+	return ihk_mc_allocate(size, 0);
+}
 void ihk_ikc_free(void *p)
 {
 	return ihk_mc_free(p);
 }
 
+void ihk_ikc_free_desc(struct ihk_ikc_channel_desc *desc)
+{
+	ihk_mc_free(desc);
+}
+
 extern ihk_ikc_ph_t arch_master_channel_packet_handler;
 
 int call_arch_master_packet_handler(void *os, struct ihk_ikc_channel_desc *c,
@@ -211,3 +360,10 @@ int ihk_ikc_get_unique_channel_id(ihk_os_t ihk_os)
 {
 	return ihk_atomic_inc_return(&channel_id);
 }
+
+/* Read with ihk_mc_get_ikc_cpu() on each send, the next packets of cpu
+ * go to linux_cpu */
+int ihk_ikc_set_ikc_cpu(ihk_os_t os, int cpu, int linux_cpu)
+{
+	return ihk_mc_set_ikc_cpu(cpu, linux_cpu);
+}
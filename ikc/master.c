@@ -6,6 +6,7 @@
  */
 #include <ikc/ihk.h>
 #include <ikc/master.h>
+#include <ikc/bulk.h>
 
 //#define DEBUG_PRINT_IKC
 
@@ -74,15 +75,15 @@ int ihk_ikc_listen_port(ihk_os_t os, struct ihk_ikc_listen_param *param)
 }
 IHK_EXPORT_SYMBOL(ihk_ikc_listen_port);
 
-static int ihk_ikc_master_send(ihk_os_t os,
+/* Replies go on the master channel the request came in on, so that
+ * connections started from different CPUs do not share a queue
+ */
+static int ihk_ikc_master_send(struct ihk_ikc_channel_desc *c,
                                uint32_t msg, uint32_t ref,
                                uint64_t a1, uint64_t a2, uint64_t a3,
                                uint64_t a4, uint64_t a5)
 {
 	struct ihk_ikc_master_packet packet;
-	struct ihk_ikc_channel_desc *c;
-
-	c = ihk_ikc_get_master_channel(os);
 
 	packet.msg = msg;
 	packet.ref = ref;
@@ -116,11 +117,14 @@ int ihk_ikc_accept(struct ihk_ikc_channel_desc *cm,
 	if (packet_size != p->pkt_size) {
 		return -ECONNABORTED;
 	}
+	/* The receive queue is read on intr_cpu */
 	c = ihk_ikc_create_channel(cm->remote_os, p->port, p->pkt_size,
-	                           p->queue_size, rq, sq, 0);
+	                           p->queue_size, rq, sq, 0, intr_cpu);
 	if (!c) {
 		return -ENOMEM;
 	}
+	/* Disconnect on the master channel the connection came in on */
+	c->master = cm;
 	
 	memset(&ci, 0, sizeof(ci));
 	ci.channel = c;
@@ -145,6 +149,37 @@ int ihk_ikc_accept(struct ihk_ikc_channel_desc *cm,
 static int ihk_ikc_master_reply_handler(ihk_os_t os,
                                         struct ihk_ikc_master_packet *packet);
 
+/* Peer side of ihk_ikc_add_prio_lane() */
+static int __ihk_ikc_accept_prio_lane(struct ihk_ikc_channel_desc *c,
+                                      unsigned long sq, unsigned long qsize,
+                                      unsigned long *rq)
+{
+	int r;
+
+	if (!c) {
+		return -ENOENT;
+	}
+	if (!sq) {
+		return -EINVAL;
+	}
+	if (c->prio_recv.queue || c->prio_send.queue) {
+		return -EBUSY;
+	}
+
+	r = ihk_ikc_set_local_queue(&c->prio_recv, c->remote_os, c->port,
+	                            c->recv.queue->pktsize, qsize, -1);
+	if (r) {
+		return r;
+	}
+	c->prio_recv.queue->read_cpu = c->recv.queue->read_cpu;
+
+	ihk_ikc_set_remote_queue(&c->prio_send, c->remote_os, sq, qsize);
+	c->prio_send.queue->write_cpu = c->recv.queue->read_cpu;
+
+	*rq = c->prio_recv.qphys;
+	return 0;
+}
+
 int ihk_ikc_master_channel_packet_handler(struct ihk_ikc_channel_desc *c,
                                           void *__packet, void *os)
 {
@@ -175,7 +210,7 @@ int ihk_ikc_master_channel_packet_handler(struct ihk_ikc_channel_desc *c,
 					(void *)virt_to_phys(c), c->recv.queue->read_cpu);
 		}
 		if (ihk_ikc_channel_enabled(c) &&
-				!ihk_ikc_queue_is_empty(c->recv.queue)) {
+				!ihk_ikc_channel_is_empty(c)) {
 			ihk_ikc_recv_handler(c, c->handler, os, 0);
 		}
 
@@ -211,7 +246,7 @@ int ihk_ikc_master_channel_packet_handler(struct ihk_ikc_channel_desc *c,
 		}
 
 		if (r != 0) {
-			ihk_ikc_master_send(os,
+			ihk_ikc_master_send(c,
 			                    IHK_IKC_MASTER_MSG_CONNECT_REPLY,
 			                    packet->ref, -r, 0, 0, 0, 0);
 		} else {
@@ -219,7 +254,7 @@ int ihk_ikc_master_channel_packet_handler(struct ihk_ikc_channel_desc *c,
 			        newc, (void *)newc->remote_channel_va);
 			newc->remote_channel_id = packet->ref;
 			ihk_ikc_enable_channel(newc);
-			ihk_ikc_master_send(os,
+			ihk_ikc_master_send(c,
 			                    IHK_IKC_MASTER_MSG_CONNECT_REPLY,
 			                    packet->ref, 0, rq,
 			                    remote_channel_va, (uint64_t)newc, 0);
@@ -231,6 +266,53 @@ int ihk_ikc_master_channel_packet_handler(struct ihk_ikc_channel_desc *c,
 		ret = ihk_ikc_master_reply_handler(os, packet);
 		break;
 
+	case IHK_IKC_MASTER_MSG_BULK_POOL:
+		/* bulk pool (phys, size, sender channel id, channel) */
+		newc = (struct ihk_ikc_channel_desc *)packet->param[3];
+		if (!newc) {
+			ret = -ENOENT;
+		} else {
+			ret = ihk_ikc_bulk_attach(newc, packet->param[0],
+			                          packet->param[1]);
+		}
+		ihk_ikc_master_send(c, IHK_IKC_MASTER_MSG_BULK_POOL_REPLY,
+		                    (uint32_t)packet->param[2], -ret, 0, 0, 0, 0);
+		break;
+
+	case IHK_IKC_MASTER_MSG_BULK_POOL_REPLY:
+		ret = ihk_ikc_master_reply_handler(os, packet);
+		break;
+
+	case IHK_IKC_MASTER_MSG_PRIO_LANE:
+	{
+		/* priority lane (recv queue, queue size, sender channel id,
+		 * channel) */
+		unsigned long rq = 0;
+
+		newc = (struct ihk_ikc_channel_desc *)packet->param[3];
+		ret = __ihk_ikc_accept_prio_lane(newc, packet->param[0],
+		                                 packet->param[1], &rq);
+		ihk_ikc_master_send(c, IHK_IKC_MASTER_MSG_PRIO_LANE_REPLY,
+		                    (uint32_t)packet->param[2], -ret, rq,
+		                    0, 0, 0);
+		break;
+	}
+	case IHK_IKC_MASTER_MSG_PRIO_LANE_REPLY:
+		ret = ihk_ikc_master_reply_handler(os, packet);
+		break;
+
+	case IHK_IKC_MASTER_MSG_REMAP_CPU:
+		/* IKC interrupt target (LWK CPU, Linux CPU) */
+		ret = ihk_ikc_set_ikc_cpu(os, (int)packet->param[0],
+		                          (int)packet->param[1]);
+		ihk_ikc_master_send(c, IHK_IKC_MASTER_MSG_REMAP_CPU_REPLY,
+		                    packet->ref, -ret, 0, 0, 0, 0);
+		break;
+
+	case IHK_IKC_MASTER_MSG_REMAP_CPU_REPLY:
+		ret = ihk_ikc_master_reply_handler(os, packet);
+		break;
+
 	case IHK_IKC_MASTER_MSG_DISCONNECT:
 		newc = (struct ihk_ikc_channel_desc *)packet->param[3];
 		dkprintf("disconnect channel #%d => %p\n", packet->ref, newc);
@@ -334,7 +416,7 @@ int ihk_ikc_master_reply_handler(ihk_os_t os,
 /* sync version. may sleep */
 int ihk_ikc_connect(ihk_os_t os, struct ihk_ikc_connect_param *p)
 {
-	struct ihk_ikc_channel_desc *c;
+	struct ihk_ikc_channel_desc *c, *mc;
 	unsigned long rq = 0, sq = 0;
 	int ref, ret;
 	struct ihk_ikc_master_wait_struct wq;
@@ -343,18 +425,24 @@ int ihk_ikc_connect(ihk_os_t os, struct ihk_ikc_connect_param *p)
 		return -EINVAL;
 	}
 
+	mc = ihk_ikc_pick_master_channel(os);
+	if (!mc) {
+		return -ENOTCONN;
+	}
+
 	dkprintf("%s: connecting channel\n", __func__);
 	c = ihk_ikc_create_channel(os, p->port, p->pkt_size, p->queue_size,
-	                           &rq, &sq, 0);
+	                           &rq, &sq, 0, -1);
 	if (!c) {
 		return -ENOMEM;
 	}
+	c->master = mc;
 	ref = c->channel_id;
 
 	ihk_ikc_wait_reply_prepare(os, &wq, IHK_IKC_MASTER_MSG_CONNECT_REPLY,
 	                           ref);
 
-	if (ihk_ikc_master_send(os, IHK_IKC_MASTER_MSG_CONNECT, ref,
+	if (ihk_ikc_master_send(mc, IHK_IKC_MASTER_MSG_CONNECT, ref,
 	                        ((unsigned long)p->pkt_size << 32) | p->port,
 	                        sq, rq, (uint64_t)c,
 	                        ((unsigned long)p->intr_cpu << 32) | p->magic) == 0) {
@@ -399,11 +487,156 @@ IHK_EXPORT_SYMBOL(ihk_ikc_connect);
 
 int __ihk_send_disconnect(struct ihk_ikc_channel_desc *c)
 {
-	return ihk_ikc_master_send(c->remote_os, IHK_IKC_MASTER_MSG_DISCONNECT, 
+	return ihk_ikc_master_send(c->master, IHK_IKC_MASTER_MSG_DISCONNECT, 
 	                           c->remote_channel_id,
 	                           c->channel_id, 0, 0, c->remote_channel_va, 0);
 }
 
+#ifndef IHK_OS_MANYCORE
+/* How long to wait for the LWK to acknowledge a switch, in ms */
+#define IHK_IKC_REMAP_CPU_TIMEOUT 1000
+
+/*
+ * Move the IKC interrupts of the LWK CPU cpu from old_cpu to linux_cpu
+ * on a running OS instance. The LWK sends to linux_cpu once it has
+ * replied, what it sent before is read on old_cpu before returning.
+ * linux_cpu must already read a regular channel. Gives up with
+ * -ETIMEDOUT when the LWK does not reply, e.g. because it hung. The
+ * request can't be taken back then, the LWK applies it when it gets
+ * to it, so callers are to keep linux_cpu as the target.
+ * sync version. may sleep
+ */
+int ihk_ikc_remap_cpu(ihk_os_t os, int cpu, int old_cpu, int linux_cpu)
+{
+	struct ihk_ikc_master_wait_struct wq;
+	struct ihk_ikc_channel_desc *mc;
+	uint32_t ref;
+	int ret;
+
+	mc = ihk_ikc_get_master_channel(os);
+	if (!mc) {
+		return -ENOTCONN;
+	}
+	if (!ihk_ikc_get_regular_channel(os, linux_cpu)) {
+		return -ENOENT;
+	}
+
+	ref = ihk_ikc_get_unique_channel_id(os);
+	ihk_ikc_wait_reply_prepare(os, &wq,
+	                           IHK_IKC_MASTER_MSG_REMAP_CPU_REPLY, ref);
+
+	if (ihk_ikc_master_send(mc, IHK_IKC_MASTER_MSG_REMAP_CPU, ref,
+	                        cpu, linux_cpu, 0, 0, 0) != 0) {
+		ihk_ikc_wait_finish(os, &wq);
+		return -EBUSY;
+	}
+
+	ret = ihk_ikc_wait_master_timeout(&wq, IHK_IKC_REMAP_CPU_TIMEOUT);
+	ihk_ikc_wait_finish(os, &wq);
+	if (ret == -ETIMEDOUT) {
+		return ret;
+	}
+	if (ret != 0) {
+		return -EINTR;
+	}
+	if (wq.res.param[0]) {
+		return -(int)wq.res.param[0];
+	}
+
+	if (old_cpu >= 0 && old_cpu != linux_cpu) {
+		ihk_ikc_drain_cpu(os, old_cpu);
+	}
+
+	return 0;
+}
+IHK_EXPORT_SYMBOL(ihk_ikc_remap_cpu);
+#endif
+
+/*
+ * Add a priority lane to a connected channel, its own pair of queues of
+ * qsize bytes. Packets sent with IKC_PRIO go on it and are read before
+ * the ones on the other lane.
+ * sync version. may sleep
+ */
+int ihk_ikc_add_prio_lane(struct ihk_ikc_channel_desc *c, unsigned long qsize)
+{
+	struct ihk_ikc_master_wait_struct wq;
+	ihk_os_t os;
+	int ret;
+
+	if (!c || !c->recv.queue || !c->master) {
+		return -EINVAL;
+	}
+	if (c->prio_send.queue) {
+		return -EBUSY;
+	}
+	os = c->remote_os;
+
+	/* Kept on failure, the reception path may be looking at it */
+	if (!c->prio_recv.queue) {
+		ret = ihk_ikc_set_local_queue(&c->prio_recv, os, c->port,
+		                              c->recv.queue->pktsize, qsize, -1);
+		if (ret) {
+			return ret;
+		}
+		c->prio_recv.queue->read_cpu = c->recv.queue->read_cpu;
+	}
+
+	ihk_ikc_wait_reply_prepare(os, &wq,
+	                           IHK_IKC_MASTER_MSG_PRIO_LANE_REPLY,
+	                           c->channel_id);
+
+	if (ihk_ikc_master_send(c->master, IHK_IKC_MASTER_MSG_PRIO_LANE,
+	                        c->remote_channel_id, c->prio_recv.qphys, qsize,
+	                        c->channel_id, c->remote_channel_va, 0) != 0) {
+		ihk_ikc_wait_finish(os, &wq);
+		return -EBUSY;
+	}
+
+	ret = ihk_ikc_wait_master(&wq);
+	ihk_ikc_wait_finish(os, &wq);
+	if (ret != 0) {
+		return -EINTR;
+	}
+	if (wq.res.param[0]) {
+		return -(int)wq.res.param[0];
+	}
+
+	ihk_ikc_set_remote_queue(&c->prio_send, os, wq.res.param[1], qsize);
+	c->prio_send.queue->write_cpu = c->recv.queue->read_cpu;
+
+	return 0;
+}
+IHK_EXPORT_SYMBOL(ihk_ikc_add_prio_lane);
+
+/* sync version. may sleep */
+int __ihk_ikc_send_bulk_pool(struct ihk_ikc_channel_desc *c,
+                             unsigned long phys, unsigned long size)
+{
+	struct ihk_ikc_master_wait_struct wq;
+	ihk_os_t os = c->remote_os;
+	int ret;
+
+	ihk_ikc_wait_reply_prepare(os, &wq,
+	                           IHK_IKC_MASTER_MSG_BULK_POOL_REPLY,
+	                           c->channel_id);
+
+	if (ihk_ikc_master_send(c->master, IHK_IKC_MASTER_MSG_BULK_POOL,
+	                        c->remote_channel_id, phys, size,
+	                        c->channel_id, c->remote_channel_va, 0) != 0) {
+		ihk_ikc_wait_finish(os, &wq);
+		return -EBUSY;
+	}
+
+	ret = ihk_ikc_wait_master(&wq);
+	ihk_ikc_wait_finish(os, &wq);
+	if (ret != 0) {
+		return -EINTR;
+	}
+
+	return -(int)wq.res.param[0];
+}
+
 int __ihk_wait_for_disconnect_ack(struct ihk_ikc_channel_desc *c)
 {
 	struct ihk_ikc_master_wait_struct wq;
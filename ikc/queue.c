@@ -8,6 +8,7 @@
 #include <ikc/ihk.h>
 #include <ikc/queue.h>
 #include <ikc/msg.h>
+#include <ikc/bulk.h>
 
 //#define DEBUG_QUEUE
 
@@ -25,6 +26,8 @@
 #endif
 
 #define IHK_IKC_WRITE_QUEUE_RETRY	128
+/* A waiting writer is notified once the queue is this empty */
+#define IHK_IKC_QUEUE_LOW_WATERMARK(q)	((q)->pktcount / 4)
 
 void ihk_ikc_notify_remote_read(struct ihk_ikc_channel_desc *c);
 void ihk_ikc_notify_remote_write(struct ihk_ikc_channel_desc *c);
@@ -178,9 +181,9 @@ retry:
 
 	/* Is the queue full? */
 	if ((w - r) == (q->pktcount - 1)) {
-		/* Did we run out of attempts? */
+		/* Did we run out of attempts? The sender decides to wait */
 		if (++attempt > IHK_IKC_WRITE_QUEUE_RETRY) {
-			kprintf("%s: queue %p r: %llu, w: %llu is full\n",
+			dkprintf("%s: queue %p r: %llu, w: %llu is full\n",
 					__FUNCTION__, (void *)virt_to_phys(q), r, w);
 			return -EBUSY;
 		}
@@ -211,6 +214,77 @@ retry:
 	return 0;
 }
 
+/*
+ * Backpressure: a writer finding the queue full asks for a notification
+ * and waits instead of spinning on it. The caller checks the queue again
+ * afterwards, the reader may have drained it before seeing the flag.
+ */
+void ihk_ikc_queue_want_space(struct ihk_ikc_queue_head *q)
+{
+	uint32_t f;
+
+	for (;;) {
+		f = q->flag;
+		if (f & IHK_IKC_QUEUE_FLAG_WANT_SPACE) {
+			ihk_ikc_mb();
+			return;
+		}
+		if (cmpxchg(&q->flag, f, f | IHK_IKC_QUEUE_FLAG_WANT_SPACE) == f) {
+			return;
+		}
+	}
+}
+
+/* Reader side, notify a waiting writer past the low watermark */
+static void ihk_ikc_check_space(struct ihk_ikc_channel_desc *c,
+                                struct ihk_ikc_queue_head *q)
+{
+	uint32_t f = q->flag;
+
+	if (!(f & IHK_IKC_QUEUE_FLAG_WANT_SPACE)) {
+		return;
+	}
+	if (q->write_off - q->read_off > IHK_IKC_QUEUE_LOW_WATERMARK(q)) {
+		return;
+	}
+	if (cmpxchg(&q->flag, f, f & ~IHK_IKC_QUEUE_FLAG_WANT_SPACE) == f) {
+		ihk_ikc_notify_remote_read(c);
+	}
+}
+
+/*
+ * Channel table keyed by channel_id, updated and looked up with the
+ * channel list lock held
+ */
+static struct ihk_ikc_channel_desc **
+ihk_ikc_table_bucket(struct ihk_ikc_channel_desc **table, int id)
+{
+	return &table[(unsigned int)id % IHK_IKC_CHANNEL_TABLE_SIZE];
+}
+
+static void ihk_ikc_table_add(struct ihk_ikc_channel_desc *c)
+{
+	struct ihk_ikc_channel_desc **bucket =
+		ihk_ikc_table_bucket(c->table, c->channel_id);
+
+	c->table_next = *bucket;
+	*bucket = c;
+}
+
+/* Remove c from the table it was added to, not the current CPU's one */
+static void ihk_ikc_table_del(struct ihk_ikc_channel_desc *c)
+{
+	struct ihk_ikc_channel_desc **p;
+
+	for (p = ihk_ikc_table_bucket(c->table, c->channel_id); *p;
+	     p = &(*p)->table_next) {
+		if (*p == c) {
+			*p = c->table_next;
+			return;
+		}
+	}
+}
+
 /*
  * Channel and queue descriptors
  */
@@ -250,8 +324,14 @@ void ihk_ikc_init_desc(struct ihk_ikc_channel_desc *c,
 	ihk_ikc_spinlock_init(&c->send.lock);
 	ihk_ikc_spinlock_init(&c->packet_pool_lock);
 
+	c->list_lock = all_lock;
+	c->table = ihk_ikc_get_channel_table(ros);
+	/* Dropped by ihk_ikc_free_channel() */
+	c->refcount = 1;
+
 	flags = ihk_ikc_spinlock_lock(all_lock);
 	list_add_tail(&c->list_all, all_list);
+	ihk_ikc_table_add(c);
 	ihk_ikc_spinlock_unlock(all_lock, flags);
 }
 
@@ -340,13 +420,94 @@ int ihk_ikc_set_remote_queue(struct ihk_ikc_queue_desc *q, ihk_os_t os,
 	return 0;
 }
 
+int ihk_ikc_set_local_queue(struct ihk_ikc_queue_desc *q, ihk_os_t os,
+                            int port, int packet_size, unsigned long qsize,
+                            int cpu)
+{
+	struct ihk_ikc_queue_head *queue;
+	int qpages;
+
+	qpages = (qsize + PAGE_SIZE - 1) >> PAGE_SHIFT;
+
+	queue = ihk_ikc_alloc_queue(os, qpages, cpu);
+	if (!queue) {
+		return -ENOMEM;
+	}
+	ihk_ikc_init_queue(queue, 1, port, PAGE_SIZE * qpages, packet_size);
+
+	ihk_ikc_spinlock_init(&q->lock);
+	q->qrphys = 0;
+	q->qphys = virt_to_phys(queue);
+	q->queue = queue;
+
+	return 0;
+}
+
+static void ihk_ikc_free_queue_desc(ihk_os_t os, struct ihk_ikc_queue_desc *q)
+{
+	int qpages;
+
+	if (!q->queue) {
+		return;
+	}
+
+	qpages = (q->queue->queue_size + sizeof(struct ihk_ikc_queue_head) +
+	          PAGE_SIZE - 1) >> PAGE_SHIFT;
+	if (q->qrphys) {
+		ihk_ikc_unmap_virtual(ihk_os_to_dev(os), q->queue, qpages);
+		ihk_ikc_unmap_memory(os, q->qphys, qpages);
+	} else {
+		ihk_ikc_free_queue(q->queue);
+	}
+}
+
+int ihk_ikc_get_lane_stats(struct ihk_ikc_channel_desc *c, int lane,
+                           struct ihk_ikc_lane_stats *st)
+{
+	struct ihk_ikc_queue_desc *recv, *send;
+
+	if (!c || !st) {
+		return -EINVAL;
+	}
+
+	switch (lane) {
+	case IHK_IKC_LANE_BULK:
+		recv = &c->recv;
+		send = &c->send;
+		break;
+	case IHK_IKC_LANE_PRIO:
+		recv = &c->prio_recv;
+		send = &c->prio_send;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	memset(st, 0, sizeof(*st));
+
+	/* The offsets only grow, they count the packets */
+	if (recv->queue) {
+		st->received = recv->queue->read_off;
+		st->queued = recv->queue->max_read_off - recv->queue->read_off;
+	}
+	if (send->queue) {
+		st->sent = send->queue->max_read_off;
+	} else if (!recv->queue) {
+		return -ENOENT;
+	}
+	st->full = ihk_atomic_read(&send->nr_full);
+
+	return 0;
+}
+
 struct ihk_ikc_channel_desc *ihk_ikc_create_channel(ihk_os_t os,
                                                     int port,
                                                     int packet_size,
                                                     unsigned long qsize,
                                                     unsigned long *rq,
                                                     unsigned long *sq,
-                                                    enum ihk_ikc_channel_flag f)
+                                                    enum ihk_ikc_channel_flag f,
+                                                    int cpu)
 {
 	unsigned long phys;
 	struct ihk_ikc_channel_desc *desc;
@@ -355,8 +516,8 @@ struct ihk_ikc_channel_desc *ihk_ikc_create_channel(ihk_os_t os,
 
 	qpages = (qsize + PAGE_SIZE - 1) >> PAGE_SHIFT;
 
-	desc = ihk_ikc_malloc(sizeof(struct ihk_ikc_channel_desc)
-	                      + packet_size);
+	desc = ihk_ikc_alloc_desc(os, sizeof(struct ihk_ikc_channel_desc)
+	                          + packet_size, cpu);
 	if (!desc) {
 		return NULL;
 	}
@@ -366,7 +527,7 @@ struct ihk_ikc_channel_desc *ihk_ikc_create_channel(ihk_os_t os,
 	desc->flag = f;
 
 	if (!*rq) {
-		recvq = ihk_ikc_alloc_queue(qpages);
+		recvq = ihk_ikc_alloc_queue(os, qpages, cpu);
 		if (!recvq) {
 			ihk_ikc_free(desc);
 			return NULL;
@@ -406,18 +567,12 @@ struct ihk_ikc_channel_desc *ihk_ikc_create_channel(ihk_os_t os,
 	return desc;
 }
 
-void ihk_ikc_free_channel(struct ihk_ikc_channel_desc *desc)
+static void __ihk_ikc_free_channel(struct ihk_ikc_channel_desc *desc)
 {
 	ihk_os_t os = desc->remote_os;
-	int qpages;
-	ihk_spinlock_t *lock = ihk_ikc_get_channel_list_lock(os);
 	struct ihk_ikc_free_packet *p_iter, *p_next;
 	unsigned long flags;
 
-	flags = ihk_ikc_spinlock_lock(lock);
-	list_del(&desc->list_all);
-	ihk_ikc_spinlock_unlock(lock, flags);
-
 	flags = ihk_ikc_spinlock_lock(&desc->packet_pool_lock);
 	list_for_each_entry_safe(p_iter, p_next, &desc->packet_pool, list) {
 		list_del(&p_iter->list);
@@ -425,40 +580,51 @@ void ihk_ikc_free_channel(struct ihk_ikc_channel_desc *desc)
 	}
 	ihk_ikc_spinlock_unlock(&desc->packet_pool_lock, flags);
 
-	if (desc->recv.queue) {
-		qpages = (desc->recv.queue->queue_size
-		          + sizeof(struct ihk_ikc_queue_head) + PAGE_SIZE - 1)
-			>> PAGE_SHIFT;
-		if (desc->recv.qrphys) {
-			ihk_ikc_unmap_virtual(ihk_os_to_dev(os),
-			                      desc->recv.queue,
-			                      qpages);
-			ihk_ikc_unmap_memory(os, desc->recv.qphys, qpages);
-		} else {
-			ihk_ikc_free_queue(desc->recv.queue);
-		}
-	}
+	ihk_ikc_bulk_fini(desc);
 
-	if (desc->send.queue) {
-		qpages = (desc->send.queue->queue_size
-		          + sizeof(struct ihk_ikc_queue_head) + PAGE_SIZE - 1)
-			>> PAGE_SHIFT;
-		if (desc->send.qrphys) {
-			ihk_ikc_unmap_virtual(ihk_os_to_dev(os),
-			                      desc->send.queue,
-			                      qpages);
-			ihk_ikc_unmap_memory(os, desc->send.qphys, qpages);
-		} else {
-			ihk_ikc_free_queue(desc->send.queue);
-		}
-	}
+	ihk_ikc_free_queue_desc(os, &desc->recv);
+	ihk_ikc_free_queue_desc(os, &desc->send);
+	ihk_ikc_free_queue_desc(os, &desc->prio_recv);
+	ihk_ikc_free_queue_desc(os, &desc->prio_send);
+
+	ihk_ikc_free_desc(desc);
+}
+
+/** \brief Remove a channel from the lookups and free it, or let the
+ *         last ihk_ikc_channel_put() free it if it was found */
+void ihk_ikc_free_channel(struct ihk_ikc_channel_desc *desc)
+{
+	ihk_spinlock_t *lock = desc->list_lock;
+	unsigned long flags;
+
+	flags = ihk_ikc_spinlock_lock(lock);
+	list_del(&desc->list_all);
+	ihk_ikc_table_del(desc);
+	ihk_ikc_spinlock_unlock(lock, flags);
 
-	ihk_ikc_free(desc);
+	ihk_ikc_channel_put(desc);
+}
+
+/** \brief Drop a reference taken by ihk_ikc_find_channel() */
+void ihk_ikc_channel_put(struct ihk_ikc_channel_desc *c)
+{
+	ihk_spinlock_t *lock = c->list_lock;
+	unsigned long flags;
+	int last;
+
+	flags = ihk_ikc_spinlock_lock(lock);
+	last = !--c->refcount;
+	ihk_ikc_spinlock_unlock(lock, flags);
+
+	if (last) {
+		__ihk_ikc_free_channel(c);
+	}
 }
 
 
 int ihk_ikc_recv(struct ihk_ikc_channel_desc *channel, void *p, int opt)
 {
+	struct ihk_ikc_queue_head *q;
 	int r;
 	unsigned long flags;
 
@@ -472,7 +638,13 @@ int ihk_ikc_recv(struct ihk_ikc_channel_desc *channel, void *p, int opt)
 	local_irq_save(flags);
 #endif
 	if (ihk_ikc_channel_enabled(channel)) {
-		r = ihk_ikc_read_queue(channel->recv.queue, p, opt);
+		/* The priority lane goes first */
+		q = channel->recv.queue;
+		if (channel->prio_recv.queue &&
+		    !ihk_ikc_queue_is_empty(channel->prio_recv.queue)) {
+			q = channel->prio_recv.queue;
+		}
+		r = ihk_ikc_read_queue(q, p, opt);
 
 		/* We set channel here instead of setting it on
 		 * allocation and skipping those bytes when receiving
@@ -481,6 +653,7 @@ int ihk_ikc_recv(struct ihk_ikc_channel_desc *channel, void *p, int opt)
 		 */
 		if (!r) {
 			((struct ihk_ikc_packet_header *)p)->channel = channel;
+			ihk_ikc_check_space(channel, q);
 		}
 
 		/* XXX: Optimal interrupt */
@@ -606,23 +779,27 @@ void ihk_ikc_disable_channel(struct ihk_ikc_channel_desc *channel)
 	ihk_ikc_spinlock_unlock(&channel->recv.lock, flags);
 }
 
+/** \brief Look up a channel by channel_id
+ *
+ * The channel returned is referenced, i.e. it stays valid until the
+ * caller releases it with ihk_ikc_channel_put(). */
 struct ihk_ikc_channel_desc *ihk_ikc_find_channel(ihk_os_t os, int id)
 {
 	ihk_spinlock_t *lock = ihk_ikc_get_channel_list_lock(os);
-	struct list_head *channels = ihk_ikc_get_channel_list(os);
 	struct ihk_ikc_channel_desc *c;
 	unsigned long flags;
 
 	flags = ihk_ikc_spinlock_lock(lock);
-	list_for_each_entry(c, channels, list_all) {
+	for (c = *ihk_ikc_table_bucket(ihk_ikc_get_channel_table(os), id);
+	     c; c = c->table_next) {
 		if (c->channel_id == id) {
-			ihk_ikc_spinlock_unlock(lock, flags);
-			return c;
+			c->refcount++;
+			break;
 		}
 	}
 	ihk_ikc_spinlock_unlock(lock, flags);
 
-	return NULL;
+	return c;
 }
 
 IHK_EXPORT_SYMBOL(ihk_ikc_recv);
@@ -631,6 +808,8 @@ IHK_EXPORT_SYMBOL(ihk_ikc_enable_channel);
 IHK_EXPORT_SYMBOL(ihk_ikc_disable_channel);
 IHK_EXPORT_SYMBOL(ihk_ikc_free_channel);
 IHK_EXPORT_SYMBOL(ihk_ikc_find_channel);
+IHK_EXPORT_SYMBOL(ihk_ikc_channel_put);
 IHK_EXPORT_SYMBOL(ihk_ikc_channel_set_cpu);
 IHK_EXPORT_SYMBOL(ihk_ikc_release_packet);
+IHK_EXPORT_SYMBOL(ihk_ikc_get_lane_stats);
 
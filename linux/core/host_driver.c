@@ -33,6 +33,9 @@
 #include <linux/eventfd.h>
 #include <linux/version.h>
 #include <linux/cred.h>
+#include <linux/bitmap.h>
+#include <linux/hash.h>
+#include <linux/rculist.h>
 #include <ihk/ihk_host_user.h>
 #include <ihk/ihk_host_driver.h>
 #include <asm/spinlock.h>
@@ -60,6 +63,18 @@
 #define OS_DATA_INVALID ((void *)-1)
 #define DEV_DATA_INVALID ((void *)-1)
 
+static unsigned int ihk_kmsg_size = IHK_KMSG_RING_SIZE;
+module_param(ihk_kmsg_size, uint, 0644);
+MODULE_PARM_DESC(ihk_kmsg_size, "Size of the kmsg record ring of an OS instance in bytes");
+
+static unsigned int ihk_watchdog_interval = 0;
+module_param(ihk_watchdog_interval, uint, 0644);
+MODULE_PARM_DESC(ihk_watchdog_interval, "Interval in ms of sampling the monitor of an OS instance, 0 disables the watchdog");
+
+static unsigned int ihk_watchdog_threshold = 10000;
+module_param(ihk_watchdog_threshold, uint, 0644);
+MODULE_PARM_DESC(ihk_watchdog_threshold, "Time in ms a CPU can stay in kernel without progress before the OS instance is regarded as hung up");
+
 static dev_t mcos_dev_num, mcd_dev_num;
 static struct class *mcos_class, *mcd_class;
 
@@ -89,6 +104,9 @@ struct ihk_event {
 #define IHK_OS_MONITOR_KERNEL_FROZEN 9
 #define IHK_OS_MONITOR_KERNEL_THAW 10
 
+static void ihk_os_watchdog_start(struct ihk_host_linux_os_data *data);
+static void ihk_os_watchdog_stop(struct ihk_host_linux_os_data *data);
+
 /*
  * OS character device file operations.
  */
@@ -119,6 +137,16 @@ static int ihk_host_os_open(struct inode *inode, struct file *file)
 	ifile->osdata = data;
 	file->private_data = ifile;
 
+	/* Share one address_space among all opens so that the user
+	 * mappings can be zapped before their memory is released */
+	if (!data->mmap_inode) {
+		ihold(inode);
+		if (cmpxchg(&data->mmap_inode, NULL, inode) != NULL) {
+			iput(inode);
+		}
+	}
+	file->f_mapping = data->mmap_inode->i_mapping;
+
 	if (data->ops->open) {
 		ret = data->ops->open(data, data->priv, file);
 		if (ret != 0) {
@@ -324,6 +352,10 @@ static int  __ihk_os_boot(struct ihk_host_linux_os_data *data, int flag)
 		}
 	}
 
+	if (ret == 0) {
+		ihk_os_watchdog_start(data);
+	}
+
 	up(&ihk_os_notifiers_lock);
 	return ret;
 }
@@ -357,6 +389,21 @@ static int release_kmsg_buf(struct ihk_kmsg_buf_container* cont) {
 	return 0;
 }
 
+/** \brief Tear down the user mappings of the monitor, the rusage
+ * snapshot and the perf rings. Accessing them afterwards raises SIGBUS.
+ * The state page is owned by Linux and stays mapped, boot_gen tells its
+ * users to drop the others before they touch them. */
+static void ihk_os_zap_mappings(struct ihk_host_linux_os_data *data)
+{
+	WRITE_ONCE(data->state->boot_gen, data->state->boot_gen + 1);
+	smp_wmb();
+
+	if (data->mmap_inode) {
+		unmap_mapping_range(data->mmap_inode->i_mapping, 0,
+				    IHK_OS_MMAP_STATE, 1);
+	}
+}
+
 /** \brief Shutdown the kernel related to the OS file */
 static int __ihk_os_shutdown(struct ihk_host_linux_os_data *data, int flag)
 {
@@ -377,8 +424,13 @@ static int __ihk_os_shutdown(struct ihk_host_linux_os_data *data, int flag)
 	}
 	up(&ihk_os_notifiers_lock);
 
+	ihk_os_watchdog_stop(data);
+
 	ikc_master_finalize(data);
 
+	/* The memory behind the mappings is reused by the next boot */
+	ihk_os_zap_mappings(data);
+
 	if (data->ops->shutdown) {
 		ret = data->ops->shutdown(data, data->priv, flag);
 	}
@@ -397,6 +449,80 @@ static int __ihk_os_shutdown(struct ihk_host_linux_os_data *data, int flag)
 	return ret;
 }
 
+/** \brief Restart the kernel related to the OS file
+ *
+ * Its CPUs, memory, IKC map and device file are kept. The driver
+ * restores the kernel image it loaded and boots it again.
+ */
+static int __ihk_os_reboot(struct ihk_host_linux_os_data *data, int flag)
+{
+	int ret = -EINVAL;
+	struct ihk_os_notifier *_ion;
+	int index = ihk_host_os_get_index(data);
+
+	if (!data->ops->reboot) {
+		return -EINVAL;
+	}
+
+	if (down_interruptible(&ihk_os_notifiers_lock)) {
+		return -ERESTARTSYS;
+	}
+
+	/* Leave a kernel which can't be restarted as it is */
+	if (data->ops->reboot_prepare) {
+		ret = data->ops->reboot_prepare(data, data->priv);
+		if (ret) {
+			up(&ihk_os_notifiers_lock);
+			return ret;
+		}
+	}
+
+	if (index != -1) {
+		list_for_each_entry(_ion, &ihk_os_notifiers, nlist) {
+			if (_ion->ops && _ion->ops->shutdown)
+				_ion->ops->shutdown(index);
+		}
+	}
+
+	ihk_os_watchdog_stop(data);
+
+	ikc_master_finalize(data);
+	memset(data->regular_channels, 0,
+	       sizeof(*data->regular_channels) * num_possible_cpus());
+
+	/* The new kernel publishes its areas again */
+	data->monitor = NULL;
+	data->monitor_pa = 0;
+	data->rusage = NULL;
+	data->rusage_pa = 0;
+	data->rusage_snapshot_pa = 0;
+	data->perf_ring_pa = 0;
+	ihk_os_zap_mappings(data);
+
+	ret = data->ops->reboot(data, data->priv, flag);
+	if (ret == 0) {
+		ret = ihk_ikc_master_init(data);
+		if (ret) {
+			/* Running but unreachable, let shutdown clean up */
+			__ihk_os_notify_hungup(data);
+		}
+	}
+
+	if (ret == 0) {
+		list_for_each_entry(_ion, &ihk_os_notifiers, nlist) {
+			if (_ion->ops && _ion->ops->boot)
+				_ion->ops->boot(index);
+		}
+		ihk_os_watchdog_start(data);
+	}
+
+	up(&ihk_os_notifiers_lock);
+
+	printk("IHK: OS reboot %s\n", ret ? "failed" : "OK");
+
+	return ret;
+}
+
 /** \brief ioctl handler for a debug request to the OS file */
 static int __ihk_os_ioctl_debug_request(struct ihk_host_linux_os_data *data,
                                         unsigned int request,
@@ -496,47 +622,40 @@ static int __ihk_os_reserve_mem(struct ihk_host_linux_os_data *data,
 	return __ihk_os_alloc_resource(data, &resource);
 }
 
+/*
+ * Copy the text of the unread records to buf, IHK_KMSG_SIZE bytes at
+ * most, without blocking the writers. Lost records are reported with
+ * a marker. When shift is set, the copied records are consumed.
+ */
 static int read_kmsg(struct ihk_kmsg_buf *kmsg_buf, char *buf, int shift)
 {
-	int len_bottom, len_top;
-	unsigned long flags;
+	unsigned long head, seq, lost = 0;
+	int len;
 
 	if (!kmsg_buf) {
 		return -EINVAL;
 	}
 
-	/* Inter-kernel lock for struct ihk_kmsg_buf */
-	local_irq_save(flags);
-	while(__sync_val_compare_and_swap(&kmsg_buf->lock, 0, 1) != 0) {
-		cpu_relax();
-	}
-  
-	if (kmsg_buf->head > kmsg_buf->tail) {
-		len_bottom = strnlen(&kmsg_buf->str[kmsg_buf->head], kmsg_buf->len - kmsg_buf->head);
-		len_top = kmsg_buf->tail;
-	} else {
-		len_bottom = kmsg_buf->tail - kmsg_buf->head;
-		len_top = 0;
-	}
-	dkprintf("kmsg head=%d,tail=%d,len=%d,len_bottom=%d,len_top=%d\n", kmsg_buf->head, kmsg_buf->tail, kmsg_buf->len, len_bottom, len_top);
+	head = seq = kmsg_buf->head;
+	len = ihk_kmsg_read(kmsg_buf, &seq, buf, IHK_KMSG_SIZE, &lost);
 
-	/* Print the end of the buffer */
-	if (len_bottom > 0) {
-		memcpy(buf, &kmsg_buf->str[kmsg_buf->head], len_bottom);
-	}
+	dkprintf("kmsg head=%ld,seq=%ld,len=%d,lost=%ld\n",
+		 head, seq, len, lost);
 
-	/* Then the front of it */
-	if (len_top > 0) {
-		memcpy(buf + len_bottom, kmsg_buf->str, len_top);
+	if (lost && len + 64 <= IHK_KMSG_SIZE) {
+		len += scnprintf(buf + len, 64,
+				 "** %lu kmsg records lost **\n", lost);
 	}
 
-	if (shift) {
-		kmsg_buf->head = kmsg_buf->tail; 
+	/* Another reader might have consumed them, in which case it has
+	 * accounted the lost records
+	 */
+	if (shift &&
+	    __sync_val_compare_and_swap(&kmsg_buf->head, head, seq) == head) {
+		__sync_fetch_and_add(&kmsg_buf->lost, lost);
 	}
-	kmsg_buf->lock = 0;
-	local_irq_restore(flags);
 
-	return len_bottom + len_top;
+	return len;
 }
 
 /** \brief ioctl handler for reading the kernel message to the buffer */
@@ -671,6 +790,36 @@ setup_rusage(struct ihk_host_linux_os_data *data)
 	data->rusage_len = size;
 }
 
+/* Areas only mapped to user space, so the physical address suffices */
+static void
+setup_user_area(struct ihk_host_linux_os_data *data, int type,
+		unsigned long *pa_out, unsigned long *len_out)
+{
+	unsigned long rpa;
+	unsigned long pa;
+	unsigned long size;
+	unsigned long psize;
+
+	if (*pa_out)
+		return;
+
+	if (__ihk_os_get_special_addr(data, type, &rpa, &size)) {
+		dprintf("get_special_addr: failed.\n");
+		return;
+	}
+
+	psize = ((size + PAGE_SIZE - 1) / PAGE_SIZE) * PAGE_SIZE;
+	pa = __ihk_os_map_memory(data, rpa, psize);
+
+#ifdef CONFIG_MIC
+	if ((long)pa <= 0) {
+		return;
+	}
+#endif
+	*len_out = size;
+	*pa_out = pa;
+}
+
 static int detect_hungup(struct ihk_host_linux_os_data *data)
 {
 	int ret;
@@ -725,8 +874,147 @@ static int detect_hungup(struct ihk_host_linux_os_data *data)
 	return ret;
 }
 
-static int __ihk_os_status(struct ihk_host_linux_os_data *data,
-		char __user *buf)
+/*
+ * Watchdog sampling the monitor with a hrtimer. A CPU staying in
+ * kernel without incrementing its counter for ihk_watchdog_threshold
+ * ms makes the OS instance hung up, which is reported through
+ * IHK_OS_EVENTFD_TYPE_STATUS as detect_hungup() does. Like there, a CPU
+ * in panic makes it failed instead, and the watchdog stops.
+ */
+static void ihk_os_watchdog_work(struct work_struct *work)
+{
+	struct ihk_host_linux_os_data *data =
+		container_of(work, struct ihk_host_linux_os_data,
+			     watchdog_work);
+	struct ihk_host_watchdog_cpu *cpus;
+	int status;
+	int cpu;
+	int n;
+	int i;
+
+	cpu = data->watchdog_stalled_cpu;
+	if (cpu != -1) {
+		pr_err("IHK: OS %d: CPU %d stalled in kernel for %lld ms\n",
+		       data->minor, cpu,
+		       ktime_to_ms(ktime_sub(ktime_get(),
+				      data->watchdog_cpus[cpu].progress)));
+		__ihk_os_notify_hungup(data);
+		ihk_os_eventfd((ihk_os_t)data, IHK_OS_EVENTFD_TYPE_STATUS);
+		return;
+	}
+
+	/* Map the monitor once the LWK has initialized it */
+	if (data->watchdog_cpus) {
+		return;
+	}
+
+	status = __ihk_os_query_status(data);
+	if (status != IHK_OS_STATUS_READY && status != IHK_OS_STATUS_RUNNING) {
+		return;
+	}
+
+	setup_monitor(data);
+	if (data->monitor == NULL) {
+		return;
+	}
+
+	n = data->monitor->num_processors;
+	cpus = kcalloc(n, sizeof(*cpus), GFP_KERNEL);
+	if (!cpus) {
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		cpus[i].counter = data->monitor->cpu[i].counter;
+		cpus[i].progress = ktime_get();
+	}
+
+	data->watchdog_nr_cpus = n;
+	smp_wmb();
+	data->watchdog_cpus = cpus;
+}
+
+static enum hrtimer_restart ihk_os_watchdog_timer(struct hrtimer *timer)
+{
+	struct ihk_host_linux_os_data *data =
+		container_of(timer, struct ihk_host_linux_os_data,
+			     watchdog_timer);
+	struct ihk_host_watchdog_cpu *cpus = data->watchdog_cpus;
+	struct ihk_os_cpu_monitor *monitor;
+	ktime_t now = ktime_get();
+	int n;
+	int i;
+
+	if (!cpus) {
+		schedule_work(&data->watchdog_work);
+		goto out;
+	}
+	smp_rmb();
+
+	/* The monitor is writable by the LWK, don't trust its size */
+	n = min_t(unsigned long, data->monitor->num_processors,
+		  data->watchdog_nr_cpus);
+
+	/* A panic is terminal and the other CPUs may stop in kernel
+	 * because of it, don't report it as hung up */
+	for (i = 0; i < n; i++) {
+		if (data->monitor->cpu[i].status == IHK_OS_MONITOR_PANIC) {
+			dkprintf("%s: PANIC detected on CPU %d\n",
+				 __func__, i);
+			return HRTIMER_NORESTART;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		monitor = &data->monitor->cpu[i];
+
+		if (monitor->status != IHK_OS_MONITOR_KERNEL ||
+		    monitor->counter != cpus[i].counter) {
+			cpus[i].counter = monitor->counter;
+			cpus[i].progress = now;
+			continue;
+		}
+
+		if (ktime_to_ms(ktime_sub(now, cpus[i].progress)) >=
+		    ihk_watchdog_threshold) {
+			dkprintf("%s: HUNGUP detected on CPU %d\n",
+				 __func__, i);
+			data->watchdog_stalled_cpu = i;
+			schedule_work(&data->watchdog_work);
+			return HRTIMER_NORESTART;
+		}
+	}
+
+ out:
+	hrtimer_forward_now(timer, ms_to_ktime(ihk_watchdog_interval));
+	return HRTIMER_RESTART;
+}
+
+static void ihk_os_watchdog_start(struct ihk_host_linux_os_data *data)
+{
+	if (!ihk_watchdog_interval) {
+		return;
+	}
+
+	data->watchdog_stalled_cpu = -1;
+	hrtimer_start(&data->watchdog_timer,
+		      ms_to_ktime(ihk_watchdog_interval), HRTIMER_MODE_REL);
+}
+
+static void ihk_os_watchdog_stop(struct ihk_host_linux_os_data *data)
+{
+	hrtimer_cancel(&data->watchdog_timer);
+	cancel_work_sync(&data->watchdog_work);
+
+	kfree(data->watchdog_cpus);
+	data->watchdog_cpus = NULL;
+	data->watchdog_nr_cpus = 0;
+}
+
+/** \brief Status of the OS including the ones derived from its monitor,
+ * i.e. IHK_OS_STATUS_FAILED, IHK_OS_STATUS_FREEZING and
+ * IHK_OS_STATUS_FROZEN */
+static int __ihk_os_monitor_status(struct ihk_host_linux_os_data *data)
 {
 	int n;
 	int i;
@@ -782,11 +1070,16 @@ static int __ihk_os_status(struct ihk_host_linux_os_data *data,
 	return status;
 }
 
+static int __ihk_os_status(struct ihk_host_linux_os_data *data,
+		char __user *buf)
+{
+	return __ihk_os_monitor_status(data);
+}
+
 /** \brief Clear the kernel message buffer. */
 static int __ihk_os_clear_kmsg(struct ihk_host_linux_os_data *data)
 {
 	struct ihk_kmsg_buf *kmsg_buf;
-	unsigned long flags;
 
 	if (!data->kmsg_buf_container) {
 		return -EINVAL;
@@ -797,18 +1090,7 @@ static int __ihk_os_clear_kmsg(struct ihk_host_linux_os_data *data)
 	}
 
 	kmsg_buf = data->kmsg_buf_container->kmsg_buf;
-
-	local_irq_save(flags);
-	while(__sync_val_compare_and_swap(&kmsg_buf->lock, 0, 1) != 0) {
-		cpu_relax();
-	}
-
-	memset(kmsg_buf->str, 0, kmsg_buf->len);
-	kmsg_buf->head = 0;
-	kmsg_buf->tail = 0;
-
-	kmsg_buf->lock = 0;
-	local_irq_restore(flags);
+	kmsg_buf->head = kmsg_buf->next_seq;
 
 	return 0;
 }
@@ -935,26 +1217,139 @@ static int __ihk_os_get_cpu_usage(struct ihk_host_linux_os_data *data, unsigned
 	return 0;
 }
 
-/** \brief Handles ioctl calls with the additional request number */
+static int __ihk_os_get_ikc_stats(struct ihk_host_linux_os_data *data,
+                                  unsigned long arg)
+{
+	struct ihk_ikc_stats stats;
+	struct ihk_ikc_channel_desc *c;
+	struct ihk_ikc_lane_stats st;
+	unsigned long flags;
+
+	memset(&stats, 0, sizeof(stats));
+
+	stats.nr_queues_local =
+		atomic_long_read(&data->ikc_stats.nr_queues_local);
+	stats.nr_queues_remote =
+		atomic_long_read(&data->ikc_stats.nr_queues_remote);
+	stats.nr_descs_local =
+		atomic_long_read(&data->ikc_stats.nr_descs_local);
+	stats.nr_descs_remote =
+		atomic_long_read(&data->ikc_stats.nr_descs_remote);
+
+	spin_lock_irqsave(&data->ikc_channel_lock, flags);
+	list_for_each_entry(c, &data->ikc_channels, list_all) {
+		if (!ihk_ikc_get_lane_stats(c, IHK_IKC_LANE_PRIO, &st)) {
+			stats.nr_prio_lanes++;
+			stats.prio_sent += st.sent;
+			stats.prio_received += st.received;
+			stats.prio_full += st.full;
+		}
+		if (!ihk_ikc_get_lane_stats(c, IHK_IKC_LANE_BULK, &st)) {
+			stats.bulk_sent += st.sent;
+			stats.bulk_received += st.received;
+			stats.bulk_full += st.full;
+		}
+	}
+	spin_unlock_irqrestore(&data->ikc_channel_lock, flags);
+
+	if (copy_to_user((void __user *)arg, &stats, sizeof(stats))) {
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+/** \brief Entry of the additional ioctl handler table */
+struct ihk_os_aux_call_entry {
+	struct hlist_node node;
+	unsigned int request;
+	struct ihk_os_aux_call_reg *reg;
+	/* Copied, clist may be gone before the calls in progress */
+	struct ihk_os_user_call_handler handler;
+};
+
+/** \brief Entries added for a struct ihk_os_user_call
+ *
+ * Freed when the table and the calls in progress have all dropped
+ * their references. */
+struct ihk_os_aux_call_reg {
+	struct list_head list;
+	struct rcu_head rcu;
+	atomic_t refcount;
+	struct ihk_os_user_call *clist;
+	struct module *owner;
+	int num_entries;
+	struct ihk_os_aux_call_entry entries[];
+};
+
+static void __ihk_os_aux_call_put(struct ihk_os_aux_call_reg *reg)
+{
+	if (atomic_dec_and_test(&reg->refcount)) {
+		/* Lookups may still be looking at it */
+		kfree_rcu(reg, rcu);
+	}
+}
+
+static inline struct hlist_head *
+__ihk_os_aux_call_bucket(struct ihk_host_linux_os_data *os,
+                         unsigned int request)
+{
+	return &os->aux_call_hash[hash_32(request,
+	                                  ilog2(IHK_OS_AUX_CALL_HASH_SIZE))];
+}
+
+static struct ihk_os_aux_call_entry *
+__ihk_os_aux_call_lookup(struct ihk_host_linux_os_data *os,
+                         unsigned int request)
+{
+	struct ihk_os_aux_call_entry *e;
+
+	hlist_for_each_entry_rcu(e, __ihk_os_aux_call_bucket(os, request),
+	                         node) {
+		if (e->request == request) {
+			return e;
+		}
+	}
+
+	return NULL;
+}
+
+/** \brief Handles ioctl calls with the additional request number
+ *
+ * The handlers may sleep for as long as they like, so the RCU read
+ * section only covers the lookup. The call holds a reference to the
+ * registration and to the module of the handler instead. */
 static long __ihk_os_ioctl_call_aux(struct ihk_host_linux_os_data *os,
                                     unsigned int request, unsigned long arg,
                                     struct file *file)
 {
-	struct ihk_os_user_call *c;
-	int i;
-	
-	/* XXX: Very awkward iteration, and no lock! */
-	list_for_each_entry(c, &os->aux_call_list, list) {
-		for (i = 0; i < c->num_handlers; i++) {
-			if (c->handlers[i].request == request) {
-				return c->handlers[i].func(os, request,
-				                           c->handlers[i].priv,
-				                           arg, file);
-			}
+	struct ihk_os_aux_call_entry *e;
+	struct ihk_os_aux_call_reg *reg = NULL;
+	struct ihk_os_user_call_handler handler;
+	long ret;
+
+	rcu_read_lock();
+	e = __ihk_os_aux_call_lookup(os, request);
+	if (e && atomic_inc_not_zero(&e->reg->refcount)) {
+		if (try_module_get(e->reg->owner)) {
+			reg = e->reg;
+			handler = e->handler;
+		} else {
+			__ihk_os_aux_call_put(e->reg);
 		}
 	}
+	rcu_read_unlock();
 
-	return -ENOSYS;
+	if (!reg) {
+		return -ENOSYS;
+	}
+
+	ret = handler.func(os, request, handler.priv, arg, file);
+
+	module_put(reg->owner);
+	__ihk_os_aux_call_put(reg);
+
+	return ret;
 }
 
 static int __ihk_os_ioctl_perm(unsigned int request)
@@ -981,6 +1376,7 @@ static int __ihk_os_ioctl_perm(unsigned int request)
 	case IHK_OS_GET_CPU_USAGE:
 	case IHK_OS_REGISTER_EVENT:
 	case IHK_OS_GET_NUM_CPUS:
+	case IHK_OS_GET_IKC_STATS:
 		break;
 	default:
 		if (request >= IHK_OS_DEBUG_START && 
@@ -1038,6 +1434,10 @@ static long ihk_host_os_ioctl(struct file *file, unsigned int request,
 		ret = __ihk_os_shutdown(data, arg);
 		break;
 
+	case IHK_OS_REBOOT:
+		ret = __ihk_os_reboot(data, arg);
+		break;
+
 	case IHK_OS_ALLOC_CPU:
 		ret = __ihk_os_allocate_cpu(data, arg);
 		break;
@@ -1070,6 +1470,10 @@ static long ihk_host_os_ioctl(struct file *file, unsigned int request,
 		ret = __ihk_os_get_ikc_map(data, arg);
 		break;
 
+	case IHK_OS_AUTO_IKC_MAP:
+		ret = __ihk_os_auto_ikc_map(data, arg);
+		break;
+
 	case IHK_OS_GET_BUILDID:
 		ret = __ihk_os_get_buildid(data, arg);
 		break;
@@ -1078,6 +1482,10 @@ static long ihk_host_os_ioctl(struct file *file, unsigned int request,
 		ret = __ihk_os_get_num_cpus(data);
 		break;
 
+	case IHK_OS_GET_IKC_STATS:
+		ret = __ihk_os_get_ikc_stats(data, arg);
+		break;
+
 	case IHK_OS_QUERY_CPU:
 		ret = __ihk_os_query_cpu(data, arg);
 		break;
@@ -1214,9 +1622,87 @@ static long ihk_host_os_write(struct file *file, const char __user *buf,
 	}
 }
 
+/** \brief mmap handler for a OS file
+ *
+ * Maps the monitor, the rusage snapshot, the perf sampling rings or the
+ * state page read-only so that tools can sample them without issuing
+ * system calls. */
+static int ihk_host_os_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct ihk_file *ifile = file->private_data;
+	struct ihk_host_linux_os_data *data = ifile->osdata;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long pa, len;
+	int status;
+
+	if (vma->vm_flags & VM_WRITE) {
+		return -EACCES;
+	}
+
+	/* The other areas are in the LWK memory */
+	status = __ihk_os_query_status(data);
+	if ((vma->vm_pgoff << PAGE_SHIFT) != IHK_OS_MMAP_STATE &&
+	    status != IHK_OS_STATUS_READY && status != IHK_OS_STATUS_RUNNING) {
+		return -EAGAIN;
+	}
+
+	switch (vma->vm_pgoff << PAGE_SHIFT) {
+	case IHK_OS_MMAP_MONITOR:
+		setup_monitor(data);
+		if (data->monitor == NULL) {
+			return -ENOSYS;
+		}
+		pa = data->monitor_pa;
+		len = data->monitor_len;
+		break;
+
+	case IHK_OS_MMAP_RUSAGE:
+		setup_user_area(data, IHK_SPADDR_RUSAGE_SNAPSHOT,
+				&data->rusage_snapshot_pa,
+				&data->rusage_snapshot_len);
+		if (!data->rusage_snapshot_pa) {
+			return -ENOSYS;
+		}
+		pa = data->rusage_snapshot_pa;
+		len = data->rusage_snapshot_len;
+		break;
+
+	case IHK_OS_MMAP_PERF:
+		setup_user_area(data, IHK_SPADDR_PERF_RING,
+				&data->perf_ring_pa, &data->perf_ring_len);
+		if (!data->perf_ring_pa) {
+			return -ENOSYS;
+		}
+		pa = data->perf_ring_pa;
+		len = data->perf_ring_len;
+		break;
+
+	case IHK_OS_MMAP_STATE:
+		pa = virt_to_phys(data->state);
+		len = PAGE_SIZE;
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	if ((pa & ~PAGE_MASK) || size > PAGE_ALIGN(len)) {
+		return -EINVAL;
+	}
+
+	vma->vm_flags &= ~VM_MAYWRITE;
+#ifdef CONFIG_MIC
+	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+#endif
+
+	return remap_pfn_range(vma, vma->vm_start, pa >> PAGE_SHIFT,
+			       size, vma->vm_page_prot);
+}
+
 static struct file_operations mcos_cdev_ops = {
 	.open = ihk_host_os_open,
 	.write = ihk_host_os_write,
+	.mmap = ihk_host_os_mmap,
 	.unlocked_ioctl = ihk_host_os_ioctl,
 	.release = ihk_host_os_release,
 };
@@ -1255,6 +1741,8 @@ static int __ihk_device_get_kmsg_buf(struct file *file, void __user * _desc)
 	}
 
 	desc.handle = cont;
+	desc.phys = virt_to_phys(cont->kmsg_buf);
+	desc.size = IHK_KMSG_BUF_SIZE(cont->kmsg_buf->nr_records);
 	if (copy_to_user(_desc, &desc, sizeof(desc))) {
 		return -EFAULT;
 	}
@@ -1298,6 +1786,38 @@ static int __ihk_device_read_kmsg_buf(struct file *file, void __user *_desc)
 	return ret;
 }
 
+/** \brief ioctl handler for consuming the kernel message read through mmap */
+static int __ihk_device_shift_kmsg_buf(struct file *file, void __user *_desc)
+{
+	struct ihk_kmsg_buf_container *cont;
+	struct ihk_kmsg_buf *kmsg_buf;
+	struct ihk_device_shift_kmsg_buf_desc desc;
+	unsigned long head;
+
+	if (copy_from_user(&desc, _desc, sizeof(desc))) {
+		return -EFAULT;
+	}
+
+	cont = (struct ihk_kmsg_buf_container *)desc.handle;
+	kmsg_buf = cont->kmsg_buf;
+
+	if ((long)(desc.seq - kmsg_buf->next_seq) > 0) {
+		return -EINVAL;
+	}
+
+	/* Don't go back when racing with other readers */
+	do {
+		head = kmsg_buf->head;
+		if ((long)(desc.seq - head) <= 0) {
+			return 0;
+		}
+	} while (__sync_val_compare_and_swap(&kmsg_buf->head, head,
+					     desc.seq) != head);
+	__sync_fetch_and_add(&kmsg_buf->lost, desc.lost);
+
+	return 0;
+}
+
 static int __ihk_device_release_kmsg_buf(struct file *file, unsigned long arg)
 {
 	return release_kmsg_buf((struct ihk_kmsg_buf_container *)arg);
@@ -1378,6 +1898,7 @@ static int __ihk_device_create_os_init(struct ihk_host_linux_device_data *data,
 	struct ihk_host_linux_os_data *os = NULL;
 	struct ihk_register_os_data drv_data;
 	int ret = 0;
+	int i;
 
 	os = kzalloc(sizeof(*os), GFP_KERNEL);
 	if (!os) {
@@ -1398,7 +1919,13 @@ static int __ihk_device_create_os_init(struct ihk_host_linux_device_data *data,
 
 	os->regular_channels = kzalloc(sizeof(*os->regular_channels) *
 			num_possible_cpus(), GFP_KERNEL);
-	if (!os->regular_channels) {
+	os->cpu_mchannels = kzalloc(sizeof(*os->cpu_mchannels) *
+			nr_cpu_ids, GFP_KERNEL);
+	os->ikc_cpu_time = kzalloc(sizeof(*os->ikc_cpu_time) *
+			nr_cpu_ids, GFP_KERNEL);
+	os->state = (struct ihk_os_state *)get_zeroed_page(GFP_KERNEL);
+	if (!os->regular_channels || !os->cpu_mchannels ||
+	    !os->ikc_cpu_time || !os->state) {
 		ret = -ENOMEM;
 		printk("ihk: error allocating channels\n");
 		goto ERR;
@@ -1406,8 +1933,15 @@ static int __ihk_device_create_os_init(struct ihk_host_linux_device_data *data,
 
 	INIT_LIST_HEAD(&os->wait_list);
 	INIT_LIST_HEAD(&os->aux_call_list);
+	for (i = 0; i < IHK_OS_AUX_CALL_HASH_SIZE; i++) {
+		INIT_HLIST_HEAD(&os->aux_call_hash[i]);
+	}
 	INIT_LIST_HEAD(&os->event_list);
 
+	hrtimer_init(&os->watchdog_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	os->watchdog_timer.function = ihk_os_watchdog_timer;
+	INIT_WORK(&os->watchdog_work, ihk_os_watchdog_work);
+
 	if (data->ops->create_os && 
 	    (ret = data->ops->create_os(data, data->priv, arg, 
 	                                os, &drv_data))) {
@@ -1430,6 +1964,9 @@ static int __ihk_device_create_os_init(struct ihk_host_linux_device_data *data,
 ERR:
 	if (os) {
 		kfree(os->regular_channels);
+		kfree(os->cpu_mchannels);
+		kfree(os->ikc_cpu_time);
+		free_page((unsigned long)os->state);
 		kfree(os);
 	}
 	return ret;
@@ -1462,6 +1999,7 @@ static int __ihk_device_create_os(struct ihk_host_linux_device_data *data,
 	struct page *kmsg_buf_pages;
 	struct ihk_kmsg_buf_container *cont = NULL;
 	struct ihk_kmsg_buf *kmsg_buf;
+	unsigned int nr_records;
 	int nbufs = 0;
 
 	/* first check if there is any free slot */
@@ -1491,7 +2029,10 @@ static int __ihk_device_create_os(struct ihk_host_linux_device_data *data,
 	}
 
 	/* Allocate kmsg_buf. Note that IHK-Core owns the buf. */
-	kmsg_buf_size = (sizeof(struct ihk_kmsg_buf) + PAGE_SIZE - 1) & PAGE_MASK;
+	nr_records = roundup_pow_of_two(max_t(unsigned int,
+				ihk_kmsg_size / sizeof(struct ihk_kmsg_record),
+				IHK_KMSG_SIZE / sizeof(struct ihk_kmsg_record)));
+	kmsg_buf_size = (IHK_KMSG_BUF_SIZE(nr_records) + PAGE_SIZE - 1) & PAGE_MASK;
 	kmsg_buf_order = 0;
 	while (((size_t)PAGE_SIZE << kmsg_buf_order) < kmsg_buf_size)
 		++kmsg_buf_order;
@@ -1505,12 +2046,8 @@ static int __ihk_device_create_os(struct ihk_host_linux_device_data *data,
 
 	/* Initialize kmsg_buf */
 	kmsg_buf = (struct ihk_kmsg_buf *)pfn_to_kaddr(page_to_pfn(kmsg_buf_pages));
-	kmsg_buf->tail = 0;
-	kmsg_buf->len = sizeof(kmsg_buf->str);
-	kmsg_buf->head = 0;
-	kmsg_buf->lock = 0;
-	memset(kmsg_buf->str, 0, sizeof(kmsg_buf->str));
-	dkprintf("%s: kmsg_buf=%p\n", __FUNCTION__, kmsg_buf);
+	ihk_kmsg_init_buf(kmsg_buf, nr_records);
+	dkprintf("%s: kmsg_buf=%p,nr_records=%d\n", __FUNCTION__, kmsg_buf, nr_records);
 
 	/* Release stray kmsg_bufs */
 	spin_lock_irqsave(&ihk_kmsg_bufs_lock, flags);
@@ -1609,6 +2146,15 @@ static int __ihk_device_destroy_os(struct ihk_host_linux_device_data *data,
 		kfree(ep);
 	}
 
+	/* No ioctl can be running once the refcount is zero */
+	while (!list_empty(&os->aux_call_list)) {
+		struct ihk_os_aux_call_reg *reg;
+		reg = list_first_entry(&os->aux_call_list,
+		                       struct ihk_os_aux_call_reg, list);
+		list_del(&reg->list);
+		__ihk_os_aux_call_put(reg);
+	}
+
 	os_data[os->minor] = NULL;
 
 	cdev_del(&os->cdev);
@@ -1616,6 +2162,16 @@ static int __ihk_device_destroy_os(struct ihk_host_linux_device_data *data,
 
 	if (os->regular_channels)
 		kfree(os->regular_channels);
+	if (os->cpu_mchannels)
+		kfree(os->cpu_mchannels);
+	if (os->ikc_cpu_time)
+		kfree(os->ikc_cpu_time);
+	if (os->mmap_inode) {
+		/* The state page may still be mapped */
+		unmap_mapping_range(os->mmap_inode->i_mapping, 0, 0, 1);
+		iput(os->mmap_inode);
+	}
+	free_page((unsigned long)os->state);
 	kfree(os);
 
 	return 0;
@@ -1736,6 +2292,132 @@ static int __ihk_device_query_mem(struct ihk_host_linux_device_data *data,
 	return data->ops->query_mem(data, arg);
 }
 
+/** \brief Freeze or thaw a set of OS instances of the device
+ *
+ * The interrupts are sent to the CPUs of all the instances first and
+ * then their monitors are polled together until all of them have
+ * reached the new state, so the pause is one round trip regardless of
+ * the number of instances. When one of them fails to freeze, the ones
+ * already asked to are thawed back. */
+static int __ihk_device_freeze_os(struct ihk_host_linux_device_data *data,
+				  unsigned long arg, int freeze)
+{
+	struct ihk_device_freeze_os_desc desc;
+	DECLARE_BITMAP(os_set, OS_MAX_MINOR);
+	struct ihk_host_linux_os_data *os, *oss[OS_MAX_MINOR];
+	int nr_oss = 0, nr_requested = 0;
+	unsigned long flags, timeout;
+	int i, status, done, ret = 0;
+
+	if (copy_from_user(&desc, (void __user *)arg, sizeof(desc))) {
+		return -EFAULT;
+	}
+
+	if (desc.n <= 0 || desc.n > OS_MAX_MINOR || desc.timeout < 0) {
+		return -EINVAL;
+	}
+
+	bitmap_zero(os_set, OS_MAX_MINOR);
+	if (copy_from_user(os_set, desc.os_set,
+			   BITS_TO_LONGS(desc.n) * sizeof(unsigned long))) {
+		return -EFAULT;
+	}
+	if (desc.n < OS_MAX_MINOR) {
+		bitmap_clear(os_set, desc.n, OS_MAX_MINOR - desc.n);
+	}
+
+	/* Keep the instances from being destroyed, as ihk_host_os_open() */
+	spin_lock_irqsave(&os_data_lock, flags);
+	for_each_set_bit(i, os_set, OS_MAX_MINOR) {
+		os = os_data[i];
+		if (!os || os == OS_DATA_INVALID || os->dev_data != data) {
+			ret = -ENOENT;
+			break;
+		}
+
+		if (os->flag & IHK_OS_FLAG_SHARABLE) {
+			atomic_inc(&os->refcount);
+		} else if (atomic_cmpxchg(&os->refcount, 0, 1) != 0) {
+			ret = -EBUSY;
+			break;
+		}
+		oss[nr_oss++] = os;
+	}
+	spin_unlock_irqrestore(&os_data_lock, flags);
+
+	if (ret) {
+		goto out;
+	}
+
+	for (i = 0; i < nr_oss; i++) {
+		/* The monitor is needed to see the new state */
+		status = __ihk_os_monitor_status(oss[i]);
+		if (status != IHK_OS_STATUS_READY &&
+		    status != IHK_OS_STATUS_RUNNING &&
+		    status != IHK_OS_STATUS_FREEZING &&
+		    status != IHK_OS_STATUS_FROZEN) {
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < nr_oss; i++) {
+		ret = freeze ? __ihk_os_freeze(oss[i]) : __ihk_os_thaw(oss[i]);
+		if (ret) {
+			goto out;
+		}
+		nr_requested++;
+	}
+
+	timeout = jiffies + msecs_to_jiffies(desc.timeout);
+	while (desc.timeout) {
+		done = 1;
+		for (i = 0; i < nr_oss; i++) {
+			status = __ihk_os_monitor_status(oss[i]);
+			if (status == IHK_OS_STATUS_FAILED) {
+				ret = -EIO;
+				goto out;
+			}
+
+			if (freeze ? status != IHK_OS_STATUS_FROZEN :
+			    (status == IHK_OS_STATUS_FREEZING ||
+			     status == IHK_OS_STATUS_FROZEN)) {
+				done = 0;
+				break;
+			}
+		}
+
+		if (done) {
+			break;
+		}
+
+		if (time_after(jiffies, timeout)) {
+			pr_err("IHK: %s of OS %d timed out\n",
+			       freeze ? "freeze" : "thaw", oss[i]->minor);
+			ret = -ETIMEDOUT;
+			break;
+		}
+		usleep_range(10, 20);
+	}
+
+out:
+	/* The set is frozen as a whole or not at all */
+	if (ret && freeze) {
+		for (i = 0; i < nr_requested; i++) {
+			if (__ihk_os_monitor_status(oss[i]) ==
+			    IHK_OS_STATUS_FAILED) {
+				continue;
+			}
+			__ihk_os_thaw(oss[i]);
+		}
+	}
+
+	for (i = 0; i < nr_oss; i++) {
+		atomic_dec(&oss[i]->refcount);
+	}
+	return ret;
+}
+
 /** \brief ioctl handler for the device file */
 static long ihk_host_device_ioctl(struct file *file, unsigned int request,
                                   unsigned long arg)
@@ -1807,6 +2489,18 @@ static long ihk_host_device_ioctl(struct file *file, unsigned int request,
 		ret = __ihk_device_release_kmsg_buf(file, arg);
 		break;
 
+	case IHK_DEVICE_SHIFT_KMSG_BUF:
+		ret = __ihk_device_shift_kmsg_buf(file, (void __user *)arg);
+		break;
+
+	case IHK_DEVICE_FREEZE_OS:
+		ret = __ihk_device_freeze_os(data, arg, 1);
+		break;
+
+	case IHK_DEVICE_THAW_OS:
+		ret = __ihk_device_freeze_os(data, arg, 0);
+		break;
+
 	default:
 		if (request >= IHK_DEVICE_DEBUG_START && 
 		    request <= IHK_DEVICE_DEBUG_END) {
@@ -2389,7 +3083,7 @@ void ihk_host_print_os_kmsg(ihk_os_t os)
 	char *lines, *line;
 	struct ihk_host_linux_os_data *data = (struct ihk_host_linux_os_data *)os;
 
-	buf = kmalloc(IHK_KMSG_SIZE, GFP_KERNEL);
+	buf = kmalloc(IHK_KMSG_SIZE + 1, GFP_KERNEL);
 	if (!buf) {
 		goto out;
 	}
@@ -2402,6 +3096,7 @@ void ihk_host_print_os_kmsg(ihk_os_t os)
 		printk("%s: kmsg_buf is not available\n", __FUNCTION__);
 		goto out;
 	}
+	buf[nread] = 0;
 
 	/* Print line-by-line */
 	lines = buf;
@@ -2533,12 +3228,20 @@ int ihk_get_request_os_cpu(ihk_os_t *ihk_os, int *cpu)
 }
 
 
+/** \brief Add the handlers of clist to the dispatch table
+ *
+ * Fails with -EEXIST when one of the requests already has a handler.
+ * The handlers are copied, but what their priv points to must stay
+ * valid until the calls in progress return, which can be after
+ * unregistering them. */
 int ihk_os_register_user_call_handlers(ihk_os_t ihk_os,
                                        struct ihk_os_user_call *clist)
 {
-	int i;
+	int i, ret = 0;
 	unsigned long flags;
 	struct ihk_host_linux_os_data *os = ihk_os;
+	struct ihk_os_aux_call_reg *reg;
+	struct ihk_os_aux_call_entry *e;
 
 	INIT_LIST_HEAD(&clist->list);
 	for (i = 0; i < clist->num_handlers; i++) {
@@ -2548,22 +3251,78 @@ int ihk_os_register_user_call_handlers(ihk_os_t ihk_os,
 		}
 	}
 
+	reg = kzalloc(sizeof(*reg) + sizeof(*e) * clist->num_handlers,
+	              GFP_KERNEL);
+	if (!reg) {
+		return -ENOMEM;
+	}
+	atomic_set(&reg->refcount, 1);
+	reg->clist = clist;
+	reg->owner = clist->owner;
+
 	spin_lock_irqsave(&os->lock, flags);
-	list_add_tail(&clist->list, &os->aux_call_list);
+	for (i = 0; i < clist->num_handlers; i++) {
+		if (__ihk_os_aux_call_lookup(os, clist->handlers[i].request)) {
+			ret = -EEXIST;
+			break;
+		}
+
+		e = &reg->entries[i];
+		e->request = clist->handlers[i].request;
+		e->reg = reg;
+		e->handler = clist->handlers[i];
+		hlist_add_head_rcu(&e->node,
+		                   __ihk_os_aux_call_bucket(os, e->request));
+		reg->num_entries++;
+	}
+
+	if (ret) {
+		for (i = 0; i < reg->num_entries; i++) {
+			hlist_del_rcu(&reg->entries[i].node);
+		}
+	} else {
+		list_add_tail(&reg->list, &os->aux_call_list);
+	}
 	spin_unlock_irqrestore(&os->lock, flags);
 
-	return 0;
+	if (ret) {
+		__ihk_os_aux_call_put(reg);
+	}
+
+	return ret;
 }
 
+/** \brief Remove the handlers of clist from the dispatch table
+ *
+ * Doesn't wait for the calls in progress, which may block for long,
+ * e.g. waiting for the LWK. They keep clist->owner loaded until they
+ * return. */
 void ihk_os_unregister_user_call_handlers(ihk_os_t ihk_os,
                                           struct ihk_os_user_call *clist)
 {
 	struct ihk_host_linux_os_data *os = ihk_os;
+	struct ihk_os_aux_call_reg *reg, *found = NULL;
 	unsigned long flags;
+	int i;
 
 	spin_lock_irqsave(&os->lock, flags);
-	list_del(&clist->list);
+	list_for_each_entry(reg, &os->aux_call_list, list) {
+		if (reg->clist == clist) {
+			found = reg;
+			break;
+		}
+	}
+	if (found) {
+		for (i = 0; i < found->num_entries; i++) {
+			hlist_del_rcu(&found->entries[i].node);
+		}
+		list_del(&found->list);
+	}
 	spin_unlock_irqrestore(&os->lock, flags);
+
+	if (found) {
+		__ihk_os_aux_call_put(found);
+	}
 }
 
 int ihk_dma_request(ihk_dma_channel_t ihk_ch, struct ihk_dma_request *req)
@@ -2577,6 +3336,39 @@ int ihk_dma_request(ihk_dma_channel_t ihk_ch, struct ihk_dma_request *req)
 	}
 }
 
+int ihk_dma_request_batch(ihk_dma_channel_t ihk_ch,
+                          struct ihk_dma_request *reqs, int nr_reqs)
+{
+	struct ihk_dma_channel *adc = ihk_ch;
+	int i, ret;
+
+	if (adc->ops->request_batch) {
+		return adc->ops->request_batch(ihk_ch, reqs, nr_reqs);
+	}
+
+	for (i = 0; i < nr_reqs; i++) {
+		ret = ihk_dma_request(ihk_ch, &reqs[i]);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+int ihk_dma_request_sg(ihk_dma_channel_t ihk_ch,
+                       struct ihk_dma_segment *segs, int nr_segs,
+                       struct ihk_dma_request *req)
+{
+	struct ihk_dma_channel *adc = ihk_ch;
+
+	if (adc->ops->request_sg) {
+		return adc->ops->request_sg(ihk_ch, segs, nr_segs, req);
+	} else {
+		return -EINVAL;
+	}
+}
+
 struct device *ihk_os_get_linux_device(ihk_os_t ihk_os)
 {
 	struct ihk_host_linux_os_data *os = ihk_os;
@@ -2687,6 +3479,8 @@ EXPORT_SYMBOL(ihk_os_get_cpu_info);
 EXPORT_SYMBOL(ihk_device_get_dma_channel);
 EXPORT_SYMBOL(ihk_device_get_dma_info);
 EXPORT_SYMBOL(ihk_dma_request);
+EXPORT_SYMBOL(ihk_dma_request_batch);
+EXPORT_SYMBOL(ihk_dma_request_sg);
 EXPORT_SYMBOL(ihk_os_register_release_handler);
 EXPORT_SYMBOL(ihk_os_set_mcos_private_data);
 EXPORT_SYMBOL(ihk_os_get_mcos_private_data);
@@ -11,9 +11,21 @@
 #define __HEADER_IHK_HOST_LINUX_H
 
 #include <linux/cdev.h>
+#include <linux/hrtimer.h>
 #include <ikc/master.h>
 #include <ihk/ihk_debug.h>
 
+/** \brief Number of buckets of the additional ioctl handler table */
+#define IHK_OS_AUX_CALL_HASH_SIZE 64
+
+/** \brief Counters of struct ihk_ikc_stats */
+struct ihk_host_ikc_stats {
+	atomic_long_t nr_queues_local;
+	atomic_long_t nr_queues_remote;
+	atomic_long_t nr_descs_local;
+	atomic_long_t nr_descs_remote;
+};
+
 /** \brief Structure that manages a manycore device in Linux */
 struct ihk_host_linux_device_data {
 	/** \brief Lock for this structure */
@@ -39,6 +51,14 @@ struct ihk_host_linux_device_data {
 	void *priv;
 };
 
+/** \brief Last progress of a CPU observed by the watchdog */
+struct ihk_host_watchdog_cpu {
+	/** \brief monitor counter sampled last */
+	unsigned long counter;
+	/** \brief Time when the counter changed last */
+	ktime_t progress;
+};
+
 /** \brief Structure that manages a kernel instance in Linux */
 struct ihk_host_linux_os_data {
 	/** \brief Pointer to the device structure */
@@ -77,11 +97,34 @@ struct ihk_host_linux_os_data {
 	/** \brief Host physical address to monitor  */
 	unsigned long monitor_pa;
 
+	/** \brief Timer sampling the monitor */
+	struct hrtimer watchdog_timer;
+	/** \brief Work mapping the monitor and reporting hang-up */
+	struct work_struct watchdog_work;
+	/** \brief Per-CPU progress, allocated once the monitor is mapped */
+	struct ihk_host_watchdog_cpu *watchdog_cpus;
+	/** \brief Number of entries of watchdog_cpus */
+	int watchdog_nr_cpus;
+	/** \brief CPU found stalled, -1 if none */
+	int watchdog_stalled_cpu;
+
 	void *rusage;
 	/** \brief Size of the rusage */
 	unsigned long rusage_len;
 	/** \brief Host physical address to rusage  */
 	unsigned long rusage_pa;
+	/** \brief Size of the rusage snapshot */
+	unsigned long rusage_snapshot_len;
+	/** \brief Host physical address to the rusage snapshot */
+	unsigned long rusage_snapshot_pa;
+	/** \brief Size of the perf sampling rings */
+	unsigned long perf_ring_len;
+	/** \brief Host physical address to the perf sampling rings */
+	unsigned long perf_ring_pa;
+	/** \brief Inode whose mapping holds all user mappings of the areas */
+	struct inode *mmap_inode;
+	/** \brief Page mapped at IHK_OS_MMAP_STATE */
+	struct ihk_os_state *state;
 
 	/** \brief Flag whether the IKC is already initialized or not */
 	int ikc_initialized;
@@ -89,6 +132,8 @@ struct ihk_host_linux_os_data {
 	spinlock_t ikc_channel_lock;
 	/** \brief List of the channels available */
 	struct list_head ikc_channels;
+	/** \brief IKC channels hashed by channel_id */
+	struct ihk_ikc_channel_desc *ikc_channel_table[IHK_IKC_CHANNEL_TABLE_SIZE];
 
 	/** \brief Interrupt handler */
 	struct ihk_host_interrupt_handler ikc_handler;
@@ -97,8 +142,17 @@ struct ihk_host_linux_os_data {
 
 	/** \brief IKC master channel between the host and this kernel */
 	struct ihk_ikc_channel_desc *mchannel;
+	/** \brief Additional IKC master channels, spreading the connection
+	 *         requests over CPUs */
+	struct ihk_ikc_channel_desc *mchannels[IHK_IKC_MAX_MASTER_CHANNELS];
+	/** \brief Number of the additional master channels */
+	int nr_mchannels;
+	/** \brief Additional master channels by the CPU draining them */
+	struct ihk_ikc_channel_desc **cpu_mchannels;
 	/** \brief IKC regular channels between the host and this kernel */
 	struct ihk_ikc_channel_desc **regular_channels;
+	/** \brief Time in ns spent handling IKC interrupts, by CPU */
+	atomic64_t *ikc_cpu_time;
 	/** \brief Lock for listeners */
 	spinlock_t listener_lock;
 	/** \brief Array of the listeners */
@@ -107,14 +161,18 @@ struct ihk_host_linux_os_data {
 	ihk_ikc_ph_t packet_handler;
 	/** \brief Last channel ID */
 	atomic_t channel_id;
+	/** \brief Placement of the IKC queues and channel descriptors */
+	struct ihk_host_ikc_stats ikc_stats;
 
 	/** \brief Lock for wait_list */
 	spinlock_t wait_lock;
 	/** \brief Wait list used in the IKC functions */
 	struct list_head wait_list;
 
-	/** \brief List of the additional ioctl handlers */
+	/** \brief List of the additional ioctl handler registrations */
 	struct list_head aux_call_list;
+	/** \brief Additional ioctl handlers hashed by the request number */
+	struct hlist_head aux_call_hash[IHK_OS_AUX_CALL_HASH_SIZE];
 
 	/** \brief user data */
 	void *usrdata;
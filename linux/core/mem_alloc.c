@@ -1,38 +1,72 @@
-/** 
+/**
  * \file mem_alloc.c
- * 
- * \brief IHK-Host: Generic page allocator (not so fast)
+ *
+ * \brief IHK-Host: Generic page allocator
+ *
+ * Blocks are tracked in a bitmap with a summary tree on top of it.
+ * Each node of the tree holds the length of the longest free run, and
+ * of the free runs at the beginning and at the end of the range of
+ * blocks it covers, so that the lowest run of any length is found
+ * in O(log n). Single-block requests are served from per-CPU caches.
  *
  * \author Taku Shimosawa  <shimosawa@is.s.u-tokyo.ac.jp> \par
  * Copyright (C) 2011 - 2012  Taku Shimosawa
- * 
+ *
  */
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/mm.h>
 #include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/vmalloc.h>
 #include <asm/bitops.h>
 
 #include <ihk/ihk_host_driver.h>
 
+/** \brief Number of single blocks a per-CPU cache holds at most */
+#define IHK_PAGEALLOC_CACHE_SIZE   32
+/** \brief Number of blocks moved at once between a cache and the map */
+#define IHK_PAGEALLOC_CACHE_BATCH  16
+
+/** \brief Free runs, in blocks, of the range covered by a tree node */
+struct ihk_page_allocator_node {
+	unsigned int prefix;
+	unsigned int suffix;
+	unsigned int max;
+};
+
+/** \brief Per-CPU cache of single blocks, marked used in the map */
+struct ihk_page_allocator_cache {
+	spinlock_t lock;
+	int nr;
+	unsigned long blocks[IHK_PAGEALLOC_CACHE_SIZE];
+};
+
 /** \brief Descriptor of an allocator */
 struct ihk_page_allocator_desc {
 	/** \brief Start address of the area that the allocator manages */
 	unsigned long start;
 	/** \brief End address of the area that the allocator manages */
 	unsigned long end;
-	/** \brief Last index in block */
-	unsigned int last;
 	/** \brief Number of blocks */
 	unsigned int count;
-	/** \brief Order of the pages that are allocated for this structure */
+	/** \brief Number of map elements */
+	unsigned int nr_words;
+	/** \brief Number of tree leaves, a power of 2 >= nr_words */
+	unsigned int nr_leaves;
+	/** \brief Non-zero if this structure is vmalloc'ed */
 	unsigned int flag;
 	/** \brief Shift count of a block in this allocator */
 	unsigned int shift;
-	/** \brief Lock for this structure */
+	/** \brief Lock for the map and the tree */
 	spinlock_t lock;
 	/** \brief List chain for multiple allocators */
 	struct list_head list;
+	/** \brief Single block caches */
+	struct ihk_page_allocator_cache __percpu *caches;
+	/** \brief Summary tree, node i has children 2i and 2i + 1, leaf i
+	 *  (node nr_leaves + i) covers map[i] */
+	struct ihk_page_allocator_node *tree;
 	/** \brief Allocation map */
 	unsigned long map[0];
 };
@@ -41,9 +75,144 @@ struct ihk_page_allocator_desc {
 #define MAP_INDEX(n)    ((n) >> 6)
 /** Get the bit number in a map element */
 #define MAP_BIT(n)      ((n) & 0x3f)
-/** Calculate an address from the map index and map bit index */
-#define ADDRESS(desc, index, bit)    \
-	((desc)->start + (((index) * 64 + (bit)) << ((desc)->shift)))
+/** Calculate an address from the block index */
+#define ADDRESS(desc, n)    ((desc)->start + ((unsigned long)(n) << ((desc)->shift)))
+/** Calculate the block index from an address */
+#define BLOCK(desc, addr)   (((addr) - (desc)->start) >> ((desc)->shift))
+
+/** \brief Longest run of zero bits in a map element */
+static unsigned int __ihk_pagealloc_word_max(unsigned long v)
+{
+	unsigned long x = ~v;
+	unsigned int n = 0;
+
+	while (x) {
+		x &= x << 1;
+		n++;
+	}
+
+	return n;
+}
+
+static void __ihk_pagealloc_update_leaf(struct ihk_page_allocator_desc *desc,
+                                        unsigned int i)
+{
+	struct ihk_page_allocator_node *node = &desc->tree[desc->nr_leaves + i];
+	unsigned long v = (i < desc->nr_words) ? desc->map[i] : ~0UL;
+
+	if (!v) {
+		node->prefix = node->suffix = node->max = 64;
+		return;
+	}
+
+	node->prefix = __ffs(v);
+	node->suffix = 63 - __fls(v);
+	node->max = __ihk_pagealloc_word_max(v);
+}
+
+/** \brief Recompute node i whose children each cover span blocks */
+static void __ihk_pagealloc_update_node(struct ihk_page_allocator_desc *desc,
+                                        unsigned int i, unsigned int span)
+{
+	struct ihk_page_allocator_node *node = &desc->tree[i];
+	struct ihk_page_allocator_node *l = &desc->tree[2 * i];
+	struct ihk_page_allocator_node *r = &desc->tree[2 * i + 1];
+
+	node->prefix = (l->prefix == span) ? span + r->prefix : l->prefix;
+	node->suffix = (r->suffix == span) ? span + l->suffix : r->suffix;
+	node->max = max3(l->max, r->max, l->suffix + r->prefix);
+}
+
+/** \brief Recompute the leaves lo..hi (inclusive) and their ancestors */
+static void __ihk_pagealloc_update(struct ihk_page_allocator_desc *desc,
+                                   unsigned int lo, unsigned int hi)
+{
+	unsigned int i, span = 64;
+
+	for (i = lo; i <= hi; i++) {
+		__ihk_pagealloc_update_leaf(desc, i);
+	}
+
+	lo += desc->nr_leaves;
+	hi += desc->nr_leaves;
+	while (lo > 1) {
+		lo >>= 1;
+		hi >>= 1;
+		for (i = lo; i <= hi; i++) {
+			__ihk_pagealloc_update_node(desc, i, span);
+		}
+		span <<= 1;
+	}
+}
+
+/** \brief Set (used) or clear (free) the bits of npages blocks */
+static void __ihk_pagealloc_mark(struct ihk_page_allocator_desc *desc,
+                                 unsigned long block, unsigned long npages,
+                                 int used)
+{
+	unsigned long end = block + npages;
+	unsigned long b, n, mask;
+
+	for (b = block; b < end; b += n) {
+		n = min(64 - MAP_BIT(b), end - b);
+		mask = (n == 64) ? ~0UL : ((1UL << n) - 1) << MAP_BIT(b);
+
+		if (used) {
+			desc->map[MAP_INDEX(b)] |= mask;
+		} else {
+			desc->map[MAP_INDEX(b)] &= ~mask;
+		}
+	}
+
+	__ihk_pagealloc_update(desc, MAP_INDEX(block), MAP_INDEX(end - 1));
+}
+
+/**
+ * \brief Find and mark the lowest run of npages free blocks.
+ *
+ * Called with desc->lock held.
+ * \return Index of the first block, -1 if failed.
+ */
+static long __ihk_pagealloc_alloc(struct ihk_page_allocator_desc *desc,
+                                  unsigned long npages)
+{
+	struct ihk_page_allocator_node *tree = desc->tree;
+	unsigned long base = 0, span, y, len, s;
+	unsigned int i = 1;
+
+	if (!npages || tree[1].max < npages) {
+		return -1;
+	}
+
+	span = 64UL * desc->nr_leaves;
+	while (i < desc->nr_leaves) {
+		span >>= 1;
+		if (tree[2 * i].max >= npages) {
+			i = 2 * i;
+		} else if (tree[2 * i].suffix + tree[2 * i + 1].prefix >=
+		           npages) {
+			/* Straddles the two children */
+			base += span - tree[2 * i].suffix;
+			goto found;
+		} else {
+			i = 2 * i + 1;
+			base += span;
+		}
+	}
+
+	/* Within one map element, y has bit j set if j..j+len-1 are free */
+	y = ~desc->map[i - desc->nr_leaves];
+	for (len = 1; len < npages; len += s) {
+		s = min(len, npages - len);
+		y &= y >> s;
+	}
+	base += __ffs(y);
+
+found:
+	__ihk_pagealloc_mark(desc, base, npages, 1);
+
+	return base;
+}
 
 /**
  * \brief Initialize a page allocator.
@@ -62,33 +231,31 @@ void *ihk_pagealloc_init(unsigned long start, unsigned long size,
 {
 	/* Unit must be power of 2, and size and start must be unit-aligned */
 	struct ihk_page_allocator_desc *desc;
-	int i, page_shift, descsize, descorder, mapsize, mapaligned;
-	int flag = 0;
+	unsigned long mapsize, nr_words, nr_leaves, descsize, i;
+	int page_shift, cpu;
+	struct ihk_page_allocator_cache *cache;
 
-	if (!unit) {
+	if (!unit || !size) {
 		return NULL;
 	}
 	page_shift = fls(unit) - 1;
 
-	/* round up to 64-bit */
 	mapsize = (size >> page_shift);
-	mapaligned = ((mapsize + 63) >> 6) << 3;
-	descsize = sizeof(*desc) + mapaligned;
+	nr_words = (mapsize + 63) >> 6;
+	nr_leaves = 1;
+	while (nr_leaves < nr_words) {
+		nr_leaves <<= 1;
+	}
 
-	printk("mapsize = %d, aligned = %d, descsize = %d, shift = %d\n",
-	       mapsize, mapaligned, descsize, page_shift);
-	
-	if (descsize >= PAGE_SIZE) {
-		descsize = (descsize + PAGE_SIZE - 1) >> PAGE_SHIFT;
-		descorder = fls(descsize) - 1;
+	/* Map followed by the tree */
+	descsize = sizeof(*desc) + nr_words * sizeof(unsigned long) +
+		2 * nr_leaves * sizeof(struct ihk_page_allocator_node);
 
-		if ((1 << descorder) < descsize) {
-			descorder++;
+	if (descsize >= PAGE_SIZE) {
+		desc = vzalloc(descsize);
+		if (desc) {
+			desc->flag = 1;
 		}
-		desc = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO,
-		                                descorder);
-
-		flag = descorder;
 	} else {
 		desc = kzalloc(descsize, GFP_KERNEL);
 	}
@@ -98,17 +265,36 @@ void *ihk_pagealloc_init(unsigned long start, unsigned long size,
 		return NULL;
 	}
 
+	desc->caches = alloc_percpu(struct ihk_page_allocator_cache);
+	if (!desc->caches) {
+		printk("IHK: failed to allocate page-allocator caches\n");
+		if (desc->flag) {
+			vfree(desc);
+		} else {
+			kfree(desc);
+		}
+		return NULL;
+	}
+	for_each_possible_cpu(cpu) {
+		cache = per_cpu_ptr(desc->caches, cpu);
+		spin_lock_init(&cache->lock);
+		cache->nr = 0;
+	}
+
 	desc->start = start;
-	desc->last = 0;
-	desc->count = mapaligned >> 3;
+	desc->end = start + (mapsize << page_shift);
+	desc->count = mapsize;
+	desc->nr_words = nr_words;
+	desc->nr_leaves = nr_leaves;
 	desc->shift = page_shift;
-	desc->flag = flag;
+	desc->tree = (void *)&desc->map[nr_words];
 	spin_lock_init(&desc->lock);
 
 	/* Reserve align padding area */
-	for (i = mapsize; i < mapaligned * 8; i++) {
-		desc->map[MAP_INDEX(i)] |= (1 << MAP_BIT(i));
+	for (i = mapsize; i < nr_words * 64; i++) {
+		desc->map[MAP_INDEX(i)] |= (1UL << MAP_BIT(i));
 	}
+	__ihk_pagealloc_update(desc, 0, nr_leaves - 1);
 
 	return desc;
 }
@@ -117,101 +303,129 @@ void *ihk_pagealloc_init(unsigned long start, unsigned long size,
 void ihk_pagealloc_destroy(void *__desc)
 {
 	struct ihk_page_allocator_desc *desc = __desc;
+
+	free_percpu(desc->caches);
 	if (desc->flag) {
-		free_pages((unsigned long)desc, desc->flag);
+		vfree(desc);
 	} else {
 		kfree(desc);
 	}
 }
 
-/**
- * \brief Internal function for the allocation of large blocks
- *
- * If the size of block to allocate is more than 32, the allocator allocates
- * by the unit of 64 blocks (because the map uses bitfield, and unsigned long
- * is 64 bit).
- * \param desc    Pointer to the allocator descriptor.
- * \param nblocks Number of large blocks (in 64 blocks)
- * \return Address of the allocated block. 0 if failed. 
- */
-static unsigned long __ihk_pagealloc_large(struct ihk_page_allocator_desc *desc,
-                                           int nblocks)
+/** \brief Return the blocks of all the per-CPU caches to the map */
+static void __ihk_pagealloc_drain(struct ihk_page_allocator_desc *desc)
 {
+	struct ihk_page_allocator_cache *cache;
 	unsigned long flags;
-	unsigned int i, j, mi;
+	int cpu;
 
-	printk("pagealloc_large_request : %d\n", nblocks);
+	for_each_possible_cpu(cpu) {
+		cache = per_cpu_ptr(desc->caches, cpu);
 
-	spin_lock_irqsave(&desc->lock, flags);
-	for (i = 0, mi = desc->last; i < desc->count; i++, mi++) {
-		if (mi > desc->count) {
-			mi = 0;
-		}
-		if (mi + nblocks >= desc->count) {
-			continue;
+		spin_lock_irqsave(&cache->lock, flags);
+		spin_lock(&desc->lock);
+		while (cache->nr > 0) {
+			__ihk_pagealloc_mark(desc, cache->blocks[--cache->nr],
+			                     1, 0);
 		}
-		for (j = mi; j < mi + nblocks; j++) {
-			if (desc->map[j]) {
+		spin_unlock(&desc->lock);
+		spin_unlock_irqrestore(&cache->lock, flags);
+	}
+}
+
+/** \brief Allocate a single block through the per-CPU cache */
+static long __ihk_pagealloc_alloc_one(struct ihk_page_allocator_desc *desc)
+{
+	struct ihk_page_allocator_cache *cache;
+	unsigned long flags;
+	long block = -1;
+
+	cache = get_cpu_ptr(desc->caches);
+	spin_lock_irqsave(&cache->lock, flags);
+
+	if (!cache->nr) {
+		spin_lock(&desc->lock);
+		while (cache->nr < IHK_PAGEALLOC_CACHE_BATCH) {
+			block = __ihk_pagealloc_alloc(desc, 1);
+			if (block < 0) {
 				break;
 			}
+			cache->blocks[cache->nr++] = block;
 		}
-		if (j == mi + nblocks) {
-			for (j = mi; j < mi + nblocks; j++) {
-				desc->map[j] = (unsigned long)-1;
-			}
-			spin_unlock_irqrestore(&desc->lock, flags);
+		spin_unlock(&desc->lock);
+	}
+
+	if (cache->nr) {
+		block = cache->blocks[--cache->nr];
+	}
+
+	spin_unlock_irqrestore(&cache->lock, flags);
+	put_cpu_ptr(desc->caches);
+
+	return block;
+}
+
+/** \brief Free a single block through the per-CPU cache */
+static void __ihk_pagealloc_free_one(struct ihk_page_allocator_desc *desc,
+                                     unsigned long block)
+{
+	struct ihk_page_allocator_cache *cache;
+	unsigned long flags;
 
-			return ADDRESS(desc, mi, 0);
+	cache = get_cpu_ptr(desc->caches);
+	spin_lock_irqsave(&cache->lock, flags);
+
+	if (cache->nr == IHK_PAGEALLOC_CACHE_SIZE) {
+		spin_lock(&desc->lock);
+		while (cache->nr > IHK_PAGEALLOC_CACHE_SIZE -
+		       IHK_PAGEALLOC_CACHE_BATCH) {
+			__ihk_pagealloc_mark(desc, cache->blocks[--cache->nr],
+			                     1, 0);
 		}
+		spin_unlock(&desc->lock);
 	}
-	
-	spin_unlock_irqrestore(&desc->lock, flags);
+	cache->blocks[cache->nr++] = block;
 
-	return 0;
+	spin_unlock_irqrestore(&cache->lock, flags);
+	put_cpu_ptr(desc->caches);
 }
 
 /**
  * \brief Allocates a memory area.
  *
+ * Exactly npages blocks are allocated, the lowest free run large enough
+ * is used.
  * \param __desc  Pointer to an allocator descriptor.
  * \param npages  Number of blocks to allocate
- * \return Address of the allocated block. 0 if failed. 
+ * \return Address of the allocated block. 0 if failed.
  */
 unsigned long ihk_pagealloc_alloc(void *__desc, int npages)
 {
 	struct ihk_page_allocator_desc *desc = __desc;
-	unsigned int i, mi;
-	int j;
-	unsigned long v, mask, flags;
-
-	/* If requested page is more than the half of the element,
-	 * we allocate the whole element (ulong) */
-	if (npages >= 32) {
-		return __ihk_pagealloc_large(desc, (npages + 63) >> 6);
-	}
+	unsigned long flags;
+	long block;
+	int retry;
 
-	mask = (1 << npages) - 1;
+	if (npages <= 0) {
+		return 0;
+	}
 
-	spin_lock_irqsave(&desc->lock, flags);
-	for (i = 0, mi = desc->last; i < desc->count; i++, mi++) {
-		if (mi > desc->count) {
-			mi = 0;
+	for (retry = 0; retry < 2; retry++) {
+		if (npages == 1) {
+			block = __ihk_pagealloc_alloc_one(desc);
+		} else {
+			spin_lock_irqsave(&desc->lock, flags);
+			block = __ihk_pagealloc_alloc(desc, npages);
+			spin_unlock_irqrestore(&desc->lock, flags);
 		}
-		
-		v = desc->map[mi];
-		if (v == (unsigned long)-1)
-			continue;
-		
-		for (j = 0; j <= 64 - npages; j++) {
-			if (!(v & (mask << j))) { /* free */
-				desc->map[mi] |= (mask << j);
-
-				spin_unlock_irqrestore(&desc->lock, flags);
-				return ADDRESS(desc, mi, j);
-			}
+
+		if (block >= 0) {
+			return ADDRESS(desc, block);
 		}
+
+		/* Free blocks might be sitting in the caches */
+		__ihk_pagealloc_drain(desc);
 	}
-	spin_unlock_irqrestore(&desc->lock, flags);
 
 	/* We use null pointer for failure */
 	return 0;
@@ -223,7 +437,7 @@ unsigned long ihk_pagealloc_alloc(void *__desc, int npages)
  * This function accepts a size in byte, instead of block.
  * \param __desc  Pointer to an allocator descriptor.
  * \param size    Number of bytes to allocate
- * \return Address of the allocated block. 0 if failed. 
+ * \return Address of the allocated block. 0 if failed.
  */
 unsigned long ihk_pagealloc_alloc_size(void *__desc, unsigned long size)
 {
@@ -244,17 +458,22 @@ unsigned long ihk_pagealloc_alloc_size(void *__desc, unsigned long size)
 void ihk_pagealloc_free(void *__desc, unsigned long address, int npages)
 {
 	struct ihk_page_allocator_desc *desc = __desc;
-	int i;
-	unsigned mi;
 	unsigned long flags;
 
-	/* XXX: Parameter check */
-	
-	spin_lock_irqsave(&desc->lock, flags);
-	mi = (address - desc->start) >> desc->shift;
-	for (i = 0; i < npages; i++, mi++) {
-		desc->map[MAP_INDEX(mi)] &= ~(1UL << MAP_BIT(mi));
+	if (npages <= 0 || address < desc->start ||
+	    BLOCK(desc, address) + npages > desc->count) {
+		printk("IHK: %s: invalid range (%lx, %d)\n",
+		       __FUNCTION__, address, npages);
+		return;
+	}
+
+	if (npages == 1) {
+		__ihk_pagealloc_free_one(desc, BLOCK(desc, address));
+		return;
 	}
+
+	spin_lock_irqsave(&desc->lock, flags);
+	__ihk_pagealloc_mark(desc, BLOCK(desc, address), npages, 0);
 	spin_unlock_irqrestore(&desc->lock, flags);
 }
 
@@ -273,4 +492,3 @@ EXPORT_SYMBOL(ihk_pagealloc_alloc);
 EXPORT_SYMBOL(ihk_pagealloc_free);
 EXPORT_SYMBOL(ihk_pagealloc_alloc_size);
 EXPORT_SYMBOL(ihk_pagealloc_free_size);
-
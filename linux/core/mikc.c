@@ -105,6 +105,95 @@ struct ihk_ikc_channel_desc *ihk_host_ikc_init_first(ihk_os_t ihk_os,
 	}
 }
 
+/**
+ * \brief Sets up the additional master channels published by the kernel
+ * with ihk_set_mikc_queues(). Each one is drained on its own online CPU,
+ * CPU 0 keeping the primary master channel, so that connection requests
+ * are not serialized on one CPU and one queue.
+ */
+static void ihk_host_ikc_init_masters(ihk_os_t ihk_os)
+{
+	struct ihk_host_linux_os_data *os = ihk_os;
+	struct ihk_ikc_master_queue *queues;
+	unsigned long addr, size, tp, rp, wp;
+	struct ihk_ikc_queue_head *rq, *wq;
+	struct ihk_ikc_channel_desc *c;
+	int i, nr, cpu = 0;
+
+	if (ihk_os_get_special_address(ihk_os, IHK_SPADDR_MIKC_QUEUES,
+	                               &addr, &size) || !addr) {
+		return;
+	}
+
+	nr = min_t(int, size / sizeof(*queues), IHK_IKC_MAX_MASTER_CHANNELS);
+
+	tp = ihk_device_map_memory(os->dev_data, addr, size);
+	queues = ihk_device_map_virtual(os->dev_data, tp, size, NULL, 0);
+	if (!queues) {
+		ihk_device_unmap_memory(os->dev_data, tp, size);
+		return;
+	}
+
+	for (i = 0; i < nr; i++) {
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids) {
+			break;
+		}
+
+		rp = ihk_device_map_memory(os->dev_data, queues[i].recv,
+		                           queues[i].size);
+		wp = ihk_device_map_memory(os->dev_data, queues[i].send,
+		                           queues[i].size);
+		rq = ihk_device_map_virtual(os->dev_data, rp, queues[i].size,
+		                            NULL, 0);
+		wq = ihk_device_map_virtual(os->dev_data, wp, queues[i].size,
+		                            NULL, 0);
+
+		c = kzalloc(sizeof(struct ihk_ikc_channel_desc)
+		            + sizeof(struct ihk_ikc_master_packet), GFP_KERNEL);
+		if (!c || !rq || !wq) {
+			printk("IHK: error setting up master channel %d\n", i);
+			kfree(c);
+			if (rq) {
+				ihk_device_unmap_virtual(os->dev_data, rq,
+				                         queues[i].size);
+			}
+			if (wq) {
+				ihk_device_unmap_virtual(os->dev_data, wq,
+				                         queues[i].size);
+			}
+			ihk_device_unmap_memory(os->dev_data, rp,
+			                        queues[i].size);
+			ihk_device_unmap_memory(os->dev_data, wp,
+			                        queues[i].size);
+			break;
+		}
+
+		ihk_ikc_init_desc(c, ihk_os, 0, rq, wq,
+		                  ihk_ikc_master_channel_packet_handler, c);
+#ifdef __x86_64
+		ihk_ikc_channel_set_cpu(c, cpu_physical_id(cpu));
+#else
+		ihk_ikc_channel_set_cpu(c, cpu);
+#endif
+
+		c->recv.qphys = rp;
+		c->send.qphys = wp;
+		c->recv.qrphys = queues[i].recv;
+		c->send.qrphys = queues[i].send;
+
+		ihk_ikc_enable_channel(c);
+		os->mchannels[os->nr_mchannels++] = c;
+		os->cpu_mchannels[cpu] = c;
+	}
+
+	dprintf("%s: %d additional master channels\n",
+	        __FUNCTION__, os->nr_mchannels);
+
+	ihk_device_unmap_virtual(os->dev_data, queues, size);
+	ihk_device_unmap_memory(os->dev_data, tp, size);
+}
+
 /** \brief Initializes a master channel */
 int ihk_ikc_master_init(ihk_os_t __os)
 {
@@ -124,6 +213,9 @@ int ihk_ikc_master_init(ihk_os_t __os)
 		return -EINVAL;
 	} else {
 		ihk_ikc_enable_channel(os->mchannel);
+
+		/* The kernel starts using them on the ack */
+		ihk_host_ikc_init_masters(os);
 		
 		dprintf("ikc_master_init done.\n");
 
@@ -147,6 +239,12 @@ void ikc_master_finalize(ihk_os_t __os)
 		return;
 	}
 
+	memset(os->cpu_mchannels, 0,
+	       sizeof(*os->cpu_mchannels) * num_possible_cpus());
+	while (os->nr_mchannels > 0) {
+		ihk_ikc_destroy_channel(os->mchannels[--os->nr_mchannels]);
+	}
+
 	if (os->mchannel) {
 		ihk_ikc_destroy_channel(os->mchannel);
 	}
@@ -163,6 +261,14 @@ struct list_head *ihk_os_get_ikc_channel_list(ihk_os_t ihk_os)
 	return &os->ikc_channels;
 }
 
+/** \brief Get the channel table (called from IHK-IKC) */
+struct ihk_ikc_channel_desc **ihk_os_get_ikc_channel_table(ihk_os_t ihk_os)
+{
+	struct ihk_host_linux_os_data *os = ihk_os;
+
+	return os->ikc_channel_table;
+}
+
 /** \brief Get the lock for the channel list (called from IHK-IKC) */
 spinlock_t *ihk_os_get_ikc_channel_lock(ihk_os_t ihk_os)
 {
@@ -282,6 +388,51 @@ struct ihk_ikc_channel_desc *ihk_os_get_master_channel(ihk_os_t __os)
 	return os->mchannel;
 }
 
+/** \brief Get the additional master channel drained on a CPU
+ *         (Called from IHK-IKC) */
+struct ihk_ikc_channel_desc *ihk_os_get_cpu_master_channel(ihk_os_t __os,
+                                                           int cpu)
+{
+	struct ihk_host_linux_os_data *os = __os;
+
+	return os->cpu_mchannels[cpu];
+}
+
+/** \brief Get the master channel to connect from the current CPU on,
+ *         spreading the connections over all master channels
+ *         (Called from IHK-IKC) */
+struct ihk_ikc_channel_desc *ihk_os_pick_master_channel(ihk_os_t __os)
+{
+	struct ihk_host_linux_os_data *os = __os;
+	int i = raw_smp_processor_id() % (os->nr_mchannels + 1);
+
+	return i ? os->mchannels[i - 1] : os->mchannel;
+}
+
+/** \brief Count an IKC queue or channel descriptor allocation by its
+ *         placement (called from IHK-IKC) */
+void ihk_os_count_ikc_alloc(ihk_os_t ihk_os, int queue, int local)
+{
+	struct ihk_host_linux_os_data *os = ihk_os;
+
+	if (queue) {
+		atomic_long_inc(local ? &os->ikc_stats.nr_queues_local :
+		                &os->ikc_stats.nr_queues_remote);
+	} else {
+		atomic_long_inc(local ? &os->ikc_stats.nr_descs_local :
+		                &os->ikc_stats.nr_descs_remote);
+	}
+}
+
+/** \brief Account the time spent handling IKC interrupts on a CPU
+ *         (called from IHK-IKC) */
+void ihk_os_count_ikc_time(ihk_os_t ihk_os, int cpu, u64 ns)
+{
+	struct ihk_host_linux_os_data *os = ihk_os;
+
+	atomic64_add(ns, &os->ikc_cpu_time[cpu]);
+}
+
 /** \brief Generate a unique ID for a channel
  *         (Called from IHK-IKC) */
 int ihk_os_get_unique_channel_id(ihk_os_t ihk_os)
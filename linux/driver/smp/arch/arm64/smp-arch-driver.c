@@ -428,6 +428,11 @@ void smp_ihk_arch_dcache_flush(void *addr, size_t len)
 	ihk___flush_dcache_area(addr, len);
 }
 
+void smp_ihk_arch_dma_copy(void *dest, const void *src, size_t len)
+{
+	memcpy(dest, src, len);
+}
+
 #if 0 // TODO[PMU]
 /* @ref.impl arch/arm64/kernel/perf_event.c:armpmu_reserve_hardware */
 static int
@@ -1177,52 +1182,19 @@ int smp_ihk_os_send_multi_intr(ihk_os_t ihk_os, void *priv, int mode)
 
 static long get_dump_num_mem_areas(struct smp_os_data *os)
 {
-	struct ihk_dump_page *dump_page = NULL;
-	int i, j, k, mem_num;
-	unsigned long bit_count;
-
-	while (1) {
-		if (IHK_DUMP_PAGE_SET_COMPLETED == os->param->dump_page_set.completion_flag) {
-			break;
-		}
-		msleep(10); /* 10ms sleep */
-	}
-	dump_page = phys_to_virt(os->param->dump_page_set.phy_page);
-
-	for (i = 0, mem_num = 0; i < os->param->dump_page_set.count; i++) {
-		if (i) {
-			dump_page = (struct ihk_dump_page *)((char *)dump_page + ((dump_page->map_count * sizeof(unsigned long)) + sizeof(struct ihk_dump_page)));
-		}
-
-		for (j = 0, bit_count = 0; j < dump_page->map_count; j++) {
-			for (k = 0; k < 64; k++) {
-				if ((dump_page->map[j] >> k) & 0x1) {
-					bit_count++;
-				}
-				else {
-					if (bit_count) {
-						mem_num++;
-						bit_count = 0;
-					}
-				}
-			}
-		}
+	long cursor = 0;
+	long mem_num;
 
-		if (bit_count) {
-			mem_num++;
-		}
-	}
+	mem_num = ihk_smp_dump_mem_areas(os, &cursor, NULL, 0);
 	return (sizeof(dump_mem_chunks_t) + (sizeof(struct dump_mem_chunk) * mem_num));
 }
 
 int smp_ihk_os_dump(ihk_os_t ihk_os, void *priv, dumpargs_t *args)
 {
 	struct smp_os_data *os = priv;
-	struct ihk_dump_page *dump_page = NULL;
-	int i,j,k,index;
-	long mem_size;
+	int i;
+	long mem_size, cursor;
 	struct ihk_os_mem_chunk *os_mem_chunk;
-	unsigned long map_start, bit_count;
 	dump_mem_chunks_t *mem_chunks;
 	void *va;
 	extern struct list_head ihk_mem_used_chunks;
@@ -1304,47 +1276,59 @@ int smp_ihk_os_dump(ihk_os_t ihk_os, void *priv, dumpargs_t *args)
 		}
 		memset(mem_chunks, 0, mem_size);
 
-		dump_page = phys_to_virt(os->param->dump_page_set.phy_page);
-
-		for (i = 0, index = 0; i < os->param->dump_page_set.count; i++) {
+		cursor = 0;
+		mem_chunks->nr_chunks =
+			ihk_smp_dump_mem_areas(os, &cursor, mem_chunks->chunks,
+				(mem_size - sizeof(dump_mem_chunks_t)) /
+				sizeof(struct dump_mem_chunk));
 
-			if (i) {
-				dump_page = (struct ihk_dump_page *)((char *)dump_page + ((dump_page->map_count * sizeof(unsigned long)) + sizeof(struct ihk_dump_page)));
-			}
+		/* See load_file() for the calculation below */
+		mem_chunks->kernel_base =
+			(os->bootstrap_mem_start + IHK_SMP_LARGE_PAGE * 2 - 1) & IHK_SMP_LARGE_PAGE_MASK;
+		mem_chunks->phys_start = *ihk___memstart_addr;
 
-			for (j = 0, bit_count = 0; j < dump_page->map_count; j++) {
-				for (k = 0; k < 64; k++) {
-					if ((dump_page->map[j] >> k) & 0x1) {
-						if (!bit_count) {
-							map_start = (unsigned long)(dump_page->start + ((unsigned long)j << (PAGE_SHIFT+6)));
-							map_start = map_start + ((unsigned long)k << PAGE_SHIFT);
-						}
-						bit_count++;
-					} else {
-						if (bit_count) {
-							mem_chunks->chunks[index].addr = map_start;
-							mem_chunks->chunks[index].size = (bit_count << PAGE_SHIFT);
-							index++;
-							bit_count = 0;
-						}
-					}
-				}
-			}
+		if (copy_to_user(args->buf, mem_chunks, mem_size)) {
+			printk("%s: copy_to_user failed.\n", __FUNCTION__);
+			kfree(mem_chunks);
+			return -EFAULT;
+		}
+		kfree(mem_chunks);
+		break;
 
-			if (bit_count) {
-				mem_chunks->chunks[index].addr = map_start;
-				mem_chunks->chunks[index].size = (bit_count << PAGE_SHIFT);
-				index++;
-			}
+	/*
+	 * Same as DUMP_QUERY_MEM_AREAS, but returns as many areas as
+	 * fit into args->size and stores the position to resume from
+	 * into args->start, which is -1 once all areas have been
+	 * returned. The first call is made with args->start set to 0.
+	 */
+	case DUMP_QUERY_MEM_AREAS_PAGED:
+		mem_size = min_t(long, args->size,
+				 IHK_SMP_DUMP_MEM_AREAS_PAGE_SIZE);
+		if (mem_size < sizeof(dump_mem_chunks_t) +
+				sizeof(struct dump_mem_chunk)) {
+			return -EINVAL;
 		}
+		mem_chunks = kmalloc(mem_size, GFP_KERNEL);
+		if (!mem_chunks) {
+			printk("%s: memory allocation failed.\n", __FUNCTION__);
+			return -ENOMEM;
+		}
+		memset(mem_chunks, 0, mem_size);
 
-		mem_chunks->nr_chunks = index;
+		cursor = args->start;
+		mem_chunks->nr_chunks =
+			ihk_smp_dump_mem_areas(os, &cursor, mem_chunks->chunks,
+				(mem_size - sizeof(dump_mem_chunks_t)) /
+				sizeof(struct dump_mem_chunk));
+		args->start = cursor;
 
 		/* See load_file() for the calculation below */
 		mem_chunks->kernel_base =
 			(os->bootstrap_mem_start + IHK_SMP_LARGE_PAGE * 2 - 1) & IHK_SMP_LARGE_PAGE_MASK;
 		mem_chunks->phys_start = *ihk___memstart_addr;
 
+		mem_size = sizeof(dump_mem_chunks_t) +
+			sizeof(struct dump_mem_chunk) * mem_chunks->nr_chunks;
 		if (copy_to_user(args->buf, mem_chunks, mem_size)) {
 			printk("%s: copy_to_user failed.\n", __FUNCTION__);
 			kfree(mem_chunks);
@@ -1947,31 +1931,6 @@ error_free_irq:
 	return error;
 }
 
-/*
- * @ref.impl arch/arm64/kernel/psci.c
- */
-static int ihk_smp_cpu_kill(unsigned int hwid, u64 affi)
-{
-	int err, i;
-
-	for (i = 0; i < 10; i++) {
-		err = ihk_psci_ops->affinity_info(affi, 0);
-		if (err == PSCI_0_2_AFFINITY_LEVEL_OFF) {
-			pr_info("IHK-SMP: CPU HWID %d killed.\n", hwid);
-			return 0;
-		}
-
-		msleep(10);
-		pr_info("IHK-SMP: Retrying again to check for CPU kill\n");
-	}
-
-	pr_warn("IHK-SMP: CPU HWID %d may not have shut down cleanly (AFFINITY_INFO reports %d)\n",
-	        hwid, err);
-
-	/* Make op_cpu_kill() fail. */
-	return -ETIMEDOUT;
-}
-
 LIST_HEAD(cpu_topology_list);
 LIST_HEAD(node_topology_list);
 
@@ -2315,44 +2274,95 @@ int smp_ihk_os_check_ikc_map(ihk_os_t ihk_os)
 
 int ihk_smp_reset_cpu(int hw_id)
 {
-	int ret = 0;
-	int i;
-	u64 affi;
+	return ihk_smp_reset_cpus(&hw_id, 1);
+}
 
-	dprintk(KERN_INFO "IHK-SMP: resetting CPU %d.\n", hw_id);
+/*
+ * Stop the CPUs with one cross call, then poll them together so that
+ * each round of waiting is shared by all of them.
+ * @ref.impl arch/arm64/kernel/psci.c (cpu_kill)
+ */
+int ihk_smp_reset_cpus(int *hw_ids, int nr)
+{
+	int ret = 0, err = 0;
+	int i, j, round, nr_left;
+	u64 *affis = NULL;
+	unsigned long *left = NULL;
+	cpumask_var_t stop;
 
 	if (!ihk_psci_ops->affinity_info) {
 		pr_warn("IHK-SMP: Undefined reference to 'affinity_info'\n");
 		return -EFAULT;
 	}
 
-	/* cpu_kill could race with cpu_die and we can
-	 * potentially end up declaring this cpu undead
-	 * while it is dying. So, try again a few times. */
-	ret = ihk_smp_get_cpu_affinity(hw_id, &affi);
-	if (ret) {
-		pr_warn("IHK-SMP: ihk_smp_get_cpu_affinity failed.(ret=%d)\n", ret);
-		return ret;
+	affis = kmalloc(sizeof(u64) * nr, GFP_KERNEL);
+	left = kcalloc(BITS_TO_LONGS(nr), sizeof(unsigned long), GFP_KERNEL);
+	if (!affis || !left || !zalloc_cpumask_var(&stop, GFP_KERNEL)) {
+		kfree(affis);
+		kfree(left);
+		return -ENOMEM;
 	}
 
-	for (i = 0; i < SMP_MAX_CPUS; i++) {
-		if ((ihk_smp_cpus[i].hw_id != hw_id) ||
-		    (ihk_smp_cpus[i].status != IHK_SMP_CPU_ASSIGNED))
+	for (i = 0; i < nr; i++) {
+		dprintk(KERN_INFO "IHK-SMP: resetting CPU %d.\n", hw_ids[i]);
+
+		for (j = 0; j < SMP_MAX_CPUS; j++) {
+			if ((ihk_smp_cpus[j].hw_id == hw_ids[i]) &&
+			    (ihk_smp_cpus[j].status == IHK_SMP_CPU_ASSIGNED))
+				break;
+		}
+		if (j == SMP_MAX_CPUS)
 			continue;
 
-		ret = ihk_psci_ops->affinity_info(affi, 0);
-		if (ret == PSCI_0_2_AFFINITY_LEVEL_ON) {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0)
-			ihk___smp_cross_call(cpumask_of(hw_id), INTRID_CPU_STOP);
-#else
-			ihk___smp_cross_call(&cpumask_of_cpu(hw_id), INTRID_CPU_STOP);
-#endif
+		/* cpu_kill could race with cpu_die and we can
+		 * potentially end up declaring this cpu undead
+		 * while it is dying. So, try again a few times. */
+		err = ihk_smp_get_cpu_affinity(hw_ids[i], &affis[i]);
+		if (err) {
+			pr_warn("IHK-SMP: ihk_smp_get_cpu_affinity failed.(ret=%d)\n", err);
+			ret = err;
+			continue;
 		}
 
-		ret = ihk_smp_cpu_kill(hw_id, affi);
-		break;
+		set_bit(i, left);
+		if (ihk_psci_ops->affinity_info(affis[i], 0) ==
+		    PSCI_0_2_AFFINITY_LEVEL_ON) {
+			cpumask_set_cpu(hw_ids[i], stop);
+		}
+	}
+
+	if (!cpumask_empty(stop)) {
+		ihk___smp_cross_call(stop, INTRID_CPU_STOP);
+	}
+
+	for (round = 0; round < 10; round++) {
+		nr_left = 0;
+		for_each_set_bit(i, left, nr) {
+			err = ihk_psci_ops->affinity_info(affis[i], 0);
+			if (err == PSCI_0_2_AFFINITY_LEVEL_OFF) {
+				pr_info("IHK-SMP: CPU HWID %d killed.\n",
+					hw_ids[i]);
+				clear_bit(i, left);
+				continue;
+			}
+			nr_left++;
+		}
+		if (!nr_left)
+			break;
+
+		msleep(10);
+		pr_info("IHK-SMP: Retrying again to check for CPU kill\n");
+	}
+
+	for_each_set_bit(i, left, nr) {
+		pr_warn("IHK-SMP: CPU HWID %d may not have shut down cleanly (AFFINITY_INFO reports %d)\n",
+			hw_ids[i], ihk_psci_ops->affinity_info(affis[i], 0));
+		ret = -ETIMEDOUT;
 	}
 
+	free_cpumask_var(stop);
+	kfree(left);
+	kfree(affis);
 	return ret;
 }
 
@@ -188,6 +188,17 @@ int ihk_smp_get_hw_id(int cpu)
 
 void smp_ihk_arch_dcache_flush(void *addr, size_t len) { }
 
+/* Copy with non-temporal stores so that bulk transfers don't evict the
+ * working set of the cores sharing the cache */
+void smp_ihk_arch_dma_copy(void *dest, const void *src, size_t len)
+{
+#ifdef CONFIG_ARCH_HAS_UACCESS_FLUSHCACHE
+	memcpy_flushcache(dest, src, len);
+#else
+	memcpy(dest, src, len);
+#endif
+}
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,0,0)
 /* origin: arch/x86/kernel/smpboot.c */
 static inline void smpboot_setup_warm_reset_vector(unsigned long start_eip)
@@ -606,52 +617,19 @@ int smp_ihk_os_send_multi_intr(ihk_os_t ihk_os, void *priv, int mode)
 
 static long get_dump_num_mem_areas(struct smp_os_data *os)
 {
-	struct ihk_dump_page *dump_page = NULL;
-	int i, j, k, mem_num;
-	unsigned long bit_count;
-
-	while (1) {
-		if (IHK_DUMP_PAGE_SET_COMPLETED == os->param->dump_page_set.completion_flag) {
-			break;
-		}
-		msleep(10); /* 10ms sleep */
-	}
-	dump_page = phys_to_virt(os->param->dump_page_set.phy_page);
-
-	for (i = 0, mem_num = 0; i < os->param->dump_page_set.count; i++) {
-		if (i) {
-			dump_page = (struct ihk_dump_page *)((char *)dump_page + ((dump_page->map_count * sizeof(unsigned long)) + sizeof(struct ihk_dump_page)));
-		}
-
-		for (j = 0, bit_count = 0; j < dump_page->map_count; j++) {
-			for (k = 0; k < 64; k++) {
-				if ((dump_page->map[j] >> k) & 0x1) {
-					bit_count++;
-				}
-				else {
-					if (bit_count) {
-						mem_num++;
-						bit_count = 0;
-					}
-				}
-			}
-		}
+	long cursor = 0;
+	long mem_num;
 
-		if (bit_count) {
-			mem_num++;
-		}
-	}
+	mem_num = ihk_smp_dump_mem_areas(os, &cursor, NULL, 0);
 	return (sizeof(dump_mem_chunks_t) + (sizeof(struct dump_mem_chunk) * mem_num));
 }
 
 int smp_ihk_os_dump(ihk_os_t ihk_os, void *priv, dumpargs_t *args)
 {
 	struct smp_os_data *os = priv;
-	struct ihk_dump_page *dump_page = NULL;
-	int i,j,k,index;
-	long mem_size;
+	int i;
+	long mem_size, cursor;
 	struct ihk_os_mem_chunk *os_mem_chunk;
-	unsigned long map_start, bit_count;
 	dump_mem_chunks_t *mem_chunks;
 	void *va;
 	extern struct list_head ihk_mem_used_chunks;
@@ -731,6 +709,9 @@ int smp_ihk_os_dump(ihk_os_t ihk_os, void *priv, dumpargs_t *args)
 
 		case DUMP_QUERY_MEM_AREAS:
 			mem_size = min(get_dump_num_mem_areas(os), args->size);
+			if (mem_size < sizeof(dump_mem_chunks_t)) {
+				return -EINVAL;
+			}
 			mem_chunks = kmalloc(mem_size, GFP_KERNEL);
 			if (!mem_chunks) {
 				printk("%s: memory allocation failed.\n", __FUNCTION__);
@@ -738,49 +719,57 @@ int smp_ihk_os_dump(ihk_os_t ihk_os, void *priv, dumpargs_t *args)
 			}
 			memset(mem_chunks, 0, mem_size);
 
-			dump_page = phys_to_virt(os->param->dump_page_set.phy_page);
-
-			for (i = 0, index = 0; i < os->param->dump_page_set.count; i++) {
-				if (mem_size < sizeof(dump_mem_chunks_t) +
-						(sizeof(struct dump_mem_chunk) * (index+1)))
-					break;
+			cursor = 0;
+			mem_chunks->nr_chunks =
+				ihk_smp_dump_mem_areas(os, &cursor, mem_chunks->chunks,
+					(mem_size - sizeof(dump_mem_chunks_t)) /
+					sizeof(struct dump_mem_chunk));
 
-				if (i) {
-					dump_page = (struct ihk_dump_page *)((char *)dump_page + ((dump_page->map_count * sizeof(unsigned long)) + sizeof(struct ihk_dump_page)));
-				}
+			/* See load_file() for the calculation below */
+			mem_chunks->kernel_base =
+				(os->bootstrap_mem_start + IHK_SMP_LARGE_PAGE * 2 - 1) & IHK_SMP_LARGE_PAGE_MASK;
 
-				for (j = 0, bit_count = 0; j < dump_page->map_count; j++) {
-					for (k = 0; k < 64; k++) {
-						if ((dump_page->map[j] >> k) & 0x1) {
-							if (!bit_count) {
-								map_start = (unsigned long)(dump_page->start + ((unsigned long)j << (PAGE_SHIFT+6)));
-								map_start = map_start + ((unsigned long)k << PAGE_SHIFT);
-							}
-							bit_count++;
-						} else {
-							if (bit_count) {
-								mem_chunks->chunks[index].addr = map_start;
-								mem_chunks->chunks[index].size = (bit_count << PAGE_SHIFT);
-								index++;
-								bit_count = 0;
-							}
-						}
-					}
-				}
+			if (copy_to_user(args->buf, mem_chunks, mem_size)) {
+				printk("%s: copy_to_user failed.\n", __FUNCTION__);
+				kfree(mem_chunks);
+				return -EFAULT;
+			}
+			kfree(mem_chunks);
+			break;
 
-				if (bit_count) {
-					mem_chunks->chunks[index].addr = map_start;
-					mem_chunks->chunks[index].size = (bit_count << PAGE_SHIFT);
-					index++;
-				}
+		/*
+		 * Same as DUMP_QUERY_MEM_AREAS, but returns as many areas as
+		 * fit into args->size and stores the position to resume
+		 * from into args->start, which is -1 once all areas have been
+		 * returned. The first call is made with args->start set to 0.
+		 */
+		case DUMP_QUERY_MEM_AREAS_PAGED:
+			mem_size = min_t(long, args->size,
+					 IHK_SMP_DUMP_MEM_AREAS_PAGE_SIZE);
+			if (mem_size < sizeof(dump_mem_chunks_t) +
+					sizeof(struct dump_mem_chunk)) {
+				return -EINVAL;
 			}
+			mem_chunks = kmalloc(mem_size, GFP_KERNEL);
+			if (!mem_chunks) {
+				printk("%s: memory allocation failed.\n", __FUNCTION__);
+				return -ENOMEM;
+			}
+			memset(mem_chunks, 0, mem_size);
 
-			mem_chunks->nr_chunks = index;
+			cursor = args->start;
+			mem_chunks->nr_chunks =
+				ihk_smp_dump_mem_areas(os, &cursor, mem_chunks->chunks,
+					(mem_size - sizeof(dump_mem_chunks_t)) /
+					sizeof(struct dump_mem_chunk));
+			args->start = cursor;
 
 			/* See load_file() for the calculation below */
 			mem_chunks->kernel_base =
 				(os->bootstrap_mem_start + IHK_SMP_LARGE_PAGE * 2 - 1) & IHK_SMP_LARGE_PAGE_MASK;
 
+			mem_size = sizeof(dump_mem_chunks_t) +
+				sizeof(struct dump_mem_chunk) * mem_chunks->nr_chunks;
 			if (copy_to_user(args->buf, mem_chunks, mem_size)) {
 				printk("%s: copy_to_user failed.\n", __FUNCTION__);
 				kfree(mem_chunks);
@@ -1623,48 +1612,65 @@ int smp_ihk_os_check_ikc_map(ihk_os_t ihk_os)
 }
 
 int ihk_smp_reset_cpu(int phys_apicid)
+{
+	return ihk_smp_reset_cpus(&phys_apicid, 1);
+}
+
+/*
+ * INIT is asserted on every CPU before the one settle delay, then
+ * deasserted on every CPU. A broadcast INIT would hit the Linux CPUs.
+ */
+int ihk_smp_reset_cpus(int *hw_ids, int nr)
 {
 	unsigned long send_status;
 	int maxlvt;
+	int i;
 
 	preempt_disable();
-	dprintk(KERN_INFO "IHK-SMP: resetting CPU %d.\n", phys_apicid);
 
 	maxlvt = _lapic_get_maxlvt();
 
-	/*
-	 * Be paranoid about clearing APIC errors.
-	 */
-	if (APIC_INTEGRATED(apic_version[phys_apicid])) {
-		if (maxlvt > 3) /* Due to the Pentium erratum 3AP. */
-			apic_write(APIC_ESR, 0);
-		apic_read(APIC_ESR);
-	}
+	for (i = 0; i < nr; i++) {
+		dprintk(KERN_INFO "IHK-SMP: resetting CPU %d.\n", hw_ids[i]);
 
-	pr_debug("Asserting INIT.\n");
+		/*
+		 * Be paranoid about clearing APIC errors.
+		 */
+		if (APIC_INTEGRATED(apic_version[hw_ids[i]])) {
+			if (maxlvt > 3) /* Due to the Pentium erratum 3AP. */
+				apic_write(APIC_ESR, 0);
+			apic_read(APIC_ESR);
+		}
 
-	/*
-	 * Turn INIT on target chip
-	 */
-	/*
-	 * Send IPI
-	 */
-	apic_icr_write(APIC_INT_LEVELTRIG | APIC_INT_ASSERT | APIC_DM_INIT,
-	               phys_apicid);
+		pr_debug("Asserting INIT.\n");
 
-	pr_debug("Waiting for send to finish...\n");
-	send_status = safe_apic_wait_icr_idle();
+		/*
+		 * Turn INIT on target chip
+		 */
+		/*
+		 * Send IPI
+		 */
+		apic_icr_write(APIC_INT_LEVELTRIG | APIC_INT_ASSERT |
+		               APIC_DM_INIT, hw_ids[i]);
 
-	mdelay(10);
+		pr_debug("Waiting for send to finish...\n");
+		send_status = safe_apic_wait_icr_idle();
+	}
 
-	pr_debug("Deasserting INIT.\n");
+	if (nr > 0) {
+		mdelay(10);
+	}
 
-	/* Target chip */
-	/* Send IPI */
-	apic_icr_write(APIC_INT_LEVELTRIG | APIC_DM_INIT, phys_apicid);
+	for (i = 0; i < nr; i++) {
+		pr_debug("Deasserting INIT.\n");
 
-	pr_debug("Waiting for send to finish...\n");
-	send_status = safe_apic_wait_icr_idle();
+		/* Target chip */
+		/* Send IPI */
+		apic_icr_write(APIC_INT_LEVELTRIG | APIC_DM_INIT, hw_ids[i]);
+
+		pr_debug("Waiting for send to finish...\n");
+		send_status = safe_apic_wait_icr_idle();
+	}
 
 	preempt_enable();
 	return 0;
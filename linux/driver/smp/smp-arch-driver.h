@@ -56,6 +56,8 @@ int smp_ihk_arch_init(void);
 int ihk_smp_arch_symbols_init(void);
 int smp_ihk_os_check_ikc_map(ihk_os_t ihk_os);
 int ihk_smp_reset_cpu(int hw_id);
+/* Reset nr CPUs together, waiting for them only once */
+int ihk_smp_reset_cpus(int *hw_ids, int nr);
 void smp_ihk_arch_exit(void);
 int smp_ihk_arch_vmap_area_taken(void);
 int smp_ihk_os_send_multi_intr(ihk_os_t ihk_os, void *priv, int mode);
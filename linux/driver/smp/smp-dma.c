@@ -0,0 +1,760 @@
+/**
+ * \file smp-dma.c
+ * \brief
+ *	IHK SMP Driver: Software DMA engine
+ *
+ * Linux kernel threads, optionally pinned to the cores given by the
+ * ihk_dma_cpus module parameter, poll the descriptor rings of the host
+ * and of the booted OSs and perform the copies on behalf of the
+ * submitters. They only poll while an OS is booted, backing off while
+ * idle, and otherwise sleep until the host submits a request.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/kthread.h>
+#include <linux/cpumask.h>
+#include <linux/hrtimer.h>
+#include <linux/rwsem.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/version.h>
+#include <asm/io.h>
+#include <ihk/ihk_host_driver.h>
+#include "smp-driver.h"
+#include "smp-dma.h"
+
+/** \brief CPU list the engine threads are bound to, e.g. "2,3".
+ *  One unbound thread is used when empty. These cores must not be
+ *  reserved for an OS. */
+static char *ihk_dma_cpus = "";
+module_param(ihk_dma_cpus, charp, 0444);
+MODULE_PARM_DESC(ihk_dma_cpus, "CPUs to run the software DMA engine on");
+
+/** \brief Time an idle engine thread sleeps before polling again (us) */
+static unsigned int ihk_dma_poll_us = 100;
+module_param(ihk_dma_poll_us, uint, 0644);
+MODULE_PARM_DESC(ihk_dma_poll_us, "Polling interval of an idle software DMA engine thread (us)");
+
+/** \brief Upper bound of the interval, doubled on every idle pass (us) */
+static unsigned int ihk_dma_poll_max_us = 2000;
+module_param(ihk_dma_poll_max_us, uint, 0644);
+MODULE_PARM_DESC(ihk_dma_poll_max_us, "Maximum polling interval of an idle software DMA engine thread (us)");
+
+/** \brief Number of channels of an OS ring, one per NUMA node of the
+ *  OS when 0. The channels are spread over the NUMA nodes of the OS. */
+static unsigned int ihk_dma_channels = 0;
+module_param(ihk_dma_channels, uint, 0644);
+MODULE_PARM_DESC(ihk_dma_channels, "Number of DMA channels of an OS, one per NUMA node when 0");
+
+static struct task_struct **smp_dma_threads;
+static int smp_dma_nr_threads;
+
+/* Rings polled by the engine threads, removal waits for them to be done */
+static LIST_HEAD(smp_dma_rings);
+static DECLARE_RWSEM(smp_dma_rings_sem);
+
+static struct smp_dma_ring *smp_dma_host_ring;
+
+/* Rings of booted OSs, which submit without waking the threads up */
+static atomic_t smp_dma_nr_os_rings = ATOMIC_INIT(0);
+
+static inline unsigned long __next(struct smp_dma_channel *c, unsigned long t)
+{
+	t++;
+	if (t >= c->len) {
+		t = 0;
+	}
+	return t;
+}
+
+static char __smp_dma_check_room(struct smp_dma_channel *c, int ndesc)
+{
+	unsigned long h = c->head, t = READ_ONCE(c->tail);
+
+	if (t <= h) {
+		t += c->len;
+	}
+	if (h + ndesc < t) { /* OK */
+		return 1;
+	}
+
+	return 0; /* NG */
+}
+
+static void smp_dma_kick(void)
+{
+	int i;
+
+	for (i = 0; i < smp_dma_nr_threads; i++) {
+		wake_up_process(smp_dma_threads[i]);
+	}
+}
+
+static int smp_dma_phys_valid(unsigned long phys, unsigned long size)
+{
+	return size > 0 && phys + size > phys &&
+		pfn_valid(phys >> PAGE_SHIFT) &&
+		pfn_valid((phys + size - 1) >> PAGE_SHIFT);
+}
+
+static void smp_dma_copy(unsigned long dest, unsigned long src,
+			 unsigned long size)
+{
+	unsigned long n;
+
+	if (!smp_dma_phys_valid(dest, size) ||
+	    !smp_dma_phys_valid(src, size)) {
+		printk_ratelimited(KERN_ERR "IHK-SMP: DMA: invalid copy 0x%lx -> 0x%lx (len: %lu)\n",
+				   src, dest, size);
+		return;
+	}
+
+	while (size > 0) {
+		n = min(size, (unsigned long)SMP_DMA_COPY_CHUNK);
+		if (n >= SMP_DMA_NT_THRESHOLD) {
+			smp_ihk_arch_dma_copy(phys_to_virt(dest),
+					      phys_to_virt(src), n);
+		} else {
+			memcpy(phys_to_virt(dest), phys_to_virt(src), n);
+		}
+
+		dest += n;
+		src += n;
+		size -= n;
+		cond_resched();
+	}
+}
+
+static void smp_dma_copy_sg(unsigned long segs_phys, unsigned long nr_segs)
+{
+	struct ihk_dma_segment *segs;
+	unsigned long i;
+
+	if (nr_segs > ULONG_MAX / sizeof(*segs) ||
+	    !smp_dma_phys_valid(segs_phys, nr_segs * sizeof(*segs))) {
+		printk_ratelimited(KERN_ERR "IHK-SMP: DMA: invalid segment array 0x%lx (nr: %lu)\n",
+				   segs_phys, nr_segs);
+		return;
+	}
+
+	segs = phys_to_virt(segs_phys);
+	for (i = 0; i < nr_segs; i++) {
+		smp_dma_copy(segs[i].dest_phys, segs[i].src_phys,
+			     segs[i].size);
+	}
+}
+
+/* Mark the LWK CPU to interrupt once the current pass is over */
+static void smp_dma_interrupt_lwk(struct smp_dma_ring *ring, int hw_id,
+				  unsigned long *intr_cpus)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < ring->os->cpu_info.n_cpus; cpu++) {
+		if (ring->os->cpu_info.hw_ids[cpu] == hw_id) {
+			__set_bit(cpu, intr_cpus);
+			return;
+		}
+	}
+}
+
+static void smp_dma_process_desc(struct smp_dma_ring *ring,
+				 struct smp_dma_desc *desc,
+				 unsigned long *intr_cpus)
+{
+	unsigned long notify;
+
+	switch (desc->type) {
+	case SMP_DMA_DESC_TYPE_COPY:
+		smp_dma_copy((unsigned long)desc->param3,
+			     (unsigned long)desc->param2, desc->param4);
+		break;
+
+	case SMP_DMA_DESC_TYPE_SG:
+		smp_dma_copy_sg((unsigned long)desc->param2, desc->param4);
+		break;
+
+	case SMP_DMA_DESC_TYPE_NOTIFY:
+		/* Make the copied data visible before the completion */
+		wmb();
+		if (ring->ihk_os &&
+		    (desc->param1 & SMP_DMA_DESC_PARAM1_INTR)) {
+			smp_dma_interrupt_lwk(ring, desc->param1 & 0xffff,
+					      intr_cpus);
+			break;
+		}
+
+		notify = (unsigned long)desc->param2;
+		if (!smp_dma_phys_valid(notify, sizeof(unsigned long))) {
+			printk_ratelimited(KERN_ERR "IHK-SMP: DMA: invalid notify address 0x%lx\n",
+					   notify);
+			break;
+		}
+		WRITE_ONCE(*(unsigned long *)phys_to_virt(notify),
+			   desc->param4);
+		break;
+
+	case SMP_DMA_DESC_TYPE_CALLBACK:
+		/* Function pointers are accepted from Linux only */
+		if (ring->ihk_os) {
+			break;
+		}
+		wmb();
+		((void (*)(void *))desc->param2)(desc->param3);
+		break;
+
+	default:
+		printk_ratelimited(KERN_ERR "IHK-SMP: DMA: unknown descriptor type %d\n",
+				   desc->type);
+		break;
+	}
+}
+
+/** \brief Process the descriptors submitted to a channel so far
+ *
+ * Completion interrupts are coalesced into one per LWK CPU.
+ * Returns the number of descriptors processed. */
+static int smp_dma_process_channel(struct smp_dma_ring *ring, int channel)
+{
+	struct smp_dma_channel *c = &ring->config->channels[channel];
+	DECLARE_BITMAP(intr_cpus, SMP_MAX_CPUS);
+	unsigned long head, tail;
+	int nr_processed = 0;
+	int cpu;
+
+	if (test_bit(channel, ring->dead) ||
+	    READ_ONCE(c->head) == ring->tail[channel]) {
+		return 0;
+	}
+
+	/* Another thread is on it */
+	if (!mutex_trylock(&ring->consumer_lock[channel])) {
+		return 0;
+	}
+
+	bitmap_zero(intr_cpus, SMP_MAX_CPUS);
+	head = READ_ONCE(c->head);
+	/* Pairs with the barrier of the submitter before the head */
+	smp_rmb();
+
+	if (head >= ring->len[channel]) {
+		pr_err("IHK-SMP: DMA: invalid head %lu of channel %d, disabling it\n",
+		       head, channel);
+		set_bit(channel, ring->dead);
+		mutex_unlock(&ring->consumer_lock[channel]);
+		return 0;
+	}
+
+	tail = ring->tail[channel];
+	while (tail != head) {
+		smp_dma_process_desc(ring, ring->desc[channel] + tail,
+				     intr_cpus);
+
+		if (++tail >= ring->len[channel]) {
+			tail = 0;
+		}
+
+		/* Free the slot only once the descriptor is consumed */
+		smp_mb();
+		ring->tail[channel] = tail;
+		WRITE_ONCE(c->tail, tail);
+		++nr_processed;
+	}
+
+	mutex_unlock(&ring->consumer_lock[channel]);
+
+	for_each_set_bit(cpu, intr_cpus, SMP_MAX_CPUS) {
+		ihk_os_issue_interrupt(ring->ihk_os, cpu, SMP_DMA_LWK_VECTOR);
+	}
+
+	return nr_processed;
+}
+
+/** \brief Process the channels local or remote to a NUMA node
+ *
+ * Every channel is local to a thread not bound to a NUMA node. */
+static int smp_dma_process_rings(int node, int local)
+{
+	struct smp_dma_ring *ring;
+	int nr_processed = 0;
+	int i;
+
+	down_read(&smp_dma_rings_sem);
+	list_for_each_entry(ring, &smp_dma_rings, list) {
+		if (local) {
+			ring->config->doorbell = 0;
+		}
+
+		for (i = 0; i < ring->nr_channels; i++) {
+			if ((node == NUMA_NO_NODE ||
+			     ring->node[i] == NUMA_NO_NODE ||
+			     ring->node[i] == node) != local) {
+				continue;
+			}
+			nr_processed += smp_dma_process_channel(ring, i);
+		}
+	}
+	up_read(&smp_dma_rings_sem);
+
+	return nr_processed;
+}
+
+static int smp_dma_thread(void *arg)
+{
+	int node = (long)arg;
+	ktime_t timeout;
+	unsigned int poll_us = ihk_dma_poll_us;
+	int nr_processed;
+
+	while (!kthread_should_stop()) {
+		/* Help with the other nodes' channels when idle */
+		nr_processed = smp_dma_process_rings(node, 1);
+		if (!nr_processed) {
+			nr_processed = smp_dma_process_rings(node, 0);
+		}
+
+		if (nr_processed) {
+			poll_us = ihk_dma_poll_us;
+			cond_resched();
+			continue;
+		}
+
+		/* Idle, woken up early by host requests */
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (kthread_should_stop()) {
+			break;
+		}
+
+		/* Only the LWKs need to be polled */
+		if (!atomic_read(&smp_dma_nr_os_rings)) {
+			poll_us = ihk_dma_poll_us;
+			schedule();
+			continue;
+		}
+
+		timeout = ktime_set(0, (u64)poll_us * NSEC_PER_USEC);
+		schedule_hrtimeout_range(&timeout, (u64)poll_us *
+					 NSEC_PER_USEC / 2, HRTIMER_MODE_REL);
+		poll_us = min(poll_us * 2,
+			      max(ihk_dma_poll_max_us, ihk_dma_poll_us));
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+static struct smp_dma_ring *smp_dma_ring_alloc(ihk_os_t ihk_os,
+					       struct smp_os_data *os,
+					       int nr_channels)
+{
+	struct smp_dma_ring *ring;
+	struct smp_dma_channel *c;
+	struct page *desc_page;
+	int i;
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring) {
+		return NULL;
+	}
+
+	ring->config = (void *)get_zeroed_page(GFP_KERNEL);
+	if (!ring->config) {
+		goto fail;
+	}
+
+	ring->nr_channels = nr_channels;
+	for (i = 0; i < nr_channels; i++) {
+		c = &ring->config->channels[i];
+
+		/* Channel i serves the LWK NUMA node i % nr_numa_nodes */
+		ring->node[i] = os && os->nr_numa_nodes ?
+			os->numa_mapping[i % os->nr_numa_nodes] : NUMA_NO_NODE;
+
+		/* The LWK maps exactly one page of descriptors */
+		desc_page = alloc_pages_node(ring->node[i] == NUMA_NO_NODE ?
+					     numa_node_id() : ring->node[i],
+					     GFP_KERNEL | __GFP_ZERO, 0);
+		if (!desc_page) {
+			goto fail;
+		}
+		c->desc_ptr = page_to_phys(desc_page);
+		c->len = PAGE_SIZE / sizeof(struct smp_dma_desc);
+		c->head = c->tail = 0;
+
+		ring->desc[i] = page_address(desc_page);
+		ring->len[i] = c->len;
+		ring->tail[i] = 0;
+
+		mutex_init(&ring->consumer_lock[i]);
+	}
+
+	spin_lock_init(&ring->submit_lock);
+	ring->ihk_os = ihk_os;
+	ring->os = os;
+	ring->config->status = 1;
+
+	down_write(&smp_dma_rings_sem);
+	list_add_tail(&ring->list, &smp_dma_rings);
+	up_write(&smp_dma_rings_sem);
+
+	return ring;
+
+fail:
+	for (i = 0; i < nr_channels; i++) {
+		if (ring->desc[i]) {
+			free_page((unsigned long)ring->desc[i]);
+		}
+	}
+	if (ring->config) {
+		free_page((unsigned long)ring->config);
+	}
+	kfree(ring);
+	return NULL;
+}
+
+static void smp_dma_ring_free(struct smp_dma_ring *ring)
+{
+	int i;
+
+	/* Wait for the threads to be done with it */
+	down_write(&smp_dma_rings_sem);
+	list_del(&ring->list);
+	up_write(&smp_dma_rings_sem);
+
+	for (i = 0; i < ring->nr_channels; i++) {
+		free_page((unsigned long)ring->desc[i]);
+	}
+	free_page((unsigned long)ring->config);
+	kfree(ring);
+}
+
+/* Number of descriptors signaling the completion of a request */
+static inline int smp_dma_nr_completion_desc(struct ihk_dma_request *req)
+{
+	return (req->callback || req->notify) ? 1 : 0;
+}
+
+static unsigned long smp_dma_put_completion(struct smp_dma_channel *c,
+					    struct smp_dma_desc *desc_head,
+					    unsigned long h,
+					    struct ihk_dma_request *req)
+{
+	struct smp_dma_desc *desc = desc_head + h;
+
+	if (!smp_dma_nr_completion_desc(req)) {
+		return h;
+	}
+
+	desc->param1 = 0;
+	if (req->callback) {
+		desc->type = SMP_DMA_DESC_TYPE_CALLBACK;
+		desc->param2 = (void *)req->callback;
+		desc->param3 = req->priv;
+	} else {
+		desc->type = SMP_DMA_DESC_TYPE_NOTIFY;
+		desc->param2 = (void *)req->notify;
+		desc->param4 = (unsigned long)req->priv;
+	}
+
+	return __next(c, h);
+}
+
+static struct smp_dma_channel *smp_dma_lock_host_channel(
+		ihk_dma_channel_t ihk_ch, int ndesc, unsigned long *flags)
+{
+	struct smp_dma_ring *ring = smp_dma_host_ring;
+	struct smp_dma_channel *c;
+
+	if (!ring || ihk_ch->channel < 0 ||
+	    ihk_ch->channel >= SMP_DMA_CHANNELS) {
+		return ERR_PTR(-EINVAL);
+	}
+
+	c = &ring->config->channels[ihk_ch->channel];
+	if (ndesc >= c->len) {
+		return ERR_PTR(-EINVAL);
+	}
+
+	spin_lock_irqsave(&ring->submit_lock, *flags);
+
+	if (!__smp_dma_check_room(c, ndesc)) {
+		spin_unlock_irqrestore(&ring->submit_lock, *flags);
+		return ERR_PTR(-EBUSY);
+	}
+
+	return c;
+}
+
+static void smp_dma_unlock_host_channel(struct smp_dma_channel *c,
+					unsigned long h, unsigned long flags)
+{
+	/* Publish the descriptors before the new head */
+	smp_wmb();
+	WRITE_ONCE(c->head, h);
+	spin_unlock_irqrestore(&smp_dma_host_ring->submit_lock, flags);
+
+	smp_dma_kick();
+}
+
+/** \brief Implementation of ihk_dma_request_batch()
+ *
+ * All the requests are submitted under one lock acquisition and one
+ * wake-up of the engine, or none of them when the ring is full. */
+static int smp_dma_request_batch(ihk_dma_channel_t ihk_ch,
+				 struct ihk_dma_request *reqs, int nr_reqs)
+{
+	struct smp_dma_channel *c;
+	struct smp_dma_desc *desc, *desc_head;
+	unsigned long flags;
+	unsigned long h;
+	int ndesc = 0;
+	int i;
+
+	for (i = 0; i < nr_reqs; i++) {
+		if (!smp_dma_phys_valid(reqs[i].src_phys, reqs[i].size) ||
+		    !smp_dma_phys_valid(reqs[i].dest_phys, reqs[i].size)) {
+			return -EINVAL;
+		}
+		ndesc += 1 + smp_dma_nr_completion_desc(&reqs[i]);
+	}
+
+	c = smp_dma_lock_host_channel(ihk_ch, ndesc, &flags);
+	if (IS_ERR(c)) {
+		return PTR_ERR(c);
+	}
+
+	h = c->head;
+	desc_head = phys_to_virt(c->desc_ptr);
+
+	for (i = 0; i < nr_reqs; i++) {
+		desc = desc_head + h;
+		desc->type = SMP_DMA_DESC_TYPE_COPY;
+		desc->param1 = 0;
+		desc->param2 = (void *)reqs[i].src_phys;
+		desc->param3 = (void *)reqs[i].dest_phys;
+		desc->param4 = reqs[i].size;
+		h = __next(c, h);
+
+		h = smp_dma_put_completion(c, desc_head, h, &reqs[i]);
+	}
+
+	smp_dma_unlock_host_channel(c, h, flags);
+
+	return 0;
+}
+
+/** \brief Implementation of ihk_dma_request() */
+static int smp_dma_request(ihk_dma_channel_t ihk_ch,
+			   struct ihk_dma_request *req)
+{
+	return smp_dma_request_batch(ihk_ch, req, 1);
+}
+
+/** \brief Implementation of ihk_dma_request_sg() */
+static int smp_dma_request_sg(ihk_dma_channel_t ihk_ch,
+			      struct ihk_dma_segment *segs, int nr_segs,
+			      struct ihk_dma_request *req)
+{
+	struct smp_dma_channel *c;
+	struct smp_dma_desc *desc, *desc_head;
+	unsigned long flags;
+	unsigned long h;
+	int i;
+
+	if (nr_segs <= 0 || !virt_addr_valid(segs) ||
+	    !virt_addr_valid((char *)(segs + nr_segs) - 1)) {
+		return -EINVAL;
+	}
+
+	for (i = 0; i < nr_segs; i++) {
+		if (!smp_dma_phys_valid(segs[i].src_phys, segs[i].size) ||
+		    !smp_dma_phys_valid(segs[i].dest_phys, segs[i].size)) {
+			return -EINVAL;
+		}
+	}
+
+	c = smp_dma_lock_host_channel(ihk_ch,
+				      1 + smp_dma_nr_completion_desc(req),
+				      &flags);
+	if (IS_ERR(c)) {
+		return PTR_ERR(c);
+	}
+
+	h = c->head;
+	desc_head = phys_to_virt(c->desc_ptr);
+
+	desc = desc_head + h;
+	desc->type = SMP_DMA_DESC_TYPE_SG;
+	desc->param1 = 0;
+	desc->param2 = (void *)virt_to_phys(segs);
+	desc->param4 = nr_segs;
+	h = __next(c, h);
+
+	h = smp_dma_put_completion(c, desc_head, h, req);
+
+	smp_dma_unlock_host_channel(c, h, flags);
+
+	return 0;
+}
+
+static void smp_dma_get_info(ihk_dma_channel_t ihk_ch,
+			     struct ihk_dma_channel_info *info)
+{
+	info->status = smp_dma_host_ring ? 1 : 0;
+	info->min_size = 1;
+	info->max_size = ULONG_MAX;
+}
+
+static struct ihk_dma_ops smp_dma_ops = {
+	.request = smp_dma_request,
+	.get_info = smp_dma_get_info,
+	.request_batch = smp_dma_request_batch,
+	.request_sg = smp_dma_request_sg,
+};
+
+/** \brief Implementation of ihk_host_get_dma_channel */
+ihk_dma_channel_t smp_dma_get_channel(ihk_device_t dev, void *priv,
+				      struct ihk_dma_channel *channels,
+				      int channel)
+{
+	if (!smp_dma_host_ring || channel < 0 ||
+	    channel >= SMP_DMA_CHANNELS) {
+		return NULL;
+	}
+
+	channels[channel].dev = dev;
+	channels[channel].priv = priv;
+	channels[channel].channel = channel;
+	channels[channel].ops = &smp_dma_ops;
+
+	return &channels[channel];
+}
+
+/** \brief Set up the rings the LWK submits its requests to */
+int smp_dma_os_init(ihk_os_t ihk_os, struct smp_os_data *os)
+{
+	int nr_channels = ihk_dma_channels ? : os->nr_numa_nodes;
+
+	/* Left over by a failed boot */
+	smp_dma_os_exit(os);
+
+	nr_channels = clamp(nr_channels, 1, SMP_DMA_MAX_CHANNELS);
+	os->dma_ring = smp_dma_ring_alloc(ihk_os, os, nr_channels);
+	if (!os->dma_ring) {
+		return -ENOMEM;
+	}
+
+	os->param->dma_address = virt_to_phys(os->dma_ring->config);
+	os->param->dma_nr_channels = nr_channels;
+
+	/* Start polling */
+	atomic_inc(&smp_dma_nr_os_rings);
+	smp_dma_kick();
+
+	return 0;
+}
+
+/** \brief Tear down the rings of an OS whose CPUs have been reset
+ *
+ * In-flight copies to or from its memory are completed on return. */
+void smp_dma_os_exit(struct smp_os_data *os)
+{
+	if (!os->dma_ring) {
+		return;
+	}
+
+	smp_dma_ring_free(os->dma_ring);
+	os->dma_ring = NULL;
+	atomic_dec(&smp_dma_nr_os_rings);
+}
+
+int smp_dma_init(void)
+{
+	cpumask_var_t cpus;
+	struct task_struct *thread;
+	int cpu;
+	int ret = 0;
+
+	if (!zalloc_cpumask_var(&cpus, GFP_KERNEL)) {
+		return -ENOMEM;
+	}
+
+	if (ihk_dma_cpus && *ihk_dma_cpus) {
+		ret = cpulist_parse(ihk_dma_cpus, cpus);
+		if (ret) {
+			eprintk("%s: error: invalid ihk_dma_cpus: %s\n",
+				__func__, ihk_dma_cpus);
+			goto out;
+		}
+		cpumask_and(cpus, cpus, cpu_online_mask);
+	}
+
+	smp_dma_host_ring = smp_dma_ring_alloc(NULL, NULL, SMP_DMA_CHANNELS);
+	if (!smp_dma_host_ring) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	smp_dma_threads = kcalloc(max_t(unsigned int, cpumask_weight(cpus), 1),
+				  sizeof(*smp_dma_threads), GFP_KERNEL);
+	if (!smp_dma_threads) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (cpumask_empty(cpus)) {
+		thread = kthread_run(smp_dma_thread, (void *)(long)NUMA_NO_NODE,
+				     "ihk_dma");
+		if (IS_ERR(thread)) {
+			ret = PTR_ERR(thread);
+			goto out;
+		}
+		smp_dma_threads[smp_dma_nr_threads++] = thread;
+	}
+
+	for_each_cpu(cpu, cpus) {
+		thread = kthread_create_on_node(smp_dma_thread,
+						(void *)(long)cpu_to_node(cpu),
+						cpu_to_node(cpu),
+						"ihk_dma/%d", cpu);
+		if (IS_ERR(thread)) {
+			ret = PTR_ERR(thread);
+			goto out;
+		}
+		kthread_bind(thread, cpu);
+		wake_up_process(thread);
+		smp_dma_threads[smp_dma_nr_threads++] = thread;
+	}
+
+	printk(KERN_INFO "IHK-SMP: software DMA engine: %d thread(s)\n",
+	       smp_dma_nr_threads);
+
+out:
+	free_cpumask_var(cpus);
+	if (ret) {
+		smp_dma_exit();
+	}
+	return ret;
+}
+
+void smp_dma_exit(void)
+{
+	int i;
+
+	for (i = 0; i < smp_dma_nr_threads; i++) {
+		kthread_stop(smp_dma_threads[i]);
+	}
+	smp_dma_nr_threads = 0;
+	kfree(smp_dma_threads);
+	smp_dma_threads = NULL;
+
+	if (smp_dma_host_ring) {
+		/* Complete what has been submitted */
+		for (i = 0; i < SMP_DMA_CHANNELS; i++) {
+			smp_dma_process_channel(smp_dma_host_ring, i);
+		}
+		smp_dma_ring_free(smp_dma_host_ring);
+		smp_dma_host_ring = NULL;
+	}
+}
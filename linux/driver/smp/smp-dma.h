@@ -0,0 +1,109 @@
+/**
+ * \file smp-dma.h
+ * \brief
+ *	IHK SMP Driver: Software DMA engine
+ *
+ * The descriptor rings follow the layout of
+ * cokernel/smp/<arch>/builtin_dma.h, i.e. the one ihk_mc_dma_request()
+ * of the LWK writes to.
+ */
+#ifndef HEADER_SMP_SMP_DMA_H
+#define HEADER_SMP_SMP_DMA_H
+
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <ihk/ihk_host_driver.h>
+
+/* MEMCPY: param2 (src), param3 (dest), param4 (len) */
+#define SMP_DMA_DESC_TYPE_COPY		1
+/* NOTIFY: param2 (notify), param4 (value) or param1 (INTR | hw_id) */
+#define SMP_DMA_DESC_TYPE_NOTIFY	2
+/* CALLBACK: param2 (callback), param3 (priv), host ring only */
+#define SMP_DMA_DESC_TYPE_CALLBACK	3
+/* SG: param2 (array of struct ihk_dma_segment), param4 (nr of segments) */
+#define SMP_DMA_DESC_TYPE_SG		4
+
+#define SMP_DMA_DESC_PARAM1_INTR	0x10000000
+
+/* Channels of the host ring */
+#define SMP_DMA_CHANNELS		2
+/* Upper bound of the channels of an OS ring, the config fits in a page */
+#define SMP_DMA_MAX_CHANNELS		64
+
+/* Copies are split into chunks of this size to reschedule in between */
+#define SMP_DMA_COPY_CHUNK		(1024 * 1024)
+/* Copies at least this large bypass the cache */
+#define SMP_DMA_NT_THRESHOLD		(256 * 1024)
+
+/* Vector used to notify the LWK of a completion, same as IKC */
+#if defined(__aarch64__)
+#define SMP_DMA_LWK_VECTOR		0x01
+#else
+#define SMP_DMA_LWK_VECTOR		0xd1
+#endif
+
+struct smp_dma_desc {
+	int type;
+	int param1;
+	void *param2;
+	void *param3;
+	unsigned long param4;
+};
+
+struct smp_dma_channel {
+	/** \brief Physical address of the descriptor ring */
+	unsigned long desc_ptr;
+	/** \brief Number of descriptors in the ring */
+	unsigned long len;
+	/** \brief Head (writer) index in the descriptor ring */
+	unsigned long head;
+	/** \brief Tail (reader) index in the descriptor ring */
+	unsigned long tail;
+	/** \brief ihk_spinlock_t of the LWK, never touched by Linux */
+	int lock;
+};
+
+struct smp_dma_config {
+	struct smp_dma_channel channels[SMP_DMA_MAX_CHANNELS];
+	unsigned long doorbell;
+	unsigned long status;
+};
+
+struct smp_os_data;
+
+/** \brief Linux-side state of a set of descriptor rings
+ *
+ * There is one for the host (ihk_dma_request()) and one per booted OS.
+ */
+struct smp_dma_ring {
+	struct list_head list;
+	struct smp_dma_config *config;
+	/** \brief NULL for the host ring */
+	ihk_os_t ihk_os;
+	struct smp_os_data *os;
+	int nr_channels;
+	/** \brief Linux NUMA node the descriptors of a channel reside on */
+	int node[SMP_DMA_MAX_CHANNELS];
+	/** \brief Serializes the engine threads on a channel */
+	struct mutex consumer_lock[SMP_DMA_MAX_CHANNELS];
+	/** \brief Serializes the submitters on the host ring */
+	spinlock_t submit_lock;
+	/** \brief Copies of the ring geometry and of the tail kept out of
+	 *  reach of the LWK, which can write the config page */
+	struct smp_dma_desc *desc[SMP_DMA_MAX_CHANNELS];
+	unsigned long len[SMP_DMA_MAX_CHANNELS];
+	unsigned long tail[SMP_DMA_MAX_CHANNELS];
+	/** \brief Channels given up on after an invalid head */
+	DECLARE_BITMAP(dead, SMP_DMA_MAX_CHANNELS);
+};
+
+int smp_dma_init(void);
+void smp_dma_exit(void);
+int smp_dma_os_init(ihk_os_t ihk_os, struct smp_os_data *os);
+void smp_dma_os_exit(struct smp_os_data *os);
+ihk_dma_channel_t smp_dma_get_channel(ihk_device_t dev, void *priv,
+				      struct ihk_dma_channel *channels,
+				      int channel);
+
+#endif /* HEADER_SMP_SMP_DMA_H */
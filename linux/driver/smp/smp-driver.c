@@ -51,6 +51,7 @@
 #include "smp-driver.h"
 #include "smp-arch-driver.h"
 #include "smp-defines-driver.h"
+#include "smp-dma.h"
 
 /** Get the index in the map array */
 #define MAP_INDEX(n)    ((n) >> 6)
@@ -79,6 +80,10 @@ static unsigned int ihk_cores = 0;
 module_param(ihk_cores, uint, 0644);
 MODULE_PARM_DESC(ihk_cores, "IHK reserved CPU cores");
 
+static unsigned int ihk_ikc_balance_interval = 0;
+module_param(ihk_ikc_balance_interval, uint, 0644);
+MODULE_PARM_DESC(ihk_ikc_balance_interval, "Interval in ms of moving LWK CPUs off the Linux CPUs busiest with IKC, 0 to disable");
+
 //#define BUILTIN_COM_VECTOR	0xf1
 
 #define BUILTIN_DEV_STATUS_READY	0
@@ -132,7 +137,7 @@ struct builtin_device_data {
 	ihk_device_t ihk_dev;
 	int status;
 
-	struct ihk_dma_channel builtin_host_channel;
+	struct ihk_dma_channel dma_channels[SMP_DMA_CHANNELS];
 };
 
 /* Chunk denotes a memory range that is pre-reserved by IHK-SMP.
@@ -196,11 +201,22 @@ void ihk_smp_unmap_virtual(void *virt)
 
 /** \brief Implementation of ihk_host_get_dma_channel.
  *
- * It returns the information of the only channel in the DMA emulating core. */
+ * It returns a channel of the software DMA engine. */
 static ihk_dma_channel_t smp_ihk_get_dma_channel(ihk_device_t dev, void *priv,
                                                  int channel)
 {
-	return NULL;
+	struct builtin_device_data *data = priv;
+
+	return smp_dma_get_channel(dev, priv, data->dma_channels, channel);
+}
+
+static int smp_ihk_get_dma_info(ihk_device_t dev, void *priv,
+                                struct ihk_dma_info *info)
+{
+	info->num_channels = SMP_DMA_CHANNELS;
+	info->align = 1;
+
+	return 0;
 }
 
 /** \brief Set the status member of the OS data with lock */
@@ -602,9 +618,17 @@ bp_cpu->numa_id = linux_numa_2_lwk_numa(os,
 	        sizeof(os->param->kernel_args));
 
 	os->param->msg_buffer = virt_to_phys(ihk_core_os->kmsg_buf_container->kmsg_buf);
-	os->param->msg_buffer_size = sizeof(struct ihk_kmsg_buf); /* Note that it's used for map_fixed_area */
+	os->param->msg_buffer_size = IHK_KMSG_BUF_SIZE(ihk_core_os->kmsg_buf_container->kmsg_buf->nr_records); /* Note that it's used for map_fixed_area */
+	os->param->msg_buffer_version = IHK_KMSG_VERSION;
 	dprintk("%s: msg_buffer=%lx,size=%ld\n", __FUNCTION__, os->param->msg_buffer, os->param->msg_buffer_size);
 
+	if (smp_dma_os_init(ihk_os, os)) {
+		printk("IHK-SMP: error: allocating DMA rings\n");
+		set_os_status(os, BUILTIN_OS_STATUS_LOADED);
+		set_dev_status(dev, BUILTIN_DEV_STATUS_READY);
+		return -ENOMEM;
+	}
+
 	os->param->ns_per_tsc = calc_ns_per_tsc();
 	getnstimeofday(&now);
 	os->param->boot_tsc = rdtsc();
@@ -684,7 +708,14 @@ bp_cpu->numa_id = linux_numa_2_lwk_numa(os,
 		(unsigned long)ihk_os);
 	udelay(300);
 
-	return smp_wakeup_secondary_cpu(os->boot_cpu, trampoline_phys);
+	ret = smp_wakeup_secondary_cpu(os->boot_cpu, trampoline_phys);
+	if (!ret && ihk_ikc_balance_interval) {
+		memset(os->ikc_balance_time, 0, sizeof(os->ikc_balance_time));
+		schedule_delayed_work(&os->ikc_balance_work,
+			msecs_to_jiffies(ihk_ikc_balance_interval));
+	}
+
+	return ret;
 	
 	/* Never reach these.. */
 	linux_numa_2_lwk_numa(os, 0);
@@ -736,6 +767,43 @@ static int smp_ihk_os_map_lwk(unsigned long phys)
 	return 0;
 }
 
+/* Keep the image and the startup page as loaded for a reboot */
+static void smp_ihk_os_cache_image(struct smp_os_data *os,
+				   unsigned long phys, unsigned long end)
+{
+	void *virt;
+
+	vfree(os->image_cache);
+	os->image_phys = phys;
+	os->image_size = end - phys;
+	os->image_cache = vmalloc(os->image_size + PAGE_SIZE);
+	if (!os->image_cache) {
+		pr_warn("%s: WARNING: no copy of the image, reboot disabled\n",
+			__func__);
+		return;
+	}
+
+	virt = ihk_smp_map_virtual(phys, os->image_size);
+	if (!virt) {
+		vfree(os->image_cache);
+		os->image_cache = NULL;
+		return;
+	}
+	memcpy(os->image_cache, virt, os->image_size);
+	ihk_smp_unmap_virtual(virt);
+
+	virt = ihk_smp_map_virtual(os->boot_rip, PAGE_SIZE);
+	if (!virt) {
+		pr_warn("%s: WARNING: startup page not mapped, reboot disabled\n",
+			__func__);
+		vfree(os->image_cache);
+		os->image_cache = NULL;
+		return;
+	}
+	memcpy(os->image_cache + os->image_size, virt, PAGE_SIZE);
+	ihk_smp_unmap_virtual(virt);
+}
+
 static int smp_ihk_os_load_file(ihk_os_t ihk_os, void *priv, const char *fn)
 {
 	int ret;
@@ -938,6 +1006,8 @@ static int smp_ihk_os_load_file(ihk_os_t ihk_os, void *priv, const char *fn)
 		return ret;
 	}
 
+	smp_ihk_os_cache_image(os, phys, maxoffset);
+
 	set_os_status(os, BUILTIN_OS_STATUS_INITIAL);
 
 	dump_bootstrap_mem_start = os->bootstrap_mem_start;
@@ -1036,6 +1106,45 @@ static void add_free_mem_chunk(struct chunk *chunk)
 	        chunk->addr, chunk->addr + chunk->size);
 }
 
+static int cmp_mem_chunks(void *priv, struct list_head *a,
+			  struct list_head *b)
+{
+	struct chunk *chunk_a = list_entry(a, struct chunk, chain);
+	struct chunk *chunk_b = list_entry(b, struct chunk, chain);
+
+	if (chunk_a->addr < chunk_b->addr)
+		return -1;
+	if (chunk_a->addr == chunk_b->addr)
+		return 0;
+	return 1;
+}
+
+/* Add many chunks at once: sort them then merge them into the free
+ * list in a single pass over it, instead of one pass per chunk */
+static void add_free_mem_chunks(struct list_head *chunks)
+{
+	struct list_head *pos = ihk_mem_free_chunks.next;
+	struct chunk *chunk;
+
+	list_sort(NULL, chunks, &cmp_mem_chunks);
+
+	while (!list_empty(chunks)) {
+		chunk = list_first_entry(chunks, struct chunk, chain);
+
+		while (pos != &ihk_mem_free_chunks &&
+		       list_entry(pos, struct chunk, chain)->addr <=
+		       chunk->addr) {
+			pos = pos->next;
+		}
+
+		/* In front of pos */
+		list_move_tail(&chunk->chain, pos);
+
+		dprintf("IHK-SMP: free mem chunk 0x%lx - 0x%lx added\n",
+		        chunk->addr, chunk->addr + chunk->size);
+	}
+}
+
 static void merge_mem_chunks(struct list_head *chunks)
 {
 	struct chunk *mem_chunk;
@@ -1096,6 +1205,33 @@ static int smp_ihk_os_unmap_lwk(void)
 	return 0;
 }
 
+/* Reset the CPU cores used by this OS, all at once if possible */
+static int smp_ihk_os_reset_cpus(ihk_os_t ihk_os)
+{
+	int i, ret = 0;
+	int *hw_ids;
+	int nr_hw_ids = 0;
+
+	hw_ids = kmalloc(sizeof(int) * SMP_MAX_CPUS, GFP_KERNEL);
+	for (i = 0; i < SMP_MAX_CPUS; ++i) {
+		if (ihk_smp_cpus[i].os != ihk_os)
+			continue;
+
+		if (hw_ids) {
+			hw_ids[nr_hw_ids++] = ihk_smp_cpus[i].hw_id;
+		} else {
+			ret = ihk_smp_reset_cpu(ihk_smp_cpus[i].hw_id);
+		}
+	}
+
+	if (hw_ids) {
+		ret = ihk_smp_reset_cpus(hw_ids, nr_hw_ids);
+		kfree(hw_ids);
+	}
+
+	return ret;
+}
+
 static int smp_ihk_os_shutdown(ihk_os_t ihk_os, void *priv, int flag)
 {
 	struct smp_os_data *os = priv;
@@ -1103,19 +1239,21 @@ static int smp_ihk_os_shutdown(ihk_os_t ihk_os, void *priv, int flag)
 	struct ihk_os_mem_chunk *os_mem_chunk = NULL;
 	struct ihk_os_mem_chunk *next_chunk = NULL;
 	struct chunk *mem_chunk;
+	LIST_HEAD(freed_chunks);
 
 	if(os->status == BUILTIN_OS_STATUS_SHUTDOWN) {
 		eprintk("%s,already down\n", __FUNCTION__);
 		return 0;
 	}
+	cancel_delayed_work_sync(&os->ikc_balance_work);
 	set_os_status(os, BUILTIN_OS_STATUS_SHUTDOWN);
 
 	/* Reset CPU cores used by this OS */
+	ret = smp_ihk_os_reset_cpus(ihk_os);
 	for (i = 0; i < SMP_MAX_CPUS; ++i) {
 		if (ihk_smp_cpus[i].os != ihk_os)
 			continue;
 
-		ret = ihk_smp_reset_cpu(ihk_smp_cpus[i].hw_id);
 		ihk_smp_cpus[i].status = IHK_SMP_CPU_AVAILABLE;
 		ihk_smp_cpus[i].os = (ihk_os_t)0;
 
@@ -1124,6 +1262,9 @@ static int smp_ihk_os_shutdown(ihk_os_t ihk_os, void *priv, int flag)
 	}
 	os->nr_cpus = 0;
 
+	/* Complete the copies to or from its memory */
+	smp_dma_os_exit(os);
+
 	if ((ret = smp_ihk_os_unmap_lwk())) {
 		printk("%s: ERROR: smp_ihk_os_unmap_lwk failed (%d)\n", __FUNCTION__, ret);
 	}
@@ -1153,10 +1294,11 @@ static int smp_ihk_os_shutdown(ihk_os_t ihk_os, void *priv, int flag)
 				mem_chunk->addr, mem_chunk->addr + mem_chunk->size,
 				mem_chunk->size);
 
-		add_free_mem_chunk(mem_chunk);
+		list_add_tail(&mem_chunk->chain, &freed_chunks);
 
 		kfree(os_mem_chunk);
 	}
+	add_free_mem_chunks(&freed_chunks);
 
 	if (os->numa_mapping) {
 		kfree(os->numa_mapping);
@@ -1167,11 +1309,202 @@ static int smp_ihk_os_shutdown(ihk_os_t ihk_os, void *priv, int flag)
 		free_pages((unsigned long)os->param, os->param_pages_order);
 	}
 
+	vfree(os->image_cache);
+	os->image_cache = NULL;
+
 	//kfree(os); /* done in destroy */
 
 	return ret;
 }
 
+#define IHK_SMP_SCRUB_PIECE	(1UL << 30)
+#define IHK_SMP_SCRUB_STEP	(2UL << 20)
+
+struct smp_scrub_work {
+	struct work_struct work;
+	char *virt;
+	unsigned long size;
+};
+
+static void smp_ihk_os_scrub_func(struct work_struct *work)
+{
+	struct smp_scrub_work *sw =
+		container_of(work, struct smp_scrub_work, work);
+	unsigned long done, len;
+
+	for (done = 0; done < sw->size; done += len) {
+		len = min_t(unsigned long, sw->size - done,
+			    IHK_SMP_SCRUB_STEP);
+		memset(sw->virt + done, 0, len);
+		smp_ihk_arch_dcache_flush(sw->virt + done, len);
+		cond_resched();
+	}
+}
+
+/* Clear the memory of this OS, pieces of each chunk in parallel on the
+ * Linux CPUs of its node */
+static int smp_ihk_os_scrub_mem(ihk_os_t ihk_os)
+{
+	struct ihk_os_mem_chunk *os_mem_chunk;
+	struct smp_scrub_work *works;
+	const struct cpumask *node_cpus;
+	unsigned long off;
+	int nr = 0, i, cpu;
+
+	list_for_each_entry(os_mem_chunk, &ihk_mem_used_chunks, list) {
+		if (os_mem_chunk->os == ihk_os) {
+			nr += DIV_ROUND_UP(os_mem_chunk->size,
+					   IHK_SMP_SCRUB_PIECE);
+		}
+	}
+
+	works = kcalloc(nr, sizeof(*works), GFP_KERNEL);
+	if (!works) {
+		return -ENOMEM;
+	}
+
+	i = 0;
+	list_for_each_entry(os_mem_chunk, &ihk_mem_used_chunks, list) {
+		if (os_mem_chunk->os != ihk_os) {
+			continue;
+		}
+
+		node_cpus = cpumask_of_node(os_mem_chunk->numa_id);
+		cpu = -1;
+		for (off = 0; off < os_mem_chunk->size;
+		     off += IHK_SMP_SCRUB_PIECE, i++) {
+			cpu = cpumask_next_and(cpu, node_cpus, cpu_online_mask);
+			if (cpu >= nr_cpu_ids) {
+				cpu = cpumask_first_and(node_cpus,
+							cpu_online_mask);
+			}
+			if (cpu >= nr_cpu_ids) {
+				cpu = cpumask_any(cpu_online_mask);
+			}
+
+			INIT_WORK(&works[i].work, smp_ihk_os_scrub_func);
+			works[i].virt = phys_to_virt(os_mem_chunk->addr) + off;
+			works[i].size = min_t(unsigned long,
+					      os_mem_chunk->size - off,
+					      IHK_SMP_SCRUB_PIECE);
+			queue_work_on(cpu, system_unbound_wq, &works[i].work);
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		flush_work(&works[i].work);
+	}
+	kfree(works);
+
+	return 0;
+}
+
+/* The checks of smp_ihk_os_reboot(), before Linux tears anything down */
+static int smp_ihk_os_reboot_prepare(ihk_os_t ihk_os, void *priv)
+{
+	struct smp_os_data *os = priv;
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&os->lock, flags);
+	if (os->status != BUILTIN_OS_STATUS_BOOTING &&
+	    os->status != BUILTIN_OS_STATUS_HUNGUP) {
+		ret = -EBUSY;
+	} else if (!os->image_cache ||
+		   !ihk_smp_map_virtual(os->image_phys, os->image_size) ||
+		   !ihk_smp_map_virtual(os->boot_rip, PAGE_SIZE)) {
+		ret = -ENOENT;
+	}
+	spin_unlock_irqrestore(&os->lock, flags);
+
+	return ret;
+}
+
+/*
+ * Restart a booted kernel on the CPUs and memory it was given: reset
+ * its CPUs, put back the image as loaded and boot it again. The boot
+ * parameter is built again as the kernel writes into it. On failure
+ * the OS instance is left HUNGUP so that a shutdown releases its
+ * resources.
+ */
+static int smp_ihk_os_reboot(ihk_os_t ihk_os, void *priv, int flag)
+{
+	struct smp_os_data *os = priv;
+	unsigned long flags;
+	void *image, *startup;
+	int ret;
+
+	spin_lock_irqsave(&os->lock, flags);
+	if (os->status != BUILTIN_OS_STATUS_BOOTING &&
+	    os->status != BUILTIN_OS_STATUS_HUNGUP) {
+		spin_unlock_irqrestore(&os->lock, flags);
+		return -EBUSY;
+	}
+
+	image = NULL;
+	startup = NULL;
+	if (os->image_cache) {
+		image = ihk_smp_map_virtual(os->image_phys, os->image_size);
+		startup = ihk_smp_map_virtual(os->boot_rip, PAGE_SIZE);
+	}
+	if (!image || !startup) {
+		/* Linux has already let go of it */
+		os->status = BUILTIN_OS_STATUS_HUNGUP;
+		spin_unlock_irqrestore(&os->lock, flags);
+		return -ENOENT;
+	}
+	os->status = BUILTIN_OS_STATUS_SHUTDOWN;
+	spin_unlock_irqrestore(&os->lock, flags);
+
+	cancel_delayed_work_sync(&os->ikc_balance_work);
+
+	ret = smp_ihk_os_reset_cpus(ihk_os);
+	if (ret) {
+		pr_err("%s: error: resetting CPUs (%d)\n", __func__, ret);
+		goto err;
+	}
+
+	/* Complete the copies to or from its memory */
+	smp_dma_os_exit(os);
+
+	if (flag & IHK_OS_REBOOT_SCRUB) {
+		ret = smp_ihk_os_scrub_mem(ihk_os);
+		if (ret) {
+			pr_err("%s: error: clearing memory (%d)\n",
+			       __func__, ret);
+			goto err;
+		}
+	}
+
+	memcpy(image, os->image_cache, os->image_size);
+	smp_ihk_arch_dcache_flush(image, os->image_size);
+	ihk_smp_unmap_virtual(image);
+
+	memcpy(startup, os->image_cache + os->image_size, PAGE_SIZE);
+	ihk_smp_unmap_virtual(startup);
+
+	/* Both are allocated again by smp_ihk_os_boot() */
+	if (os->param) {
+		free_pages((unsigned long)os->param, os->param_pages_order);
+		os->param = NULL;
+	}
+	kfree(os->numa_mapping);
+	os->numa_mapping = NULL;
+
+	set_os_status(os, BUILTIN_OS_STATUS_INITIAL);
+
+	ret = smp_ihk_os_boot(ihk_os, priv, 0);
+	if (ret) {
+		pr_err("%s: error: booting (%d)\n", __func__, ret);
+		goto err;
+	}
+
+	return 0;
+
+err:
+	set_os_status(os, BUILTIN_OS_STATUS_HUNGUP);
+	return ret;
+}
 
 static int smp_ihk_os_alloc_resource(ihk_os_t ihk_os, void *priv,
                                      struct ihk_resource *resource)
@@ -1460,6 +1793,28 @@ static int smp_ihk_os_get_special_addr(ihk_os_t ihk_os, void *priv,
 			return 0;
 		}
 		break;
+	case IHK_SPADDR_RUSAGE_SNAPSHOT:
+		if (os->param->rusage_snapshot) {
+			*addr = os->param->rusage_snapshot;
+			*size = os->param->rusage_snapshot_size;
+			return 0;
+		}
+		break;
+	case IHK_SPADDR_PERF_RING:
+		if (os->param->perf_ring) {
+			*addr = os->param->perf_ring;
+			*size = os->param->perf_ring_size;
+			return 0;
+		}
+		break;
+	case IHK_SPADDR_MIKC_QUEUES:
+		if (os->param->mikc_queues) {
+			*addr = os->param->mikc_queues;
+			*size = os->param->nr_mikc_queues *
+				sizeof(struct ihk_ikc_master_queue);
+			return 0;
+		}
+		break;
 	case IHK_SPADDR_MULTI_INTR_MODE:
 		if (os->param->multi_intr_mode_addr) {
 			*addr = os->param->multi_intr_mode_addr;
@@ -1832,6 +2187,145 @@ static int smp_ihk_os_get_num_cpus(ihk_os_t ihk_os, void *priv)
 	return os->nr_cpus;
 }
 
+static int ikc_map_distance(int lwk_cpu, int linux_cpu);
+
+/*
+ * Move the IKC interrupts of the LWK CPU on Linux CPU src of a running
+ * kernel to Linux CPU dst. The kernel acknowledges the switch before
+ * what was queued for the former target is drained. When it doesn't
+ * in time, the map still moves to dst and -ETIMEDOUT is returned.
+ * Called with ikc_map_lock held.
+ */
+static int smp_ihk_os_remap_ikc_cpu(struct smp_os_data *os, int src, int dst)
+{
+	struct ihk_smp_boot_param_cpu *bp_cpu;
+	int lwk_cpu, old_cpu, ret;
+
+	lwk_cpu = linux_cpu_2_lwk_cpu(os, src);
+	if (lwk_cpu < 0 || dst < 0 || dst >= SMP_MAX_CPUS || dst >= nr_cpu_ids ||
+	    ihk_smp_cpus[dst].status == IHK_SMP_CPU_ASSIGNED) {
+		return -EINVAL;
+	}
+
+	old_cpu = os->cpu_ikc_map[lwk_cpu];
+	if (old_cpu == dst) {
+		return 0;
+	}
+
+	ret = ihk_ikc_remap_cpu(os->ihk_os, lwk_cpu, old_cpu, dst);
+	/* A late kernel still applies the request, the master channel is
+	 * read in order. Both CPUs read a regular channel until then. */
+	if (ret && ret != -ETIMEDOUT) {
+		return ret;
+	}
+
+	bp_cpu = (struct ihk_smp_boot_param_cpu *)((char *)os->param +
+			sizeof(*os->param));
+	bp_cpu[lwk_cpu].ikc_cpu = dst;
+	os->cpu_ikc_map[lwk_cpu] = dst;
+	ihk_smp_cpus[src].ikc_map_cpu = dst;
+
+	return ret;
+}
+
+/*
+ * Move one LWK CPU off the Linux CPU which spent the most time handling
+ * IKC since the last run, if it is over twice the mean, to the one
+ * which spent the least. Only the Linux CPUs reading a regular channel
+ * are candidates.
+ */
+static void smp_ihk_os_ikc_balance(struct work_struct *work)
+{
+	struct smp_os_data *os = container_of(to_delayed_work(work),
+			struct smp_os_data, ikc_balance_work);
+	struct ihk_host_linux_os_data *data =
+		(struct ihk_host_linux_os_data *)os->ihk_os;
+	int cpu, lwk_cpu, hot = -1, cold = -1, move = -1;
+	int nr_hot = 0, nr, nr_targets = 0, d, best_d = 0;
+	u64 time, delta, hot_delta = 0, cold_delta = 0, total = 0;
+	int ret;
+
+	/* Leave a kernel which is not running, e.g. found hung, alone */
+	if (os->status != BUILTIN_OS_STATUS_BOOTING) {
+		return;
+	}
+
+	mutex_lock(&os->ikc_map_lock);
+
+	if (os->status == BUILTIN_OS_STATUS_HUNGUP) {
+		mutex_unlock(&os->ikc_map_lock);
+		return;
+	}
+
+	for_each_online_cpu(cpu) {
+		if (cpu >= SMP_MAX_CPUS || !data->regular_channels[cpu] ||
+		    ihk_smp_cpus[cpu].status == IHK_SMP_CPU_ASSIGNED) {
+			continue;
+		}
+
+		time = atomic64_read(&data->ikc_cpu_time[cpu]);
+		delta = time - os->ikc_balance_time[cpu];
+		os->ikc_balance_time[cpu] = time;
+
+		nr = 0;
+		for (lwk_cpu = 0; lwk_cpu < os->nr_cpus; lwk_cpu++) {
+			if (os->cpu_ikc_map[lwk_cpu] == cpu) {
+				nr++;
+			}
+		}
+
+		total += delta;
+		nr_targets++;
+		if (nr > 1 && (hot < 0 || delta > hot_delta)) {
+			hot = cpu;
+			hot_delta = delta;
+			nr_hot = nr;
+		}
+		if (cold < 0 || delta < cold_delta) {
+			cold = cpu;
+			cold_delta = delta;
+		}
+	}
+
+	if (hot < 0 || cold < 0 || hot == cold ||
+	    hot_delta * nr_targets <= 2 * total) {
+		goto out;
+	}
+
+	/* The LWK CPU nearest to its new target */
+	for (lwk_cpu = 0; lwk_cpu < os->nr_cpus; lwk_cpu++) {
+		if (os->cpu_ikc_map[lwk_cpu] != hot) {
+			continue;
+		}
+		d = ikc_map_distance(os->cpu_mapping[lwk_cpu], cold);
+		if (move < 0 || d < best_d) {
+			move = lwk_cpu;
+			best_d = d;
+		}
+	}
+
+	ret = smp_ihk_os_remap_ikc_cpu(os, os->cpu_mapping[move], cold);
+	if (ret == 0) {
+		pr_info("%s: IKC IRQ routing: %d -> %d (was %d of %d on %d)\n",
+			__func__, os->cpu_mapping[move], cold, move, nr_hot,
+			hot);
+	} else if (ret == -ETIMEDOUT) {
+		/* The kernel does not reply, stop balancing it */
+		pr_warn("%s: moving IKC IRQ of CPU %d timed out\n",
+			__func__, os->cpu_mapping[move]);
+		mutex_unlock(&os->ikc_map_lock);
+		return;
+	}
+
+out:
+	mutex_unlock(&os->ikc_map_lock);
+
+	if (ihk_ikc_balance_interval &&
+	    os->status == BUILTIN_OS_STATUS_BOOTING) {
+		schedule_delayed_work(&os->ikc_balance_work,
+			msecs_to_jiffies(ihk_ikc_balance_interval));
+	}
+}
 
 static int smp_ihk_os_set_ikc_map(ihk_os_t ihk_os, void *priv, unsigned long arg)
 {
@@ -1843,6 +2337,7 @@ static int smp_ihk_os_set_ikc_map(ihk_os_t ihk_os, void *priv, unsigned long arg
 	int *req_src_cpus = NULL;
 	int *req_dst_cpus = NULL;
 	char req_string[REQ_STR_MAXLEN];
+	int running;
 
 	dprintk("%s,set_ikc_map\n", __func__);
 
@@ -1856,8 +2351,10 @@ static int smp_ihk_os_set_ikc_map(ihk_os_t ihk_os, void *priv, unsigned long arg
 		return -EINVAL;
 	}
 
+	/* A running kernel switches its CPUs one by one */
 	spin_lock_irqsave(&os->lock, flags);
-	if (os->status != BUILTIN_OS_STATUS_INITIAL) {
+	running = (os->status == BUILTIN_OS_STATUS_BOOTING);
+	if (os->status != BUILTIN_OS_STATUS_INITIAL && !running) {
 		spin_unlock_irqrestore(&os->lock, flags);
 		ret = -EBUSY;
 		goto out;
@@ -1896,6 +2393,73 @@ static int smp_ihk_os_set_ikc_map(ihk_os_t ihk_os, void *priv, unsigned long arg
 		pr_warn("%s: failed to build ikc_map string\n", __func__);
 	}
 
+	if (running) {
+		int *prev_dst_cpus;
+		int lwk_cpu, err;
+
+		prev_dst_cpus = kmalloc(sizeof(int) * req.num_cpus, GFP_KERNEL);
+		if (!prev_dst_cpus) {
+			pr_err("%s: error: allocating previous dst_cpus\n",
+			       __func__);
+			kfree(req_src_cpus);
+			kfree(req_dst_cpus);
+			return -ENOMEM;
+		}
+
+		mutex_lock(&os->ikc_map_lock);
+		for (i = 0; i < req.num_cpus; i++) {
+			lwk_cpu = linux_cpu_2_lwk_cpu(os, req_src_cpus[i]);
+			prev_dst_cpus[i] = lwk_cpu < 0 ? -1 :
+				os->cpu_ikc_map[lwk_cpu];
+
+			ret = smp_ihk_os_remap_ikc_cpu(os, req_src_cpus[i],
+						       req_dst_cpus[i]);
+			if (ret) {
+				pr_err("%s: error: moving IKC IRQ of CPU %d to %d (%d)\n",
+				       __func__, req_src_cpus[i],
+				       req_dst_cpus[i], ret);
+				break;
+			}
+			pr_info("%s: IKC IRQ routing: %d -> %d\n",
+				__func__, req_src_cpus[i], req_dst_cpus[i]);
+		}
+
+		/* Put back what was moved so that the request is all or
+		 * nothing. Requests to a kernel which doesn't reply would
+		 * only queue up behind the one timed out. */
+		if (ret == -ETIMEDOUT) {
+			pr_err("%s: error: the kernel doesn't reply, the first %d entries stay applied\n",
+			       __func__, i + 1);
+		} else if (ret) {
+			while (--i >= 0) {
+				err = smp_ihk_os_remap_ikc_cpu(os,
+						req_src_cpus[i],
+						prev_dst_cpus[i]);
+				if (err == -ETIMEDOUT) {
+					pr_err("%s: error: restoring IKC IRQ of CPU %d to %d timed out, the first %d entries stay applied\n",
+					       __func__, req_src_cpus[i],
+					       prev_dst_cpus[i], i);
+					break;
+				}
+				if (err) {
+					pr_err("%s: error: restoring IKC IRQ of CPU %d to %d (%d), entries 0-%d stay applied\n",
+					       __func__, req_src_cpus[i],
+					       prev_dst_cpus[i], err, i);
+					break;
+				}
+				pr_info("%s: IKC IRQ routing: %d -> %d (restored)\n",
+					__func__, req_src_cpus[i],
+					prev_dst_cpus[i]);
+			}
+		}
+		mutex_unlock(&os->ikc_map_lock);
+
+		kfree(prev_dst_cpus);
+		kfree(req_src_cpus);
+		kfree(req_dst_cpus);
+		return ret;
+	}
+
 	for (i = 0; i < req.num_cpus; i++) {
 		int src_cpu = req_src_cpus[i];
 		int dst_cpu = req_dst_cpus[i];
@@ -2046,6 +2610,178 @@ out:
 	return ret;
 }
 
+/* CPUs sharing the last level cache with cpu, NULL if unknown */
+static cpumask_t *ikc_map_llc(int cpu)
+{
+	struct ihk_cpu_topology *cpu_topo;
+	struct ihk_cache_topology *cache, *llc = NULL;
+
+	list_for_each_entry(cpu_topo, &cpu_topology_list, chain) {
+		if (cpu_topo->cpu_number != cpu) {
+			continue;
+		}
+		list_for_each_entry(cache, &cpu_topo->cache_topology_list,
+				    chain) {
+			if (!llc || cache->level > llc->level) {
+				llc = cache;
+			}
+		}
+		break;
+	}
+
+	return llc ? &llc->shared_cpu_map : NULL;
+}
+
+/* Expected cost of taking the IKC interrupts of lwk_cpu on linux_cpu */
+static int ikc_map_distance(int lwk_cpu, int linux_cpu)
+{
+	cpumask_t *llc = ikc_map_llc(lwk_cpu);
+
+	if (llc && cpumask_test_cpu(linux_cpu, llc)) {
+		return 0;
+	}
+
+	return node_distance(cpu_to_node(lwk_cpu), cpu_to_node(linux_cpu));
+}
+
+/*
+ * Map each LWK CPU to the nearest online Linux CPU, first by shared
+ * last level cache then by NUMA distance. Ties go to the Linux CPU with
+ * the fewest LWK CPUs and none takes more than its even share.
+ */
+static int smp_ihk_os_auto_ikc_map(ihk_os_t ihk_os, void *priv,
+				   unsigned long arg)
+{
+	int ret = 0;
+	int i, cpu, best, d, best_d = 0;
+	int nr_lwk = 0, nr_linux = 0, share;
+	struct smp_os_data *os = priv;
+	struct ihk_ikc_auto_req req;
+	unsigned long flags;
+	int *src_cpus = NULL;
+	int *dst_cpus = NULL;
+	int *old_dst_cpus = NULL;
+	int *load = NULL;
+	long cost = 0;
+
+	if (copy_from_user(&req, (void *)arg, sizeof(req))) {
+		pr_err("%s: error: copying request\n", __func__);
+		return -EFAULT;
+	}
+
+	if (req.num_cpus <= 0) {
+		pr_err("%s: invalid request length\n", __func__);
+		return -EINVAL;
+	}
+
+	if (!(req.flags & IHK_IKC_AUTO_MAP_DRY_RUN)) {
+		spin_lock_irqsave(&os->lock, flags);
+		if (os->status != BUILTIN_OS_STATUS_INITIAL) {
+			spin_unlock_irqrestore(&os->lock, flags);
+			return -EBUSY;
+		}
+		spin_unlock_irqrestore(&os->lock, flags);
+	}
+
+	src_cpus = kmalloc(sizeof(int) * req.num_cpus, GFP_KERNEL);
+	dst_cpus = kmalloc(sizeof(int) * req.num_cpus, GFP_KERNEL);
+	old_dst_cpus = kmalloc(sizeof(int) * req.num_cpus, GFP_KERNEL);
+	load = kzalloc(sizeof(int) * SMP_MAX_CPUS, GFP_KERNEL);
+	if (!src_cpus || !dst_cpus || !old_dst_cpus || !load) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+		if (ihk_smp_cpus[cpu].status == IHK_SMP_CPU_ASSIGNED) {
+			if (ihk_smp_cpus[cpu].os != ihk_os) {
+				continue;
+			}
+			if (nr_lwk == req.num_cpus) {
+				pr_err("%s: error: query_space is not large enough\n",
+				       __func__);
+				ret = -EINVAL;
+				goto out;
+			}
+			src_cpus[nr_lwk++] = cpu;
+		} else if (cpu < nr_cpu_ids && cpu_online(cpu)) {
+			nr_linux++;
+		}
+	}
+
+	if (nr_lwk == 0 || nr_linux == 0) {
+		pr_err("%s: error: no LWK CPU (%d) or Linux CPU (%d)\n",
+		       __func__, nr_lwk, nr_linux);
+		ret = -EINVAL;
+		goto out;
+	}
+	share = DIV_ROUND_UP(nr_lwk, nr_linux);
+
+	for (i = 0; i < nr_lwk; i++) {
+		best = -1;
+		for (cpu = 0; cpu < SMP_MAX_CPUS && cpu < nr_cpu_ids; cpu++) {
+			if (!cpu_online(cpu) ||
+			    ihk_smp_cpus[cpu].status == IHK_SMP_CPU_ASSIGNED ||
+			    load[cpu] >= share) {
+				continue;
+			}
+
+			d = ikc_map_distance(src_cpus[i], cpu);
+			if (best < 0 || d < best_d ||
+			    (d == best_d && load[cpu] < load[best])) {
+				best = cpu;
+				best_d = d;
+			}
+		}
+
+		dst_cpus[i] = best;
+		load[best]++;
+		cost += best_d;
+		dprintk("%s: %d -> %d, distance: %d\n",
+			__func__, src_cpus[i], best, best_d);
+	}
+
+	if (!(req.flags & IHK_IKC_AUTO_MAP_DRY_RUN)) {
+		for (i = 0; i < nr_lwk; i++) {
+			old_dst_cpus[i] = ihk_smp_cpus[src_cpus[i]].ikc_map_cpu;
+			ihk_smp_cpus[src_cpus[i]].ikc_map_cpu = dst_cpus[i];
+		}
+
+		if (smp_ihk_os_check_ikc_map(ihk_os)) {
+			for (i = 0; i < nr_lwk; i++) {
+				ihk_smp_cpus[src_cpus[i]].ikc_map_cpu =
+					old_dst_cpus[i];
+			}
+			ret = -ENOSPC;
+			goto out;
+		}
+		os->cpu_ikc_mapped = 1;
+
+		for (i = 0; i < nr_lwk; i++) {
+			pr_info("%s: IKC IRQ routing: %d -> %d\n",
+				__func__, src_cpus[i], dst_cpus[i]);
+		}
+		pr_info("%s: IKC IRQ routing cost: %ld\n", __func__, cost);
+	}
+
+	req.num_cpus = nr_lwk;
+	req.cost = cost;
+	if (copy_to_user(req.src_cpus, src_cpus, sizeof(int) * nr_lwk) ||
+	    copy_to_user(req.dst_cpus, dst_cpus, sizeof(int) * nr_lwk) ||
+	    copy_to_user((void *)arg, &req, sizeof(req))) {
+		pr_err("%s: error: copying result to user-space\n", __func__);
+		ret = -EFAULT;
+		goto out;
+	}
+
+out:
+	kfree(src_cpus);
+	kfree(dst_cpus);
+	kfree(old_dst_cpus);
+	kfree(load);
+	return ret;
+}
+
 static int smp_ihk_os_get_buildid(ihk_os_t ihk_os, void *priv, unsigned long arg)
 {
 	char buildid[] = BUILDID;
@@ -2505,12 +3241,78 @@ static int smp_ihk_os_thaw(ihk_os_t ihk_os, void *priv)
 	return 0;
 }
 
+/*
+ * Turn the dump page bitmaps into runs of pages to be dumped.
+ * find_next_bit() and find_next_zero_bit() scan a word at a time,
+ * so all-zero and all-one words are skipped in one step.
+ *
+ * *cursor is a bit offset into the concatenation of all the bitmaps.
+ * It is advanced past the last run stored, or set to -1 when no runs
+ * are left. When chunks is NULL, the remaining runs are only counted.
+ * Returns the number of runs found.
+ */
+long ihk_smp_dump_mem_areas(struct smp_os_data *os, long *cursor,
+			    struct dump_mem_chunk *chunks, long nr_chunks)
+{
+	struct ihk_dump_page *dump_page = NULL;
+	unsigned long base, pos, start, end, nbits;
+	long nr = 0;
+	int i;
+
+	if (*cursor < 0) {
+		return 0;
+	}
+
+	while (os->param->dump_page_set.completion_flag !=
+	       IHK_DUMP_PAGE_SET_COMPLETED) {
+		msleep(10); /* 10ms sleep */
+	}
+
+	dump_page = phys_to_virt(os->param->dump_page_set.phy_page);
+	pos = *cursor;
+
+	for (i = 0, base = 0; i < os->param->dump_page_set.count;
+	     i++, base += nbits) {
+		if (i) {
+			dump_page = (struct ihk_dump_page *)((char *)dump_page + ((dump_page->map_count * sizeof(unsigned long)) + sizeof(struct ihk_dump_page)));
+		}
+
+		nbits = dump_page->map_count * BITS_PER_LONG;
+		if (pos >= base + nbits) {
+			continue;
+		}
+
+		start = find_next_bit(dump_page->map, nbits,
+				      pos > base ? pos - base : 0);
+		while (start < nbits) {
+			if (chunks && nr >= nr_chunks) {
+				*cursor = base + start;
+				return nr;
+			}
+
+			end = find_next_zero_bit(dump_page->map, nbits,
+						 start + 1);
+			if (chunks) {
+				chunks[nr].addr = dump_page->start +
+					(start << PAGE_SHIFT);
+				chunks[nr].size = (end - start) << PAGE_SHIFT;
+			}
+			nr++;
+
+			start = find_next_bit(dump_page->map, nbits, end);
+		}
+	}
+
+	*cursor = -1;
+	return nr;
+}
+
 static void smp_ihk_os_panic_notifier(ihk_os_t ihk_os, void *priv)
 {
 	struct smp_os_data *os = priv;
 	struct ihk_dump_page *dump_page = NULL;
 	unsigned long map_start;
-	unsigned long i,j,k;
+	unsigned long i,j;
 	struct page *pg;
 
 	smp_ihk_os_send_nmi(ihk_os, priv, 0);
@@ -2531,15 +3333,11 @@ static void smp_ihk_os_panic_notifier(ihk_os_t ihk_os, void *priv)
 				dump_page = (struct ihk_dump_page *)((char *)dump_page + ((dump_page->map_count * sizeof(unsigned long)) + sizeof(struct ihk_dump_page)));
 			}
 
-			for (j = 0; j < dump_page->map_count; j++) {
-				for (k = 0; k < 64; k++) {
-					if (!((dump_page->map[j] >> k) & 0x1)) {
-						map_start = (unsigned long)(dump_page->start + (j << (PAGE_SHIFT+6)));
-						map_start = map_start + (k << PAGE_SHIFT);
-						pg = virt_to_page(phys_to_virt(map_start));
-						pg->mapping += PAGE_MAPPING_ANON;
-					}
-				}
+			for_each_clear_bit(j, dump_page->map,
+					   dump_page->map_count * BITS_PER_LONG) {
+				map_start = dump_page->start + (j << PAGE_SHIFT);
+				pg = virt_to_page(phys_to_virt(map_start));
+				pg->mapping += PAGE_MAPPING_ANON;
 			}
 		}
 	}
@@ -2552,6 +3350,8 @@ static struct ihk_os_ops smp_ihk_os_ops = {
 	.load_file = smp_ihk_os_load_file,
 	.boot = smp_ihk_os_boot,
 	.shutdown = smp_ihk_os_shutdown,
+	.reboot = smp_ihk_os_reboot,
+	.reboot_prepare = smp_ihk_os_reboot_prepare,
 	.alloc_resource = smp_ihk_os_alloc_resource,
 	.query_status = smp_ihk_os_query_status,
 	.notify_hungup = smp_ihk_os_notify_hungup,
@@ -2574,6 +3374,7 @@ static struct ihk_os_ops smp_ihk_os_ops = {
 	.release_cpu = smp_ihk_os_release_cpu,
 	.set_ikc_map = smp_ihk_os_set_ikc_map,
 	.get_ikc_map = smp_ihk_os_get_ikc_map,
+	.auto_ikc_map = smp_ihk_os_auto_ikc_map,
 	.get_buildid = smp_ihk_os_get_buildid,
 	.get_num_cpus = smp_ihk_os_get_num_cpus,
 	.query_cpu = smp_ihk_os_query_cpu,
@@ -2609,6 +3410,9 @@ static int smp_ihk_create_os(ihk_device_t ihk_dev, void *priv,
 
 	spin_lock_init(&os->lock);
 	os->dev = data;
+	os->ihk_os = ihk_os;
+	mutex_init(&os->ikc_map_lock);
+	INIT_DELAYED_WORK(&os->ikc_balance_work, smp_ihk_os_ikc_balance);
 	regdata->priv = os;
 	/* Put the image into the smallest NUMA id if value is -1,
 	 * use the designated NUMA node otherwise */
@@ -2622,6 +3426,9 @@ static int smp_ihk_destroy_os(ihk_device_t ihk_dev, void *ihk_dev_priv,
 							  ihk_os_t ihk_os, void *ihk_os_priv)
 {
 	struct smp_os_data *smp_os = ihk_os_priv;
+
+	cancel_delayed_work_sync(&smp_os->ikc_balance_work);
+	vfree(smp_os->image_cache);
 	kfree(smp_os);
 	return 0;
 }
@@ -4502,6 +5309,14 @@ static int smp_ihk_init(ihk_device_t ihk_dev, void *priv)
 	}
 
 	ret = smp_ihk_arch_init();
+	if (ret) {
+		return ret;
+	}
+
+	/* Not fatal, ihk_dma_request() is just unavailable */
+	if (smp_dma_init()) {
+		printk("IHK-SMP: warning: software DMA engine unavailable\n");
+	}
 
 	return ret;
 }
@@ -4510,6 +5325,7 @@ static int smp_ihk_exit(ihk_device_t ihk_dev, void *priv)
 {
 	int cpu, ret = 0;
 
+	smp_dma_exit();
 	smp_ihk_arch_exit();
 
 	/* Re-enable CPU cores */
@@ -4548,6 +5364,7 @@ static struct ihk_device_ops smp_ihk_device_ops = {
 	.unmap_virtual = smp_ihk_unmap_virtual,
 	.debug_request = smp_ihk_debug_request,
 	.get_dma_channel = smp_ihk_get_dma_channel,
+	.get_dma_info = smp_ihk_get_dma_info,
 	.reserve_cpu = smp_ihk_reserve_cpu,
 	.release_cpu = smp_ihk_release_cpu,
 	.reserve_mem = smp_ihk_reserve_mem,
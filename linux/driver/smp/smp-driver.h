@@ -18,6 +18,9 @@
 #include <linux/slab.h>
 #include <linux/irq.h>
 #include <linux/version.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/vmalloc.h>
 #include <ihk/ihk_host_driver.h>
 #include <bootparam.h>
 
@@ -45,6 +48,9 @@
 #define BUILTIN_OS_STATUS_SHUTDOWN	4 /* After shutdown */
 #define BUILTIN_OS_STATUS_HUNGUP	5
 
+/* Upper bound of the buffer used by one DUMP_QUERY_MEM_AREAS_PAGED call */
+#define IHK_SMP_DUMP_MEM_AREAS_PAGE_SIZE	(64 * 1024)
+
 #define IHK_SMP_CPU_NONE	0
 #define IHK_SMP_CPU_ONLINE	1
 #define IHK_SMP_CPU_AVAILABLE	2
@@ -123,8 +129,25 @@ struct smp_os_data {
 	struct smp_boot_param *param;
 	int param_pages_order;
 
+	/** \brief Descriptor rings the kernel submits DMA requests to */
+	struct smp_dma_ring *dma_ring;
+
 	/** \brief Status of the kernel */
 	int status;
+
+	ihk_os_t ihk_os;
+	/** \brief Serializes the IKC map changes of the running kernel */
+	struct mutex ikc_map_lock;
+	/** \brief Periodic IKC map balancing, see ihk_ikc_balance_interval */
+	struct delayed_work ikc_balance_work;
+	/* IKC handling time of each Linux CPU at the last balancing */
+	u64 ikc_balance_time[SMP_MAX_CPUS];
+
+	/** \brief Kernel image as loaded, followed by the startup page,
+	 * restored by a reboot */
+	void *image_cache;
+	unsigned long image_phys;
+	unsigned long image_size;
 };
 
 /* ihk_os_mem_chunk represents a memory range which is used by
@@ -146,9 +169,12 @@ void *ihk_smp_map_virtual(unsigned long phys, unsigned long size);
 void ihk_smp_unmap_virtual(void *virt);
 int ihk_smp_set_multi_intr_mode(ihk_os_t ihk_os, void *priv, int mode);
 int ihk_smp_set_nmi_mode(ihk_os_t ihk_os, void *priv, int mode);
+long ihk_smp_dump_mem_areas(struct smp_os_data *os, long *cursor,
+			    struct dump_mem_chunk *chunks, long nr_chunks);
 irqreturn_t smp_ihk_irq_call_handlers(int irq, void *data);
 int ihk_smp_map_kernel(pgd_t *pt, unsigned long vaddr, phys_addr_t paddr);
 void smp_ihk_arch_dcache_flush(void *addr, size_t len);
+void smp_ihk_arch_dma_copy(void *dest, const void *src, size_t len);
 
 int read_file(void *buf, size_t size, char *fmt, va_list ap);
 int file_readable(char *fmt, ...);
@@ -8,17 +8,198 @@
 #ifndef IHK_DEBUG_H_INCLUDED
 #define IHK_DEBUG_H_INCLUDED
 
+/* Maximum length of the text returned by one read of kmsg */
 #define IHK_KMSG_SIZE            8192
 #define IHK_KMSG_HIGH_WATER_MARK (IHK_KMSG_SIZE / 2)
 #define IHK_KMSG_NOTIFY_DELAY    400 /* Unit is us, 400 us would avoid overloading fwrite of ihkmond */
 
+/* Default size of the record ring, see ihk_kmsg_size module parameter */
+#define IHK_KMSG_RING_SIZE       (256 * 1024)
+
+#define IHK_KMSG_RECORD_SIZE     256
+#define IHK_KMSG_RECORD_TEXT_SIZE \
+	(IHK_KMSG_RECORD_SIZE - sizeof(unsigned long) - sizeof(int) * 2)
+
+/* The message continues in the record with the next sequence number */
+#define IHK_KMSG_RECORD_CONT     0x1
+
+/* Record is being written */
+#define IHK_KMSG_SEQ_BUSY        (~0UL)
+
+/* Identify the layout below, bump the version when changing it */
+#define IHK_KMSG_MAGIC           0x6b6d7367 /* "kmsg" */
+#define IHK_KMSG_VERSION         2
+
+/*
+ * A record is committed when seq holds the sequence number it was
+ * reserved with. Readers copy the record and check seq again to
+ * detect a writer that has lapped them in the meantime.
+ */
+struct ihk_kmsg_record {
+	volatile unsigned long seq;
+	unsigned short len;
+	unsigned short cpu;
+	int flags;
+	char text[IHK_KMSG_RECORD_TEXT_SIZE];
+};
+
+/*
+ * Sequence-numbered record ring shared by the LWK (writers) and
+ * Linux (readers). Writers reserve a record by incrementing next_seq
+ * and never wait for readers, i.e. unread records are overwritten
+ * when the ring is full. Readers consume records from head and
+ * account the ones overwritten before being read in lost.
+ */
 struct ihk_kmsg_buf {
-	int lock; /* Be careful, it's inter-kernel lock */
-	int tail;
-	int len;
-	int head;
-	char padding[4096 - sizeof(int) * 4]; /* Alignmment needed for some systems */
-	char str[IHK_KMSG_SIZE];
+	unsigned int magic;              /* IHK_KMSG_MAGIC */
+	unsigned int version;            /* IHK_KMSG_VERSION */
+	volatile unsigned long next_seq; /* Updated by writers */
+	volatile unsigned long head;     /* Updated by readers */
+	volatile unsigned long lost;     /* Updated by readers */
+	unsigned int nr_records;         /* Power of two */
+	unsigned int record_size;
+	char padding[4096 - sizeof(long) * 3 - sizeof(int) * 4]; /* Alignmment needed for some systems */
+	struct ihk_kmsg_record records[];
 };
 
+#define IHK_KMSG_BUF_SIZE(nr_records) \
+	(sizeof(struct ihk_kmsg_buf) + \
+	 (nr_records) * sizeof(struct ihk_kmsg_record))
+
+/* Set up an empty ring of nr_records records, which must be zeroed */
+static inline void ihk_kmsg_init_buf(struct ihk_kmsg_buf *kmsg_buf,
+				     unsigned int nr_records)
+{
+	unsigned int i;
+
+	kmsg_buf->magic = IHK_KMSG_MAGIC;
+	kmsg_buf->version = IHK_KMSG_VERSION;
+	kmsg_buf->next_seq = 0;
+	kmsg_buf->head = 0;
+	kmsg_buf->lost = 0;
+	kmsg_buf->nr_records = nr_records;
+	kmsg_buf->record_size = sizeof(struct ihk_kmsg_record);
+	/* Make the records look written in the previous lap */
+	for (i = 0; i < nr_records; i++) {
+		kmsg_buf->records[i].seq = (unsigned long)i - nr_records;
+	}
+}
+
+/* Tell if the ring was set up with the layout of this header */
+static inline int ihk_kmsg_compatible(struct ihk_kmsg_buf *kmsg_buf)
+{
+	return kmsg_buf->magic == IHK_KMSG_MAGIC &&
+		kmsg_buf->version == IHK_KMSG_VERSION &&
+		kmsg_buf->record_size == sizeof(struct ihk_kmsg_record) &&
+		kmsg_buf->nr_records &&
+		!(kmsg_buf->nr_records & (kmsg_buf->nr_records - 1));
+}
+
+/* Number of records not consumed yet, including overwritten ones */
+static inline unsigned long ihk_kmsg_pending(struct ihk_kmsg_buf *kmsg_buf)
+{
+	return kmsg_buf->next_seq - kmsg_buf->head;
+}
+
+/*
+ * Tell if writers should notify Linux, i.e. the text of the pending
+ * records could exceed IHK_KMSG_HIGH_WATER_MARK bytes
+ */
+static inline int ihk_kmsg_above_high_water_mark(struct ihk_kmsg_buf *kmsg_buf)
+{
+	return ihk_kmsg_pending(kmsg_buf) * IHK_KMSG_RECORD_TEXT_SIZE >=
+		IHK_KMSG_HIGH_WATER_MARK;
+}
+
+/*
+ * Append a message, which is split into multiple records when it
+ * doesn't fit into one. Lock-free, callable from any CPU, with IRQs
+ * enabled or disabled.
+ */
+static inline void ihk_kmsg_write(struct ihk_kmsg_buf *kmsg_buf, int cpu,
+				  const char *str, int len)
+{
+	unsigned long seq;
+	struct ihk_kmsg_record *rec;
+	int n;
+
+	while (len > 0) {
+		seq = __sync_fetch_and_add(&kmsg_buf->next_seq, 1);
+		rec = &kmsg_buf->records[seq & (kmsg_buf->nr_records - 1)];
+		n = len < IHK_KMSG_RECORD_TEXT_SIZE ?
+			len : IHK_KMSG_RECORD_TEXT_SIZE;
+
+		rec->seq = IHK_KMSG_SEQ_BUSY;
+		__sync_synchronize();
+
+		rec->len = n;
+		rec->cpu = cpu;
+		rec->flags = len > n ? IHK_KMSG_RECORD_CONT : 0;
+		__builtin_memcpy(rec->text, str, n);
+		__sync_synchronize();
+
+		rec->seq = seq;
+
+		str += n;
+		len -= n;
+	}
+}
+
+/*
+ * Copy the text of the committed records from *seq on to buf, size
+ * bytes at most, and advance *seq past them. Records overwritten
+ * before or while being copied are skipped and counted in *lost.
+ * Never blocks the writers. Returns the number of bytes copied.
+ */
+static inline int ihk_kmsg_read(struct ihk_kmsg_buf *kmsg_buf,
+				unsigned long *seq, char *buf, int size,
+				unsigned long *lost)
+{
+	struct ihk_kmsg_record *rec;
+	unsigned long next_seq, rec_seq;
+	int len = 0, n;
+
+	next_seq = kmsg_buf->next_seq;
+	__sync_synchronize();
+
+	if (next_seq - *seq > kmsg_buf->nr_records) {
+		*lost += next_seq - *seq - kmsg_buf->nr_records;
+		*seq = next_seq - kmsg_buf->nr_records;
+	}
+
+	for (; *seq != next_seq; (*seq)++) {
+		rec = &kmsg_buf->records[*seq & (kmsg_buf->nr_records - 1)];
+
+		rec_seq = rec->seq;
+		if (rec_seq == IHK_KMSG_SEQ_BUSY ||
+		    (long)(rec_seq - *seq) < 0) {
+			/* Not committed yet, continue from here next time */
+			break;
+		}
+
+		if (rec_seq != *seq) {
+			(*lost)++;
+			continue;
+		}
+		__sync_synchronize();
+
+		n = rec->len < IHK_KMSG_RECORD_TEXT_SIZE ?
+			rec->len : IHK_KMSG_RECORD_TEXT_SIZE;
+		if (len + n > size) {
+			break;
+		}
+		__builtin_memcpy(buf + len, rec->text, n);
+		__sync_synchronize();
+
+		/* Overwritten while copying */
+		if (rec->seq != *seq) {
+			(*lost)++;
+			continue;
+		}
+		len += n;
+	}
+
+	return len;
+}
+
 #endif /* !defined(IHK_DEBUG_H_INCLUDED) */
@@ -34,6 +34,9 @@ enum ihk_special_addr_type {
 	IHK_SPADDR_NMI_MODE = 6,
 	IHK_SPADDR_MCKERNEL_DO_FUTEX = 7,
 	IHK_SPADDR_MULTI_INTR_MODE = 8,
+	IHK_SPADDR_RUSAGE_SNAPSHOT = 9,
+	IHK_SPADDR_PERF_RING = 10,
+	IHK_SPADDR_MIKC_QUEUES = 11,
 };
 
 /** \brief Type of an IHK device */
@@ -49,6 +52,7 @@ struct ihk_host_interrupt_handler;
 struct ihk_mem_info;
 struct ihk_cpu_info;
 struct ihk_dma_request;
+struct ihk_dma_segment;
 struct ihk_dma_channel_info;
 
 /** \brief IHK-Host DMA channel descriptor */
@@ -64,6 +68,12 @@ typedef struct ihk_dma_channel *ihk_dma_channel_t;
 struct ihk_dma_ops {
 	int (*request)(ihk_dma_channel_t, struct ihk_dma_request *);
 	void (*get_info)(ihk_dma_channel_t, struct ihk_dma_channel_info *);
+	/** \brief Submit requests at once (optional) */
+	int (*request_batch)(ihk_dma_channel_t, struct ihk_dma_request *,
+	                     int nr_reqs);
+	/** \brief Submit a scatter-gather request (optional) */
+	int (*request_sg)(ihk_dma_channel_t, struct ihk_dma_segment *,
+	                  int nr_segs, struct ihk_dma_request *);
 };
 
 /** \brief IHK-Host DMA request structure */
@@ -99,6 +109,21 @@ struct ihk_dma_request {
 	unsigned long *notify;
 };
 
+/** \brief Segment of a scatter-gather DMA request
+ *
+ * The array of segments is read by the DMA engine, i.e. it must be
+ * physically contiguous (e.g. kmalloc'ed) and stay valid until the
+ * request completes.
+ */
+struct ihk_dma_segment {
+	/** \brief Source physical address */
+	unsigned long src_phys;
+	/** \brief Destination physical address */
+	unsigned long dest_phys;
+	/** \brief Size in byte */
+	unsigned long size;
+};
+
 /** \brief Information of a DMA channel */
 struct ihk_dma_channel_info {
 	/** \brief Status of the channel */
@@ -152,6 +177,17 @@ struct ihk_os_ops {
 	 *  \param flag  Unused
 	 **/
 	int (*shutdown)(ihk_os_t, void *, int flag);
+	/** \brief Restart a booted kernel on the resources it has
+	 *
+	 *  \param flag  IHK_OS_REBOOT_SCRUB or 0
+	 **/
+	int (*reboot)(ihk_os_t, void *, int flag);
+	/** \brief Tell if reboot would find what it needs, called before
+	 *         anything is torn down
+	 *
+	 *  \return 0, -EBUSY if not booted or -ENOENT without an image
+	 **/
+	int (*reboot_prepare)(ihk_os_t, void *);
 
 	/** \brief Allocate a resource
 	 *
@@ -301,6 +337,13 @@ struct ihk_os_ops {
 	**/
 	int (*get_ikc_map)(ihk_os_t, void *, unsigned long arg);
 
+	/** \brief Define IKC CPU mapping from the CPU topology.
+	*
+	* \return Success or failure.
+	* \param struct ihk_ikc_auto_req, filled with the mapping.
+	**/
+	int (*auto_ikc_map)(ihk_os_t, void *, unsigned long arg);
+
 	/** \brief Get build-id.
 	*
 	* \return Success or failure.
@@ -890,6 +933,9 @@ struct ihk_os_user_call {
 	int num_handlers;
 	/** \brief Array of handlers */
 	struct ihk_os_user_call_handler *handlers;
+	/** \brief Module of the handlers, i.e. THIS_MODULE. Kept loaded
+	 *  while they run, which can be after unregistering them */
+	struct module *owner;
 };
 
 /** \brief Register new ioctl handlers for the specified OS instance */
@@ -942,6 +988,16 @@ int ihk_device_get_dma_info(ihk_device_t data, struct ihk_dma_info *info);
 ihk_dma_channel_t ihk_device_get_dma_channel(ihk_device_t data, int channel);
 /** \brief Request a DMA opertation on the DMA channel */
 int ihk_dma_request(ihk_dma_channel_t ihk_ch, struct ihk_dma_request *req);
+/** \brief Request DMA operations on the DMA channel at once.
+ *  The completion of each request is signaled as specified in it, i.e.
+ *  set callback or notify on the last one only to be signaled once. */
+int ihk_dma_request_batch(ihk_dma_channel_t ihk_ch,
+                          struct ihk_dma_request *reqs, int nr_reqs);
+/** \brief Request a scatter-gather DMA operation on the DMA channel.
+ *  Only the completion members of req are used. */
+int ihk_dma_request_sg(ihk_dma_channel_t ihk_ch,
+                       struct ihk_dma_segment *segs, int nr_segs,
+                       struct ihk_dma_request *req);
 void  ihk_os_register_release_handler(struct file *,void (*)(ihk_os_t, void *),
                                       void *);
 
@@ -28,6 +28,9 @@
 #define IHK_DEVICE_GET_BUILDID        0x11290b
 #define IHK_DEVICE_GET_NUM_CPUS       0x11290c
 #define IHK_DEVICE_RELEASE_MEM_PARTIALLY        0x11290d
+#define IHK_DEVICE_SHIFT_KMSG_BUF     0x11290e
+#define IHK_DEVICE_FREEZE_OS          0x11290f
+#define IHK_DEVICE_THAW_OS            0x112910
 
 #define IHK_DEVICE_DEBUG_START        0x122900
 #define IHK_DEVICE_DEBUG_END          0x1229ff
@@ -67,6 +70,18 @@
 #define IHK_OS_DETECT_HUNGUP          0x112a36
 #define IHK_OS_GET_BUILDID            0x112a37
 #define IHK_OS_GET_NUM_CPUS           0x112a38
+#define IHK_OS_GET_IKC_STATS          0x112a39
+#define IHK_OS_AUTO_IKC_MAP           0x112a3a
+#define IHK_OS_REBOOT                 0x112a3b
+
+/* Clear the memory of the OS before IHK_OS_REBOOT restarts it */
+#define IHK_OS_REBOOT_SCRUB           0x1
+
+/* mmap offsets of /dev/mcosX, mapped read-only */
+#define IHK_OS_MMAP_MONITOR           0x0UL
+#define IHK_OS_MMAP_RUSAGE            0x1000000UL
+#define IHK_OS_MMAP_PERF              0x2000000UL
+#define IHK_OS_MMAP_STATE             0x3000000UL
 
 #define IHK_OS_DEBUG_START            0x122a00
 #define IHK_OS_DEBUG_END              0x122aff
@@ -111,6 +126,7 @@ typedef struct dumpargs_s {
 #define DUMP_QUERY_MEM_AREAS 8
 #define DUMP_QUERY_PHYS_START 9
 #define DUMP_NMI_CONT 10
+#define DUMP_QUERY_MEM_AREAS_PAGED 11
 	unsigned int level;
 #define DUMP_LEVEL_ALL 0
 #define DUMP_LEVEL_USER_UNUSED_EXCLUDE 24
@@ -155,16 +171,63 @@ struct ihk_ikc_req {
 	int num_cpus;
 };
 
+/* Only report the map IHK_OS_AUTO_IKC_MAP would set */
+#define IHK_IKC_AUTO_MAP_DRY_RUN	0x1
+
+/* Used by IHK-core and ihklib. The map chosen from the cache and NUMA
+ * topology is returned in src_cpus/dst_cpus, num_cpus is set to the
+ * number of LWK CPUs. cost sums the distance of each pair, 0 when the
+ * two CPUs share the last level cache and the NUMA distance of their
+ * nodes otherwise (10 on the same node).
+ */
+struct ihk_ikc_auto_req {
+	int *src_cpus;
+	int *dst_cpus;
+	int num_cpus;
+	int flags;
+	long cost;
+};
+
+/* Used by IHK-core and ihklib. Counts since the OS instance was created
+ * of the IKC queues and channel descriptors allocated by Linux, placed
+ * on the NUMA node of the CPU reading them (local) or on another one
+ * because that node was short of memory (remote).
+ */
+struct ihk_ikc_stats {
+	unsigned long nr_queues_local;
+	unsigned long nr_queues_remote;
+	unsigned long nr_descs_local;
+	unsigned long nr_descs_remote;
+	/* Packets of all channels by lane, see ihk_ikc_get_lane_stats() */
+	unsigned long nr_prio_lanes;
+	unsigned long prio_sent;
+	unsigned long prio_received;
+	unsigned long prio_full;
+	unsigned long bulk_sent;
+	unsigned long bulk_received;
+	unsigned long bulk_full;
+};
+
 /* Used by IHK-core and ihklib */
 struct ihk_os_ioctl_eventfd_desc {
 	int fd;
 	enum ihk_os_eventfd_type type;
 };
 
+/* Mapped at IHK_OS_MMAP_STATE. Unlike the monitor it is in the Linux
+ * memory, so it stays valid across shutdown and reboot */
+struct ihk_os_state {
+	/* Incremented before the other mappings are torn down */
+	unsigned long boot_gen;
+	unsigned long reserve[7];
+};
+
 /* Used by IHK-core and ihklib */
 struct ihk_device_get_kmsg_buf_desc {
 	int os_index; /* IN: OS index */
 	void* handle; /* OUT: "Pointer" to kmsg_buf container */
+	unsigned long phys; /* OUT: mmap offset of /dev/mcdX for kmsg_buf */
+	unsigned long size; /* OUT: Size of kmsg_buf */
 };
 
 /* Used by IHK-core and ihklib */
@@ -174,4 +237,18 @@ struct ihk_device_read_kmsg_buf_desc {
 	char* buf;    /* OUT: Buffer */
 };
 
+/* Used by IHK-core and ihkmond reading kmsg_buf through mmap */
+struct ihk_device_shift_kmsg_buf_desc {
+	void* handle;       /* IN: "Pointer" to kmsg_buf container */
+	unsigned long seq;  /* IN: Consume records up to this one */
+	unsigned long lost; /* IN: Number of records lost by the reader */
+};
+
+/* Used by IHK-core and ihklib freezing or thawing a set of OS instances */
+struct ihk_device_freeze_os_desc {
+	unsigned long *os_set; /* IN: Bitmap of OS indices */
+	int n;                 /* IN: Number of bits in os_set */
+	int timeout;           /* IN: ms to wait for all the CPUs, 0: no wait */
+};
+
 #endif /* !defined(__HEADER_IHK_HOST_USER_H) */
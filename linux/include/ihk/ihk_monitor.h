@@ -33,6 +33,10 @@ struct ihk_os_monitor {
 	struct ihk_os_cpu_monitor cpu[0]; /* clv[i].monitor = &cpu[i] */
 };
 
+#define IHK_OS_MONITOR_SIZE(num_processors) \
+	(sizeof(struct ihk_os_monitor) + \
+	 sizeof(struct ihk_os_cpu_monitor) * (num_processors))
+
 #ifndef IHK_OS_EVENTFD_TYPE_DEFINED
 #define IHK_OS_EVENTFD_TYPE_DEFINED
 /* Used by ihklib-impl, ihklib-user, IHK-core, mckernel */
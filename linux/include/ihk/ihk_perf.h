@@ -0,0 +1,71 @@
+#ifndef __IHK_PERF_H
+#define __IHK_PERF_H
+
+/* Counters sampled per CPU at most */
+#define IHK_PERF_MAX_COUNTERS 8
+
+struct ihk_perf_sample {
+	unsigned long time;		/* LWK clock, in ns */
+	int cpu;
+	int nr_counters;
+	unsigned long counters[IHK_PERF_MAX_COUNTERS];
+};
+
+/* One per CPU, written only by that CPU. head counts the samples
+ * written so far, the sample n is in samples[n % nr_samples] and is
+ * overwritten when the reader lags nr_samples behind.
+ */
+struct ihk_perf_ring {
+	unsigned long head;
+	unsigned long reserve[7];
+	struct ihk_perf_sample samples[];
+};
+
+/* Published by the LWK with ihk_set_perf_ring() and mapped read-only
+ * by ihk_os_map_perf_ring(). The LWK samples the events set with
+ * ihk_os_setperfevent() every period_ns on every CPU while they are
+ * enabled.
+ */
+struct ihk_perf_rings {
+	int nr_cpus;
+	int nr_samples;
+	unsigned long period_ns;
+	unsigned long reserve[6];
+	char rings[];
+};
+
+static inline unsigned long
+ihk_perf_ring_size(int nr_samples)
+{
+	return sizeof(struct ihk_perf_ring) +
+		sizeof(struct ihk_perf_sample) * nr_samples;
+}
+
+static inline struct ihk_perf_ring *
+ihk_perf_ring_of(struct ihk_perf_rings *rings, int cpu)
+{
+	return (struct ihk_perf_ring *)(rings->rings +
+		ihk_perf_ring_size(rings->nr_samples) * cpu);
+}
+
+static inline unsigned long
+ihk_perf_rings_size(int nr_cpus, int nr_samples)
+{
+	return sizeof(struct ihk_perf_rings) +
+		ihk_perf_ring_size(nr_samples) * nr_cpus;
+}
+
+static inline struct ihk_perf_sample *
+ihk_perf_ring_write_begin(struct ihk_perf_rings *rings,
+			  struct ihk_perf_ring *ring)
+{
+	return &ring->samples[ring->head % rings->nr_samples];
+}
+
+static inline void
+ihk_perf_ring_write_end(struct ihk_perf_ring *ring)
+{
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
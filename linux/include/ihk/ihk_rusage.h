@@ -67,4 +67,68 @@ struct ihk_os_rusage {
 	int max_num_threads;
 };
 
+/* Contiguous parts of struct ihk_os_rusage, in the order of the fields */
+enum ihk_os_rusage_block {
+	IHK_OS_RUSAGE_BLOCK_MEMORY,	/* memory_stat_rss to kmem_max_usage */
+	IHK_OS_RUSAGE_BLOCK_NUMA_STAT,
+	IHK_OS_RUSAGE_BLOCK_CPUACCT,	/* cpuacct_stat_system to usage */
+	IHK_OS_RUSAGE_BLOCK_PERCPU,
+	IHK_OS_RUSAGE_BLOCK_THREADS,
+	IHK_OS_RUSAGE_NR_BLOCKS,
+};
+
+/* Published by the LWK with ihk_set_rusage_snapshot() and mapped
+ * read-only by ihk_os_map_rusage(). seq is odd while the LWK is
+ * updating rusage, readers retry when it is odd or has changed
+ * across their copy. The LWK updates it from every CPU, so writers
+ * are serialized by write_lock, which readers don't look at.
+ * gen[block] is the seq following the last update of the block, so
+ * that readers can skip the blocks which haven't changed. It stays
+ * zero when the LWK doesn't maintain it, readers copy such blocks
+ * every time.
+ */
+struct ihk_os_rusage_snapshot {
+	unsigned long seq;
+	unsigned long write_lock;
+	unsigned long gen[IHK_OS_RUSAGE_NR_BLOCKS];
+	unsigned long reserve[1];
+	struct ihk_os_rusage rusage;
+};
+
+/* Writers must not be interrupted by another writer on the same CPU,
+ * i.e. call it with IRQs disabled when rusage is updated from IRQ
+ * context too */
+static inline void
+ihk_os_rusage_write_begin(struct ihk_os_rusage_snapshot *snapshot)
+{
+	while (__atomic_exchange_n(&snapshot->write_lock, 1,
+				   __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&snapshot->write_lock,
+				       __ATOMIC_RELAXED)) {
+		}
+	}
+
+	__atomic_store_n(&snapshot->seq, snapshot->seq + 1, __ATOMIC_RELAXED);
+	/* A release fence doesn't keep the updates from passing seq */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* Mark the block as updated, call it between write_begin and write_end */
+static inline void
+ihk_os_rusage_touch(struct ihk_os_rusage_snapshot *snapshot,
+		    enum ihk_os_rusage_block block)
+{
+	__atomic_store_n(&snapshot->gen[block], snapshot->seq + 1,
+			 __ATOMIC_RELAXED);
+}
+
+static inline void
+ihk_os_rusage_write_end(struct ihk_os_rusage_snapshot *snapshot)
+{
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&snapshot->seq, snapshot->seq + 1, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&snapshot->write_lock, 0, __ATOMIC_RELEASE);
+}
+
 #endif
@@ -3,6 +3,7 @@
 #define INCLUDED_IHKLIB
 
 #include <stdio.h>
+#include <stdint.h>
 #include <unistd.h>
 
 #include <bfd.h>
@@ -11,6 +12,7 @@
 
 #include <ihk/affinity.h> 
 #include <ihk/ihk_rusage.h>
+#include <ihk/ihk_perf.h>
 
 #ifndef IHK_OS_EVENTFD_TYPE_DEFINED
 #define IHK_OS_EVENTFD_TYPE_DEFINED
@@ -22,6 +24,19 @@ enum ihk_os_eventfd_type {
 };
 #endif
 
+/* Defined in ihk/ihk_monitor.h */
+struct ihk_os_monitor;
+
+/* Defined in ihk/ihk_host_user.h */
+struct ihk_ikc_stats;
+
+/* Device and OS files kept open by ihk_device_handle_open() and
+ * ihk_os_handle_open(). The _h variants of the functions below do
+ * the same as the index ones without opening the file each time.
+ */
+struct ihk_device_handle;
+struct ihk_os_handle;
+
 struct ihk_mem_chunk {
 	unsigned long size;
 	int numa_node_number;
@@ -59,6 +74,121 @@ typedef struct ihk_perf_event_attr {
 	unsigned exclude_idle:1;
 } ihk_perf_event_attr;
 
+/* Result of ihk_os_perf_stat(). value is raw scaled by
+ * time_enabled / time_running when the event was multiplexed.
+ */
+struct ihk_perf_count {
+	unsigned long value;
+	unsigned long raw;
+	unsigned long time_enabled;	/* In ns */
+	unsigned long time_running;	/* In ns */
+};
+
+/* File written by ihk_os_perf_record(): the header followed by one
+ * struct ihk_perf_sample per sample. nr_cpus is zero when the totals
+ * were polled from Linux, cpu is -1 and time is in ns since the start
+ * in that case.
+ */
+#define IHK_OS_PERF_RECORD_MAGIC "IHKP"
+#define IHK_OS_PERF_RECORD_VERSION 1
+
+struct ihk_os_perf_record_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t nr_counters;
+	uint32_t nr_cpus;
+	uint64_t period_ns;
+	uint64_t nr_lost;	/* Overwritten before being copied */
+	uint64_t config[IHK_PERF_MAX_COUNTERS];
+};
+
+/* CPU states distinguished by ihk_os_sample_cpu_state() */
+enum ihk_os_cpu_state {
+	IHK_OS_CPU_STATE_NOT_BOOT,
+	IHK_OS_CPU_STATE_IDLE,
+	IHK_OS_CPU_STATE_USER,
+	IHK_OS_CPU_STATE_KERNEL,	/* Including KERNEL_HEAVY */
+	IHK_OS_CPU_STATE_OFFLOAD,	/* Waiting for offloaded syscall */
+	IHK_OS_CPU_STATE_FROZEN,	/* Including FREEZING and THAW */
+	IHK_OS_CPU_STATE_PANIC,
+	IHK_OS_CPU_STATE_OTHER,
+	IHK_OS_CPU_STATE_MAX,
+};
+
+/* Number of samples found in each state */
+struct ihk_os_cpu_state_hist {
+	unsigned long nr_samples[IHK_OS_CPU_STATE_MAX];
+};
+
+/* Binary trace written by ihk_os_sample_cpu_state(): the header
+ * followed by one record per state transition. The state of each CPU
+ * at the first sample is recorded with time_us of zero.
+ */
+#define IHK_OS_SAMPLE_TRACE_MAGIC "IHKS"
+#define IHK_OS_SAMPLE_TRACE_VERSION 2	/* 1 had 32-bit time_us */
+
+struct ihk_os_sample_trace_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t num_cpus;
+	uint32_t rate;		/* Sampling rate in Hz */
+	uint64_t start;		/* CLOCK_REALTIME in ns */
+};
+
+struct ihk_os_sample_trace_record {
+	uint64_t time_us;	/* Since start */
+	uint16_t cpu;
+	uint8_t state;		/* enum ihk_os_cpu_state */
+	uint8_t reserved[5];
+};
+
+/* Counters of struct ihk_os_rusage in the records written by
+ * ihk_os_rusage_stream_read()
+ */
+enum ihk_os_rusage_counter {
+	IHK_OS_RUSAGE_MEMORY_STAT_RSS,		/* Indexed by enum ihk_os_pgsize */
+	IHK_OS_RUSAGE_MEMORY_STAT_MAPPED_FILE,	/* Indexed by enum ihk_os_pgsize */
+	IHK_OS_RUSAGE_MEMORY_MAX_USAGE,
+	IHK_OS_RUSAGE_MEMORY_KMEM_USAGE,
+	IHK_OS_RUSAGE_MEMORY_KMEM_MAX_USAGE,
+	IHK_OS_RUSAGE_MEMORY_NUMA_STAT,		/* Indexed by NUMA node */
+	IHK_OS_RUSAGE_CPUACCT_STAT_SYSTEM,
+	IHK_OS_RUSAGE_CPUACCT_STAT_USER,
+	IHK_OS_RUSAGE_CPUACCT_USAGE,
+	IHK_OS_RUSAGE_CPUACCT_USAGE_PERCPU,	/* Indexed by CPU */
+	IHK_OS_RUSAGE_NUM_THREADS,
+	IHK_OS_RUSAGE_MAX_NUM_THREADS,
+	IHK_OS_RUSAGE_NR_COUNTERS,
+};
+
+/* Record written by ihk_os_rusage_stream_read(): the header followed by
+ * one delta per counter changed since the previous record. The first
+ * record has the non-zero counters as deltas from zero.
+ */
+#define IHK_OS_RUSAGE_RECORD_MAGIC "IHKR"
+
+struct ihk_os_rusage_record_header {
+	char magic[4];
+	uint32_t nr_deltas;
+	uint64_t time;		/* CLOCK_REALTIME in ns */
+};
+
+struct ihk_os_rusage_delta {
+	uint16_t counter;	/* enum ihk_os_rusage_counter */
+	uint16_t index;		/* 0 for scalar counters */
+	uint32_t reserved;
+	int64_t delta;
+};
+
+#define IHK_OS_RUSAGE_RECORD_MAX_SIZE					\
+	(sizeof(struct ihk_os_rusage_record_header) +			\
+	 sizeof(struct ihk_os_rusage_delta) *				\
+	 (IHK_MAX_NUM_PGSIZES * 2 + IHK_MAX_NUM_NUMA_NODES +		\
+	  IHK_MAX_NUM_CPUS + IHK_OS_RUSAGE_NR_COUNTERS))
+
+/* Defined in ihk/ihklib_private.h */
+struct ihk_os_rusage_stream;
+
 enum IHKLIB_LOGLEVEL {
 	IHKLIB_LOGLEVEL_EMERG = 0,
 	IHKLIB_LOGLEVEL_ERR
@@ -73,26 +203,44 @@ enum ihk_reserve_mem_conf_keys {
 
 extern int loglevel;
 
+int ihk_device_handle_open(int index, struct ihk_device_handle **handle);
+void ihk_device_handle_close(struct ihk_device_handle *handle);
 int ihk_reserve_cpu(int index, int* cpus, int num_cpus);
 int ihk_get_num_reserved_cpus(int index);
+int ihk_get_num_reserved_cpus_h(struct ihk_device_handle *handle);
 int ihk_query_cpu(int index, int* cpus, int _num_cpus);
+int ihk_query_cpu_h(struct ihk_device_handle *handle, int *cpus, int num_cpus);
 int ihk_release_cpu(int index, int* cpus, int num_cpus);
 int ihk_reserve_mem_conf(int index, int key, void *value);
 int ihk_reserve_mem(int index, struct ihk_mem_chunk* mem_chunks, int num_mem_chunks);
 int ihk_get_num_reserved_mem_chunks(int index);
+int ihk_get_num_reserved_mem_chunks_h(struct ihk_device_handle *handle);
 int ihk_query_mem(int index, struct ihk_mem_chunk* mem_chunks, int _num_mem_chunks);
+int ihk_query_mem_h(struct ihk_device_handle *handle,
+		    struct ihk_mem_chunk *mem_chunks, int _num_mem_chunks);
 int ihk_release_mem(int index, struct ihk_mem_chunk* mem_chunks, int num_mem_chunks);
 int ihk_create_os(int index);
 int ihk_get_num_os_instances(int index);
 int ihk_get_os_instances(int index, int *indices, int _num_os_instances);
 int ihk_destroy_os(int dev_index, int os_index);
 ;
+int ihk_os_handle_open(int index, struct ihk_os_handle **handle);
+void ihk_os_handle_close(struct ihk_os_handle *handle);
 int ihk_os_assign_cpu(int index, int* cpus, int num_cpus);
 int ihk_os_get_num_assigned_cpus(int index);
+int ihk_os_get_num_assigned_cpus_h(struct ihk_os_handle *handle);
 int ihk_os_query_cpu(int index, int* cpus, int _num_cpus);
+int ihk_os_query_cpu_h(struct ihk_os_handle *handle, int *cpus, int num_cpus);
 int ihk_os_release_cpu(int index, int* cpus, int num_cpus);
 int ihk_os_set_ikc_map(int index, struct ihk_ikc_cpu_map *map, int num_cpus);
 int ihk_os_get_ikc_map(int index, struct ihk_ikc_cpu_map *map, int num_cpus);
+/* Set the map chosen from the CPU topology, only report it if dry_run.
+ * num_cpus is the number of assigned CPUs, see struct ihk_ikc_auto_req
+ * for cost.
+ */
+int ihk_os_auto_ikc_map(int index, struct ihk_ikc_cpu_map *map, int num_cpus,
+			int dry_run, long *cost);
+int ihk_os_get_ikc_stats(int index, struct ihk_ikc_stats *stats);
 int ihk_os_assign_mem(int index, struct ihk_mem_chunk *mem_chunks, int num_mem_chunks);
 int ihk_os_get_num_assigned_mem_chunks(int index);
 int ihk_os_query_mem(int index, struct ihk_mem_chunk* mem_chunks, int _num_mem_chunks);
@@ -101,20 +249,57 @@ int ihk_os_get_eventfd(int index, int type);
 int ihk_os_load(int index, char* fn);
 int ihk_os_kargs(int index, char* kargs);
 int ihk_os_boot(int index);
+/* Restart a booted OS keeping its CPUs, memory and IKC map, clearing
+ * its memory first if scrub. The image is the one last loaded. */
+int ihk_os_reboot(int index, int scrub);
 int ihk_os_shutdown(int index);
 int ihk_os_get_status(int index);
+int ihk_os_get_status_h(struct ihk_os_handle *handle);
+int ihk_os_map_monitor(int index, struct ihk_os_monitor **monitor);
+int ihk_os_unmap_monitor(struct ihk_os_monitor *monitor);
+int ihk_os_sample_cpu_state(int index, int rate, int duration_ms,
+			    struct ihk_os_cpu_state_hist *hist, int num_cpus,
+			    const char *trace_file);
 int ihk_os_get_kmsg_size(int index);
+int ihk_os_get_kmsg_size_h(struct ihk_os_handle *handle);
 int ihk_os_kmsg(int index, char* kmsg, ssize_t sz_kmsg);
+int ihk_os_kmsg_h(struct ihk_os_handle *handle, char *kmsg, ssize_t sz_kmsg);
 int ihk_os_clear_kmsg(int index);
+int ihk_os_clear_kmsg_h(struct ihk_os_handle *handle);
 int ihk_os_get_num_numa_nodes(int index);
 int ihk_os_query_free_mem(int os_index, unsigned long *memfree, int num_numa_nodes);
 int ihk_os_query_total_mem(int os_index, unsigned long *memtotal, int num_numa_nodes);
 int ihk_os_get_num_pagesizes(int index);
 int ihk_os_get_pagesizes(int index, long *pgsizes, int num_pgsizes);
 int ihk_os_getrusage(int index, struct ihk_os_rusage *rusage, size_t size_rusage);
+int ihk_os_getrusage_h(struct ihk_os_handle *handle,
+		       struct ihk_os_rusage *rusage, size_t size_rusage);
+int ihk_os_map_rusage(int index, struct ihk_os_rusage_snapshot **snapshot);
+int ihk_os_unmap_rusage(struct ihk_os_rusage_snapshot *snapshot);
+int ihk_os_read_rusage(struct ihk_os_rusage_snapshot *snapshot,
+		       struct ihk_os_rusage *rusage, size_t size_rusage);
+int ihk_os_rusage_stream_open(int index,
+			      struct ihk_os_rusage_stream **stream);
+int ihk_os_rusage_stream_read(struct ihk_os_rusage_stream *stream,
+			      void *buf, size_t size);
+int ihk_os_rusage_stream_close(struct ihk_os_rusage_stream *stream);
+int ihk_os_rusage_apply_record(struct ihk_os_rusage *rusage,
+			       const void *buf, size_t size);
 int ihk_os_setperfevent(int index, ihk_perf_event_attr *attr, int n);
+int ihk_os_setperfevent_h(struct ihk_os_handle *handle,
+			  ihk_perf_event_attr *attr, int n);
 int ihk_os_perfctl(int index, int comm);
+int ihk_os_perfctl_h(struct ihk_os_handle *handle, int comm);
 int ihk_os_getperfevent(int index, unsigned long *counter, int n);
+int ihk_os_getperfevent_h(struct ihk_os_handle *handle,
+			  unsigned long *counter, int n);
+int ihk_os_perf_stat(int index, ihk_perf_event_attr *attr, int n,
+		     int nr_counters, int slice_ms, int duration_ms,
+		     struct ihk_perf_count *counts);
+int ihk_os_map_perf_ring(int index, struct ihk_perf_rings **rings);
+int ihk_os_unmap_perf_ring(struct ihk_perf_rings *rings);
+int ihk_os_perf_record(int index, ihk_perf_event_attr *attr, int n,
+		       int period_ms, int duration_ms, const char *file);
 int ihk_os_freeze(unsigned long *os_set, int n);
 int ihk_os_thaw(unsigned long *os_set, int n);
 int ihk_os_makedumpfile(int index, char *dump_file, int dump_level, int interactive);
@@ -24,6 +24,32 @@ struct ihk_ioctl_ikc_desc {
 	int num_cpus;
 };
 
+struct ihk_device_handle {
+	int index;
+	int fd;
+};
+
+struct ihk_os_handle {
+	int index;
+	int fd;
+};
+
+/* Reads the snapshot when the LWK publishes one, issues
+ * IHK_OS_GETRUSAGE otherwise
+ */
+struct ihk_os_rusage_stream {
+	struct ihk_os_rusage_snapshot *snapshot;
+	struct ihk_os_state *state;
+	unsigned long boot_gen;	/* state->boot_gen when opened */
+	struct ihk_os_handle *handle;
+	struct ihk_os_rusage prev;
+	struct ihk_os_rusage cur;
+	unsigned long seq;	/* snapshot->seq of cur, odd before the first read */
+	unsigned long gen[IHK_OS_RUSAGE_NR_BLOCKS];
+	int running;	/* The OS instance has been seen running */
+	int stale;	/* The OS instance has been shut down or rebooted */
+};
+
 struct mcctrl_ioctl_getrusage_desc {
 	struct ihk_os_rusage *rusage;
 	size_t size_rusage;
@@ -0,0 +1,374 @@
+/**
+ * \file ihkexporter.c
+ *  License details are found in the file LICENSE.
+ * \brief
+ *  Export the rusage of an OS instance in the Prometheus text format
+ *  on a local TCP port, sampling it with ihk_os_rusage_stream_read()
+ **/
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <ihk/ihklib.h>
+
+//#define DEBUG
+
+#ifdef DEBUG
+#define	dprintf(...)							\
+	do {								\
+		char msg[1024];						\
+		sprintf(msg, __VA_ARGS__);				\
+		fprintf(stderr, "%s,%s", __func__, msg);		\
+	} while (0)
+#else
+#define dprintf(...) do {  } while (0)
+#endif
+
+#define eprintf(...)							\
+	do {								\
+		char msg[1024];						\
+		sprintf(msg, __VA_ARGS__);				\
+		fprintf(stderr, "%s,%s", __func__, msg);		\
+	} while (0)
+
+#define CHKANDJUMP(cond, err, ...)					\
+	do {								\
+		if (cond) {						\
+			eprintf(__VA_ARGS__);				\
+			ret = err;					\
+			goto out;					\
+		}							\
+	} while (0)
+
+#define IHKEXPORTER_DEFAULT_PORT 9465
+#define IHKEXPORTER_DEFAULT_INTERVAL 100 /* ms */
+#define IHKEXPORTER_IO_TIMEOUT 100 /* ms, bounds the stall of sampling */
+
+struct metric {
+	int counter; /* enum ihk_os_rusage_counter */
+	const char *name;
+	const char *type;
+	const char *label; /* Name of the index label, NULL for scalars */
+	int nr;
+	const char *help;
+};
+
+static const struct metric metrics[] = {
+	{ IHK_OS_RUSAGE_MEMORY_STAT_RSS, "ihk_os_memory_stat_rss",
+	  "gauge", "pgsize", IHK_MAX_NUM_PGSIZES,
+	  "Resident set size by page size" },
+	{ IHK_OS_RUSAGE_MEMORY_STAT_MAPPED_FILE,
+	  "ihk_os_memory_stat_mapped_file",
+	  "gauge", "pgsize", IHK_MAX_NUM_PGSIZES,
+	  "File mapped memory by page size" },
+	{ IHK_OS_RUSAGE_MEMORY_MAX_USAGE, "ihk_os_memory_max_usage",
+	  "gauge", NULL, 1, "Maximum memory usage" },
+	{ IHK_OS_RUSAGE_MEMORY_KMEM_USAGE, "ihk_os_memory_kmem_usage",
+	  "gauge", NULL, 1, "Kernel memory usage" },
+	{ IHK_OS_RUSAGE_MEMORY_KMEM_MAX_USAGE,
+	  "ihk_os_memory_kmem_max_usage",
+	  "gauge", NULL, 1, "Maximum kernel memory usage" },
+	{ IHK_OS_RUSAGE_MEMORY_NUMA_STAT, "ihk_os_memory_numa_stat",
+	  "gauge", "numa_node", IHK_MAX_NUM_NUMA_NODES,
+	  "Memory usage by NUMA node" },
+	{ IHK_OS_RUSAGE_CPUACCT_STAT_SYSTEM,
+	  "ihk_os_cpuacct_stat_system_total",
+	  "counter", NULL, 1, "CPU time in kernel mode" },
+	{ IHK_OS_RUSAGE_CPUACCT_STAT_USER, "ihk_os_cpuacct_stat_user_total",
+	  "counter", NULL, 1, "CPU time in user mode" },
+	{ IHK_OS_RUSAGE_CPUACCT_USAGE, "ihk_os_cpuacct_usage_ns_total",
+	  "counter", NULL, 1, "CPU time in ns" },
+	{ IHK_OS_RUSAGE_CPUACCT_USAGE_PERCPU,
+	  "ihk_os_cpuacct_usage_percpu_ns_total",
+	  "counter", "cpu", IHK_MAX_NUM_CPUS, "CPU time in ns by CPU" },
+	{ IHK_OS_RUSAGE_NUM_THREADS, "ihk_os_num_threads",
+	  "gauge", NULL, 1, "Number of threads" },
+	{ IHK_OS_RUSAGE_MAX_NUM_THREADS, "ihk_os_max_num_threads",
+	  "gauge", NULL, 1, "Maximum number of threads" },
+};
+
+static int os_index;
+static struct ihk_os_rusage rusage;
+/* Counters seen non-zero, exported from then on */
+static char seen[IHK_OS_RUSAGE_NR_COUNTERS][IHK_MAX_NUM_NUMA_NODES];
+static unsigned long nr_records, nr_bytes;
+
+static unsigned long metric_value(const struct metric *m, int i)
+{
+	switch (m->counter) {
+	case IHK_OS_RUSAGE_MEMORY_STAT_RSS:
+		return rusage.memory_stat_rss[i];
+	case IHK_OS_RUSAGE_MEMORY_STAT_MAPPED_FILE:
+		return rusage.memory_stat_mapped_file[i];
+	case IHK_OS_RUSAGE_MEMORY_MAX_USAGE:
+		return rusage.memory_max_usage;
+	case IHK_OS_RUSAGE_MEMORY_KMEM_USAGE:
+		return rusage.memory_kmem_usage;
+	case IHK_OS_RUSAGE_MEMORY_KMEM_MAX_USAGE:
+		return rusage.memory_kmem_max_usage;
+	case IHK_OS_RUSAGE_MEMORY_NUMA_STAT:
+		return rusage.memory_numa_stat[i];
+	case IHK_OS_RUSAGE_CPUACCT_STAT_SYSTEM:
+		return rusage.cpuacct_stat_system;
+	case IHK_OS_RUSAGE_CPUACCT_STAT_USER:
+		return rusage.cpuacct_stat_user;
+	case IHK_OS_RUSAGE_CPUACCT_USAGE:
+		return rusage.cpuacct_usage;
+	case IHK_OS_RUSAGE_CPUACCT_USAGE_PERCPU:
+		return rusage.cpuacct_usage_percpu[i];
+	case IHK_OS_RUSAGE_NUM_THREADS:
+		return rusage.num_threads;
+	case IHK_OS_RUSAGE_MAX_NUM_THREADS:
+		return rusage.max_num_threads;
+	}
+	return 0;
+}
+
+static void mark_seen(const void *record)
+{
+	const struct ihk_os_rusage_record_header *header = record;
+	const struct ihk_os_rusage_delta *deltas = (const void *)(header + 1);
+	uint32_t i;
+
+	for (i = 0; i < header->nr_deltas; i++) {
+		seen[deltas[i].counter][deltas[i].index] = 1;
+	}
+}
+
+static void print_metrics(FILE *fp)
+{
+	int i, j;
+	const struct metric *m;
+
+	for (i = 0; i < sizeof(metrics) / sizeof(metrics[0]); i++) {
+		m = &metrics[i];
+		fprintf(fp, "# HELP %s %s\n", m->name, m->help);
+		fprintf(fp, "# TYPE %s %s\n", m->name, m->type);
+
+		if (!m->label) {
+			fprintf(fp, "%s{os=\"%d\"} %lu\n",
+				m->name, os_index, metric_value(m, 0));
+			continue;
+		}
+
+		for (j = 0; j < m->nr; j++) {
+			if (!seen[m->counter][j]) {
+				continue;
+			}
+			if (m->counter == IHK_OS_RUSAGE_MEMORY_STAT_RSS ||
+			    m->counter == IHK_OS_RUSAGE_MEMORY_STAT_MAPPED_FILE) {
+				fprintf(fp, "%s{os=\"%d\",%s=\"%ld\"} %lu\n",
+					m->name, os_index, m->label,
+					rusage_pgtype_to_pgsize(j),
+					metric_value(m, j));
+			} else {
+				fprintf(fp, "%s{os=\"%d\",%s=\"%d\"} %lu\n",
+					m->name, os_index, m->label, j,
+					metric_value(m, j));
+			}
+		}
+	}
+
+	fprintf(fp, "# HELP ihkexporter_records_total Records read from ihklib\n");
+	fprintf(fp, "# TYPE ihkexporter_records_total counter\n");
+	fprintf(fp, "ihkexporter_records_total{os=\"%d\"} %lu\n",
+		os_index, nr_records);
+	fprintf(fp, "# HELP ihkexporter_record_bytes_total Size of the records read from ihklib\n");
+	fprintf(fp, "# TYPE ihkexporter_record_bytes_total counter\n");
+	fprintf(fp, "ihkexporter_record_bytes_total{os=\"%d\"} %lu\n",
+		os_index, nr_bytes);
+}
+
+static void serve(int sock)
+{
+	int fd;
+	char req[1024];
+	char *body = NULL;
+	size_t len = 0;
+	FILE *fp;
+	char head[256];
+	ssize_t n;
+	size_t off;
+	struct timeval tv = {
+		.tv_sec = 0,
+		.tv_usec = IHKEXPORTER_IO_TIMEOUT * 1000,
+	};
+
+	fd = accept(sock, NULL, NULL);
+	if (fd == -1) {
+		eprintf("accept failed: %s\n", strerror(errno));
+		return;
+	}
+
+	/* Don't let a slow client hold up sampling */
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) ||
+	    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv))) {
+		eprintf("setsockopt failed: %s\n", strerror(errno));
+		goto out;
+	}
+
+	/* Any request is answered with the metrics */
+	if (read(fd, req, sizeof(req)) <= 0) {
+		goto out;
+	}
+
+	fp = open_memstream(&body, &len);
+	if (!fp) {
+		goto out;
+	}
+	print_metrics(fp);
+	fclose(fp);
+
+	sprintf(head, "HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %zu\r\n\r\n", len);
+
+	if (write(fd, head, strlen(head)) != strlen(head)) {
+		goto out;
+	}
+	for (off = 0; off < len; off += n) {
+		n = write(fd, body + off, len - off);
+		if (n <= 0) {
+			break;
+		}
+	}
+ out:
+	free(body);
+	close(fd);
+}
+
+static long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void usage(char **argv)
+{
+	fprintf(stderr,
+		"Usage: %s [-o os_index] [-i interval_ms] [-p port]\n",
+		argv[0]);
+}
+
+int main(int argc, char **argv)
+{
+	int ret = 0;
+	int opt;
+	int interval = IHKEXPORTER_DEFAULT_INTERVAL;
+	int port = IHKEXPORTER_DEFAULT_PORT;
+	int sock = -1;
+	int one = 1;
+	struct sockaddr_in addr = { 0 };
+	struct ihk_os_rusage_stream *stream = NULL;
+	struct pollfd pfd;
+	void *record = NULL;
+	long next, timeout;
+
+	while ((opt = getopt(argc, argv, "o:i:p:")) != -1) {
+		switch (opt) {
+		case 'o':
+			os_index = atoi(optarg);
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		default:
+			usage(argv);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+	CHKANDJUMP(interval <= 0, -EINVAL, "invalid interval\n");
+
+	signal(SIGPIPE, SIG_IGN);
+
+	record = malloc(IHK_OS_RUSAGE_RECORD_MAX_SIZE);
+	CHKANDJUMP(!record, -ENOMEM, "malloc failed\n");
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	CHKANDJUMP(sock == -1, -errno, "socket failed: %s\n",
+		   strerror(errno));
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	/* Local only */
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	ret = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+	CHKANDJUMP(ret == -1, -errno, "bind failed: %s\n", strerror(errno));
+	ret = listen(sock, 16);
+	CHKANDJUMP(ret == -1, -errno, "listen failed: %s\n", strerror(errno));
+
+	pfd.fd = sock;
+	pfd.events = POLLIN;
+	next = now_ms();
+
+	while (1) {
+		timeout = next - now_ms();
+		if (timeout > 0) {
+			ret = poll(&pfd, 1, timeout);
+			if (ret == -1 && errno != EINTR) {
+				CHKANDJUMP(1, -errno, "poll failed: %s\n",
+					   strerror(errno));
+			}
+			if (ret > 0) {
+				serve(sock);
+			}
+			continue;
+		}
+		next += interval;
+
+		/* (Re-)open when the OS instance is (re-)booted. Reading
+		 * fails with -ESTALE once it is shut down or rebooted.
+		 */
+		if (!stream) {
+			if (ihk_os_rusage_stream_open(os_index, &stream)) {
+				stream = NULL;
+				continue;
+			}
+			memset(&rusage, 0, sizeof(rusage));
+		}
+
+		ret = ihk_os_rusage_stream_read(stream, record,
+						IHK_OS_RUSAGE_RECORD_MAX_SIZE);
+		if (ret < 0) {
+			dprintf("ihk_os_rusage_stream_read returned %d\n",
+				ret);
+			ihk_os_rusage_stream_close(stream);
+			stream = NULL;
+			continue;
+		}
+
+		ret = ihk_os_rusage_apply_record(&rusage, record, ret);
+		CHKANDJUMP(ret < 0, ret, "invalid record\n");
+		mark_seen(record);
+		nr_records++;
+		nr_bytes += ret;
+	}
+
+ out:
+	if (stream) {
+		ihk_os_rusage_stream_close(stream);
+	}
+	if (sock != -1) {
+		close(sock);
+	}
+	free(record);
+	return ret;
+}
@@ -9,8 +9,10 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#include <stddef.h>
 #include <dirent.h>
 #include <bfd.h>
 #include <inttypes.h>
@@ -661,6 +663,41 @@ int ihklib_device_open(int index)
 	return ret;
 }
 
+/* Keep the device file open across calls of the _h variants */
+int ihk_device_handle_open(int index, struct ihk_device_handle **handle)
+{
+	int ret = 0;
+	struct ihk_device_handle *h = NULL;
+
+	dprintk("%s: enter\n", __func__);
+
+	h = malloc(sizeof(*h));
+	CHKANDJUMP(!h, -ENOMEM, "malloc failed\n");
+
+	h->index = index;
+	if ((h->fd = ihklib_device_open(index)) < 0) {
+		dprintf("%s: ihklib_device_open returned %d\n",
+			__func__, h->fd);
+		ret = h->fd;
+		goto out;
+	}
+
+	*handle = h;
+	h = NULL;
+ out:
+	free(h);
+	return ret;
+}
+
+void ihk_device_handle_close(struct ihk_device_handle *handle)
+{
+	if (!handle) {
+		return;
+	}
+	close(handle->fd);
+	free(handle);
+}
+
 int ihk_reserve_cpu(int index, int* cpus, int num_cpus)
 {
 	int ret = 0;
@@ -707,34 +744,40 @@ int ihk_reserve_cpu(int index, int* cpus, int num_cpus)
 	return ret;
 }
 
-int ihk_get_num_reserved_cpus(int index)
+int ihk_get_num_reserved_cpus_h(struct ihk_device_handle *handle)
 {
 	int ret = 0;
-	int fd = -1;
 
 	dprintk("%s: enter\n", __func__);
-	if ((fd = ihklib_device_open(index)) < 0) {
-		dprintf("%s: ihklib_device_open returned %d\n",
-			__func__, fd);
-		ret = fd;
+	ret = ioctl(handle->fd, IHK_DEVICE_GET_NUM_CPUS);
+	CHKANDJUMP(ret < 0, -errno, "ioctl failed\n");
+
+ out:
+	return ret;
+}
+
+int ihk_get_num_reserved_cpus(int index)
+{
+	int ret;
+	struct ihk_device_handle *handle;
+
+	if ((ret = ihk_device_handle_open(index, &handle))) {
+		dprintf("%s: ihk_device_handle_open returned %d\n",
+			__func__, ret);
 		goto out;
 	}
 
-	ret = ioctl(fd, IHK_DEVICE_GET_NUM_CPUS);
-	CHKANDJUMP(ret < 0, -errno, "ioctl failed\n");
+	ret = ihk_get_num_reserved_cpus_h(handle);
+	ihk_device_handle_close(handle);
 
  out:
-	if (fd != -1) {
-		close(fd);
-	}
 	return ret;
 }
 
-int ihk_query_cpu(int index, int *cpus, int num_cpus)
+int ihk_query_cpu_h(struct ihk_device_handle *handle, int *cpus, int num_cpus)
 {
 	int ret = 0;
 	struct ihk_ioctl_cpu_desc req = { 0 };
-	int fd = -1;
 
 	dprintk("%s: enter\n", __func__);
 	if (num_cpus < 0 || num_cpus > IHK_MAX_NUM_CPUS) {
@@ -744,14 +787,7 @@ int ihk_query_cpu(int index, int *cpus, int num_cpus)
 		goto out;
 	}
 
-	if ((fd = ihklib_device_open(index)) < 0) {
-		dprintf("%s: ihklib_device_open returned %d\n",
-			__func__, fd);
-		ret = fd;
-		goto out;
-	}
-
-	if ((ret = ioctl(fd, IHK_DEVICE_GET_NUM_CPUS)) < 0) {
+	if ((ret = ioctl(handle->fd, IHK_DEVICE_GET_NUM_CPUS)) < 0) {
 		int errno_save = errno;
 
 		dprintf("%s: IHK_DEVICE_GET_NUM_CPUS returned %d\n",
@@ -772,7 +808,7 @@ int ihk_query_cpu(int index, int *cpus, int num_cpus)
 	req.num_cpus = num_cpus;
 	CHKANDJUMP(!req.cpus || !req.num_cpus, -EINVAL, "invalid format\n");
 
-	if ((ret = ioctl(fd, IHK_DEVICE_QUERY_CPU, &req))) {
+	if ((ret = ioctl(handle->fd, IHK_DEVICE_QUERY_CPU, &req))) {
 		int errno_save = errno;
 
 		dprintf("%s: error: IHK_DEVICE_QUERY_CPU\n",
@@ -782,9 +818,24 @@ int ihk_query_cpu(int index, int *cpus, int num_cpus)
 	}
 
  out:
-	if (fd != -1) {
-		close(fd);
+	return ret;
+}
+
+int ihk_query_cpu(int index, int *cpus, int num_cpus)
+{
+	int ret;
+	struct ihk_device_handle *handle;
+
+	if ((ret = ihk_device_handle_open(index, &handle))) {
+		dprintf("%s: ihk_device_handle_open returned %d\n",
+			__func__, ret);
+		goto out;
 	}
+
+	ret = ihk_query_cpu_h(handle, cpus, num_cpus);
+	ihk_device_handle_close(handle);
+
+ out:
 	return ret;
 }
 
@@ -1146,49 +1197,49 @@ out:
 	return ret;
 }
 
-int ihk_get_num_reserved_mem_chunks(int index)
+int ihk_get_num_reserved_mem_chunks_h(struct ihk_device_handle *handle)
 {
 	int ret = 0, ret_ioctl;
-	int fd = -1;
 	struct ihk_mem_req req = { 0 };
 
 	dprintk("%s: enter\n", __func__);
-	if ((fd = ihklib_device_open(index)) < 0) {
-		eprintf("%s: error: ihklib_device_open\n",
-			__func__);
-		ret = fd;
-		goto out;
-	}
-
 	req.num_chunks = 0;   /* means only get num_reserved_mem_chunks */
 
-	ret_ioctl = ioctl(fd, IHK_DEVICE_QUERY_MEM, &req);
+	ret_ioctl = ioctl(handle->fd, IHK_DEVICE_QUERY_MEM, &req);
 	CHKANDJUMP(ret_ioctl != 0, -errno, "ioctl failed\n");
 
 	ret = req.num_chunks;
 
  out:
-	if (fd != -1) {
-		close(fd);
+	return ret;
+}
+
+int ihk_get_num_reserved_mem_chunks(int index)
+{
+	int ret;
+	struct ihk_device_handle *handle;
+
+	if ((ret = ihk_device_handle_open(index, &handle))) {
+		eprintf("%s: error: ihk_device_handle_open\n",
+			__func__);
+		goto out;
 	}
+
+	ret = ihk_get_num_reserved_mem_chunks_h(handle);
+	ihk_device_handle_close(handle);
+
+ out:
 	return ret;
 }
 
-int ihk_query_mem(int index, struct ihk_mem_chunk* mem_chunks, int _num_mem_chunks)
+int ihk_query_mem_h(struct ihk_device_handle *handle,
+		    struct ihk_mem_chunk *mem_chunks, int _num_mem_chunks)
 {
 	int ret = 0, ret_ioctl;
-	int fd = -1;
 	int i;
 	struct ihk_mem_req req = { 0 };
 
 	dprintk("%s: enter\n", __func__);
-	if ((fd = ihklib_device_open(index)) < 0) {
-		eprintf("%s: error: ihklib_device_open\n",
-			__func__);
-		ret = fd;
-		goto out;
-	}
-
 	req.sizes = calloc(_num_mem_chunks, sizeof(size_t));
 	if (!req.sizes) {
 		eprintf("%s: error: allocating request sizes\n",
@@ -1207,7 +1258,7 @@ int ihk_query_mem(int index, struct ihk_mem_chunk* mem_chunks, int _num_mem_chun
 
 	req.num_chunks = _num_mem_chunks;
 
-	ret_ioctl = ioctl(fd, IHK_DEVICE_QUERY_MEM, &req);
+	ret_ioctl = ioctl(handle->fd, IHK_DEVICE_QUERY_MEM, &req);
 	CHKANDJUMP(ret_ioctl != 0, -errno, "ioctl failed\n");
 
 	CHKANDJUMP(req.num_chunks != _num_mem_chunks, -EINVAL,
@@ -1220,14 +1271,29 @@ int ihk_query_mem(int index, struct ihk_mem_chunk* mem_chunks, int _num_mem_chun
 	}
 
  out:
-	if (fd != -1) {
-		close(fd);
-	}
 	free(req.sizes);
 	free(req.numa_ids);
 	return ret;
 }
 
+int ihk_query_mem(int index, struct ihk_mem_chunk* mem_chunks, int _num_mem_chunks)
+{
+	int ret;
+	struct ihk_device_handle *handle;
+
+	if ((ret = ihk_device_handle_open(index, &handle))) {
+		eprintf("%s: error: ihk_device_handle_open\n",
+			__func__);
+		goto out;
+	}
+
+	ret = ihk_query_mem_h(handle, mem_chunks, _num_mem_chunks);
+	ihk_device_handle_close(handle);
+
+ out:
+	return ret;
+}
+
 int ihk_release_mem(int index, struct ihk_mem_chunk* mem_chunks, int num_mem_chunks)
 {
 	int ret = 0, i, ret_ioctl;
@@ -1446,6 +1512,43 @@ int ihklib_os_open(int index)
 	return ret;
 }
 
+/* Keep the OS file open across calls of the _h variants, so that
+ * pollers do one ioctl per sample
+ */
+int ihk_os_handle_open(int index, struct ihk_os_handle **handle)
+{
+	int ret = 0;
+	struct ihk_os_handle *h = NULL;
+
+	dprintk("%s: enter\n", __func__);
+
+	h = malloc(sizeof(*h));
+	CHKANDJUMP(!h, -ENOMEM, "malloc failed\n");
+
+	h->index = index;
+	if ((h->fd = ihklib_os_open(index)) < 0) {
+		dprintf("%s: ihklib_os_open returned %d\n",
+			__func__, h->fd);
+		ret = h->fd;
+		goto out;
+	}
+
+	*handle = h;
+	h = NULL;
+ out:
+	free(h);
+	return ret;
+}
+
+void ihk_os_handle_close(struct ihk_os_handle *handle)
+{
+	if (!handle) {
+		return;
+	}
+	close(handle->fd);
+	free(handle);
+}
+
 int ihk_os_assign_cpu(int index, int* cpus, int num_cpus)
 {
 	int ret = 0, ret_ioctl;
@@ -1478,34 +1581,40 @@ int ihk_os_assign_cpu(int index, int* cpus, int num_cpus)
 	return ret;
 }
 
-int ihk_os_get_num_assigned_cpus(int index)
+int ihk_os_get_num_assigned_cpus_h(struct ihk_os_handle *handle)
 {
 	int ret = 0;
-	int fd = -1;
 
 	dprintk("%s: enter\n", __func__);
-	if ((fd = ihklib_os_open(index)) < 0) {
-		eprintf("%s: error: ihklib_os_open\n",
+	ret = ioctl(handle->fd, IHK_OS_GET_NUM_CPUS);
+	CHKANDJUMP(ret < 0, -errno, "ioctl failed\n");
+
+ out:
+	return ret;
+}
+
+int ihk_os_get_num_assigned_cpus(int index)
+{
+	int ret;
+	struct ihk_os_handle *handle;
+
+	if ((ret = ihk_os_handle_open(index, &handle))) {
+		eprintf("%s: error: ihk_os_handle_open\n",
 			__func__);
-		ret = fd;
 		goto out;
 	}
 
-	ret = ioctl(fd, IHK_OS_GET_NUM_CPUS);
-	CHKANDJUMP(ret < 0, -errno, "ioctl failed\n");
+	ret = ihk_os_get_num_assigned_cpus_h(handle);
+	ihk_os_handle_close(handle);
 
  out:
-	if (fd != -1) {
-		close(fd);
-	}
 	return ret;
 }
 
-int ihk_os_query_cpu(int index, int *cpus, int num_cpus)
+int ihk_os_query_cpu_h(struct ihk_os_handle *handle, int *cpus, int num_cpus)
 {
 	int ret = 0;
 	struct ihk_ioctl_cpu_desc req = { 0 };
-	int fd = -1;
 
 	dprintk("%s: enter\n", __func__);
 	if (num_cpus > IHK_MAX_NUM_CPUS) {
@@ -1515,14 +1624,7 @@ int ihk_os_query_cpu(int index, int *cpus, int num_cpus)
 		goto out;
 	}
 
-	if ((fd = ihklib_os_open(index)) < 0) {
-		eprintf("%s: error: ihklib_os_open\n",
-			__func__);
-		ret = fd;
-		goto out;
-	}
-
-	if ((ret = ioctl(fd, IHK_OS_GET_NUM_CPUS)) < 0) {
+	if ((ret = ioctl(handle->fd, IHK_OS_GET_NUM_CPUS)) < 0) {
 		int errno_save = errno;
 
 		dprintf("%s: error: IHK_OS_GET_NUM_CPUS returned %d\n",
@@ -1543,7 +1645,7 @@ int ihk_os_query_cpu(int index, int *cpus, int num_cpus)
 	req.num_cpus = num_cpus;
 	CHKANDJUMP(!req.cpus || !req.num_cpus, -EINVAL, "invalid format\n");
 
-	if ((ret = ioctl(fd, IHK_OS_QUERY_CPU, &req))) {
+	if ((ret = ioctl(handle->fd, IHK_OS_QUERY_CPU, &req))) {
 		int errno_save = errno;
 
 		dprintf("%s: error: IHK_OS_QUERY_CPU returned %d\n",
@@ -1553,9 +1655,24 @@ int ihk_os_query_cpu(int index, int *cpus, int num_cpus)
 	}
 
  out:
-	if (fd != -1) {
-		close(fd);
+	return ret;
+}
+
+int ihk_os_query_cpu(int index, int *cpus, int num_cpus)
+{
+	int ret;
+	struct ihk_os_handle *handle;
+
+	if ((ret = ihk_os_handle_open(index, &handle))) {
+		eprintf("%s: error: ihk_os_handle_open\n",
+			__func__);
+		goto out;
 	}
+
+	ret = ihk_os_query_cpu_h(handle, cpus, num_cpus);
+	ihk_os_handle_close(handle);
+
+ out:
 	return ret;
 }
 
@@ -1700,6 +1817,94 @@ int ihk_os_get_ikc_map(int index, struct ihk_ikc_cpu_map *map, int num_cpus)
 	return ret;
 }
 
+int ihk_os_auto_ikc_map(int index, struct ihk_ikc_cpu_map *map, int num_cpus,
+			int dry_run, long *cost)
+{
+	int ret = 0, i, ret_ioctl;
+	struct ihk_ikc_auto_req req = { 0 };
+	int fd = -1;
+
+	dprintk("%s: enter\n", __func__);
+	CHKANDJUMP(num_cpus <= 0 || num_cpus > IHK_MAX_NUM_CPUS, -EINVAL,
+		"invalid number of cpus\n");
+
+	if ((fd = ihklib_os_open(index)) < 0) {
+		eprintf("%s: error: ihklib_os_open\n",
+			__func__);
+		ret = fd;
+		goto out;
+	}
+
+	req.src_cpus = calloc(num_cpus, sizeof(int));
+	if (!req.src_cpus) {
+		eprintf("%s: error: allocating request src_cpus\n",
+			__func__);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	req.dst_cpus = calloc(num_cpus, sizeof(int));
+	if (!req.dst_cpus) {
+		eprintf("%s: error: allocating request dst_cpus\n",
+			__func__);
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	req.num_cpus = num_cpus;
+	req.flags = dry_run ? IHK_IKC_AUTO_MAP_DRY_RUN : 0;
+
+	ret_ioctl = ioctl(fd, IHK_OS_AUTO_IKC_MAP, &req);
+	CHKANDJUMP(ret_ioctl != 0, -errno, "ioctl failed\n");
+
+	CHKANDJUMP(req.num_cpus != num_cpus, -EINVAL,
+		   "actual number of ikc_maps (%d) is different than requested (%d)\n",
+		   req.num_cpus, num_cpus);
+
+	for (i = 0; i < req.num_cpus; i++) {
+		map[i].src_cpu = req.src_cpus[i];
+		map[i].dst_cpu = req.dst_cpus[i];
+	}
+
+	if (cost) {
+		*cost = req.cost;
+	}
+
+	ret = 0;
+
+ out:
+	if (fd != -1) {
+		close(fd);
+	}
+	free(req.src_cpus);
+	free(req.dst_cpus);
+	return ret;
+}
+
+int ihk_os_get_ikc_stats(int index, struct ihk_ikc_stats *stats)
+{
+	int ret = 0, ret_ioctl;
+	int fd = -1;
+
+	dprintk("%s: enter\n", __func__);
+
+	if ((fd = ihklib_os_open(index)) < 0) {
+		eprintf("%s: error: ihklib_os_open\n",
+			__func__);
+		ret = fd;
+		goto out;
+	}
+
+	ret_ioctl = ioctl(fd, IHK_OS_GET_IKC_STATS, stats);
+	CHKANDJUMP(ret_ioctl != 0, -errno, "ioctl failed\n");
+
+ out:
+	if (fd != -1) {
+		close(fd);
+	}
+	return ret;
+}
+
 int ihk_os_assign_mem(int index, struct ihk_mem_chunk *mem_chunks, int num_mem_chunks)
 {
 	int ret = 0, ret_ioctl, i;
@@ -1989,22 +2194,14 @@ int ihk_os_kargs(int index, char* kargs)
 	return ret;
 }
 
-int ihk_os_boot(int index)
+/* Boot with request and wait for the OS to be running */
+static int ihklib_os_boot_wait(int fd, unsigned int request, int flags)
 {
 	int ret = 0;
-	int fd = -1;
 	int i;
 	char query_result[1024];
 
-	dprintk("%s: enter\n", __func__);
-	if ((fd = ihklib_os_open(index)) < 0) {
-		eprintf("%s: error: ihklib_os_open\n",
-			__func__);
-		ret = fd;
-		goto out;
-	}
-
-	if ((ret = ioctl(fd, IHK_OS_BOOT, 0)) == -1) {
+	if ((ret = ioctl(fd, request, flags)) == -1) {
 		int errno_save = errno;
 
 		dprintf("error: ioctl failed\n");
@@ -2045,6 +2242,46 @@ booted_or_error:
 	}
 
 	ret = 0;
+ out:
+	return ret;
+}
+
+int ihk_os_boot(int index)
+{
+	int ret = 0;
+	int fd = -1;
+
+	dprintk("%s: enter\n", __func__);
+	if ((fd = ihklib_os_open(index)) < 0) {
+		eprintf("%s: error: ihklib_os_open\n",
+			__func__);
+		ret = fd;
+		goto out;
+	}
+
+	ret = ihklib_os_boot_wait(fd, IHK_OS_BOOT, 0);
+ out:
+	if (fd != -1) {
+		close(fd);
+	}
+	return ret;
+}
+
+int ihk_os_reboot(int index, int scrub)
+{
+	int ret = 0;
+	int fd = -1;
+
+	dprintk("%s: enter\n", __func__);
+	if ((fd = ihklib_os_open(index)) < 0) {
+		eprintf("%s: error: ihklib_os_open\n",
+			__func__);
+		ret = fd;
+		goto out;
+	}
+
+	ret = ihklib_os_boot_wait(fd, IHK_OS_REBOOT,
+				  scrub ? IHK_OS_REBOOT_SCRUB : 0);
  out:
 	if (fd != -1) {
 		close(fd);
@@ -2077,24 +2314,16 @@ int ihk_os_shutdown(int index)
 
 }
 
-int ihk_os_get_status(int index)
+int ihk_os_get_status_h(struct ihk_os_handle *handle)
 {
 	int ret = IHK_STATUS_INACTIVE, ret_ioctl;
-	int fd = -1;
 	char query_result[1024];
 
 	dprintk("%s: enter\n", __func__);
 
-	if ((fd = ihklib_os_open(index)) < 0) {
-		eprintf("%s: error: ihklib_os_open\n",
-			__func__);
-		ret = fd;
-		goto out;
-	}
-
 	memset(query_result, 0, sizeof(query_result));
 
-	ret_ioctl = ioctl(fd, IHK_OS_STATUS, query_result);
+	ret_ioctl = ioctl(handle->fd, IHK_OS_STATUS, query_result);
 	CHKANDJUMP(ret_ioctl < 0, -errno, "ioctl failed\n");
 
 	switch (ret_ioctl) {
@@ -2131,17 +2360,39 @@ int ihk_os_get_status(int index)
 	}
 
  out:
-	if (fd != -1) {
-		close(fd);
-	}
 	dprintk("%s: returning %d\n", __func__, ret);
 	return ret;
 }
 
-int ihk_os_get_kmsg_size(int index)
+int ihk_os_get_status(int index)
+{
+	int ret;
+	struct ihk_os_handle *handle;
+
+	if ((ret = ihk_os_handle_open(index, &handle))) {
+		eprintf("%s: error: ihk_os_handle_open\n",
+			__func__);
+		goto out;
+	}
+
+	ret = ihk_os_get_status_h(handle);
+	ihk_os_handle_close(handle);
+
+ out:
+	return ret;
+}
+
+/* Map the monitor of the OS instance read-only. The mapping is torn
+ * down when the OS instance is shut down or rebooted and accessing it
+ * afterwards raises SIGBUS. Unmap it with ihk_os_unmap_monitor() and
+ * map it again once the OS instance is running.
+ */
+int ihk_os_map_monitor(int index, struct ihk_os_monitor **monitor)
 {
 	int ret = 0;
 	int fd = -1;
+	struct ihk_os_monitor *head = MAP_FAILED;
+	void *addr;
 
 	dprintk("%s: enter\n", __func__);
 
@@ -2152,62 +2403,254 @@ int ihk_os_get_kmsg_size(int index)
 		goto out;
 	}
 
-	ret = IHK_KMSG_SIZE;
+	/* Find the size from num_processors */
+	head = mmap(NULL, sizeof(struct ihk_os_monitor), PROT_READ,
+		    MAP_SHARED, fd, IHK_OS_MMAP_MONITOR);
+	CHKANDJUMP(head == MAP_FAILED, -errno, "mmap failed\n");
+
+	addr = mmap(NULL, IHK_OS_MONITOR_SIZE(head->num_processors),
+		    PROT_READ, MAP_SHARED, fd, IHK_OS_MMAP_MONITOR);
+	CHKANDJUMP(addr == MAP_FAILED, -errno, "mmap failed\n");
 
+	*monitor = addr;
  out:
+	if (head != MAP_FAILED) {
+		munmap(head, sizeof(struct ihk_os_monitor));
+	}
 	if (fd != -1) {
 		close(fd);
 	}
+	dprintk("%s: returning %d\n", __func__, ret);
 	return ret;
 }
 
-int ihk_os_kmsg(int index, char* kmsg, ssize_t sz_kmsg)
+int ihk_os_unmap_monitor(struct ihk_os_monitor *monitor)
 {
 	int ret = 0;
-	int fd = -1;
 
 	dprintk("%s: enter\n", __func__);
 
-	if ((fd = ihklib_os_open(index)) < 0) {
-		eprintf("%s: error: ihklib_os_open\n",
+	ret = munmap(monitor, IHK_OS_MONITOR_SIZE(monitor->num_processors));
+	CHKANDJUMP(ret != 0, -errno, "munmap failed\n");
+
+ out:
+	dprintk("%s: returning %d\n", __func__, ret);
+	return ret;
+}
+
+static int ihklib_cpu_state(int status)
+{
+	switch (status & ~IHK_OS_MONITOR_ALLOW_THAW_REQUEST) {
+	case IHK_OS_MONITOR_NOT_BOOT:
+		return IHK_OS_CPU_STATE_NOT_BOOT;
+	case IHK_OS_MONITOR_IDLE:
+		return IHK_OS_CPU_STATE_IDLE;
+	case IHK_OS_MONITOR_USER:
+		return IHK_OS_CPU_STATE_USER;
+	case IHK_OS_MONITOR_KERNEL:
+	case IHK_OS_MONITOR_KERNEL_HEAVY:
+		return IHK_OS_CPU_STATE_KERNEL;
+	case IHK_OS_MONITOR_KERNEL_OFFLOAD:
+		return IHK_OS_CPU_STATE_OFFLOAD;
+	case IHK_OS_MONITOR_KERNEL_FREEZING:
+	case IHK_OS_MONITOR_KERNEL_FROZEN:
+	case IHK_OS_MONITOR_KERNEL_THAW:
+		return IHK_OS_CPU_STATE_FROZEN;
+	case IHK_OS_MONITOR_PANIC:
+		return IHK_OS_CPU_STATE_PANIC;
+	default:
+		return IHK_OS_CPU_STATE_OTHER;
+	}
+}
+
+/* Sample the state of the CPUs through the mapped monitor at rate Hz
+ * for duration_ms and count the samples found in each state to hist.
+ * When trace_file isn't NULL, the state transitions are also recorded
+ * to it. Returns the number of samples taken.
+ */
+int ihk_os_sample_cpu_state(int index, int rate, int duration_ms,
+			    struct ihk_os_cpu_state_hist *hist, int num_cpus,
+			    const char *trace_file)
+{
+	int ret = 0;
+	struct ihk_os_monitor *monitor = NULL;
+	FILE *fp = NULL;
+	unsigned char *prev = NULL;
+	struct ihk_os_sample_trace_header header;
+	struct ihk_os_sample_trace_record record;
+	struct timespec start, next, now;
+	int64_t elapsed_us;
+	int nr_samples;
+	int state;
+	int n, i;
+
+	dprintk("%s: enter\n", __func__);
+
+	CHKANDJUMP(rate <= 0 || rate > 1000000 || duration_ms <= 0 ||
+		   num_cpus <= 0, -EINVAL, "invalid argument\n");
+
+	ret = ihk_os_map_monitor(index, &monitor);
+	CHKANDJUMP(ret != 0, ret, "ihk_os_map_monitor failed\n");
+
+	n = num_cpus < monitor->num_processors ?
+		num_cpus : monitor->num_processors;
+	memset(hist, 0, sizeof(*hist) * num_cpus);
+
+	prev = malloc(n);
+	CHKANDJUMP(prev == NULL, -ENOMEM, "malloc failed\n");
+	memset(prev, 0xff, n);
+
+	if (trace_file) {
+		fp = fopen(trace_file, "w");
+		CHKANDJUMP(fp == NULL, -errno, "fopen failed\n");
+
+		memcpy(header.magic, IHK_OS_SAMPLE_TRACE_MAGIC,
+		       sizeof(header.magic));
+		header.version = IHK_OS_SAMPLE_TRACE_VERSION;
+		header.num_cpus = n;
+		header.rate = rate;
+		clock_gettime(CLOCK_REALTIME, &now);
+		header.start = now.tv_sec * 1000000000ULL + now.tv_nsec;
+		CHKANDJUMP(fwrite(&header, sizeof(header), 1, fp) != 1,
+			   -EIO, "fwrite failed\n");
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	next = start;
+	for (nr_samples = 0; ; nr_samples++) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed_us = (now.tv_sec - start.tv_sec) * 1000000LL +
+			(now.tv_nsec - start.tv_nsec) / 1000;
+		if (elapsed_us >= duration_ms * 1000LL) {
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			state = ihklib_cpu_state(monitor->cpu[i].status);
+			hist[i].nr_samples[state]++;
+
+			if (fp && state != prev[i]) {
+				record.time_us = nr_samples ? elapsed_us : 0;
+				record.cpu = i;
+				record.state = state;
+				memset(record.reserved, 0,
+				       sizeof(record.reserved));
+				CHKANDJUMP(fwrite(&record, sizeof(record), 1,
+						  fp) != 1,
+					   -EIO, "fwrite failed\n");
+				prev[i] = state;
+			}
+		}
+
+		/* Absolute deadlines don't accumulate drift */
+		next.tv_nsec += 1000000000L / rate;
+		if (next.tv_nsec >= 1000000000L) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000L;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+
+	ret = nr_samples;
+ out:
+	if (fp) {
+		if (fclose(fp) != 0 && ret >= 0) {
+			ret = -errno;
+		}
+	}
+	free(prev);
+	if (monitor) {
+		ihk_os_unmap_monitor(monitor);
+	}
+	dprintk("%s: returning %d\n", __func__, ret);
+	return ret;
+}
+
+int ihk_os_get_kmsg_size_h(struct ihk_os_handle *handle)
+{
+	dprintk("%s: enter\n", __func__);
+	return IHK_KMSG_SIZE;
+}
+
+int ihk_os_get_kmsg_size(int index)
+{
+	int ret;
+	struct ihk_os_handle *handle;
+
+	if ((ret = ihk_os_handle_open(index, &handle))) {
+		eprintf("%s: error: ihk_os_handle_open\n",
 			__func__);
-		ret = fd;
 		goto out;
 	}
 
+	ret = ihk_os_get_kmsg_size_h(handle);
+	ihk_os_handle_close(handle);
+
+ out:
+	return ret;
+}
+
+int ihk_os_kmsg_h(struct ihk_os_handle *handle, char* kmsg, ssize_t sz_kmsg)
+{
+	int ret = 0;
+
+	dprintk("%s: enter\n", __func__);
+
 	CHKANDJUMP(sz_kmsg > IHK_KMSG_SIZE, -EINVAL, "message size is too large\n");
 
-	ret = ioctl(fd, IHK_OS_READ_KMSG, (unsigned long)kmsg);
+	ret = ioctl(handle->fd, IHK_OS_READ_KMSG, (unsigned long)kmsg);
     CHKANDJUMP(ret < 0, -errno, "ioctl failed\n");
 
  out:
-	if (fd != -1) {
-		close(fd);
+	return ret;
+}
+
+int ihk_os_kmsg(int index, char* kmsg, ssize_t sz_kmsg)
+{
+	int ret;
+	struct ihk_os_handle *handle;
+
+	if ((ret = ihk_os_handle_open(index, &handle))) {
+		eprintf("%s: error: ihk_os_handle_open\n",
+			__func__);
+		goto out;
 	}
+
+	ret = ihk_os_kmsg_h(handle, kmsg, sz_kmsg);
+	ihk_os_handle_close(handle);
+
+ out:
 	return ret;
 }
 
-int ihk_os_clear_kmsg(int index)
+int ihk_os_clear_kmsg_h(struct ihk_os_handle *handle)
 {
 	int ret = 0, ret_ioctl;
-	int fd = -1;
 
 	dprintk("%s: enter\n", __func__);
 
-	if ((fd = ihklib_os_open(index)) < 0) {
-		eprintf("%s: error: ihklib_os_open\n",
+	ret_ioctl = ioctl(handle->fd, IHK_OS_CLEAR_KMSG, 0);
+	CHKANDJUMP(ret_ioctl != 0, -errno, "ioctl failed\n");
+
+ out:
+	return ret;
+}
+
+int ihk_os_clear_kmsg(int index)
+{
+	int ret;
+	struct ihk_os_handle *handle;
+
+	if ((ret = ihk_os_handle_open(index, &handle))) {
+		eprintf("%s: error: ihk_os_handle_open\n",
 			__func__);
-		ret = fd;
 		goto out;
 	}
 
-	ret_ioctl = ioctl(fd, IHK_OS_CLEAR_KMSG, 0);
-	CHKANDJUMP(ret_ioctl != 0, -errno, "ioctl failed\n");
+	ret = ihk_os_clear_kmsg_h(handle);
+	ihk_os_handle_close(handle);
 
  out:
-	if (fd != -1) {
-		close(fd);
-	}
 	return ret;
 }
 
@@ -2434,8 +2877,8 @@ int ihk_os_get_pagesizes(int index, long *pgsizes, int num_pgsizes)
 }
 
 #ifdef ENABLE_RUSAGE
-int ihk_os_getrusage(int index, struct ihk_os_rusage *rusage,
-		     size_t size_rusage)
+int ihk_os_getrusage_h(struct ihk_os_handle *handle,
+		       struct ihk_os_rusage *rusage, size_t size_rusage)
 {
 	dprintk("%s: enter\n", __func__);
 	int ret = 0, ret_ioctl;
@@ -2443,28 +2886,43 @@ int ihk_os_getrusage(int index, struct ihk_os_rusage *rusage,
 		.rusage = rusage,
 		.size_rusage = size_rusage,
 	};
-	int fd = -1;
 
 	dprintf("%s: 1\n", __func__);
 
-	if ((fd = ihklib_os_open(index)) < 0) {
-		eprintf("%s: error: ihklib_os_open\n",
+	ret_ioctl = ioctl(handle->fd, IHK_OS_GETRUSAGE, &desc);
+	CHKANDJUMP(ret_ioctl != 0, -errno, "ioctl failed,ret=%d\n", ret);
+
+ out:
+	dprintk("%s: returning %d\n", __func__, ret);
+	return ret;
+}
+
+int ihk_os_getrusage(int index, struct ihk_os_rusage *rusage,
+		     size_t size_rusage)
+{
+	int ret;
+	struct ihk_os_handle *handle;
+
+	if ((ret = ihk_os_handle_open(index, &handle))) {
+		eprintf("%s: error: ihk_os_handle_open\n",
 			__func__);
-		ret = fd;
 		goto out;
 	}
 
-	ret_ioctl = ioctl(fd, IHK_OS_GETRUSAGE, &desc);
-	CHKANDJUMP(ret_ioctl != 0, -errno, "ioctl failed,ret=%d\n", ret);
+	ret = ihk_os_getrusage_h(handle, rusage, size_rusage);
+	ihk_os_handle_close(handle);
 
  out:
-	if (fd != -1) {
-		close(fd);
-	}
-	dprintk("%s: returning %d\n", __func__, ret);
 	return ret;
 }
 #else
+int ihk_os_getrusage_h(struct ihk_os_handle *handle,
+		       struct ihk_os_rusage *rusage, size_t size_rusage)
+{
+	dprintf("Specify --enable-rusage when configuring.\n");
+	return -ENOSYS;
+}
+
 int ihk_os_getrusage(int index, struct ihk_os_rusage *rusage,
 		     size_t size_rusage)
 {
@@ -2473,10 +2931,15 @@ int ihk_os_getrusage(int index, struct ihk_os_rusage *rusage,
 }
 #endif
 
-int ihk_os_setperfevent(int index, ihk_perf_event_attr *attr, int n)
+/* Map the rusage snapshot of the OS instance read-only. Read it with
+ * ihk_os_read_rusage() instead of copying it with ihk_os_getrusage().
+ * Like the monitor, it is torn down on shutdown and reboot.
+ */
+int ihk_os_map_rusage(int index, struct ihk_os_rusage_snapshot **snapshot)
 {
-	int ret = 0, ret_ioctl;
+	int ret = 0;
 	int fd = -1;
+	void *addr;
 
 	dprintk("%s: enter\n", __func__);
 
@@ -2487,13 +2950,11 @@ int ihk_os_setperfevent(int index, ihk_perf_event_attr *attr, int n)
 		goto out;
 	}
 
-	ret_ioctl = ioctl(fd, IHK_OS_AUX_PERF_NUM, n);
-	CHKANDJUMP(ret_ioctl != 0, -errno, "ioctl failed\n");
-
-	ret_ioctl = ioctl(fd, IHK_OS_AUX_PERF_SET, attr);
-	CHKANDJUMP(ret_ioctl < 0, -errno, "ioctl failed\n");
+	addr = mmap(NULL, sizeof(struct ihk_os_rusage_snapshot), PROT_READ,
+		    MAP_SHARED, fd, IHK_OS_MMAP_RUSAGE);
+	CHKANDJUMP(addr == MAP_FAILED, -errno, "mmap failed\n");
 
-	ret = ret_ioctl;
+	*snapshot = addr;
  out:
 	if (fd != -1) {
 		close(fd);
@@ -2502,126 +2963,912 @@ int ihk_os_setperfevent(int index, ihk_perf_event_attr *attr, int n)
 	return ret;
 }
 
-int ihk_os_perfctl(int index, int comm)
+int ihk_os_unmap_rusage(struct ihk_os_rusage_snapshot *snapshot)
 {
-	int ret = 0, ret_ioctl;
-	int fd = -1;
+	int ret = 0;
 
 	dprintk("%s: enter\n", __func__);
-	if ((fd = ihklib_os_open(index)) < 0) {
-		eprintf("%s: error: ihklib_os_open\n",
-			__func__);
-		ret = fd;
-		goto out;
-	}
 
-	switch (comm) {
-	case PERF_EVENT_ENABLE : /* start PA event */
-		ret_ioctl = ioctl(fd, IHK_OS_AUX_PERF_ENABLE, 0);
-		break;
-	case PERF_EVENT_DISABLE : /* stop PA event */
-		ret_ioctl = ioctl(fd, IHK_OS_AUX_PERF_DISABLE, 0);
-		break;
-	case PERF_EVENT_DESTROY : /* delete PA event */
-		ret_ioctl = ioctl(fd, IHK_OS_AUX_PERF_DESTROY, 0);
-		break;
-	default:
-		ret = -EINVAL;
-		goto out;
-	}
-	CHKANDJUMP(ret_ioctl != 0, -errno, "ioctl failed\n");
+	ret = munmap(snapshot, sizeof(struct ihk_os_rusage_snapshot));
+	CHKANDJUMP(ret != 0, -errno, "munmap failed\n");
 
  out:
-	if (fd != -1) {
-		close(fd);
-	}
 	dprintk("%s: returning %d\n", __func__, ret);
 	return ret;
 }
 
-int ihk_os_getperfevent(int index, unsigned long *counter, int n)
+/* Give up when the LWK seems to have stopped in the middle of an update */
+#define IHKLIB_RUSAGE_READ_RETRIES 1000000
+
+int ihk_os_read_rusage(struct ihk_os_rusage_snapshot *snapshot,
+		       struct ihk_os_rusage *rusage, size_t size_rusage)
 {
-	int ret = 0, ret_ioctl;
-	int fd = -1;
+	int ret = 0;
+	int i;
+	unsigned long seq;
 
-	dprintk("%s: enter\n", __func__);
-	if ((fd = ihklib_os_open(index)) < 0) {
-		eprintf("%s: error: ihklib_os_open\n",
-			__func__);
-		ret = fd;
-		goto out;
-	}
+	CHKANDJUMP(size_rusage > sizeof(struct ihk_os_rusage), -EINVAL,
+		   "size_rusage is too large\n");
 
-	ret_ioctl = ioctl(fd, IHK_OS_AUX_PERF_GET, counter);
-	CHKANDJUMP(ret_ioctl != 0, -errno, "ioctl failed\n");
+	for (i = 0; i < IHKLIB_RUSAGE_READ_RETRIES; i++) {
+		if (i > 0) {
+			/* Let the LWK finish its update */
+			sched_yield();
+		}
+
+		seq = __atomic_load_n(&snapshot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			continue;
+		}
+
+		memcpy(rusage, &snapshot->rusage, size_rusage);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&snapshot->seq, __ATOMIC_RELAXED) == seq) {
+			goto out;
+		}
+	}
 
+	ret = -EAGAIN;
+	eprintf("%s: error: snapshot kept changing\n", __func__);
  out:
-    if (fd != -1) {
-        close(fd);
-    }
 	return ret;
 }
 
-int ihk_os_freeze(unsigned long *os_set, int n)
-{
-	int ret = 0, ret_ioctl;
-	int index;
-	int fd = -1;
+/* Location of the blocks in struct ihk_os_rusage */
+static const struct {
+	size_t start;
+	size_t end;
+} ihklib_rusage_blocks[IHK_OS_RUSAGE_NR_BLOCKS] = {
+#define IHKLIB_RUSAGE_BLOCK(block, first, next)			\
+	[block] = { offsetof(struct ihk_os_rusage, first), next }
+	IHKLIB_RUSAGE_BLOCK(IHK_OS_RUSAGE_BLOCK_MEMORY, memory_stat_rss,
+			    offsetof(struct ihk_os_rusage, memory_numa_stat)),
+	IHKLIB_RUSAGE_BLOCK(IHK_OS_RUSAGE_BLOCK_NUMA_STAT, memory_numa_stat,
+			    offsetof(struct ihk_os_rusage,
+				     cpuacct_stat_system)),
+	IHKLIB_RUSAGE_BLOCK(IHK_OS_RUSAGE_BLOCK_CPUACCT, cpuacct_stat_system,
+			    offsetof(struct ihk_os_rusage,
+				     cpuacct_usage_percpu)),
+	IHKLIB_RUSAGE_BLOCK(IHK_OS_RUSAGE_BLOCK_PERCPU, cpuacct_usage_percpu,
+			    offsetof(struct ihk_os_rusage, num_threads)),
+	IHKLIB_RUSAGE_BLOCK(IHK_OS_RUSAGE_BLOCK_THREADS, num_threads,
+			    sizeof(struct ihk_os_rusage)),
+#undef IHKLIB_RUSAGE_BLOCK
+};
 
-	dprintk("%s: enter\n", __func__);
-	for (index = 0; index < n; index++) {
-		if (*(os_set + index / 64) & (1ULL << (index % 64))) {
-			if ((fd = ihklib_os_open(index)) < 0) {
-				eprintf("%s: error: ihklib_os_open\n",
-					__func__);
-				ret = fd;
-				goto out;
-			}
+#define IHKLIB_RUSAGE_ALL_BLOCKS ((1 << IHK_OS_RUSAGE_NR_BLOCKS) - 1)
+
+/* Location of the counters in struct ihk_os_rusage */
+static const struct {
+	size_t offset;
+	int nr;
+	int is_int;
+	int block;
+} ihklib_rusage_counters[IHK_OS_RUSAGE_NR_COUNTERS] = {
+#define IHKLIB_RUSAGE_COUNTER(counter, field, nr, is_int, block)	\
+	[counter] = { offsetof(struct ihk_os_rusage, field), nr, is_int, \
+		      IHK_OS_RUSAGE_BLOCK_##block }
+	IHKLIB_RUSAGE_COUNTER(IHK_OS_RUSAGE_MEMORY_STAT_RSS,
+			      memory_stat_rss, IHK_MAX_NUM_PGSIZES, 0,
+			      MEMORY),
+	IHKLIB_RUSAGE_COUNTER(IHK_OS_RUSAGE_MEMORY_STAT_MAPPED_FILE,
+			      memory_stat_mapped_file, IHK_MAX_NUM_PGSIZES, 0,
+			      MEMORY),
+	IHKLIB_RUSAGE_COUNTER(IHK_OS_RUSAGE_MEMORY_MAX_USAGE,
+			      memory_max_usage, 1, 0, MEMORY),
+	IHKLIB_RUSAGE_COUNTER(IHK_OS_RUSAGE_MEMORY_KMEM_USAGE,
+			      memory_kmem_usage, 1, 0, MEMORY),
+	IHKLIB_RUSAGE_COUNTER(IHK_OS_RUSAGE_MEMORY_KMEM_MAX_USAGE,
+			      memory_kmem_max_usage, 1, 0, MEMORY),
+	IHKLIB_RUSAGE_COUNTER(IHK_OS_RUSAGE_MEMORY_NUMA_STAT,
+			      memory_numa_stat, IHK_MAX_NUM_NUMA_NODES, 0,
+			      NUMA_STAT),
+	IHKLIB_RUSAGE_COUNTER(IHK_OS_RUSAGE_CPUACCT_STAT_SYSTEM,
+			      cpuacct_stat_system, 1, 0, CPUACCT),
+	IHKLIB_RUSAGE_COUNTER(IHK_OS_RUSAGE_CPUACCT_STAT_USER,
+			      cpuacct_stat_user, 1, 0, CPUACCT),
+	IHKLIB_RUSAGE_COUNTER(IHK_OS_RUSAGE_CPUACCT_USAGE,
+			      cpuacct_usage, 1, 0, CPUACCT),
+	IHKLIB_RUSAGE_COUNTER(IHK_OS_RUSAGE_CPUACCT_USAGE_PERCPU,
+			      cpuacct_usage_percpu, IHK_MAX_NUM_CPUS, 0,
+			      PERCPU),
+	IHKLIB_RUSAGE_COUNTER(IHK_OS_RUSAGE_NUM_THREADS,
+			      num_threads, 1, 1, THREADS),
+	IHKLIB_RUSAGE_COUNTER(IHK_OS_RUSAGE_MAX_NUM_THREADS,
+			      max_num_threads, 1, 1, THREADS),
+#undef IHKLIB_RUSAGE_COUNTER
+};
 
-			ret_ioctl = ioctl(fd, IHK_OS_FREEZE, 0);
-			CHKANDJUMP(ret_ioctl != 0, -errno, "ioctl failed\n");
+static int64_t ihklib_rusage_get(const struct ihk_os_rusage *rusage,
+				 int counter, int index)
+{
+	const char *field = (const char *)rusage +
+		ihklib_rusage_counters[counter].offset;
 
-			close(fd);
-			fd = -1;
-		}
-    }
- out:
-	if (fd != -1) {
-		close(fd);
+	if (ihklib_rusage_counters[counter].is_int) {
+		return ((const int *)field)[index];
 	}
+	return ((const unsigned long *)field)[index];
+}
+
+static void ihklib_rusage_add(struct ihk_os_rusage *rusage,
+			      int counter, int index, int64_t delta)
+{
+	char *field = (char *)rusage + ihklib_rusage_counters[counter].offset;
+
+	if (ihklib_rusage_counters[counter].is_int) {
+		((int *)field)[index] += delta;
+	} else {
+		((unsigned long *)field)[index] += delta;
+	}
+}
+
+int ihk_os_rusage_stream_open(int index,
+			      struct ihk_os_rusage_stream **stream)
+{
+	int ret = 0;
+	struct ihk_os_rusage_stream *s;
+	void *addr;
+
+	dprintk("%s: enter\n", __func__);
+
+	s = calloc(1, sizeof(*s));
+	CHKANDJUMP(!s, -ENOMEM, "calloc failed\n");
+
+	ret = ihk_os_handle_open(index, &s->handle);
+	if (ret) {
+		eprintf("%s: error: ihk_os_handle_open\n",
+			__func__);
+		free(s);
+		goto out;
+	}
+
+	/* Tells the end of the boot without a status ioctl per read.
+	 * Take boot_gen before mapping the snapshot of that boot.
+	 */
+	addr = mmap(NULL, sizeof(struct ihk_os_state), PROT_READ,
+		    MAP_SHARED, s->handle->fd, IHK_OS_MMAP_STATE);
+	if (addr != MAP_FAILED) {
+		s->state = addr;
+		s->boot_gen = __atomic_load_n(&s->state->boot_gen,
+					      __ATOMIC_ACQUIRE);
+	}
+
+	/* No seq of the snapshot is odd once it has been read */
+	s->seq = 1;
+
+	/* Fall back to the ioctl when the LWK publishes no snapshot */
+	if (ihk_os_map_rusage(index, &s->snapshot)) {
+		s->snapshot = NULL;
+	}
+
+	*stream = s;
+ out:
+	dprintk("%s: returning %d\n", __func__, ret);
 	return ret;
 }
 
-int ihk_os_thaw(unsigned long *os_set, int n)
+/* The stream belongs to one boot of the OS instance. Tell if that boot
+ * is over, in which case the snapshot mapping has been torn down.
+ */
+static int ihklib_rusage_stream_stale(struct ihk_os_rusage_stream *stream)
+{
+	int status;
+
+	if (stream->stale) {
+		return 1;
+	}
+
+	if (stream->state) {
+		stream->stale =
+			__atomic_load_n(&stream->state->boot_gen,
+					__ATOMIC_ACQUIRE) != stream->boot_gen;
+		return stream->stale;
+	}
+
+	/* The driver predates the state page */
+	status = ihk_os_get_status_h(stream->handle);
+	switch (status) {
+	case IHK_STATUS_RUNNING:
+		stream->running = 1;
+		break;
+	case IHK_STATUS_BOOTING:
+		/* Rebooted since the stream saw it running */
+		stream->stale = stream->running;
+		break;
+	case IHK_STATUS_PANIC:
+	case IHK_STATUS_HUNGUP:
+	case IHK_STATUS_FREEZING:
+	case IHK_STATUS_FROZEN:
+		break;
+	default:
+		stream->stale = 1;
+		break;
+	}
+
+	return stream->stale;
+}
+
+/* Copy the blocks of the snapshot changed since the previous call to
+ * stream->cur, return their mask. Nothing is copied when seq hasn't
+ * moved, only the blocks whose gen has moved otherwise.
+ */
+static int ihklib_rusage_stream_copy(struct ihk_os_rusage_stream *stream)
+{
+	struct ihk_os_rusage_snapshot *snapshot = stream->snapshot;
+	unsigned long seq, gen[IHK_OS_RUSAGE_NR_BLOCKS];
+	int i, block, changed;
+
+	for (i = 0; i < IHKLIB_RUSAGE_READ_RETRIES; i++) {
+		if (i > 0) {
+			/* Let the LWK finish its update */
+			sched_yield();
+		}
+
+		seq = __atomic_load_n(&snapshot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			continue;
+		}
+
+		if (seq == stream->seq) {
+			return 0;
+		}
+
+		changed = 0;
+		for (block = 0; block < IHK_OS_RUSAGE_NR_BLOCKS; block++) {
+			gen[block] = __atomic_load_n(&snapshot->gen[block],
+						     __ATOMIC_RELAXED);
+			/* Zero when the LWK doesn't maintain it */
+			if (gen[block] && gen[block] == stream->gen[block]) {
+				continue;
+			}
+
+			memcpy((char *)&stream->cur +
+			       ihklib_rusage_blocks[block].start,
+			       (char *)&snapshot->rusage +
+			       ihklib_rusage_blocks[block].start,
+			       ihklib_rusage_blocks[block].end -
+			       ihklib_rusage_blocks[block].start);
+			changed |= 1 << block;
+		}
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&snapshot->seq, __ATOMIC_RELAXED) == seq) {
+			stream->seq = seq;
+			memcpy(stream->gen, gen, sizeof(gen));
+			return changed;
+		}
+	}
+
+	eprintf("%s: error: snapshot kept changing\n", __func__);
+	return -EAGAIN;
+}
+
+/* Write a record of the counters changed since the previous call to buf,
+ * return its size. Return -ESTALE once the OS instance has been shut
+ * down or rebooted, the stream needs to be closed and opened again.
+ */
+int ihk_os_rusage_stream_read(struct ihk_os_rusage_stream *stream,
+			      void *buf, size_t size)
+{
+	int ret = 0;
+	struct ihk_os_rusage_record_header *header = buf;
+	struct ihk_os_rusage_delta *deltas = (void *)(header + 1);
+	struct timespec now;
+	int counter, i, changed;
+	int64_t delta;
+	uint32_t n = 0;
+
+	CHKANDJUMP(size < IHK_OS_RUSAGE_RECORD_MAX_SIZE, -ENOSPC,
+		   "buffer is too small\n");
+
+	if (ihklib_rusage_stream_stale(stream)) {
+		dprintf("%s: the OS instance has been shut down or rebooted\n",
+			__func__);
+		ret = -ESTALE;
+		goto out;
+	}
+
+	if (stream->snapshot) {
+		ret = changed = ihklib_rusage_stream_copy(stream);
+	} else {
+		ret = ihk_os_getrusage_h(stream->handle, &stream->cur,
+					 sizeof(stream->cur));
+		changed = IHKLIB_RUSAGE_ALL_BLOCKS;
+	}
+	CHKANDJUMP(ret < 0, ret, "reading rusage failed\n");
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	for (counter = 0; counter < IHK_OS_RUSAGE_NR_COUNTERS; counter++) {
+		if (!(changed & (1 << ihklib_rusage_counters[counter].block))) {
+			continue;
+		}
+
+		for (i = 0; i < ihklib_rusage_counters[counter].nr; i++) {
+			delta = ihklib_rusage_get(&stream->cur, counter, i) -
+				ihklib_rusage_get(&stream->prev, counter, i);
+			if (!delta) {
+				continue;
+			}
+			deltas[n].counter = counter;
+			deltas[n].index = i;
+			deltas[n].reserved = 0;
+			deltas[n].delta = delta;
+			n++;
+		}
+	}
+
+	memcpy(header->magic, IHK_OS_RUSAGE_RECORD_MAGIC,
+	       sizeof(header->magic));
+	header->nr_deltas = n;
+	header->time = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+	/* Only the changed counters of prev differ from cur */
+	for (i = 0; i < n; i++) {
+		ihklib_rusage_add(&stream->prev, deltas[i].counter,
+				  deltas[i].index, deltas[i].delta);
+	}
+	ret = sizeof(*header) + sizeof(*deltas) * n;
+ out:
+	return ret;
+}
+
+int ihk_os_rusage_stream_close(struct ihk_os_rusage_stream *stream)
+{
+	int ret = 0;
+
+	dprintk("%s: enter\n", __func__);
+
+	if (stream->snapshot) {
+		ret = ihk_os_unmap_rusage(stream->snapshot);
+	}
+	if (stream->state) {
+		munmap(stream->state, sizeof(struct ihk_os_state));
+	}
+	ihk_os_handle_close(stream->handle);
+	free(stream);
+
+	dprintk("%s: returning %d\n", __func__, ret);
+	return ret;
+}
+
+/* Apply a record to rusage, which is zero-cleared before the first
+ * record. Return the size of the record.
+ */
+int ihk_os_rusage_apply_record(struct ihk_os_rusage *rusage,
+			       const void *buf, size_t size)
+{
+	int ret = 0;
+	const struct ihk_os_rusage_record_header *header = buf;
+	const struct ihk_os_rusage_delta *deltas = (const void *)(header + 1);
+	uint32_t i;
+
+	CHKANDJUMP(size < sizeof(*header) ||
+		   memcmp(header->magic, IHK_OS_RUSAGE_RECORD_MAGIC,
+			  sizeof(header->magic)), -EINVAL,
+		   "invalid record\n");
+	CHKANDJUMP(size < sizeof(*header) +
+		   sizeof(*deltas) * (size_t)header->nr_deltas, -EINVAL,
+		   "truncated record\n");
+
+	for (i = 0; i < header->nr_deltas; i++) {
+		CHKANDJUMP(deltas[i].counter >= IHK_OS_RUSAGE_NR_COUNTERS ||
+			   deltas[i].index >=
+			   ihklib_rusage_counters[deltas[i].counter].nr,
+			   -EINVAL, "invalid delta\n");
+	}
+
+	for (i = 0; i < header->nr_deltas; i++) {
+		ihklib_rusage_add(rusage, deltas[i].counter, deltas[i].index,
+				  deltas[i].delta);
+	}
+
+	ret = sizeof(*header) + sizeof(*deltas) * header->nr_deltas;
+ out:
+	return ret;
+}
+
+int ihk_os_setperfevent_h(struct ihk_os_handle *handle,
+			  ihk_perf_event_attr *attr, int n)
+{
+	int ret = 0, ret_ioctl;
+
+	dprintk("%s: enter\n", __func__);
+
+	ret_ioctl = ioctl(handle->fd, IHK_OS_AUX_PERF_NUM, n);
+	CHKANDJUMP(ret_ioctl != 0, -errno, "ioctl failed\n");
+
+	ret_ioctl = ioctl(handle->fd, IHK_OS_AUX_PERF_SET, attr);
+	CHKANDJUMP(ret_ioctl < 0, -errno, "ioctl failed\n");
+
+	ret = ret_ioctl;
+ out:
+	dprintk("%s: returning %d\n", __func__, ret);
+	return ret;
+}
+
+int ihk_os_setperfevent(int index, ihk_perf_event_attr *attr, int n)
+{
+	int ret;
+	struct ihk_os_handle *handle;
+
+	if ((ret = ihk_os_handle_open(index, &handle))) {
+		eprintf("%s: error: ihk_os_handle_open\n",
+			__func__);
+		goto out;
+	}
+
+	ret = ihk_os_setperfevent_h(handle, attr, n);
+	ihk_os_handle_close(handle);
+
+ out:
+	return ret;
+}
+
+int ihk_os_perfctl_h(struct ihk_os_handle *handle, int comm)
 {
 	int ret = 0, ret_ioctl;
-	int index;
+
+	dprintk("%s: enter\n", __func__);
+	switch (comm) {
+	case PERF_EVENT_ENABLE : /* start PA event */
+		ret_ioctl = ioctl(handle->fd, IHK_OS_AUX_PERF_ENABLE, 0);
+		break;
+	case PERF_EVENT_DISABLE : /* stop PA event */
+		ret_ioctl = ioctl(handle->fd, IHK_OS_AUX_PERF_DISABLE, 0);
+		break;
+	case PERF_EVENT_DESTROY : /* delete PA event */
+		ret_ioctl = ioctl(handle->fd, IHK_OS_AUX_PERF_DESTROY, 0);
+		break;
+	default:
+		ret = -EINVAL;
+		goto out;
+	}
+	CHKANDJUMP(ret_ioctl != 0, -errno, "ioctl failed\n");
+
+ out:
+	dprintk("%s: returning %d\n", __func__, ret);
+	return ret;
+}
+
+int ihk_os_perfctl(int index, int comm)
+{
+	int ret;
+	struct ihk_os_handle *handle;
+
+	if ((ret = ihk_os_handle_open(index, &handle))) {
+		eprintf("%s: error: ihk_os_handle_open\n",
+			__func__);
+		goto out;
+	}
+
+	ret = ihk_os_perfctl_h(handle, comm);
+	ihk_os_handle_close(handle);
+
+ out:
+	return ret;
+}
+
+int ihk_os_getperfevent_h(struct ihk_os_handle *handle,
+			  unsigned long *counter, int n)
+{
+	int ret = 0, ret_ioctl;
+
+	dprintk("%s: enter\n", __func__);
+	ret_ioctl = ioctl(handle->fd, IHK_OS_AUX_PERF_GET, counter);
+	CHKANDJUMP(ret_ioctl != 0, -errno, "ioctl failed\n");
+
+ out:
+	return ret;
+}
+
+int ihk_os_getperfevent(int index, unsigned long *counter, int n)
+{
+	int ret;
+	struct ihk_os_handle *handle;
+
+	if ((ret = ihk_os_handle_open(index, &handle))) {
+		eprintf("%s: error: ihk_os_handle_open\n",
+			__func__);
+		goto out;
+	}
+
+	ret = ihk_os_getperfevent_h(handle, counter, n);
+	ihk_os_handle_close(handle);
+
+ out:
+	return ret;
+}
+
+/* Map the perf sampling rings of the OS instance read-only. Like the
+ * monitor, they are torn down on shutdown and reboot.
+ */
+int ihk_os_map_perf_ring(int index, struct ihk_perf_rings **rings)
+{
+	int ret = 0;
 	int fd = -1;
+	struct ihk_perf_rings *head = MAP_FAILED;
+	void *addr;
 
 	dprintk("%s: enter\n", __func__);
-	for (index = 0; index < n; index++) {
-		if (*(os_set + index / 64) & (1ULL << (index % 64))) {
-			if ((fd = ihklib_os_open(index)) < 0) {
-				eprintf("%s: error: ihklib_os_open\n",
-					__func__);
-				ret = fd;
-				goto out;
+
+	if ((fd = ihklib_os_open(index)) < 0) {
+		eprintf("%s: error: ihklib_os_open\n",
+			__func__);
+		ret = fd;
+		goto out;
+	}
+
+	/* Find the size from nr_cpus and nr_samples */
+	head = mmap(NULL, sizeof(struct ihk_perf_rings), PROT_READ,
+		    MAP_SHARED, fd, IHK_OS_MMAP_PERF);
+	CHKANDJUMP(head == MAP_FAILED, -errno, "mmap failed\n");
+	CHKANDJUMP(head->nr_cpus <= 0 || head->nr_samples <= 0, -EAGAIN,
+		   "rings not initialized\n");
+
+	addr = mmap(NULL, ihk_perf_rings_size(head->nr_cpus,
+					      head->nr_samples),
+		    PROT_READ, MAP_SHARED, fd, IHK_OS_MMAP_PERF);
+	CHKANDJUMP(addr == MAP_FAILED, -errno, "mmap failed\n");
+
+	*rings = addr;
+ out:
+	if (head != MAP_FAILED) {
+		munmap(head, sizeof(struct ihk_perf_rings));
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+	dprintk("%s: returning %d\n", __func__, ret);
+	return ret;
+}
+
+int ihk_os_unmap_perf_ring(struct ihk_perf_rings *rings)
+{
+	int ret = 0;
+
+	dprintk("%s: enter\n", __func__);
+
+	ret = munmap(rings, ihk_perf_rings_size(rings->nr_cpus,
+						rings->nr_samples));
+	CHKANDJUMP(ret != 0, -errno, "munmap failed\n");
+
+ out:
+	dprintk("%s: returning %d\n", __func__, ret);
+	return ret;
+}
+
+static unsigned long ihklib_now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+static void ihklib_sleep_until(unsigned long ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000UL,
+		.tv_nsec = ns % 1000000000UL,
+	};
+
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/* Count the n events for duration_ms. When n is larger than the number
+ * of hardware counters, the events are counted nr_counters at a time,
+ * switching to the next group every slice_ms, and each count is scaled
+ * by time_enabled / time_running. nr_counters of zero means the number
+ * of events the LWK accepts at once.
+ */
+int ihk_os_perf_stat(int index, ihk_perf_event_attr *attr, int n,
+		     int nr_counters, int slice_ms, int duration_ms,
+		     struct ihk_perf_count *counts)
+{
+	int ret = 0;
+	struct ihk_os_handle *handle = NULL;
+	unsigned long *values = NULL;
+	unsigned long start, end, t0, t1;
+	int nr_groups, group, first, nr, i;
+	int set = 0;
+
+	dprintk("%s: enter\n", __func__);
+
+	CHKANDJUMP(n <= 0 || nr_counters < 0 || slice_ms <= 0 ||
+		   duration_ms <= 0, -EINVAL, "invalid argument\n");
+
+	ret = ihk_os_handle_open(index, &handle);
+	CHKANDJUMP(ret != 0, ret, "ihk_os_handle_open failed\n");
+
+	values = calloc(n, sizeof(*values));
+	CHKANDJUMP(values == NULL, -ENOMEM, "calloc failed\n");
+	memset(counts, 0, sizeof(*counts) * n);
+
+	if (nr_counters == 0) {
+		ret = ihk_os_setperfevent_h(handle, attr, n);
+		CHKANDJUMP(ret <= 0, ret ? ret : -EINVAL,
+			   "ihk_os_setperfevent_h failed\n");
+		nr_counters = ret < n ? ret : n;
+		ihk_os_perfctl_h(handle, PERF_EVENT_DESTROY);
+	}
+	if (nr_counters > n) {
+		nr_counters = n;
+	}
+	nr_groups = (n + nr_counters - 1) / nr_counters;
+
+	start = ihklib_now_ns();
+	end = start + duration_ms * 1000000UL;
+	for (group = 0, t1 = start; t1 < end;
+	     group = (group + 1) % nr_groups) {
+		first = group * nr_counters;
+		nr = n - first < nr_counters ? n - first : nr_counters;
+
+		ret = ihk_os_setperfevent_h(handle, attr + first, nr);
+		CHKANDJUMP(ret < nr, ret < 0 ? ret : -EINVAL,
+			   "ihk_os_setperfevent_h failed\n");
+		set = 1;
+
+		ret = ihk_os_perfctl_h(handle, PERF_EVENT_ENABLE);
+		CHKANDJUMP(ret != 0, ret, "ihk_os_perfctl_h failed\n");
+		t0 = ihklib_now_ns();
+
+		t1 = t0 + slice_ms * 1000000UL;
+		ihklib_sleep_until(nr_groups > 1 && t1 < end ? t1 : end);
+
+		ret = ihk_os_perfctl_h(handle, PERF_EVENT_DISABLE);
+		CHKANDJUMP(ret != 0, ret, "ihk_os_perfctl_h failed\n");
+		t1 = ihklib_now_ns();
+
+		ret = ihk_os_getperfevent_h(handle, values, nr);
+		CHKANDJUMP(ret != 0, ret, "ihk_os_getperfevent_h failed\n");
+
+		ihk_os_perfctl_h(handle, PERF_EVENT_DESTROY);
+		set = 0;
+
+		for (i = 0; i < nr; i++) {
+			counts[first + i].raw += values[i];
+			counts[first + i].time_running += t1 - t0;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		counts[i].time_enabled = t1 - start;
+		counts[i].value = counts[i].time_running ?
+			(unsigned long)((double)counts[i].raw *
+					counts[i].time_enabled /
+					counts[i].time_running) : 0;
+	}
+
+	ret = 0;
+ out:
+	if (set) {
+		ihk_os_perfctl_h(handle, PERF_EVENT_DESTROY);
+	}
+	free(values);
+	ihk_os_handle_close(handle);
+	dprintk("%s: returning %d\n", __func__, ret);
+	return ret;
+}
+
+/* Copy the samples written to the ring since *tail to fp. Returns the
+ * number of samples copied, those overwritten are added to *nr_lost.
+ */
+static int ihklib_perf_ring_drain(struct ihk_perf_rings *rings,
+				  struct ihk_perf_ring *ring,
+				  unsigned long *tail,
+				  unsigned long *nr_lost, FILE *fp)
+{
+	int ret = 0;
+	struct ihk_perf_sample sample;
+	unsigned long head;
+	int nr = 0;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	if (head - *tail > rings->nr_samples) {
+		*nr_lost += head - *tail - rings->nr_samples;
+		*tail = head - rings->nr_samples;
+	}
+
+	for (; *tail != head; (*tail)++) {
+		memcpy(&sample, &ring->samples[*tail % rings->nr_samples],
+		       sizeof(sample));
+
+		/* The writer may have lapped us during the copy */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&ring->head, __ATOMIC_RELAXED) - *tail >=
+		    rings->nr_samples) {
+			(*nr_lost)++;
+			continue;
+		}
+
+		CHKANDJUMP(fwrite(&sample, sizeof(sample), 1, fp) != 1,
+			   -EIO, "fwrite failed\n");
+		nr++;
+	}
+
+	ret = nr;
+ out:
+	return ret;
+}
+
+/* Enable the n events for duration_ms and record the counter samples to
+ * file. The per-CPU samples the LWK writes to the perf sampling rings
+ * are copied every period_ms. When the LWK doesn't publish the rings,
+ * the totals are read with ihk_os_getperfevent() every period_ms
+ * instead and recorded with cpu of -1. Returns the number of samples
+ * recorded.
+ */
+int ihk_os_perf_record(int index, ihk_perf_event_attr *attr, int n,
+		       int period_ms, int duration_ms, const char *file)
+{
+	int ret = 0;
+	struct ihk_os_handle *handle = NULL;
+	struct ihk_perf_rings *rings = NULL;
+	unsigned long *tails = NULL;
+	struct ihk_os_perf_record_header header;
+	struct ihk_perf_sample sample;
+	FILE *fp = NULL;
+	unsigned long start, end, next, now;
+	long nr_records = 0;
+	int set = 0, enabled = 0;
+	int cpu, i;
+
+	dprintk("%s: enter\n", __func__);
+
+	CHKANDJUMP(n <= 0 || n > IHK_PERF_MAX_COUNTERS || period_ms <= 0 ||
+		   duration_ms <= 0, -EINVAL, "invalid argument\n");
+
+	ret = ihk_os_handle_open(index, &handle);
+	CHKANDJUMP(ret != 0, ret, "ihk_os_handle_open failed\n");
+
+	if (ihk_os_map_perf_ring(index, &rings) == 0) {
+		tails = calloc(rings->nr_cpus, sizeof(*tails));
+		CHKANDJUMP(tails == NULL, -ENOMEM, "calloc failed\n");
+	}
+
+	fp = fopen(file, "w");
+	CHKANDJUMP(fp == NULL, -errno, "fopen failed\n");
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, IHK_OS_PERF_RECORD_MAGIC, sizeof(header.magic));
+	header.version = IHK_OS_PERF_RECORD_VERSION;
+	header.nr_counters = n;
+	header.nr_cpus = rings ? rings->nr_cpus : 0;
+	header.period_ns = rings ? rings->period_ns : period_ms * 1000000UL;
+	for (i = 0; i < n; i++) {
+		header.config[i] = attr[i].config;
+	}
+	CHKANDJUMP(fwrite(&header, sizeof(header), 1, fp) != 1,
+		   -EIO, "fwrite failed\n");
+
+	ret = ihk_os_setperfevent_h(handle, attr, n);
+	CHKANDJUMP(ret < n, ret < 0 ? ret : -EINVAL,
+		   "more events than counters\n");
+	set = 1;
+
+	/* Skip what the rings hold from before */
+	for (cpu = 0; rings && cpu < rings->nr_cpus; cpu++) {
+		tails[cpu] = __atomic_load_n(&ihk_perf_ring_of(rings,
+							       cpu)->head,
+					     __ATOMIC_ACQUIRE);
+	}
+
+	ret = ihk_os_perfctl_h(handle, PERF_EVENT_ENABLE);
+	CHKANDJUMP(ret != 0, ret, "ihk_os_perfctl_h failed\n");
+	enabled = 1;
+
+	start = ihklib_now_ns();
+	end = start + duration_ms * 1000000UL;
+	for (next = start + period_ms * 1000000UL; ;
+	     next += period_ms * 1000000UL) {
+		ihklib_sleep_until(next < end ? next : end);
+		now = ihklib_now_ns();
+
+		if (rings) {
+			for (cpu = 0; cpu < rings->nr_cpus; cpu++) {
+				ret = ihklib_perf_ring_drain(rings,
+					ihk_perf_ring_of(rings, cpu),
+					&tails[cpu], &header.nr_lost, fp);
+				CHKANDJUMP(ret < 0, ret,
+					   "ihklib_perf_ring_drain failed\n");
+				nr_records += ret;
 			}
+		} else {
+			memset(&sample, 0, sizeof(sample));
+			ret = ihk_os_getperfevent_h(handle, sample.counters, n);
+			CHKANDJUMP(ret != 0, ret,
+				   "ihk_os_getperfevent_h failed\n");
+			sample.time = now - start;
+			sample.cpu = -1;
+			sample.nr_counters = n;
+			CHKANDJUMP(fwrite(&sample, sizeof(sample), 1, fp) != 1,
+				   -EIO, "fwrite failed\n");
+			nr_records++;
+		}
 
-			ret_ioctl = ioctl(fd, IHK_OS_THAW, 0);
-			CHKANDJUMP(ret_ioctl != 0, -errno, "ioctl failed\n");
+		if (now >= end) {
+			break;
+		}
+	}
+
+	/* Rewrite the header with the number of samples lost */
+	CHKANDJUMP(fseek(fp, 0, SEEK_SET) != 0, -errno, "fseek failed\n");
+	CHKANDJUMP(fwrite(&header, sizeof(header), 1, fp) != 1,
+		   -EIO, "fwrite failed\n");
 
-			close(fd);
-			fd = -1;
+	ret = nr_records;
+ out:
+	if (enabled) {
+		ihk_os_perfctl_h(handle, PERF_EVENT_DISABLE);
+	}
+	if (set) {
+		ihk_os_perfctl_h(handle, PERF_EVENT_DESTROY);
+	}
+	if (fp) {
+		if (fclose(fp) != 0 && ret >= 0) {
+			ret = -errno;
 		}
 	}
+	free(tails);
+	if (rings) {
+		ihk_os_unmap_perf_ring(rings);
+	}
+	ihk_os_handle_close(handle);
+	dprintk("%s: returning %d\n", __func__, ret);
+	return ret;
+}
+
+/* ms to wait for all the CPUs of the OS instances to freeze or thaw */
+#define IHKLIB_FREEZE_TIMEOUT 5000
+
+/* Freeze or thaw all the OS instances in os_set with one ioctl and
+ * wait until all of them have reached the new state
+ */
+static int ihklib_os_freeze(unsigned long *os_set, int n, int freeze)
+{
+	int ret = 0, ret_ioctl;
+	int fd = -1;
+	struct ihk_device_freeze_os_desc desc = {
+		.os_set = os_set,
+		.n = n,
+		.timeout = IHKLIB_FREEZE_TIMEOUT,
+	};
+
+	dprintk("%s: enter\n", __func__);
+
+	/* OS instances are created on /dev/mcd0 */
+	if ((fd = ihklib_device_open(0)) < 0) {
+		eprintf("%s: error: ihklib_device_open\n",
+			__func__);
+		ret = fd;
+		goto out;
+	}
+
+	ret_ioctl = ioctl(fd, freeze ? IHK_DEVICE_FREEZE_OS :
+			  IHK_DEVICE_THAW_OS, &desc);
+	CHKANDJUMP(ret_ioctl != 0, -errno, "ioctl failed\n");
+
  out:
 	if (fd != -1) {
 		close(fd);
 	}
+	dprintk("%s: returning %d\n", __func__, ret);
 	return ret;
 }
 
+int ihk_os_freeze(unsigned long *os_set, int n)
+{
+	return ihklib_os_freeze(os_set, n, 1);
+}
+
+int ihk_os_thaw(unsigned long *os_set, int n)
+{
+	return ihklib_os_freeze(os_set, n, 0);
+}
+
 #ifdef ENABLE_MEMDUMP
 #include <bfd.h>
 #include <inttypes.h>
@@ -2647,7 +3894,8 @@ int ihk_os_makedumpfile(int index, char *dump_file, int dump_level, int interact
 	struct tm *tm;
 	char *date;
 	struct passwd *pw;
-	dump_mem_chunks_t *mem_chunks;
+	dump_mem_chunks_t *mem_chunks = NULL;
+	dump_mem_chunks_t *mem_chunks_page = NULL;
 	long mem_size;
 	char *physmem_name_buf = NULL;
 	char physmem_name[PHYSMEM_NAME_SIZE];
@@ -2685,21 +3933,41 @@ int ihk_os_makedumpfile(int index, char *dump_file, int dump_level, int interact
 	error = ioctl(osfd, IHK_OS_DUMP, &args);
 	CHKANDJUMP(error != 0, -errno, "DUMP_NMI failed\n");
 
-	args.cmd = DUMP_QUERY_NUM_MEM_AREAS;
-	args.size = 0;
-	error = ioctl(osfd, IHK_OS_DUMP, &args);
-	CHKANDJUMP(error != 0, -errno, "DUMP_QUERY_NUM_MEM_AREAS failed\n");
+	/* Collect the areas page by page so that the whole list
+	 * doesn't have to be sized and copied at once
+	 */
+	mem_chunks_page = malloc(PHYS_CHUNKS_DESC_SIZE);
+	CHKANDJUMP(mem_chunks_page == NULL, -ENOMEM, "malloc failed\n");
 
-	mem_size = args.size;
-	mem_chunks = malloc(mem_size);
+	mem_size = sizeof(dump_mem_chunks_t);
+	mem_chunks = calloc(1, mem_size);
 	CHKANDJUMP(mem_chunks == NULL, -ENOMEM, "malloc failed\n");
 
-	memset(mem_chunks, 0, args.size);
-
-	args.cmd = DUMP_QUERY_MEM_AREAS;
-	args.buf = (void *)mem_chunks;
-	error = ioctl(osfd, IHK_OS_DUMP, &args);
-	CHKANDJUMP(error != 0, -errno, "DUMP_QUERY_MEM_AREAS failed\n");
+	args.cmd = DUMP_QUERY_MEM_AREAS_PAGED;
+	args.start = 0;
+	do {
+		dump_mem_chunks_t *new_chunks;
+		size_t page_size;
+
+		args.size = PHYS_CHUNKS_DESC_SIZE;
+		args.buf = (void *)mem_chunks_page;
+		error = ioctl(osfd, IHK_OS_DUMP, &args);
+		CHKANDJUMP(error != 0, -errno,
+			   "DUMP_QUERY_MEM_AREAS_PAGED failed\n");
+
+		page_size = sizeof(struct dump_mem_chunk) *
+			mem_chunks_page->nr_chunks;
+		new_chunks = realloc(mem_chunks, mem_size + page_size);
+		CHKANDJUMP(new_chunks == NULL, -ENOMEM, "realloc failed\n");
+		mem_chunks = new_chunks;
+
+		memcpy(&mem_chunks->chunks[mem_chunks->nr_chunks],
+		       mem_chunks_page->chunks, page_size);
+		mem_chunks->nr_chunks += mem_chunks_page->nr_chunks;
+		mem_chunks->kernel_base = mem_chunks_page->kernel_base;
+		mem_chunks->phys_start = mem_chunks_page->phys_start;
+		mem_size += page_size;
+	} while (args.start != -1);
 
 	phys_size = 0;
 	dprintf("%s: nr chunks: %d\n",
@@ -2876,6 +4144,8 @@ out:
 			ret = -errno_save;
 		}
 	}
+	free(mem_chunks_page);
+	free(mem_chunks);
 	return ret;
 }
 #else /* ENABLE_MEMDUMP */
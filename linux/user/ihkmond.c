@@ -27,6 +27,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/eventfd.h>
 #include <config.h>
 #include <ihk/ihklib.h>
@@ -69,6 +70,15 @@
 #define IHKMOND_SIZE_FILEBUF_SLOT (1 * (1ULL << 20))
 #define IHKMOND_NUM_FILEBUF_SLOTS 64
 #define IHKMOND_TMP "/tmp/ihkmond"
+#define IHKMOND_SYSLOG_BATCH 256
+#define IHKMOND_SYSLOG_BATCH_DELAY 10000 /* us */
+
+/* Read at least one record so that a small IHK_KMSG_SIZE still progresses.
+ * 64 bytes are kept for the lost-records marker.
+ */
+#define IHKMOND_SIZE_READ \
+	(IHK_KMSG_SIZE > IHK_KMSG_RECORD_TEXT_SIZE + 64 ? \
+	 IHK_KMSG_SIZE - 64 : IHK_KMSG_RECORD_TEXT_SIZE)
 
 struct thr_args {
 	pthread_t thread;
@@ -220,60 +230,62 @@ static int ihkmond_device_open(int dev_index) {
 	return devfd;
 }
 
-static int fwrite_kmsg(int dev_index, void* handle, int os_index, FILE **fps, int *sizes, int *prod, int shift) {
+/* Consume kmsg records in place through the read-only mapping and
+ * append them to the rotating tmp files
+ */
+static int fwrite_kmsg(int devfd, void* handle, struct ihk_kmsg_buf *kmsg_buf, unsigned long *seq, int os_index, FILE **fps, int *sizes, int *prod) {
 	int ret = 0, ret_lib;
-	int devfd = -1;
 	ssize_t nread;
-	char buf[IHK_KMSG_SIZE];
+	char buf[IHKMOND_SIZE_READ + 64];
 	char fn[256];
-	int next_slot = 0;
-	struct ihk_device_read_kmsg_buf_desc desc = { .handle = handle, .shift = shift, .buf = buf };
-	
-	devfd = ihkmond_device_open(dev_index);
-	CHKANDJUMP(devfd < 0, -errno, "ihkmond_device_open returned %d\n", -errno);
-
-	nread = ioctl(devfd, IHK_DEVICE_READ_KMSG_BUF, (unsigned long)&desc);
-	CHKANDJUMP(nread < 0 || nread > IHK_KMSG_SIZE, nread, "ioctl failed\n");
-	if (nread == 0) {
-		dprintf("nread is zero\n");
-		goto out;
-	}
-	close(devfd);
-	devfd = -1;
+	int next_slot;
+	unsigned long lost = 0;
+	struct ihk_device_shift_kmsg_buf_desc desc_shift = { .handle = handle };
+
+	while ((nread = ihk_kmsg_read(kmsg_buf, seq, buf, IHKMOND_SIZE_READ, &lost)) > 0 || lost) {
+		if (lost) {
+			nread += sprintf(buf + nread, "** %lu kmsg records lost **\n", lost);
+			desc_shift.lost += lost;
+			lost = 0;
+		}
 
-	if (sizes[*prod] + nread > IHKMOND_SIZE_FILEBUF_SLOT) {
-		*prod = (*prod + 1) % IHKMOND_NUM_FILEBUF_SLOTS;
-		next_slot = 1;
-	}
+		next_slot = 0;
+		if (sizes[*prod] + nread > IHKMOND_SIZE_FILEBUF_SLOT) {
+			*prod = (*prod + 1) % IHKMOND_NUM_FILEBUF_SLOTS;
+			next_slot = 1;
+		}
 
-	if (next_slot || fps[*prod] == NULL) {
-		if (fps[*prod] == NULL) {
-			sprintf(fn, IHKMOND_TMP);
-			ret_lib = mkdir(fn, 0755);
-			CHKANDJUMP(ret_lib != 0 && errno != EEXIST, -errno, "mkdir failed\n");
+		if (next_slot || fps[*prod] == NULL) {
+			if (fps[*prod] == NULL) {
+				sprintf(fn, IHKMOND_TMP);
+				ret_lib = mkdir(fn, 0755);
+				CHKANDJUMP(ret_lib != 0 && errno != EEXIST, -errno, "mkdir failed\n");
+
+				sprintf(fn, IHKMOND_TMP "/mcos%d", os_index);
+				ret_lib = mkdir(fn, 0755);
+				CHKANDJUMP(ret_lib != 0 && errno != EEXIST, -errno, "mkdir failed\n");
+			} else {
+				fclose(fps[*prod]);
+				fps[*prod] = NULL;
+			}
 
-			sprintf(fn, IHKMOND_TMP "/mcos%d", os_index);
-			ret_lib = mkdir(fn, 0755);
-			CHKANDJUMP(ret_lib != 0 && errno != EEXIST, -errno, "mkdir failed\n");
-		} else {
-			fclose(fps[*prod]);
-			fps[*prod] = NULL;
+			sprintf(fn, IHKMOND_TMP "/mcos%d/kmsg%d", os_index, *prod);
+			fps[*prod] = fopen(fn, "w+");
+			CHKANDJUMP(fps[*prod] == NULL, -EINVAL, "fopen failed\n");
+			sizes[*prod] = 0;
+			dprintf("fn=%s\n", fn);
 		}
 
-		sprintf(fn, IHKMOND_TMP "/mcos%d/kmsg%d", os_index, *prod);
-		fps[*prod] = fopen(fn, "w+");
-		CHKANDJUMP(fps[*prod] == NULL, -EINVAL, "fopen failed\n"); 
-		sizes[*prod] = 0;
-		dprintf("fn=%s\n", fn);
+		ret = fwrite(buf, 1, nread, fps[*prod]);
+		sizes[*prod] += nread;
+		dprintf("fwrite returned %d\n", ret);
 	}
 
-	ret = fwrite(buf, 1, nread, fps[*prod]); 
-	sizes[*prod] += nread;
-	dprintf("fwrite returned %d\n", ret);
+	/* Let the LWK know the records have been consumed */
+	desc_shift.seq = *seq;
+	ret_lib = ioctl(devfd, IHK_DEVICE_SHIFT_KMSG_BUF, (unsigned long)&desc_shift);
+	CHKANDJUMP(ret_lib < 0, -errno, "IHK_DEVICE_SHIFT_KMSG_BUF failed\n");
  out:
-	if (devfd >= 0) {
-		close(devfd);
-	}
 	return ret;
 }
 
@@ -283,6 +295,7 @@ static ssize_t syslog_kmsg(FILE **fps, int prod) {
 	char *cur;
 	char *token;
 	int cons;
+	int nlines;
 	int i;
 
 	buf = malloc(IHKMOND_SIZE_FILEBUF_SLOT + 1);
@@ -314,6 +327,7 @@ static ssize_t syslog_kmsg(FILE **fps, int prod) {
 		fps[cons] = NULL;
 
 		cur = buf;
+		nlines = 0;
 		token = strsep(&cur, "\n");
 		while (token != NULL) {
 			if(*token == 0) {
@@ -321,7 +335,13 @@ static ssize_t syslog_kmsg(FILE **fps, int prod) {
 			}
 			dprintf("token=%s\n", token);
 			syslog(LOG_INFO, "%s", token);
-			usleep(200); /* Prevent syslog from dropping messages */
+
+			/* Prevent syslog from dropping messages by pacing
+			 * per batch, not per line
+			 */
+			if (++nlines % IHKMOND_SYSLOG_BATCH == 0) {
+				usleep(IHKMOND_SYSLOG_BATCH_DELAY);
+			}
 		empty_token:
 			token = strsep(&cur, "\n");
 		}
@@ -347,6 +367,8 @@ static void* redirect_kmsg(void* _arg) {
 	int sizes[IHKMOND_NUM_FILEBUF_SLOTS];
 	int prod = 0; /* Producer pointer */
 	struct ihk_device_get_kmsg_buf_desc desc_get;
+	struct ihk_kmsg_buf *kmsg_buf = MAP_FAILED;
+	unsigned long seq = 0; /* Consumer pointer */
 
 	memset(fps, 0, IHKMOND_NUM_FILEBUF_SLOTS * sizeof(FILE *));
 	memset(sizes, 0, IHKMOND_NUM_FILEBUF_SLOTS * sizeof(int));
@@ -386,9 +408,13 @@ static void* redirect_kmsg(void* _arg) {
 	ret_lib = ioctl(devfd, IHK_DEVICE_GET_KMSG_BUF, &desc_get);
 	CHKANDJUMP(ret_lib < 0, ret_lib, "IHK_DEVICE_GET_KMSG_BUF returned %d\n", ret_lib);
 
-	close(devfd);
-	devfd = -1;
-	
+	/* Consume kmsg_buf in place. Keep devfd open until releasing it. */
+	kmsg_buf = mmap(NULL, desc_get.size, PROT_READ, MAP_SHARED, devfd, desc_get.phys);
+	CHKANDJUMP(kmsg_buf == MAP_FAILED, -errno, "mmap kmsg_buf failed\n");
+	CHKANDJUMP(!ihk_kmsg_compatible(kmsg_buf), -EPROTO,
+		   "kmsg_buf has another layout, rebuild ihkmond\n");
+	seq = kmsg_buf->head;
+
 	/* Get notification when the amount of kmsg exceeds a threshold */
 	evfd_kmsg = ihk_os_get_eventfd(arg->os_index, IHK_OS_EVENTFD_TYPE_KMSG);
 	CHKANDJUMP(evfd_kmsg < 0, -EINVAL, "ihk_os_get_eventfd\n");
@@ -418,12 +444,12 @@ static void* redirect_kmsg(void* _arg) {
 			if (events[i].data.fd == evfd_kmsg) {
 				reap_event(events[i].data.fd);
 				dprintf("kmsg event detected\n");
-				ret_lib = fwrite_kmsg(arg->dev_index, desc_get.handle, arg->os_index, fps, sizes, &prod, 1);
+				ret_lib = fwrite_kmsg(devfd, desc_get.handle, kmsg_buf, &seq, arg->os_index, fps, sizes, &prod);
 				CHKANDJUMP(ret_lib < 0, -EINVAL, "fwrite_kmsg returned %d\n", ret_lib);
 			} else if (events[i].data.fd == evfd_status) {
 				reap_event(events[i].data.fd);
 				dprintf("LWK status event detected\n");
-				ret_lib = fwrite_kmsg(arg->dev_index, desc_get.handle, arg->os_index, fps, sizes, &prod, 1);
+				ret_lib = fwrite_kmsg(devfd, desc_get.handle, kmsg_buf, &seq, arg->os_index, fps, sizes, &prod);
 				CHKANDJUMP(ret_lib < 0, -EINVAL, "fwrite_kmsg returned %d\n", ret_lib);
 
 				ret_lib = syslog_kmsg(fps, prod);
@@ -431,7 +457,7 @@ static void* redirect_kmsg(void* _arg) {
 			} else if (events[i].data.fd == arg->evfd_mcos_removed) {
 				reap_event(events[i].data.fd);
 				dprintf("mcos remove event detected\n");
-				ret_lib = fwrite_kmsg(arg->dev_index, desc_get.handle, arg->os_index, fps, sizes, &prod, 1);
+				ret_lib = fwrite_kmsg(devfd, desc_get.handle, kmsg_buf, &seq, arg->os_index, fps, sizes, &prod);
 				CHKANDJUMP(ret_lib < 0, -EINVAL, "fwrite_kmsg returned %d\n", ret_lib);
 
 				ret_lib = syslog_kmsg(fps, prod);
@@ -439,8 +465,8 @@ static void* redirect_kmsg(void* _arg) {
 				dprintf("after syslog_kmsg for destroy\n");
 #if 1
 				/* Release (i.e. unref) kmsg_buf */
-				devfd = ihkmond_device_open(arg->dev_index); 
-				CHKANDJUMP(devfd < 0, -errno, "ihkmond_device_open returned %d\n", devfd);
+				munmap(kmsg_buf, desc_get.size);
+				kmsg_buf = MAP_FAILED;
 				ret_lib = ioctl(devfd, IHK_DEVICE_RELEASE_KMSG_BUF, desc_get.handle);
 				CHKANDJUMP(ret_lib != 0, ret_lib, "IHK_DEVICE_RELEASE_KMSG_BUF failed\n");
 				close(devfd);
@@ -480,6 +506,9 @@ static void* redirect_kmsg(void* _arg) {
 	} while (1);
 
 out:
+	if (kmsg_buf != MAP_FAILED) {
+		munmap(kmsg_buf, desc_get.size);
+	}
 	if (devfd >= 0) {
 		close(devfd);
 	}
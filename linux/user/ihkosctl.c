@@ -62,18 +62,23 @@ static int usage(char **arg)
 	fprintf(stderr, "    load (kernel.img)\n");
 	fprintf(stderr, "    boot\n");
 	fprintf(stderr, "    shutdown\n");
+	fprintf(stderr, "    reboot [scrub]\n");
 	fprintf(stderr, "    assign cpu|mem \n");
 	fprintf(stderr, "           cpu (cpu_list) \n");
 	fprintf(stderr, "           mem (size@NUMA) \n");
 	fprintf(stderr, "    release cpu|mem \n");
 	fprintf(stderr, "            cpu (cpu_list) \n");
 	fprintf(stderr, "            mem (size@NUMA) \n");
-	fprintf(stderr, "    set ikc_map (cpu_list:cpu+cpu_list:cpu+..) \n");
-	fprintf(stderr, "    get ikc_map\n");
+	fprintf(stderr, "    set ikc_map (cpu_list:cpu+cpu_list:cpu+..)|auto \n");
+	fprintf(stderr, "    get ikc_map [auto]\n");
+	fprintf(stderr, "    get ikc_stats\n");
 	fprintf(stderr, "    query [cpu|mem]\n");
 	fprintf(stderr, "    query_free_mem\n");
 	fprintf(stderr, "    kargs (kernel arg)\n");
 	fprintf(stderr, "    get status\n");
+	fprintf(stderr, "    top [rate_hz] [duration_ms] [trace_file]\n");
+	fprintf(stderr, "    perf stat (config,...) [duration_ms] [slice_ms] [nr_counters]\n");
+	fprintf(stderr, "    perf record (config,...) (file) [duration_ms] [period_ms]\n");
 	fprintf(stderr, "    kmsg\n");
 	fprintf(stderr, "    clear_kmsg\n");
 	fprintf(stderr, "    intr cpu irq_vector\n");
@@ -95,6 +100,17 @@ static int do_boot(int fd)
 	return r;
 }
 
+static int do_reboot(int index)
+{
+	int ret;
+
+	ret = ihk_os_reboot(index, __argc > 3 && !strcmp(__argv[3], "scrub"));
+	if (ret != 0) {
+		fprintf(stderr, "error: rebooting (%d)\n", ret);
+	}
+	return ret;
+}
+
 static int do_get_status(int index)
 {
 	int ret = 0, ret_ihklib;
@@ -135,6 +151,53 @@ static int do_get_status(int index)
 	goto fn_exit;
 }
 
+/* Set or only report with dry_run the map chosen from the topology */
+static int do_auto_ikc_map(int index, int dry_run)
+{
+	int ret = 0, ret_ihklib, num_cpus, i;
+	struct ihk_ikc_cpu_map *map = NULL;
+	struct ihk_ikc_req req_ikc = { 0 };
+	char *result = NULL;
+	long cost;
+
+	num_cpus = ihk_os_get_num_assigned_cpus(index);
+	IHKOSCTL_CHKANDJUMP(num_cpus <= 0, "get num of assigned cpus", -1);
+
+	map = calloc(num_cpus, sizeof(*map));
+	IHKOSCTL_CHKANDJUMP(!map, "allocate request space", -1);
+
+	ret_ihklib = ihk_os_auto_ikc_map(index, map, num_cpus, dry_run, &cost);
+	IHKOSCTL_CHKANDJUMP(ret_ihklib != 0, "error: ihk_os_auto_ikc_map", -1);
+
+	req_ikc.src_cpus = calloc(sizeof(int), num_cpus);
+	IHKOSCTL_CHKANDJUMP(!req_ikc.src_cpus, "allocate request space", -1);
+
+	req_ikc.dst_cpus = calloc(sizeof(int), num_cpus);
+	IHKOSCTL_CHKANDJUMP(!req_ikc.dst_cpus, "allocate request space", -1);
+
+	for (i = 0; i < num_cpus; i++) {
+		req_ikc.src_cpus[i] = map[i].src_cpu;
+		req_ikc.dst_cpus[i] = map[i].dst_cpu;
+	}
+	req_ikc.num_cpus = num_cpus;
+
+	result = ikc_req2str(&req_ikc);
+	IHKOSCTL_CHKANDJUMP(!result, "build result string", -1);
+
+	printf("%s\n", result);
+	printf("cost: %ld (%.1f per CPU, 0: shared LLC, 10: same node)\n",
+	       cost, (double)cost / num_cpus);
+
+ fn_exit:
+	free(map);
+	free(req_ikc.src_cpus);
+	free(req_ikc.dst_cpus);
+	free(result);
+	return ret;
+ fn_fail:
+	goto fn_exit;
+}
+
 static int do_get_ikc_map(int index)
 {
 	int ret = 0, ret_ioctl;
@@ -177,6 +240,34 @@ static int do_get_ikc_map(int index)
 	goto fn_exit;
 }
 
+static int do_get_ikc_stats(int index)
+{
+	int ret = 0, ret_ihklib;
+	struct ihk_ikc_stats stats;
+
+	ret_ihklib = ihk_os_get_ikc_stats(index, &stats);
+	IHKOSCTL_CHKANDJUMP(ret_ihklib != 0, "error: ihk_os_get_ikc_stats", -1);
+
+	printf("%-8s %10s %10s\n", "", "local", "remote");
+	printf("%-8s %10lu %10lu\n", "queues",
+	       stats.nr_queues_local, stats.nr_queues_remote);
+	printf("%-8s %10lu %10lu\n", "descs",
+	       stats.nr_descs_local, stats.nr_descs_remote);
+
+	printf("\n%-8s %10s %10s %10s\n", "lane", "sent", "received",
+	       "full");
+	printf("%-8s %10lu %10lu %10lu\n", "prio",
+	       stats.prio_sent, stats.prio_received, stats.prio_full);
+	printf("%-8s %10lu %10lu %10lu\n", "bulk",
+	       stats.bulk_sent, stats.bulk_received, stats.bulk_full);
+	printf("%lu channel(s) with a priority lane\n", stats.nr_prio_lanes);
+
+ fn_exit:
+	return ret;
+ fn_fail:
+	goto fn_exit;
+}
+
 static int do_get_buildid(int index)
 {
 	int ret = 0;
@@ -213,7 +304,12 @@ static int do_get(int index)
 	if (!strcmp(__argv[3], "status")) {
 		return do_get_status(index);
 	} else if (!strcmp(__argv[3], "ikc_map")) {
+		if (__argc > 4 && !strcmp(__argv[4], "auto")) {
+			return do_auto_ikc_map(index, 1);
+		}
 		return do_get_ikc_map(index);
+	} else if (!strcmp(__argv[3], "ikc_stats")) {
+		return do_get_ikc_stats(index);
 	} else if (!strcmp(__argv[3], "buildid")) {
 		return do_get_buildid(index);
 	} else {
@@ -341,6 +437,10 @@ static int do_set_ikc_map(int fd)
 		return -1;
 	}
 
+	if (!strcmp(__argv[4], "auto")) {
+		return do_auto_ikc_map(atoi(__argv[1]), 0);
+	}
+
 	/* Parse ikc_map list */
 	cnt = ikc_str2count(__argv[4]);
 	IHKOSCTL_CHKANDJUMP(cnt <= 0,
@@ -689,6 +789,154 @@ static int do_kargs(int fd)
 	return r;
 }
 
+/* Print how much time each CPU spent in each state */
+static int do_top(int index)
+{
+	int ret = 0, ret_ihklib;
+	int rate = 1000, duration_ms = 1000;
+	char *trace_file = NULL;
+	struct ihk_os_cpu_state_hist *hist = NULL;
+	int num_cpus;
+	int i;
+
+	if (__argc > 3) {
+		rate = atoi(__argv[3]);
+	}
+	if (__argc > 4) {
+		duration_ms = atoi(__argv[4]);
+	}
+	if (__argc > 5) {
+		trace_file = __argv[5];
+	}
+
+	num_cpus = ihk_os_get_num_assigned_cpus(index);
+	IHKOSCTL_CHKANDJUMP(num_cpus <= 0,
+			    "error: ihk_os_get_num_assigned_cpus", -1);
+
+	hist = calloc(num_cpus, sizeof(*hist));
+	IHKOSCTL_CHKANDJUMP(hist == NULL, "error: calloc", -1);
+
+	ret_ihklib = ihk_os_sample_cpu_state(index, rate, duration_ms,
+					     hist, num_cpus, trace_file);
+	IHKOSCTL_CHKANDJUMP(ret_ihklib <= 0,
+			    "error: ihk_os_sample_cpu_state", -1);
+
+	printf("%4s %7s %7s %7s %7s %7s\n",
+	       "CPU", "idle%", "user%", "kernel%", "offload%", "other%");
+	for (i = 0; i < num_cpus; i++) {
+		unsigned long *nr = hist[i].nr_samples;
+		unsigned long other = nr[IHK_OS_CPU_STATE_NOT_BOOT] +
+			nr[IHK_OS_CPU_STATE_FROZEN] +
+			nr[IHK_OS_CPU_STATE_PANIC] +
+			nr[IHK_OS_CPU_STATE_OTHER];
+
+		printf("%4d %7.1f %7.1f %7.1f %7.1f %7.1f\n", i,
+		       100.0 * nr[IHK_OS_CPU_STATE_IDLE] / ret_ihklib,
+		       100.0 * nr[IHK_OS_CPU_STATE_USER] / ret_ihklib,
+		       100.0 * nr[IHK_OS_CPU_STATE_KERNEL] / ret_ihklib,
+		       100.0 * nr[IHK_OS_CPU_STATE_OFFLOAD] / ret_ihklib,
+		       100.0 * other / ret_ihklib);
+	}
+
+ fn_exit:
+	free(hist);
+	return ret;
+ fn_fail:
+	goto fn_exit;
+}
+
+/* Parse a comma separated list of raw event configs */
+static int parse_perf_events(char *list, ihk_perf_event_attr **attr)
+{
+	char *token, *end;
+	ihk_perf_event_attr *new;
+	int n = 0;
+
+	*attr = NULL;
+	for (token = strtok(list, ","); token; token = strtok(NULL, ",")) {
+		new = realloc(*attr, sizeof(**attr) * (n + 1));
+		if (new == NULL) {
+			return -1;
+		}
+		*attr = new;
+		memset(&(*attr)[n], 0, sizeof(**attr));
+		(*attr)[n].config = strtoul(token, &end, 0);
+		if (*end != '\0') {
+			return -1;
+		}
+		n++;
+	}
+	return n;
+}
+
+/* Count events with multiplexing, or record per-CPU counter samples */
+static int do_perf(int index)
+{
+	int ret = 0, ret_ihklib;
+	ihk_perf_event_attr *attr = NULL;
+	struct ihk_perf_count *counts = NULL;
+	int duration_ms = 1000, slice_ms = 10, period_ms = 100;
+	int nr_counters = 0;
+	int n, i;
+
+	IHKOSCTL_CHKANDJUMP(__argc < 5, "error: missing arguments", -1);
+
+	n = parse_perf_events(__argv[4], &attr);
+	IHKOSCTL_CHKANDJUMP(n <= 0, "error: invalid event list", -1);
+
+	if (!strcmp(__argv[3], "stat")) {
+		if (__argc > 5) {
+			duration_ms = atoi(__argv[5]);
+		}
+		if (__argc > 6) {
+			slice_ms = atoi(__argv[6]);
+		}
+		if (__argc > 7) {
+			nr_counters = atoi(__argv[7]);
+		}
+
+		counts = calloc(n, sizeof(*counts));
+		IHKOSCTL_CHKANDJUMP(counts == NULL, "error: calloc", -1);
+
+		ret_ihklib = ihk_os_perf_stat(index, attr, n, nr_counters,
+					      slice_ms, duration_ms, counts);
+		IHKOSCTL_CHKANDJUMP(ret_ihklib != 0,
+				    "error: ihk_os_perf_stat", -1);
+
+		printf("%20s %18s %9s\n", "count", "event", "running%");
+		for (i = 0; i < n; i++) {
+			printf("%20lu %#18lx %9.1f\n", counts[i].value,
+			       attr[i].config,
+			       counts[i].time_enabled ?
+			       100.0 * counts[i].time_running /
+			       counts[i].time_enabled : 0.0);
+		}
+	} else if (!strcmp(__argv[3], "record")) {
+		IHKOSCTL_CHKANDJUMP(__argc < 6, "error: missing file", -1);
+		if (__argc > 6) {
+			duration_ms = atoi(__argv[6]);
+		}
+		if (__argc > 7) {
+			period_ms = atoi(__argv[7]);
+		}
+
+		ret_ihklib = ihk_os_perf_record(index, attr, n, period_ms,
+						duration_ms, __argv[5]);
+		IHKOSCTL_CHKANDJUMP(ret_ihklib < 0,
+				    "error: ihk_os_perf_record", -1);
+		printf("%d samples recorded to %s\n", ret_ihklib, __argv[5]);
+	} else {
+		IHKOSCTL_CHKANDJUMP(1, "error: unknown perf command", -1);
+	}
+
+ fn_exit:
+	free(counts);
+	free(attr);
+	return ret;
+ fn_fail:
+	goto fn_exit;
+}
+
 static int do_kmsg(int fd)
 {
 	char buf[IHK_KMSG_SIZE];
@@ -827,6 +1075,9 @@ int main(int argc, char **argv)
 
 	HANDLER_WITH_INDEX(get)
 	else HANDLER_WITH_INDEX(dump)
+	else HANDLER_WITH_INDEX(top)
+	else HANDLER_WITH_INDEX(perf)
+	else HANDLER_WITH_INDEX(reboot)
 
 	sprintf(fn, "/dev/mcos%d", atoi(argv[1]));
 
@@ -33,7 +33,8 @@ int main(int argc, char **argv)
 	// kill ihkmond
 	status = system("pid=`pidof ihkmond`&&if [ \"${pid}\" != \"\" ]; then kill -9 ${pid}; fi");
 
-	sprintf(cmd, "insmod %s/kmod/ihk.ko", QUOTE(MCK_DIR));
+	sprintf(cmd, "insmod %s/kmod/ihk.ko ihk_kmsg_size=1024",
+		QUOTE(MCK_DIR));
 	status = system(cmd);
 	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system insmod");
 
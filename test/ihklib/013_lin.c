@@ -39,7 +39,8 @@ int main(int argc, char **argv)
 	status = system(cmd);
 	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system /sbin/ihkmond");
 
-	sprintf(cmd, "insmod %s/kmod/ihk.ko", QUOTE(MCK_DIR));
+	sprintf(cmd, "insmod %s/kmod/ihk.ko ihk_kmsg_size=1024",
+		QUOTE(MCK_DIR));
 	status = system(cmd);
 	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system insmod");
 
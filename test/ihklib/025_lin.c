@@ -0,0 +1,214 @@
+/**
+ * \file ihklib025_lin.c
+ *  License details are found in the file LICENSE.
+ * \brief
+ *  Test ihk_device_handle_open(), ihk_os_handle_open() and the _h
+ *  variants of the query functions
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ihklib.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <time.h>
+#include "util.h"
+
+#define NLOOP 100000
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	int ret, status;
+	int i;
+	FILE *fp;
+	size_t nread;
+
+	char cmd[1024];
+	char logname[256], *envstr, *groups;
+
+	int cpus[4];
+	int num_cpus;
+
+	struct ihk_device_handle *dev_handle = NULL;
+	struct ihk_os_handle *os_handle = NULL;
+	double t_index, t_handle;
+
+	char *retstr;
+
+	fp = popen("logname", "r");
+	nread = fread(logname, 1, sizeof(logname), fp);
+	CHKANDJUMP(nread == 0, -1, "fread");
+	retstr = strrchr(logname, '\n');
+	if (retstr) {
+		*retstr = 0;
+	}
+
+	envstr = getenv("MYGROUPS");
+	CHKANDJUMP(envstr == NULL, -1, "groups");
+	groups = strdup(envstr);
+	retstr = strrchr(groups, '\n');
+	if (retstr) {
+		*retstr = 0;
+	}
+
+	if (geteuid() != 0) {
+		printf("Execute as a root\n");
+	}
+
+	sprintf(cmd, "insmod %s/kmod/ihk.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "insmod %s/kmod/ihk-smp-%s.ko "
+		"ihk_start_irq=240 ihk_ikc_irq_core=0",
+		QUOTE(MCK_DIR), QUOTE(ARCH));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "chown %s:%s /dev/mcd*\n", logname, groups);
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "insmod %s/kmod/mcctrl.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	// open device handle (error handling)
+	ret = ihk_device_handle_open(1, &dev_handle);
+	OKNG(ret == -ENOENT,
+	     "ihk_device_handle_open returned -ENOENT as expected\n");
+
+	// open device handle
+	ret = ihk_device_handle_open(0, &dev_handle);
+	OKNG(ret == 0 && dev_handle, "ihk_device_handle_open succeeded\n");
+
+	// reserve cpu
+	cpus[0] = 1;
+	cpus[1] = 2;
+	cpus[2] = 3;
+	num_cpus = 3;
+	ret = ihk_reserve_cpu(0, cpus, num_cpus);
+	OKNG(ret == 0, "ihk_reserve_cpu 1,2,3 succeeded\n");
+
+	// the handle sees the reservation made after it was opened
+	num_cpus = ihk_get_num_reserved_cpus_h(dev_handle);
+	OKNG(num_cpus == 3, "ihk_get_num_reserved_cpus_h returned 3\n");
+
+	memset(cpus, 0, sizeof(cpus));
+	ret = ihk_query_cpu_h(dev_handle, cpus, num_cpus);
+	OKNG(ret == 0 &&
+		 cpus[0] == 1 &&
+		 cpus[1] == 2 &&
+		 cpus[2] == 3, "ihk_query_cpu_h returned 1,2,3\n");
+
+	// create 0
+	ret = ihk_create_os(0);
+	OKNG(ret == 0, "ihk_create_os succeeded\n");
+
+	sprintf(cmd, "chown %s:%s /dev/mcos*\n", logname, groups);
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	// open OS handle (error handling)
+	ret = ihk_os_handle_open(1, &os_handle);
+	OKNG(ret == -ENOENT,
+	     "ihk_os_handle_open returned -ENOENT as expected\n");
+
+	// open OS handle
+	ret = ihk_os_handle_open(0, &os_handle);
+	OKNG(ret == 0 && os_handle, "ihk_os_handle_open succeeded\n");
+
+	ret = ihk_os_get_status_h(os_handle);
+	OKNG(ret == IHK_STATUS_INACTIVE,
+		"ihk_os_get_status_h returned IHK_STATUS_INACTIVE\n");
+
+	// assign cpu 1,2,3
+	ret = ihk_os_assign_cpu(0, cpus, num_cpus);
+	OKNG(ret == 0, "ihk_os_assign_cpu 1,2,3 succeeded\n");
+
+	num_cpus = ihk_os_get_num_assigned_cpus_h(os_handle);
+	OKNG(num_cpus == 3, "ihk_os_get_num_assigned_cpus_h returned 3\n");
+
+	memset(cpus, 0, sizeof(cpus));
+	ret = ihk_os_query_cpu_h(os_handle, cpus, num_cpus);
+	OKNG(ret == 0 &&
+		 cpus[0] == 1 &&
+		 cpus[1] == 2 &&
+		 cpus[2] == 3, "ihk_os_query_cpu_h returned 1,2,3\n");
+
+	// get assigned cpus (error handling)
+	ret = ihk_os_query_cpu_h(os_handle, cpus, num_cpus + 1);
+	OKNG(ret == -EINVAL,
+	     "ihk_os_query_cpu_h returned -EINVAL as expected\n");
+
+	// compare polling cost
+	t_index = now();
+	for (i = 0; i < NLOOP; i++) {
+		ret = ihk_os_get_status(0);
+		NG(ret == IHK_STATUS_INACTIVE,
+		   "ihk_os_get_status returned %d\n", ret);
+	}
+	t_index = now() - t_index;
+
+	t_handle = now();
+	for (i = 0; i < NLOOP; i++) {
+		ret = ihk_os_get_status_h(os_handle);
+		NG(ret == IHK_STATUS_INACTIVE,
+		   "ihk_os_get_status_h returned %d\n", ret);
+	}
+	t_handle = now() - t_handle;
+
+	printf("[INFO] ihk_os_get_status: %.2f usec/call, ihk_os_get_status_h: %.2f usec/call\n",
+	       t_index * 1e6 / NLOOP, t_handle * 1e6 / NLOOP);
+
+	// release cpu
+	ret = ihk_os_release_cpu(0, cpus, num_cpus);
+	OKNG(ret == 0, "ihk_os_release_cpu 1,2,3 succeeded\n");
+
+	ihk_os_handle_close(os_handle);
+	os_handle = NULL;
+
+	// destroy OS
+	ret = ihk_destroy_os(0, 0);
+	OKNG(ret == 0, "ihk_destroy_os succeeded\n");
+
+	// release cpu
+	ret = ihk_release_cpu(0, cpus, num_cpus);
+	OKNG(ret == 0, "ihk_release_cpu 1,2,3 succeeded\n");
+
+	ihk_device_handle_close(dev_handle);
+	dev_handle = NULL;
+
+	// rmmod modules
+	sprintf(cmd, "rmmod %s/kmod/mcctrl.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "rmmod %s/kmod/ihk-smp-%s.ko",
+		QUOTE(MCK_DIR), QUOTE(ARCH));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1,
+		   "rmmod ihk-smp-x86 failed\n");
+
+	sprintf(cmd, "rmmod %s/kmod/ihk.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	printf("[INFO] All tests finished\n");
+	ret = 0;
+
+ fn_fail:
+	ihk_os_handle_close(os_handle);
+	ihk_device_handle_close(dev_handle);
+	return ret;
+}
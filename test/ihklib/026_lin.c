@@ -0,0 +1,207 @@
+/**
+ * \file ihklib026_lin.c
+ *  License details are found in the file LICENSE.
+ * \brief
+ *  Test ihk_os_freeze() and ihk_os_thaw() on a booted OS instance
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ihklib.h>
+#include <sys/types.h>
+#include <errno.h>
+#include "util.h"
+
+int main(int argc, char **argv)
+{
+	int ret, status;
+	FILE *fp;
+	size_t nread;
+
+	char cmd[1024];
+	char fn[256];
+	char kargs[256];
+	char logname[256], *envstr, *groups;
+
+	int cpus[4];
+	int num_cpus;
+
+	struct ihk_mem_chunk mem_chunks[4];
+	int num_mem_chunks;
+
+	unsigned long os_set[1];
+
+	char *retstr;
+
+	fp = popen("logname", "r");
+	nread = fread(logname, 1, sizeof(logname), fp);
+	CHKANDJUMP(nread == 0, -1, "fread");
+	retstr = strrchr(logname, '\n');
+	if (retstr) {
+		*retstr = 0;
+	}
+
+	envstr = getenv("MYGROUPS");
+	CHKANDJUMP(envstr == NULL, -1, "groups");
+	groups = strdup(envstr);
+	retstr = strrchr(groups, '\n');
+	if (retstr) {
+		*retstr = 0;
+	}
+
+	if (geteuid() != 0) {
+		printf("Execute as a root\n");
+	}
+
+	sprintf(cmd, "insmod %s/kmod/ihk.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "insmod %s/kmod/ihk-smp-%s.ko "
+		"ihk_start_irq=240 ihk_ikc_irq_core=0",
+		QUOTE(MCK_DIR), QUOTE(ARCH));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "chown %s:%s /dev/mcd*\n", logname, groups);
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "insmod %s/kmod/mcctrl.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	// reserve cpu
+	cpus[0] = 1;
+	cpus[1] = 2;
+	cpus[2] = 3;
+	num_cpus = 3;
+	ret = ihk_reserve_cpu(0, cpus, num_cpus);
+	OKNG(ret == 0, "ihk_reserve_cpu 1,2,3 succeeded\n");
+
+	// reserve mem 128m@0
+	num_mem_chunks = 1;
+	mem_chunks[0].size = 128*1024*1024ULL;
+	mem_chunks[0].numa_node_number = 0;
+	ret = ihk_reserve_mem(0, mem_chunks, num_mem_chunks);
+	OKNG(ret == 0, "ihk_reserve_mem 128m@0 succeeded\n");
+
+	// create 0
+	ret = ihk_create_os(0);
+	OKNG(ret == 0, "ihk_create_os succeeded\n");
+
+	sprintf(cmd, "chown %s:%s /dev/mcos*\n", logname, groups);
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	// assign cpu 1,2,3
+	ret = ihk_os_assign_cpu(0, cpus, num_cpus);
+	OKNG(ret == 0, "ihk_os_assign_cpu 1,2,3 succeeded\n");
+
+	// assign mem 128m@0
+	ret = ihk_os_assign_mem(0, mem_chunks, num_mem_chunks);
+	OKNG(ret == 0, "ihk_os_assign_mem 128m@0 succeeded\n");
+
+	os_set[0] = 1UL << 0;
+
+	// freeze (error handling)
+	ret = ihk_os_freeze(os_set, 1);
+	OKNG(ret == -EINVAL,
+	     "ihk_os_freeze of an OS not booted returned -EINVAL\n");
+
+	// load
+	sprintf(fn, "%s/%s/kernel/mckernel.img",
+		QUOTE(MCK_DIR), QUOTE(TARGET));
+	ret = ihk_os_load(0, fn);
+	OKNG(ret == 0, "ihk_os_load succeeded\n");
+
+	// kargs
+	sprintf(kargs, "hidos ksyslogd=0");
+	ret = ihk_os_kargs(0, kargs);
+	OKNG(ret == 0, "ihk_os_kargs succeeded\n");
+
+	// boot
+	ret = ihk_os_boot(0);
+	OKNG(ret == 0, "ihk_os_boot succeeded\n");
+
+	ret = ihk_os_get_status(0);
+	OKNG(ret == IHK_STATUS_RUNNING,
+	     "ihk_os_get_status returned IHK_STATUS_RUNNING\n");
+
+	// freeze
+	ret = ihk_os_freeze(os_set, 1);
+	OKNG(ret == 0, "ihk_os_freeze succeeded\n");
+
+	ret = ihk_os_get_status(0);
+	OKNG(ret == IHK_STATUS_FROZEN,
+	     "ihk_os_get_status returned IHK_STATUS_FROZEN\n");
+
+	// freeze twice
+	ret = ihk_os_freeze(os_set, 1);
+	OKNG(ret == 0, "ihk_os_freeze of a frozen OS succeeded\n");
+
+	// thaw
+	ret = ihk_os_thaw(os_set, 1);
+	OKNG(ret == 0, "ihk_os_thaw succeeded\n");
+
+	ret = ihk_os_get_status(0);
+	OKNG(ret == IHK_STATUS_RUNNING,
+	     "ihk_os_get_status returned IHK_STATUS_RUNNING after thaw\n");
+
+	// freeze and thaw again
+	ret = ihk_os_freeze(os_set, 1);
+	OKNG(ret == 0, "ihk_os_freeze (2) succeeded\n");
+
+	ret = ihk_os_thaw(os_set, 1);
+	OKNG(ret == 0, "ihk_os_thaw (2) succeeded\n");
+
+	ret = ihk_os_get_status(0);
+	OKNG(ret == IHK_STATUS_RUNNING,
+	     "ihk_os_get_status returned IHK_STATUS_RUNNING after thaw (2)\n");
+
+	// freeze (error handling)
+	os_set[0] = 1UL << 1;
+	ret = ihk_os_freeze(os_set, 2);
+	OKNG(ret == -ENOENT,
+	     "ihk_os_freeze of a non-existent OS returned -ENOENT\n");
+
+	// shutdown
+	ret = ihk_os_shutdown(0);
+	OKNG(ret == 0, "ihk_os_shutdown succeeded\n");
+
+	// destroy os
+	usleep(250*1000); // Wait for nothing is in-flight
+	ret = ihk_destroy_os(0, 0);
+	OKNG(ret == 0, "ihk_destroy_os succeeded\n");
+
+	// release mem
+	ret = ihk_release_mem(0, mem_chunks, num_mem_chunks);
+	OKNG(ret == 0, "ihk_release_mem succeeded\n");
+
+	// release cpu
+	ret = ihk_release_cpu(0, cpus, num_cpus);
+	OKNG(ret == 0, "ihk_release_cpu 1,2,3 succeeded\n");
+
+	// rmmod modules
+	sprintf(cmd, "rmmod %s/kmod/mcctrl.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "rmmod %s/kmod/ihk-smp-%s.ko",
+		QUOTE(MCK_DIR), QUOTE(ARCH));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1,
+		   "rmmod ihk-smp-x86 failed\n");
+
+	sprintf(cmd, "rmmod %s/kmod/ihk.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	printf("[INFO] All tests finished\n");
+	ret = 0;
+
+ fn_fail:
+	return ret;
+}
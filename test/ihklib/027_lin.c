@@ -0,0 +1,208 @@
+/**
+ * \file ihklib027_lin.c
+ *  License details are found in the file LICENSE.
+ * \brief
+ *  Test ihk_os_map_rusage() and ihk_os_read_rusage()
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ihklib.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <errno.h>
+#include "util.h"
+
+int main(int argc, char **argv)
+{
+	int ret, status;
+	FILE *fp;
+	size_t nread;
+
+	char cmd[1024];
+	char fn[256];
+	char kargs[256];
+	char logname[256], *envstr, *groups;
+
+	int cpus[4];
+	int num_cpus;
+
+	struct ihk_mem_chunk mem_chunks[4];
+	int num_mem_chunks;
+
+	struct ihk_os_rusage_snapshot *snapshot;
+	struct ihk_os_rusage rusage, rusage_ioctl;
+
+	char *retstr;
+
+	fp = popen("logname", "r");
+	nread = fread(logname, 1, sizeof(logname), fp);
+	CHKANDJUMP(nread == 0, -1, "fread");
+	retstr = strrchr(logname, '\n');
+	if (retstr) {
+		*retstr = 0;
+	}
+
+	envstr = getenv("MYGROUPS");
+	CHKANDJUMP(envstr == NULL, -1, "groups");
+	groups = strdup(envstr);
+	retstr = strrchr(groups, '\n');
+	if (retstr) {
+		*retstr = 0;
+	}
+
+	if (geteuid() != 0) {
+		printf("Execute as a root\n");
+	}
+
+	sprintf(cmd, "insmod %s/kmod/ihk.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "insmod %s/kmod/ihk-smp-%s.ko "
+		"ihk_start_irq=240 ihk_ikc_irq_core=0",
+		QUOTE(MCK_DIR), QUOTE(ARCH));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "chown %s:%s /dev/mcd*\n", logname, groups);
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "insmod %s/kmod/mcctrl.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	// reserve cpu
+	cpus[0] = 1;
+	cpus[1] = 2;
+	cpus[2] = 3;
+	num_cpus = 3;
+	ret = ihk_reserve_cpu(0, cpus, num_cpus);
+	OKNG(ret == 0, "ihk_reserve_cpu 1,2,3 succeeded\n");
+
+	// reserve mem 128m@0
+	num_mem_chunks = 1;
+	mem_chunks[0].size = 128*1024*1024ULL;
+	mem_chunks[0].numa_node_number = 0;
+	ret = ihk_reserve_mem(0, mem_chunks, num_mem_chunks);
+	OKNG(ret == 0, "ihk_reserve_mem 128m@0 succeeded\n");
+
+	// create 0
+	ret = ihk_create_os(0);
+	OKNG(ret == 0, "ihk_create_os succeeded\n");
+
+	sprintf(cmd, "chown %s:%s /dev/mcos*\n", logname, groups);
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	// assign cpu 1,2,3
+	ret = ihk_os_assign_cpu(0, cpus, num_cpus);
+	OKNG(ret == 0, "ihk_os_assign_cpu 1,2,3 succeeded\n");
+
+	// assign mem 128m@0
+	ret = ihk_os_assign_mem(0, mem_chunks, num_mem_chunks);
+	OKNG(ret == 0, "ihk_os_assign_mem 128m@0 succeeded\n");
+
+	// map rusage (error handling)
+	ret = ihk_os_map_rusage(0, &snapshot);
+	OKNG(ret == -EAGAIN,
+	     "ihk_os_map_rusage of an OS not booted returned -EAGAIN\n");
+
+	// load
+	sprintf(fn, "%s/%s/kernel/mckernel.img",
+		QUOTE(MCK_DIR), QUOTE(TARGET));
+	ret = ihk_os_load(0, fn);
+	OKNG(ret == 0, "ihk_os_load succeeded\n");
+
+	// kargs
+	sprintf(kargs, "hidos ksyslogd=0");
+	ret = ihk_os_kargs(0, kargs);
+	OKNG(ret == 0, "ihk_os_kargs succeeded\n");
+
+	// boot
+	ret = ihk_os_boot(0);
+	OKNG(ret == 0, "ihk_os_boot succeeded\n");
+
+	// map rusage
+	ret = ihk_os_map_rusage(0, &snapshot);
+	OKNG(ret == 0, "ihk_os_map_rusage succeeded\n");
+
+	// read
+	memset(&rusage, 0xff, sizeof(rusage));
+	ret = ihk_os_read_rusage(snapshot, &rusage, sizeof(rusage));
+	OKNG(ret == 0, "ihk_os_read_rusage succeeded\n");
+
+	// compare with the ioctl, no thread is created or exits meanwhile
+	ret = ihk_os_getrusage(0, &rusage_ioctl, sizeof(rusage_ioctl));
+	OKNG(ret == 0, "ihk_os_getrusage succeeded\n");
+
+	OKNG(rusage.num_threads == rusage_ioctl.num_threads &&
+	     rusage.max_num_threads == rusage_ioctl.max_num_threads,
+	     "ihk_os_read_rusage and ihk_os_getrusage agree on "
+	     "the number of threads\n");
+
+	// read the head only
+	memset(&rusage_ioctl, 0xff, sizeof(rusage_ioctl));
+	ret = ihk_os_read_rusage(snapshot, &rusage_ioctl,
+				 offsetof(struct ihk_os_rusage,
+					  memory_max_usage));
+	OKNG(ret == 0, "ihk_os_read_rusage of a part succeeded\n");
+
+	OKNG(rusage_ioctl.memory_max_usage == (unsigned long)-1,
+	     "ihk_os_read_rusage didn't write past the size\n");
+
+	// read (error handling)
+	ret = ihk_os_read_rusage(snapshot, &rusage, sizeof(rusage) + 1);
+	OKNG(ret == -EINVAL,
+	     "ihk_os_read_rusage of a too large size returned -EINVAL\n");
+
+	// unmap
+	ret = ihk_os_unmap_rusage(snapshot);
+	OKNG(ret == 0, "ihk_os_unmap_rusage succeeded\n");
+
+	// shutdown
+	ret = ihk_os_shutdown(0);
+	OKNG(ret == 0, "ihk_os_shutdown succeeded\n");
+
+	// map rusage (error handling)
+	ret = ihk_os_map_rusage(0, &snapshot);
+	OKNG(ret == -EAGAIN,
+	     "ihk_os_map_rusage of an OS shut down returned -EAGAIN\n");
+
+	// destroy os
+	usleep(250*1000); // Wait for nothing is in-flight
+	ret = ihk_destroy_os(0, 0);
+	OKNG(ret == 0, "ihk_destroy_os succeeded\n");
+
+	// release mem
+	ret = ihk_release_mem(0, mem_chunks, num_mem_chunks);
+	OKNG(ret == 0, "ihk_release_mem succeeded\n");
+
+	// release cpu
+	ret = ihk_release_cpu(0, cpus, num_cpus);
+	OKNG(ret == 0, "ihk_release_cpu 1,2,3 succeeded\n");
+
+	// rmmod modules
+	sprintf(cmd, "rmmod %s/kmod/mcctrl.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "rmmod %s/kmod/ihk-smp-%s.ko",
+		QUOTE(MCK_DIR), QUOTE(ARCH));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1,
+		   "rmmod ihk-smp-x86 failed\n");
+
+	sprintf(cmd, "rmmod %s/kmod/ihk.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	printf("[INFO] All tests finished\n");
+	ret = 0;
+
+ fn_fail:
+	return ret;
+}
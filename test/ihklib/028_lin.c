@@ -0,0 +1,246 @@
+/**
+ * \file ihklib028_lin.c
+ *  License details are found in the file LICENSE.
+ * \brief
+ *  Test ihk_os_rusage_stream_{open,read,close}() and
+ *  ihk_os_rusage_apply_record()
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ihklib.h>
+#include <sys/types.h>
+#include <errno.h>
+#include "util.h"
+
+int main(int argc, char **argv)
+{
+	int ret, status;
+	FILE *fp;
+	size_t nread;
+
+	char cmd[1024];
+	char fn[256];
+	char kargs[256];
+	char logname[256], *envstr, *groups;
+
+	int cpus[4];
+	int num_cpus;
+
+	struct ihk_mem_chunk mem_chunks[4];
+	int num_mem_chunks;
+
+	struct ihk_os_rusage_stream *stream;
+	struct ihk_os_rusage_record_header *header, bad;
+	struct ihk_os_rusage rusage, rusage_ioctl;
+	char *buf;
+	int size;
+
+	char *retstr;
+
+	fp = popen("logname", "r");
+	nread = fread(logname, 1, sizeof(logname), fp);
+	CHKANDJUMP(nread == 0, -1, "fread");
+	retstr = strrchr(logname, '\n');
+	if (retstr) {
+		*retstr = 0;
+	}
+
+	envstr = getenv("MYGROUPS");
+	CHKANDJUMP(envstr == NULL, -1, "groups");
+	groups = strdup(envstr);
+	retstr = strrchr(groups, '\n');
+	if (retstr) {
+		*retstr = 0;
+	}
+
+	if (geteuid() != 0) {
+		printf("Execute as a root\n");
+	}
+
+	sprintf(cmd, "insmod %s/kmod/ihk.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "insmod %s/kmod/ihk-smp-%s.ko "
+		"ihk_start_irq=240 ihk_ikc_irq_core=0",
+		QUOTE(MCK_DIR), QUOTE(ARCH));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "chown %s:%s /dev/mcd*\n", logname, groups);
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "insmod %s/kmod/mcctrl.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	// reserve cpu
+	cpus[0] = 1;
+	cpus[1] = 2;
+	cpus[2] = 3;
+	num_cpus = 3;
+	ret = ihk_reserve_cpu(0, cpus, num_cpus);
+	OKNG(ret == 0, "ihk_reserve_cpu 1,2,3 succeeded\n");
+
+	// reserve mem 128m@0
+	num_mem_chunks = 1;
+	mem_chunks[0].size = 128*1024*1024ULL;
+	mem_chunks[0].numa_node_number = 0;
+	ret = ihk_reserve_mem(0, mem_chunks, num_mem_chunks);
+	OKNG(ret == 0, "ihk_reserve_mem 128m@0 succeeded\n");
+
+	// create 0
+	ret = ihk_create_os(0);
+	OKNG(ret == 0, "ihk_create_os succeeded\n");
+
+	sprintf(cmd, "chown %s:%s /dev/mcos*\n", logname, groups);
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	// assign cpu 1,2,3
+	ret = ihk_os_assign_cpu(0, cpus, num_cpus);
+	OKNG(ret == 0, "ihk_os_assign_cpu 1,2,3 succeeded\n");
+
+	// assign mem 128m@0
+	ret = ihk_os_assign_mem(0, mem_chunks, num_mem_chunks);
+	OKNG(ret == 0, "ihk_os_assign_mem 128m@0 succeeded\n");
+
+	buf = malloc(IHK_OS_RUSAGE_RECORD_MAX_SIZE);
+	CHKANDJUMP(buf == NULL, -1, "malloc");
+	header = (struct ihk_os_rusage_record_header *)buf;
+
+	// stream (error handling)
+	ret = ihk_os_rusage_stream_open(0, &stream);
+	OKNG(ret == 0, "ihk_os_rusage_stream_open of an OS not booted "
+	     "succeeded\n");
+
+	ret = ihk_os_rusage_stream_read(stream, buf,
+					IHK_OS_RUSAGE_RECORD_MAX_SIZE);
+	OKNG(ret == -ESTALE,
+	     "ihk_os_rusage_stream_read of an OS not booted returned -ESTALE\n");
+
+	ret = ihk_os_rusage_stream_close(stream);
+	OKNG(ret == 0, "ihk_os_rusage_stream_close succeeded\n");
+
+	// load
+	sprintf(fn, "%s/%s/kernel/mckernel.img",
+		QUOTE(MCK_DIR), QUOTE(TARGET));
+	ret = ihk_os_load(0, fn);
+	OKNG(ret == 0, "ihk_os_load succeeded\n");
+
+	// kargs
+	sprintf(kargs, "hidos ksyslogd=0");
+	ret = ihk_os_kargs(0, kargs);
+	OKNG(ret == 0, "ihk_os_kargs succeeded\n");
+
+	// boot
+	ret = ihk_os_boot(0);
+	OKNG(ret == 0, "ihk_os_boot succeeded\n");
+
+	// open
+	ret = ihk_os_rusage_stream_open(0, &stream);
+	OKNG(ret == 0, "ihk_os_rusage_stream_open succeeded\n");
+
+	// read (error handling)
+	ret = ihk_os_rusage_stream_read(stream, buf, sizeof(*header));
+	OKNG(ret == -ENOSPC,
+	     "ihk_os_rusage_stream_read to a small buffer returned -ENOSPC\n");
+
+	// first record, the deltas from zero
+	size = ihk_os_rusage_stream_read(stream, buf,
+					 IHK_OS_RUSAGE_RECORD_MAX_SIZE);
+	OKNG(size >= (int)sizeof(*header) &&
+	     !memcmp(header->magic, IHK_OS_RUSAGE_RECORD_MAGIC,
+		     sizeof(header->magic)),
+	     "ihk_os_rusage_stream_read returned a record\n");
+
+	memset(&rusage, 0, sizeof(rusage));
+	ret = ihk_os_rusage_apply_record(&rusage, buf, size);
+	OKNG(ret == size, "ihk_os_rusage_apply_record succeeded\n");
+
+	ret = ihk_os_getrusage(0, &rusage_ioctl, sizeof(rusage_ioctl));
+	OKNG(ret == 0, "ihk_os_getrusage succeeded\n");
+
+	OKNG(rusage.num_threads == rusage_ioctl.num_threads &&
+	     rusage.max_num_threads == rusage_ioctl.max_num_threads,
+	     "the first record gives the number of threads\n");
+
+	// second record
+	usleep(100*1000);
+	size = ihk_os_rusage_stream_read(stream, buf,
+					 IHK_OS_RUSAGE_RECORD_MAX_SIZE);
+	OKNG(size >= (int)sizeof(*header),
+	     "ihk_os_rusage_stream_read (2) returned a record\n");
+
+	ret = ihk_os_rusage_apply_record(&rusage, buf, size);
+	OKNG(ret == size, "ihk_os_rusage_apply_record (2) succeeded\n");
+
+	OKNG(rusage.num_threads == rusage_ioctl.num_threads,
+	     "the number of threads is kept by the second record\n");
+
+	// apply (error handling)
+	memcpy(&bad, header, sizeof(bad));
+	bad.magic[0] = 'X';
+	ret = ihk_os_rusage_apply_record(&rusage, &bad, sizeof(bad));
+	OKNG(ret == -EINVAL,
+	     "ihk_os_rusage_apply_record of a bad magic returned -EINVAL\n");
+
+	memcpy(&bad, header, sizeof(bad));
+	bad.nr_deltas = 1;
+	ret = ihk_os_rusage_apply_record(&rusage, &bad, sizeof(bad));
+	OKNG(ret == -EINVAL,
+	     "ihk_os_rusage_apply_record of a truncated record "
+	     "returned -EINVAL\n");
+
+	// shutdown
+	ret = ihk_os_shutdown(0);
+	OKNG(ret == 0, "ihk_os_shutdown succeeded\n");
+
+	// read after shutdown
+	ret = ihk_os_rusage_stream_read(stream, buf,
+					IHK_OS_RUSAGE_RECORD_MAX_SIZE);
+	OKNG(ret == -ESTALE,
+	     "ihk_os_rusage_stream_read after shutdown returned -ESTALE\n");
+
+	ret = ihk_os_rusage_stream_close(stream);
+	OKNG(ret == 0, "ihk_os_rusage_stream_close succeeded\n");
+	free(buf);
+
+	// destroy os
+	usleep(250*1000); // Wait for nothing is in-flight
+	ret = ihk_destroy_os(0, 0);
+	OKNG(ret == 0, "ihk_destroy_os succeeded\n");
+
+	// release mem
+	ret = ihk_release_mem(0, mem_chunks, num_mem_chunks);
+	OKNG(ret == 0, "ihk_release_mem succeeded\n");
+
+	// release cpu
+	ret = ihk_release_cpu(0, cpus, num_cpus);
+	OKNG(ret == 0, "ihk_release_cpu 1,2,3 succeeded\n");
+
+	// rmmod modules
+	sprintf(cmd, "rmmod %s/kmod/mcctrl.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "rmmod %s/kmod/ihk-smp-%s.ko",
+		QUOTE(MCK_DIR), QUOTE(ARCH));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1,
+		   "rmmod ihk-smp-x86 failed\n");
+
+	sprintf(cmd, "rmmod %s/kmod/ihk.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	printf("[INFO] All tests finished\n");
+	ret = 0;
+
+ fn_fail:
+	return ret;
+}
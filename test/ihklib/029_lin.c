@@ -0,0 +1,220 @@
+/**
+ * \file ihklib029_lin.c
+ *  License details are found in the file LICENSE.
+ * \brief
+ *  Test ihk_os_perf_stat() and ihk_os_map_perf_ring()
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ihklib.h>
+#include <sys/types.h>
+#include <errno.h>
+#include "util.h"
+
+int main(int argc, char **argv)
+{
+	int ret, status;
+	FILE *fp;
+	size_t nread;
+
+	char cmd[1024];
+	char fn[256];
+	char kargs[256];
+	char logname[256], *envstr, *groups;
+
+	int cpus[4];
+	int num_cpus;
+
+	struct ihk_mem_chunk mem_chunks[4];
+	int num_mem_chunks;
+
+	ihk_perf_event_attr attr[2];
+	struct ihk_perf_count counts[2];
+	struct ihk_perf_rings *rings;
+	int i;
+
+	char *retstr;
+
+	fp = popen("logname", "r");
+	nread = fread(logname, 1, sizeof(logname), fp);
+	CHKANDJUMP(nread == 0, -1, "fread");
+	retstr = strrchr(logname, '\n');
+	if (retstr) {
+		*retstr = 0;
+	}
+
+	envstr = getenv("MYGROUPS");
+	CHKANDJUMP(envstr == NULL, -1, "groups");
+	groups = strdup(envstr);
+	retstr = strrchr(groups, '\n');
+	if (retstr) {
+		*retstr = 0;
+	}
+
+	if (geteuid() != 0) {
+		printf("Execute as a root\n");
+	}
+
+	sprintf(cmd, "insmod %s/kmod/ihk.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "insmod %s/kmod/ihk-smp-%s.ko "
+		"ihk_start_irq=240 ihk_ikc_irq_core=0",
+		QUOTE(MCK_DIR), QUOTE(ARCH));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "chown %s:%s /dev/mcd*\n", logname, groups);
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "insmod %s/kmod/mcctrl.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	// reserve cpu
+	cpus[0] = 1;
+	cpus[1] = 2;
+	cpus[2] = 3;
+	num_cpus = 3;
+	ret = ihk_reserve_cpu(0, cpus, num_cpus);
+	OKNG(ret == 0, "ihk_reserve_cpu 1,2,3 succeeded\n");
+
+	// reserve mem 128m@0
+	num_mem_chunks = 1;
+	mem_chunks[0].size = 128*1024*1024ULL;
+	mem_chunks[0].numa_node_number = 0;
+	ret = ihk_reserve_mem(0, mem_chunks, num_mem_chunks);
+	OKNG(ret == 0, "ihk_reserve_mem 128m@0 succeeded\n");
+
+	// create 0
+	ret = ihk_create_os(0);
+	OKNG(ret == 0, "ihk_create_os succeeded\n");
+
+	sprintf(cmd, "chown %s:%s /dev/mcos*\n", logname, groups);
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	// assign cpu 1,2,3
+	ret = ihk_os_assign_cpu(0, cpus, num_cpus);
+	OKNG(ret == 0, "ihk_os_assign_cpu 1,2,3 succeeded\n");
+
+	// assign mem 128m@0
+	ret = ihk_os_assign_mem(0, mem_chunks, num_mem_chunks);
+	OKNG(ret == 0, "ihk_os_assign_mem 128m@0 succeeded\n");
+
+	// Cycles and instructions as raw events
+	memset(attr, 0, sizeof(attr));
+#ifdef __aarch64__
+	attr[0].config = 0x11;
+	attr[1].config = 0x08;
+#else
+	attr[0].config = 0x3c;
+	attr[1].config = 0xc0;
+#endif
+
+	// perf stat (error handling)
+	ret = ihk_os_perf_stat(0, attr, 0, 0, 10, 200, counts);
+	OKNG(ret == -EINVAL,
+	     "ihk_os_perf_stat of no event returned -EINVAL\n");
+
+	// map perf ring (error handling)
+	ret = ihk_os_map_perf_ring(0, &rings);
+	OKNG(ret == -EAGAIN,
+	     "ihk_os_map_perf_ring of an OS not booted returned -EAGAIN\n");
+
+	// load
+	sprintf(fn, "%s/%s/kernel/mckernel.img",
+		QUOTE(MCK_DIR), QUOTE(TARGET));
+	ret = ihk_os_load(0, fn);
+	OKNG(ret == 0, "ihk_os_load succeeded\n");
+
+	// kargs
+	sprintf(kargs, "hidos ksyslogd=0");
+	ret = ihk_os_kargs(0, kargs);
+	OKNG(ret == 0, "ihk_os_kargs succeeded\n");
+
+	// boot
+	ret = ihk_os_boot(0);
+	OKNG(ret == 0, "ihk_os_boot succeeded\n");
+
+	// perf stat, one counter at a time
+	ret = ihk_os_perf_stat(0, attr, 2, 1, 10, 200, counts);
+	OKNG(ret == 0, "ihk_os_perf_stat with multiplexing succeeded\n");
+
+	for (i = 0; i < 2; i++) {
+		OKNG(counts[i].time_enabled >= 200*1000*1000UL &&
+		     counts[i].time_running > 0 &&
+		     counts[i].time_running < counts[i].time_enabled &&
+		     counts[i].value >= counts[i].raw,
+		     "event %d was counted part of the time and scaled\n", i);
+	}
+
+	// perf stat, as many counters as the LWK accepts
+	ret = ihk_os_perf_stat(0, attr, 2, 0, 10, 200, counts);
+	OKNG(ret == 0, "ihk_os_perf_stat without multiplexing succeeded\n");
+
+	for (i = 0; i < 2; i++) {
+		OKNG(counts[i].time_running > 0 &&
+		     counts[i].time_running <= counts[i].time_enabled &&
+		     counts[i].value >= counts[i].raw,
+		     "event %d was counted\n", i);
+	}
+
+	// map perf ring
+	ret = ihk_os_map_perf_ring(0, &rings);
+	OKNG(ret == 0, "ihk_os_map_perf_ring succeeded\n");
+
+	OKNG(rings->nr_cpus == num_cpus && rings->nr_samples > 0,
+	     "a ring per LWK CPU is mapped\n");
+
+	ret = ihk_os_unmap_perf_ring(rings);
+	OKNG(ret == 0, "ihk_os_unmap_perf_ring succeeded\n");
+
+	// shutdown
+	ret = ihk_os_shutdown(0);
+	OKNG(ret == 0, "ihk_os_shutdown succeeded\n");
+
+	// map perf ring (error handling)
+	ret = ihk_os_map_perf_ring(0, &rings);
+	OKNG(ret == -EAGAIN,
+	     "ihk_os_map_perf_ring of an OS shut down returned -EAGAIN\n");
+
+	// destroy os
+	usleep(250*1000); // Wait for nothing is in-flight
+	ret = ihk_destroy_os(0, 0);
+	OKNG(ret == 0, "ihk_destroy_os succeeded\n");
+
+	// release mem
+	ret = ihk_release_mem(0, mem_chunks, num_mem_chunks);
+	OKNG(ret == 0, "ihk_release_mem succeeded\n");
+
+	// release cpu
+	ret = ihk_release_cpu(0, cpus, num_cpus);
+	OKNG(ret == 0, "ihk_release_cpu 1,2,3 succeeded\n");
+
+	// rmmod modules
+	sprintf(cmd, "rmmod %s/kmod/mcctrl.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "rmmod %s/kmod/ihk-smp-%s.ko",
+		QUOTE(MCK_DIR), QUOTE(ARCH));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1,
+		   "rmmod ihk-smp-x86 failed\n");
+
+	sprintf(cmd, "rmmod %s/kmod/ihk.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	printf("[INFO] All tests finished\n");
+	ret = 0;
+
+ fn_fail:
+	return ret;
+}
@@ -0,0 +1,218 @@
+/**
+ * \file ihklib032_lin.c
+ *  License details are found in the file LICENSE.
+ * \brief
+ *  Test ihk_os_auto_ikc_map()
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ihklib.h>
+#include <sys/types.h>
+#include <errno.h>
+#include "util.h"
+
+int main(int argc, char **argv)
+{
+	int ret, status;
+	FILE *fp;
+	size_t nread;
+
+	char cmd[1024];
+	char fn[256];
+	char kargs[256];
+	char logname[256], *envstr, *groups;
+
+	int cpus[4];
+	int num_cpus;
+
+	struct ihk_mem_chunk mem_chunks[4];
+	int num_mem_chunks;
+
+	struct ihk_ikc_cpu_map map[3], map_dry[3], map_get[3];
+	long cost, cost_dry;
+	int i, j, valid;
+
+	char *retstr;
+
+	fp = popen("logname", "r");
+	nread = fread(logname, 1, sizeof(logname), fp);
+	CHKANDJUMP(nread == 0, -1, "fread");
+	retstr = strrchr(logname, '\n');
+	if (retstr) {
+		*retstr = 0;
+	}
+
+	envstr = getenv("MYGROUPS");
+	CHKANDJUMP(envstr == NULL, -1, "groups");
+	groups = strdup(envstr);
+	retstr = strrchr(groups, '\n');
+	if (retstr) {
+		*retstr = 0;
+	}
+
+	if (geteuid() != 0) {
+		printf("Execute as a root\n");
+	}
+
+	sprintf(cmd, "insmod %s/kmod/ihk.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "insmod %s/kmod/ihk-smp-%s.ko "
+		"ihk_start_irq=240 ihk_ikc_irq_core=0",
+		QUOTE(MCK_DIR), QUOTE(ARCH));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "chown %s:%s /dev/mcd*\n", logname, groups);
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "insmod %s/kmod/mcctrl.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	// reserve cpu
+	cpus[0] = 1;
+	cpus[1] = 2;
+	cpus[2] = 3;
+	num_cpus = 3;
+	ret = ihk_reserve_cpu(0, cpus, num_cpus);
+	OKNG(ret == 0, "ihk_reserve_cpu 1,2,3 succeeded\n");
+
+	// reserve mem 128m@0
+	num_mem_chunks = 1;
+	mem_chunks[0].size = 128*1024*1024ULL;
+	mem_chunks[0].numa_node_number = 0;
+	ret = ihk_reserve_mem(0, mem_chunks, num_mem_chunks);
+	OKNG(ret == 0, "ihk_reserve_mem 128m@0 succeeded\n");
+
+	// create 0
+	ret = ihk_create_os(0);
+	OKNG(ret == 0, "ihk_create_os succeeded\n");
+
+	sprintf(cmd, "chown %s:%s /dev/mcos*\n", logname, groups);
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	// assign cpu 1,2,3
+	ret = ihk_os_assign_cpu(0, cpus, num_cpus);
+	OKNG(ret == 0, "ihk_os_assign_cpu 1,2,3 succeeded\n");
+
+	// assign mem 128m@0
+	ret = ihk_os_assign_mem(0, mem_chunks, num_mem_chunks);
+	OKNG(ret == 0, "ihk_os_assign_mem 128m@0 succeeded\n");
+
+	ret = ihk_os_get_ikc_map(0, map_get, num_cpus);
+	OKNG(ret == 0, "ihk_os_get_ikc_map succeeded\n");
+
+	// auto ikc map (error handling)
+	ret = ihk_os_auto_ikc_map(0, map, 0, 1, &cost);
+	OKNG(ret == -EINVAL,
+	     "ihk_os_auto_ikc_map of no CPU returned -EINVAL\n");
+
+	ret = ihk_os_auto_ikc_map(0, map, num_cpus - 1, 1, &cost);
+	OKNG(ret == -EINVAL,
+	     "ihk_os_auto_ikc_map with too little space returned -EINVAL\n");
+
+	// dry run
+	ret = ihk_os_auto_ikc_map(0, map_dry, num_cpus, 1, &cost_dry);
+	OKNG(ret == 0, "ihk_os_auto_ikc_map dry run succeeded\n");
+
+	valid = cost_dry >= 0;
+	for (i = 0; i < num_cpus; i++) {
+		if (map_dry[i].src_cpu != cpus[i] || map_dry[i].dst_cpu < 0) {
+			valid = 0;
+		}
+		for (j = 0; j < num_cpus; j++) {
+			if (map_dry[i].dst_cpu == cpus[j]) {
+				valid = 0;
+			}
+		}
+	}
+	OKNG(valid, "each LWK CPU is mapped to a Linux CPU\n");
+
+	ret = ihk_os_get_ikc_map(0, map, num_cpus);
+	OKNG(ret == 0 && !memcmp(map, map_get, sizeof(map)),
+	     "dry run didn't change the map\n");
+
+	// set
+	ret = ihk_os_auto_ikc_map(0, map, num_cpus, 0, &cost);
+	OKNG(ret == 0, "ihk_os_auto_ikc_map succeeded\n");
+
+	OKNG(!memcmp(map, map_dry, sizeof(map)) && cost == cost_dry,
+	     "the map and the cost are those of the dry run\n");
+
+	ret = ihk_os_get_ikc_map(0, map_get, num_cpus);
+	OKNG(ret == 0 && !memcmp(map_get, map, sizeof(map)),
+	     "ihk_os_get_ikc_map returned the map set\n");
+
+	// load
+	sprintf(fn, "%s/%s/kernel/mckernel.img",
+		QUOTE(MCK_DIR), QUOTE(TARGET));
+	ret = ihk_os_load(0, fn);
+	OKNG(ret == 0, "ihk_os_load succeeded\n");
+
+	// kargs
+	sprintf(kargs, "hidos ksyslogd=0");
+	ret = ihk_os_kargs(0, kargs);
+	OKNG(ret == 0, "ihk_os_kargs succeeded\n");
+
+	// boot
+	ret = ihk_os_boot(0);
+	OKNG(ret == 0, "ihk_os_boot succeeded\n");
+
+	// auto ikc map of a running OS
+	ret = ihk_os_auto_ikc_map(0, map_dry, num_cpus, 0, &cost_dry);
+	OKNG(ret == -EBUSY,
+	     "ihk_os_auto_ikc_map of a running OS returned -EBUSY\n");
+
+	ret = ihk_os_auto_ikc_map(0, map_dry, num_cpus, 1, &cost_dry);
+	OKNG(ret == 0 && !memcmp(map_dry, map, sizeof(map)),
+	     "ihk_os_auto_ikc_map dry run of a running OS succeeded\n");
+
+	ret = ihk_os_get_ikc_map(0, map_get, num_cpus);
+	OKNG(ret == 0 && !memcmp(map_get, map, sizeof(map)),
+	     "the map is kept through boot\n");
+
+	// shutdown
+	ret = ihk_os_shutdown(0);
+	OKNG(ret == 0, "ihk_os_shutdown succeeded\n");
+
+	// destroy os
+	usleep(250*1000); // Wait for nothing is in-flight
+	ret = ihk_destroy_os(0, 0);
+	OKNG(ret == 0, "ihk_destroy_os succeeded\n");
+
+	// release mem
+	ret = ihk_release_mem(0, mem_chunks, num_mem_chunks);
+	OKNG(ret == 0, "ihk_release_mem succeeded\n");
+
+	// release cpu
+	ret = ihk_release_cpu(0, cpus, num_cpus);
+	OKNG(ret == 0, "ihk_release_cpu 1,2,3 succeeded\n");
+
+	// rmmod modules
+	sprintf(cmd, "rmmod %s/kmod/mcctrl.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "rmmod %s/kmod/ihk-smp-%s.ko",
+		QUOTE(MCK_DIR), QUOTE(ARCH));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1,
+		   "rmmod ihk-smp-x86 failed\n");
+
+	sprintf(cmd, "rmmod %s/kmod/ihk.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	printf("[INFO] All tests finished\n");
+	ret = 0;
+
+ fn_fail:
+	return ret;
+}
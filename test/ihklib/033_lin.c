@@ -0,0 +1,205 @@
+/**
+ * \file ihklib033_lin.c
+ *  License details are found in the file LICENSE.
+ * \brief
+ *  Test ihk_os_set_ikc_map() on a running OS instance
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ihklib.h>
+#include <sys/types.h>
+#include <errno.h>
+#include "util.h"
+
+int main(int argc, char **argv)
+{
+	int ret, status;
+	FILE *fp;
+	size_t nread;
+
+	char cmd[1024];
+	char fn[256];
+	char kargs[256];
+	char logname[256], *envstr, *groups;
+
+	int cpus[4];
+	int num_cpus;
+
+	struct ihk_mem_chunk mem_chunks[4];
+	int num_mem_chunks;
+
+	struct ihk_ikc_cpu_map map[2], map_get[2];
+
+	char *retstr;
+
+	fp = popen("logname", "r");
+	nread = fread(logname, 1, sizeof(logname), fp);
+	CHKANDJUMP(nread == 0, -1, "fread");
+	retstr = strrchr(logname, '\n');
+	if (retstr) {
+		*retstr = 0;
+	}
+
+	envstr = getenv("MYGROUPS");
+	CHKANDJUMP(envstr == NULL, -1, "groups");
+	groups = strdup(envstr);
+	retstr = strrchr(groups, '\n');
+	if (retstr) {
+		*retstr = 0;
+	}
+
+	if (geteuid() != 0) {
+		printf("Execute as a root\n");
+	}
+
+	sprintf(cmd, "insmod %s/kmod/ihk.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "insmod %s/kmod/ihk-smp-%s.ko "
+		"ihk_start_irq=240 ihk_ikc_irq_core=0",
+		QUOTE(MCK_DIR), QUOTE(ARCH));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "chown %s:%s /dev/mcd*\n", logname, groups);
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "insmod %s/kmod/mcctrl.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	// reserve cpu
+	cpus[0] = 2;
+	cpus[1] = 3;
+	num_cpus = 2;
+	ret = ihk_reserve_cpu(0, cpus, num_cpus);
+	OKNG(ret == 0, "ihk_reserve_cpu 2,3 succeeded\n");
+
+	// reserve mem 128m@0
+	num_mem_chunks = 1;
+	mem_chunks[0].size = 128*1024*1024ULL;
+	mem_chunks[0].numa_node_number = 0;
+	ret = ihk_reserve_mem(0, mem_chunks, num_mem_chunks);
+	OKNG(ret == 0, "ihk_reserve_mem 128m@0 succeeded\n");
+
+	// create 0
+	ret = ihk_create_os(0);
+	OKNG(ret == 0, "ihk_create_os succeeded\n");
+
+	sprintf(cmd, "chown %s:%s /dev/mcos*\n", logname, groups);
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	// assign cpu 2,3
+	ret = ihk_os_assign_cpu(0, cpus, num_cpus);
+	OKNG(ret == 0, "ihk_os_assign_cpu 2,3 succeeded\n");
+
+	// assign mem 128m@0
+	ret = ihk_os_assign_mem(0, mem_chunks, num_mem_chunks);
+	OKNG(ret == 0, "ihk_os_assign_mem 128m@0 succeeded\n");
+
+	// ikc map 2:0+3:1
+	map[0].src_cpu = 2;
+	map[0].dst_cpu = 0;
+	map[1].src_cpu = 3;
+	map[1].dst_cpu = 1;
+	ret = ihk_os_set_ikc_map(0, map, 2);
+	OKNG(ret == 0, "ihk_os_set_ikc_map 2:0+3:1 succeeded\n");
+
+	// load
+	sprintf(fn, "%s/%s/kernel/mckernel.img",
+		QUOTE(MCK_DIR), QUOTE(TARGET));
+	ret = ihk_os_load(0, fn);
+	OKNG(ret == 0, "ihk_os_load succeeded\n");
+
+	// kargs
+	sprintf(kargs, "hidos ksyslogd=0");
+	ret = ihk_os_kargs(0, kargs);
+	OKNG(ret == 0, "ihk_os_kargs succeeded\n");
+
+	// boot
+	ret = ihk_os_boot(0);
+	OKNG(ret == 0, "ihk_os_boot succeeded\n");
+
+	// move 2 to 1
+	map[0].dst_cpu = 1;
+	ret = ihk_os_set_ikc_map(0, map, 1);
+	OKNG(ret == 0, "ihk_os_set_ikc_map 2:1 of a running OS succeeded\n");
+
+	ret = ihk_os_get_ikc_map(0, map_get, 2);
+	OKNG(ret == 0 &&
+	     map_get[0].src_cpu == 2 && map_get[0].dst_cpu == 1 &&
+	     map_get[1].src_cpu == 3 && map_get[1].dst_cpu == 1,
+	     "ihk_os_get_ikc_map returned 2:1+3:1\n");
+
+	// move 2 back to 0
+	map[0].dst_cpu = 0;
+	ret = ihk_os_set_ikc_map(0, map, 1);
+	OKNG(ret == 0, "ihk_os_set_ikc_map 2:0 of a running OS succeeded\n");
+
+	// set ikc map (error handling)
+	map[0].dst_cpu = 3;
+	ret = ihk_os_set_ikc_map(0, map, 1);
+	OKNG(ret == -EINVAL,
+	     "ihk_os_set_ikc_map to an LWK CPU returned -EINVAL\n");
+
+	// a failing entry undoes the ones before it
+	map[0].dst_cpu = 1;
+	map[1].dst_cpu = 2;
+	ret = ihk_os_set_ikc_map(0, map, 2);
+	OKNG(ret == -EINVAL,
+	     "ihk_os_set_ikc_map 2:1+3:2 returned -EINVAL\n");
+
+	ret = ihk_os_get_ikc_map(0, map_get, 2);
+	OKNG(ret == 0 &&
+	     map_get[0].src_cpu == 2 && map_get[0].dst_cpu == 0 &&
+	     map_get[1].src_cpu == 3 && map_get[1].dst_cpu == 1,
+	     "ihk_os_get_ikc_map returned 2:0+3:1\n");
+
+	ret = ihk_os_get_status(0);
+	OKNG(ret == IHK_STATUS_RUNNING,
+	     "ihk_os_get_status returned IHK_STATUS_RUNNING\n");
+
+	// shutdown
+	ret = ihk_os_shutdown(0);
+	OKNG(ret == 0, "ihk_os_shutdown succeeded\n");
+
+	// destroy os
+	usleep(250*1000); // Wait for nothing is in-flight
+	ret = ihk_destroy_os(0, 0);
+	OKNG(ret == 0, "ihk_destroy_os succeeded\n");
+
+	// release mem
+	ret = ihk_release_mem(0, mem_chunks, num_mem_chunks);
+	OKNG(ret == 0, "ihk_release_mem succeeded\n");
+
+	// release cpu
+	ret = ihk_release_cpu(0, cpus, num_cpus);
+	OKNG(ret == 0, "ihk_release_cpu 2,3 succeeded\n");
+
+	// rmmod modules
+	sprintf(cmd, "rmmod %s/kmod/mcctrl.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "rmmod %s/kmod/ihk-smp-%s.ko",
+		QUOTE(MCK_DIR), QUOTE(ARCH));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1,
+		   "rmmod ihk-smp-x86 failed\n");
+
+	sprintf(cmd, "rmmod %s/kmod/ihk.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	printf("[INFO] All tests finished\n");
+	ret = 0;
+
+ fn_fail:
+	return ret;
+}
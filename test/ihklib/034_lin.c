@@ -0,0 +1,295 @@
+/**
+ * \file ihklib034_lin.c
+ *  License details are found in the file LICENSE.
+ * \brief
+ *  Test ihk_os_reboot() with and without scrubbing the memory
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <ihklib.h>
+#include <ihk/ihk_host_user.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+#include "util.h"
+
+#define SZ_PAGE 4096
+#define SZ_READ (2 * (1ULL<<20))
+
+/* Tell if a page written by ihklib034_mck is found in the memory of
+ * OS 0, 1 if so, 0 if not and negative errno on failure */
+static int find_marker(void)
+{
+	int ret, fd, i;
+	unsigned long marker[SZ_PAGE / sizeof(unsigned long)];
+	char chunks_buf[sizeof(dump_mem_chunks_t) +
+			sizeof(struct dump_mem_chunk) * 16];
+	dump_mem_chunks_t *chunks = (dump_mem_chunks_t *)chunks_buf;
+	dumpargs_t args;
+	char *buf = NULL;
+	unsigned long off, size, page;
+
+	for (i = 0; i < SZ_PAGE / sizeof(unsigned long); i++) {
+		marker[i] = 0x69686b6c69623334UL ^ i;
+	}
+
+	fd = open("/dev/mcos0", O_RDONLY);
+	if (fd < 0) {
+		return -errno;
+	}
+
+	memset(&args, 0, sizeof(args));
+	memset(chunks_buf, 0, sizeof(chunks_buf));
+	args.cmd = DUMP_QUERY;
+	args.size = sizeof(chunks_buf);
+	args.buf = chunks;
+	if (ioctl(fd, IHK_OS_DUMP, &args)) {
+		ret = -errno;
+		goto out;
+	}
+
+	buf = malloc(SZ_READ);
+	if (!buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = 0;
+	for (i = 0; i < chunks->nr_chunks && !ret; i++) {
+		for (off = 0; off < chunks->chunks[i].size && !ret;
+		     off += size) {
+			size = chunks->chunks[i].size - off;
+			if (size > SZ_READ) {
+				size = SZ_READ;
+			}
+
+			args.cmd = DUMP_READ;
+			args.start = chunks->chunks[i].addr + off;
+			args.size = size;
+			args.buf = buf;
+			if (ioctl(fd, IHK_OS_DUMP, &args)) {
+				ret = -errno;
+				goto out;
+			}
+
+			for (page = 0; page + SZ_PAGE <= size;
+			     page += SZ_PAGE) {
+				if (!memcmp(buf + page, marker, SZ_PAGE)) {
+					ret = 1;
+					break;
+				}
+			}
+		}
+	}
+
+ out:
+	free(buf);
+	close(fd);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int ret, status;
+	FILE *fp;
+	size_t nread;
+
+	char cmd[1024];
+	char buf[4096];
+	char fn[256];
+	char kargs[256];
+	char logname[256], *envstr, *groups;
+
+	int cpus[4];
+	int num_cpus;
+
+	struct ihk_mem_chunk mem_chunks[4];
+	int num_mem_chunks;
+
+	struct ihk_ikc_cpu_map map[3], map_get[3];
+
+	char *retstr;
+
+	fp = popen("logname", "r");
+	nread = fread(logname, 1, sizeof(logname), fp);
+	CHKANDJUMP(nread == 0, -1, "fread");
+	retstr = strrchr(logname, '\n');
+	if (retstr) {
+		*retstr = 0;
+	}
+
+	envstr = getenv("MYGROUPS");
+	CHKANDJUMP(envstr == NULL, -1, "groups");
+	groups = strdup(envstr);
+	retstr = strrchr(groups, '\n');
+	if (retstr) {
+		*retstr = 0;
+	}
+
+	if (geteuid() != 0) {
+		printf("Execute as a root\n");
+	}
+
+	sprintf(cmd, "insmod %s/kmod/ihk.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "insmod %s/kmod/ihk-smp-%s.ko "
+		"ihk_start_irq=240 ihk_ikc_irq_core=0",
+		QUOTE(MCK_DIR), QUOTE(ARCH));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "chown %s:%s /dev/mcd*\n", logname, groups);
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "insmod %s/kmod/mcctrl.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	// reserve cpu
+	cpus[0] = 1;
+	cpus[1] = 2;
+	cpus[2] = 3;
+	num_cpus = 3;
+	ret = ihk_reserve_cpu(0, cpus, num_cpus);
+	OKNG(ret == 0, "ihk_reserve_cpu 1,2,3 succeeded\n");
+
+	// reserve mem 128m@0
+	num_mem_chunks = 1;
+	mem_chunks[0].size = 128*1024*1024ULL;
+	mem_chunks[0].numa_node_number = 0;
+	ret = ihk_reserve_mem(0, mem_chunks, num_mem_chunks);
+	OKNG(ret == 0, "ihk_reserve_mem 128m@0 succeeded\n");
+
+	// create 0
+	ret = ihk_create_os(0);
+	OKNG(ret == 0, "ihk_create_os succeeded\n");
+
+	sprintf(cmd, "chown %s:%s /dev/mcos*\n", logname, groups);
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	// assign cpu 1,2,3
+	ret = ihk_os_assign_cpu(0, cpus, num_cpus);
+	OKNG(ret == 0, "ihk_os_assign_cpu 1,2,3 succeeded\n");
+
+	// assign mem 128m@0
+	ret = ihk_os_assign_mem(0, mem_chunks, num_mem_chunks);
+	OKNG(ret == 0, "ihk_os_assign_mem 128m@0 succeeded\n");
+
+	// load
+	sprintf(fn, "%s/%s/kernel/mckernel.img",
+		QUOTE(MCK_DIR), QUOTE(TARGET));
+	ret = ihk_os_load(0, fn);
+	OKNG(ret == 0, "ihk_os_load succeeded\n");
+
+	// kargs
+	sprintf(kargs, "hidos ksyslogd=0");
+	ret = ihk_os_kargs(0, kargs);
+	OKNG(ret == 0, "ihk_os_kargs succeeded\n");
+
+	// reboot (error handling)
+	ret = ihk_os_reboot(0, 0);
+	OKNG(ret == -EBUSY,
+	     "ihk_os_reboot of a loaded but not booted OS returned -EBUSY\n");
+
+	// boot
+	ret = ihk_os_boot(0);
+	OKNG(ret == 0, "ihk_os_boot succeeded\n");
+
+	ret = ihk_os_get_ikc_map(0, map, num_cpus);
+	OKNG(ret == 0, "ihk_os_get_ikc_map succeeded\n");
+
+	// reboot (error handling)
+	ret = ihk_os_reboot(1, 0);
+	OKNG(ret == -ENOENT,
+	     "ihk_os_reboot of a non-existent OS returned -ENOENT\n");
+
+	// leave a marker in the memory
+	sprintf(cmd, "%s/bin/mcexec ./034_mck", QUOTE(MCK_DIR));
+	fp = popen(cmd, "r");
+	nread = fread(buf, 1, sizeof(buf) - 1, fp);
+	buf[nread] = 0;
+	pclose(fp);
+	OKNG(strstr(buf, "ihklib034_mck exit OK") != NULL,
+	     "a marker is written to the memory\n");
+
+	// reboot
+	ret = ihk_os_reboot(0, 0);
+	OKNG(ret == 0, "ihk_os_reboot succeeded\n");
+
+	ret = find_marker();
+	OKNG(ret == 1, "the marker is kept without scrubbing\n");
+
+	ret = ihk_os_get_status(0);
+	OKNG(ret == IHK_STATUS_RUNNING,
+	     "ihk_os_get_status returned IHK_STATUS_RUNNING\n");
+
+	ret = ihk_os_get_num_assigned_cpus(0);
+	OKNG(ret == num_cpus, "the CPUs are kept\n");
+
+	ret = ihk_os_get_num_assigned_mem_chunks(0);
+	OKNG(ret == num_mem_chunks, "the memory is kept\n");
+
+	ret = ihk_os_get_ikc_map(0, map_get, num_cpus);
+	OKNG(ret == 0 && !memcmp(map_get, map, sizeof(map)),
+	     "the IKC map is kept\n");
+
+	// reboot with scrubbing
+	ret = ihk_os_reboot(0, 1);
+	OKNG(ret == 0, "ihk_os_reboot with scrubbing succeeded\n");
+
+	ret = ihk_os_get_status(0);
+	OKNG(ret == IHK_STATUS_RUNNING,
+	     "ihk_os_get_status returned IHK_STATUS_RUNNING\n");
+
+	ret = ihk_os_get_num_assigned_cpus(0);
+	OKNG(ret == num_cpus, "the CPUs are kept\n");
+
+	ret = find_marker();
+	OKNG(ret == 0, "the marker is cleared by scrubbing\n");
+
+	// shutdown
+	ret = ihk_os_shutdown(0);
+	OKNG(ret == 0, "ihk_os_shutdown succeeded\n");
+
+	// destroy os
+	usleep(250*1000); // Wait for nothing is in-flight
+	ret = ihk_destroy_os(0, 0);
+	OKNG(ret == 0, "ihk_destroy_os succeeded\n");
+
+	// release mem
+	ret = ihk_release_mem(0, mem_chunks, num_mem_chunks);
+	OKNG(ret == 0, "ihk_release_mem succeeded\n");
+
+	// release cpu
+	ret = ihk_release_cpu(0, cpus, num_cpus);
+	OKNG(ret == 0, "ihk_release_cpu 1,2,3 succeeded\n");
+
+	// rmmod modules
+	sprintf(cmd, "rmmod %s/kmod/mcctrl.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	sprintf(cmd, "rmmod %s/kmod/ihk-smp-%s.ko",
+		QUOTE(MCK_DIR), QUOTE(ARCH));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1,
+		   "rmmod ihk-smp-x86 failed\n");
+
+	sprintf(cmd, "rmmod %s/kmod/ihk.ko", QUOTE(MCK_DIR));
+	status = system(cmd);
+	CHKANDJUMP(WEXITSTATUS(status) != 0, -1, "system");
+
+	printf("[INFO] All tests finished\n");
+	ret = 0;
+
+ fn_fail:
+	return ret;
+}
@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include "util.h"
+
+#define SZ_MARKER (16 * (1ULL<<20))
+#define SZ_PAGE 4096
+
+/* Leave pages of a pattern which isn't in any image in the LWK memory.
+ * ihklib034_lin looks for them after ihk_os_reboot(). */
+int main(int argc, char **argv)
+{
+	int ret = 0;
+	unsigned long *mem;
+	unsigned long i;
+
+	mem = mmap(0, SZ_MARKER, PROT_READ | PROT_WRITE,
+		   MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	CHKANDJUMP(mem == MAP_FAILED, 255, "mmap failed\n");
+
+	for (i = 0; i < SZ_MARKER / sizeof(unsigned long); i++) {
+		mem[i] = 0x69686b6c69623334UL ^
+			(i % (SZ_PAGE / sizeof(unsigned long)));
+	}
+
+	munmap(mem, SZ_MARKER);
+	printf("ihklib034_mck exit OK\n");
+
+ fn_fail:
+	return ret;
+}
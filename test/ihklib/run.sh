@@ -45,10 +45,10 @@ case ${testname} in
 	printf "*** Apply ${testname}.patch to enable syscall #900 and recompile IHK/McKernel.\n"
 	;;
     011)
-	printf "*** Apply ${testname}.patch to set kmsg buffer size to 256 and enable syscall #900 and recompile IHK/McKernel.\n"
+	printf "*** Apply ${testname}.patch to set the kmsg read size to 256 and enable syscall #900 and recompile IHK/McKernel.\n"
 	;;
     013)
-	printf "*** Apply ${testname}.patch to set the size of the kmsg memory-buffer o 256 and enable syscall #900 and set the width of the kmsg file-buffer to 64 and its depth to 4 and then recompile IHK/McKernel.\n"
+	printf "*** Apply ${testname}.patch to set the kmsg read size to 256 and the high water mark to 1 and enable syscall #900 and set the width of the kmsg file-buffer to 64 and its depth to 4 and then recompile IHK/McKernel.\n"
 	;;
     014 | 015)
 	printf "*** Apply ${testname}.patch to enable syscall #900 and recompile IHK/McKernel.\n"
@@ -71,7 +71,7 @@ case ${testname} in
 esac
 
 case ${testname} in
-    001 | 020 | 021 | 022 | 023 | 024)
+    001 | 020 | 021 | 022 | 023 | 024 | 025 | 026 | 027 | 028 | 029 | 030 | 031 | 032 | 033 | 034)
 	;;
     *)
 	read -p "*** Hit return when ready!" key
@@ -79,7 +79,7 @@ case ${testname} in
 esac
 
 case ${testname} in
-    001 | 020 | 021 | 023 | 024)
+    001 | 020 | 021 | 023 | 024 | 025 | 026 | 027 | 028 | 029 | 030 | 031 | 032 | 033)
 	bn_lin="${testname}_lin"
 	make clean > /dev/null 2> /dev/null
 	make ${bn_lin}
@@ -93,7 +93,7 @@ case ${testname} in
 	if [ $? -ne 0 ]; then echo "make failed"; exit 1; fi
 	;;
     002 | 003 | 004 | 005 | 006 | 007 | 008 | 009 | 010 | 011 | 012 | \
-	013 | 014 | 015 | 016 | 017)
+	013 | 014 | 015 | 016 | 017 | 034)
 	bn_lin="${testname}_lin"
 	bn_mck="${testname}_mck"
 	make clean > /dev/null 2> /dev/null
@@ -135,7 +135,7 @@ case ${testname} in
     009 | 010 | 011 | 012 | \
     013 | 014 | 015 | 016 | \
     017 | 019 | 020 | 021 | \
-	022 | 023 | 024)
+	022 | 023 | 024 | 025 | 026 | 027 | 028 | 029 | 030 | 031 | 032 | 033 | 034)
 	;;
     *)
 	echo Unknown test case
@@ -147,7 +147,7 @@ if [ ${dryrun} == "y" ]; then
 fi
 
 case ${testname} in
-    001 | 002 | 020 | 021 | 023 | 024)
+    001 | 002 | 020 | 021 | 023 | 024 | 025 | 026 | 027 | 028 | 029 | 030 | 031 | 032 | 033 | 034)
 	if ! sudo ${SBIN}/mcstop+release.sh 2>&1; then
 	    exit 255
 	fi
@@ -219,7 +219,7 @@ else
 	    sudo MYGROUPS=${groups} ./${bn_lin} ${testopt}
 	    ret=$?
 	;;
-	020 | 021 | 023 | 024)
+	020 | 021 | 023 | 024 | 025 | 026 | 027 | 028 | 029 | 030 | 031 | 032 | 033 | 034)
 	    sudo MYGROUPS=${groups} ./${bn_lin}
 	    ret=$?
 	;;
@@ -335,7 +335,7 @@ else
 fi
 
 case ${testname} in
-    001 | 020 | 021 | 023 | 024)
+    001 | 020 | 021 | 023 | 024 | 025 | 026 | 027 | 028 | 029 | 030 | 031 | 032 | 033 | 034)
 	;;
     003)
 	;;
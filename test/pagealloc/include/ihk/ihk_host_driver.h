@@ -0,0 +1,3 @@
+#include "../kernel_shim.h"
+
+typedef void *ihk_device_t;
@@ -0,0 +1,66 @@
+/*
+ * Userspace stand-ins for the kernel API used by linux/core/mem_alloc.c
+ */
+#ifndef KERNEL_SHIM_H
+#define KERNEL_SHIM_H
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define SHIM_NR_CPUS	64
+
+#define printk	printf
+#define EXPORT_SYMBOL(sym)
+
+#define PAGE_SIZE	4096UL
+#define GFP_KERNEL	0
+
+#define kzalloc(size, gfp)	calloc(1, (size))
+#define kfree(p)		free(p)
+#define vzalloc(size)		calloc(1, (size))
+#define vfree(p)		free(p)
+
+typedef pthread_spinlock_t spinlock_t;
+
+#define spin_lock_init(l)	pthread_spin_init((l), PTHREAD_PROCESS_PRIVATE)
+#define spin_lock(l)		pthread_spin_lock(l)
+#define spin_unlock(l)		pthread_spin_unlock(l)
+#define spin_lock_irqsave(l, flags) \
+	do { (flags) = 0; pthread_spin_lock(l); } while (0)
+#define spin_unlock_irqrestore(l, flags) \
+	do { (void)(flags); pthread_spin_unlock(l); } while (0)
+
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+#define __percpu
+#define alloc_percpu(type)	((type *)calloc(SHIM_NR_CPUS, sizeof(type)))
+#define free_percpu(p)		free(p)
+#define per_cpu_ptr(p, cpu)	(&(p)[(cpu)])
+#define for_each_possible_cpu(cpu) \
+	for ((cpu) = 0; (cpu) < SHIM_NR_CPUS; (cpu)++)
+
+static inline int shim_cpu(void)
+{
+	int cpu = sched_getcpu();
+
+	return (cpu < 0 ? 0 : cpu) % SHIM_NR_CPUS;
+}
+
+#define get_cpu_ptr(p)		(&(p)[shim_cpu()])
+#define put_cpu_ptr(p)		do { } while (0)
+
+#define __ffs(v)	((unsigned long)__builtin_ctzl(v))
+#define __fls(v)	((unsigned long)(63 - __builtin_clzl(v)))
+#define fls(x)		((x) ? 32 - __builtin_clz(x) : 0)
+
+#define min(a, b)	((a) < (b) ? (a) : (b))
+#define max(a, b)	((a) > (b) ? (a) : (b))
+#define max3(a, b, c)	max(max((a), (b)), (c))
+
+#endif
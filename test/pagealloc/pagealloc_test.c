@@ -0,0 +1,316 @@
+/*
+ * Unit tests and benchmark of the page allocator (linux/core/mem_alloc.c)
+ * built against userspace stand-ins of the kernel API.
+ *
+ * Usage: pagealloc_test [-n nr_blocks] [-o nr_ops] [-t nr_threads] [-s seed]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <ihk/ihk_host_misc.h>
+
+#define START	0x100000000UL
+#define UNIT	4096UL
+
+#define OKNG(cond, ...) do {				\
+	if (cond) {					\
+		printf("[ OK ] " __VA_ARGS__);		\
+	} else {					\
+		printf("[ NG ] " __VA_ARGS__);		\
+		exit(1);				\
+	}						\
+} while (0)
+
+static unsigned long nr_blocks = 10000;
+static unsigned long nr_ops = 1000000;
+static int nr_threads = 4;
+
+/* Blocks handed out, to check the allocator against */
+static unsigned char *shadow;
+
+struct alloc {
+	unsigned long addr;
+	int npages;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int shadow_has_run(int npages)
+{
+	unsigned long i, run = 0;
+
+	for (i = 0; i < nr_blocks; i++) {
+		run = shadow[i] ? 0 : run + 1;
+		if (run >= npages) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int shadow_alloc(unsigned long addr, int npages)
+{
+	unsigned long block, i;
+
+	if (addr < START || (addr - START) % UNIT) {
+		return -1;
+	}
+	block = (addr - START) / UNIT;
+	if (block + npages > nr_blocks) {
+		return -1;
+	}
+	for (i = block; i < block + npages; i++) {
+		if (shadow[i]) {
+			return -1;
+		}
+		shadow[i] = 1;
+	}
+	return 0;
+}
+
+static void shadow_free(unsigned long addr, int npages)
+{
+	memset(shadow + (addr - START) / UNIT, 0, npages);
+}
+
+static int random_npages(void)
+{
+	switch (rand() % 8) {
+	case 0:
+		return 1 + rand() % 1024;
+	case 1:
+	case 2:
+		return 1 + rand() % 64;
+	default:
+		return 1;
+	}
+}
+
+/* Fill a fresh allocator, blocks cached per CPU would leave holes */
+static void test_fill(int npages)
+{
+	void *desc;
+	unsigned long addr, i, count = 0;
+	int packed = 1;
+
+	desc = ihk_pagealloc_init(START, nr_blocks * UNIT, UNIT);
+	OKNG(desc != NULL, "ihk_pagealloc_init\n");
+
+	while ((addr = ihk_pagealloc_alloc(desc, npages))) {
+		if (shadow_alloc(addr, npages)) {
+			OKNG(0, "alloc of %d blocks returned a used or out of range area 0x%lx\n",
+			     npages, addr);
+		}
+		count++;
+	}
+	OKNG(count == nr_blocks / npages,
+	     "fill with %d-block requests: %lu allocated, %lu expected\n",
+	     npages, count, nr_blocks / npages);
+
+	for (i = 0; i < nr_blocks; i++) {
+		if (shadow[i] != (i < count * npages)) {
+			packed = 0;
+		}
+	}
+	OKNG(packed, "fill with %d-block requests: packed from the start\n",
+	     npages);
+
+	for (i = 0; i < count; i++) {
+		ihk_pagealloc_free(desc, START + i * npages * UNIT, npages);
+	}
+	memset(shadow, 0, nr_blocks);
+
+	/* Everything is free again */
+	addr = ihk_pagealloc_alloc(desc, nr_blocks);
+	OKNG(addr == START, "fill with %d-block requests: all freed\n",
+	     npages);
+	ihk_pagealloc_destroy(desc);
+}
+
+static void test_random(void *desc)
+{
+	struct alloc *allocs;
+	unsigned long i, nr_allocs = 0, nr_fails = 0;
+	unsigned long addr;
+	int npages, k;
+
+	allocs = calloc(nr_blocks, sizeof(*allocs));
+
+	for (i = 0; i < nr_ops / 10; i++) {
+		if (nr_allocs && (rand() % 2 || nr_allocs == nr_blocks)) {
+			k = rand() % nr_allocs;
+			ihk_pagealloc_free(desc, allocs[k].addr,
+					   allocs[k].npages);
+			shadow_free(allocs[k].addr, allocs[k].npages);
+			allocs[k] = allocs[--nr_allocs];
+			continue;
+		}
+
+		npages = random_npages();
+		addr = ihk_pagealloc_alloc(desc, npages);
+		if (!addr) {
+			/* Failing while a large enough run is free is a bug */
+			if (shadow_has_run(npages)) {
+				OKNG(0, "alloc of %d blocks failed with a free run\n",
+				     npages);
+			}
+			nr_fails++;
+			continue;
+		}
+		if (shadow_alloc(addr, npages)) {
+			OKNG(0, "alloc of %d blocks returned a used or out of range area 0x%lx\n",
+			     npages, addr);
+		}
+		allocs[nr_allocs].addr = addr;
+		allocs[nr_allocs].npages = npages;
+		nr_allocs++;
+	}
+
+	OKNG(1, "random alloc/free: %lu ops, %lu failures, all consistent\n",
+	     nr_ops / 10, nr_fails);
+
+	for (i = 0; i < nr_allocs; i++) {
+		ihk_pagealloc_free(desc, allocs[i].addr, allocs[i].npages);
+		shadow_free(allocs[i].addr, allocs[i].npages);
+	}
+	free(allocs);
+}
+
+static void bench_mixed(void *desc)
+{
+	struct alloc *allocs;
+	unsigned long i, nr_allocs = 0;
+	double t;
+	int k;
+
+	allocs = calloc(nr_blocks, sizeof(*allocs));
+
+	t = now();
+	for (i = 0; i < nr_ops; i++) {
+		if (nr_allocs && (rand() % 2 || nr_allocs == nr_blocks)) {
+			k = rand() % nr_allocs;
+			ihk_pagealloc_free(desc, allocs[k].addr,
+					   allocs[k].npages);
+			allocs[k] = allocs[--nr_allocs];
+			continue;
+		}
+
+		allocs[nr_allocs].npages = random_npages();
+		allocs[nr_allocs].addr =
+			ihk_pagealloc_alloc(desc, allocs[nr_allocs].npages);
+		if (allocs[nr_allocs].addr) {
+			nr_allocs++;
+		}
+	}
+	t = now() - t;
+
+	printf("[BENCH] mixed sizes, 1 thread: %.1f ns/op\n", t * 1e9 / nr_ops);
+
+	for (i = 0; i < nr_allocs; i++) {
+		ihk_pagealloc_free(desc, allocs[i].addr, allocs[i].npages);
+	}
+	free(allocs);
+}
+
+static void *bench_single_thread(void *desc)
+{
+	unsigned long addrs[64];
+	unsigned long i;
+	int j;
+
+	for (i = 0; i < nr_ops / 64; i++) {
+		for (j = 0; j < 64; j++) {
+			addrs[j] = ihk_pagealloc_alloc(desc, 1);
+		}
+		for (j = 0; j < 64; j++) {
+			if (addrs[j]) {
+				ihk_pagealloc_free(desc, addrs[j], 1);
+			}
+		}
+	}
+	return NULL;
+}
+
+static void bench_single(void *desc)
+{
+	pthread_t *threads;
+	double t;
+	int i;
+
+	threads = calloc(nr_threads, sizeof(*threads));
+
+	t = now();
+	for (i = 0; i < nr_threads; i++) {
+		pthread_create(&threads[i], NULL, bench_single_thread, desc);
+	}
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	t = now() - t;
+
+	printf("[BENCH] single blocks, %d threads: %.1f ns/op\n",
+	       nr_threads, t * 1e9 / (2 * (nr_ops / 64) * 64 * nr_threads));
+	free(threads);
+}
+
+int main(int argc, char **argv)
+{
+	void *desc;
+	int opt;
+	unsigned int seed = time(NULL);
+
+	while ((opt = getopt(argc, argv, "n:o:t:s:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_blocks = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			nr_ops = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n nr_blocks] [-o nr_ops] [-t nr_threads] [-s seed]\n",
+				argv[0]);
+			exit(1);
+		}
+	}
+
+	printf("nr_blocks: %lu, nr_ops: %lu, seed: %u\n",
+	       nr_blocks, nr_ops, seed);
+	srand(seed);
+
+	shadow = calloc(nr_blocks, 1);
+
+	test_fill(1);
+	test_fill(7);
+	test_fill(33);
+	test_fill(100);
+	test_fill(nr_blocks);
+
+	desc = ihk_pagealloc_init(START, nr_blocks * UNIT, UNIT);
+	OKNG(!ihk_pagealloc_alloc(desc, nr_blocks + 1),
+	     "alloc larger than the area fails\n");
+	test_random(desc);
+
+	bench_mixed(desc);
+	bench_single(desc);
+
+	ihk_pagealloc_destroy(desc);
+	free(shadow);
+
+	return 0;
+}